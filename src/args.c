@@ -8,119 +8,237 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
 
-static int add_regex_internal(pcre2_code** re, const char* pattern, uint32_t options) {
+// Argument errors go to stderr, or to the request's error stream while a
+// server request is parsed.
+static FILE* request_errors = NULL;
+
+static FILE* errors(void) {
+    return request_errors ? request_errors : stderr;
+}
+
+// With --serve, compiled and JIT-compiled patterns are kept for later
+// requests. The table owns them; each context that uses one holds a
+// reference, dropped by its cleanup list when the request ends. Beyond
+// SHARED_REGEX_MAX entries the least recently used unreferenced ones are
+// freed. Lookups happen while parsing, which the server serializes, but
+// requests end concurrently, so the table has its own lock.
+typedef struct shared_regex {
+    struct shared_regex* next;
+    struct shared_regex* lru_prev;
+    struct shared_regex* lru_next;
+    uint64_t hash;
+    uint32_t options;
+    uint32_t jit_options;
+    int refs;
+    pcre2_code* code;
+    char pattern[];
+} shared_regex;
+
+#define SHARED_REGEX_BUCKETS 1024
+#define SHARED_REGEX_MAX 512
+
+static shared_regex** shared_regexes = NULL;
+static shared_regex* lru_first = NULL;
+static shared_regex* lru_last = NULL;
+static size_t shared_regex_count = 0;
+static pthread_mutex_t shared_regex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int regex_cache_init(void) {
+    shared_regexes = calloc(SHARED_REGEX_BUCKETS, sizeof(shared_regex*));
+    return shared_regexes ? 0 : -1;
+}
+
+void regex_cache_free(void) {
+    if (!shared_regexes) return;
+    for (size_t i = 0; i < SHARED_REGEX_BUCKETS; i++) {
+        for (shared_regex* e = shared_regexes[i]; e;) {
+            shared_regex* next = e->next;
+            pcre2_code_free(e->code);
+            free(e);
+            e = next;
+        }
+    }
+    free(shared_regexes);
+    shared_regexes = NULL;
+    lru_first = lru_last = NULL;
+    shared_regex_count = 0;
+}
+
+static void lru_unlink(shared_regex* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else lru_first = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else lru_last = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(shared_regex* e) {
+    e->lru_next = lru_first;
+    if (lru_first) lru_first->lru_prev = e;
+    else lru_last = e;
+    lru_first = e;
+}
+
+static void evict_shared_regex(shared_regex* e) {
+    shared_regex** link = &shared_regexes[e->hash % SHARED_REGEX_BUCKETS];
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+    lru_unlink(e);
+    pcre2_code_free(e->code);
+    free(e);
+    shared_regex_count--;
+}
+
+// Frees unreferenced entries, least recently used first, until the table is
+// back under its cap. Entries still held by requests stay.
+static void trim_shared_regexes(void) {
+    for (shared_regex* e = lru_last; e && shared_regex_count > SHARED_REGEX_MAX;) {
+        shared_regex* prev = e->lru_prev;
+        if (e->refs == 0) evict_shared_regex(e);
+        e = prev;
+    }
+}
+
+static void release_shared_regex(shared_regex* e) {
+    pthread_mutex_lock(&shared_regex_lock);
+    if (--e->refs == 0 && shared_regex_count > SHARED_REGEX_MAX) trim_shared_regexes();
+    pthread_mutex_unlock(&shared_regex_lock);
+}
+
+static int compile_regex(pcre2_code** re, const char* pattern, uint32_t options, uint32_t jit_options) {
     int error_code;
     PCRE2_SIZE error_offset;
     *re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, options, &error_code, &error_offset, NULL);
     if (*re == NULL) {
         PCRE2_UCHAR err_buf[256];
         pcre2_get_error_message(error_code, err_buf, sizeof(err_buf));
-        fprintf(stderr, "Error: Could not compile regex '%s': %s at offset %d\n", pattern, (char*)err_buf, (int)error_offset);
+        fprintf(errors(), "Error: Could not compile regex '%s': %s at offset %d\n", pattern, (char*)err_buf, (int)error_offset);
         return -1;
     }
     // Enable JIT compilation
-    pcre2_jit_compile(*re, PCRE2_JIT_COMPLETE);
+    pcre2_jit_compile(*re, jit_options);
     return 0;
 }
 
-static int add_regex(regex_ctx* ctx, const char* pattern) {
-    if (ctx->count >= MAX_PATTERNS) {
-        fprintf(stderr, "Error: Too many regex patterns. Max allowed is %d\n", MAX_PATTERNS);
-        return -1;
+// Compiles a pattern, or with --serve takes it from the shared table. A
+// shared pattern is referenced until owner is destroyed; otherwise the caller
+// frees the code.
+static int add_regex_internal(memlst_t* owner, pcre2_code** re, const char* pattern, uint32_t options, uint32_t jit_options) {
+    if (!shared_regexes) return compile_regex(re, pattern, options, jit_options);
+
+    size_t len = strlen(pattern);
+    uint64_t hash = cache_hash(cache_hash(CACHE_HASH_SEED, pattern, len), &options, sizeof(options));
+    pthread_mutex_lock(&shared_regex_lock);
+    shared_regex** bucket = &shared_regexes[hash % SHARED_REGEX_BUCKETS];
+    shared_regex* e = *bucket;
+    while (e && !(e->hash == hash && e->options == options && e->jit_options == jit_options && strcmp(e->pattern, pattern) == 0)) {
+        e = e->next;
     }
-    if (add_regex_internal(&ctx->compiled[ctx->count], pattern, 0) != 0) {
-        return -1;
+    if (e) {
+        lru_unlink(e);
     }
-    pcre2_code* compiled = ctx->compiled[ctx->count];
-    pcre2_match_data* match_data = pcre2_match_data_create_from_pattern(compiled, NULL);
-    if (!match_data) {
-        fprintf(stderr, "Error: Could not allocate match data for regex '%s'\n", pattern);
-        pcre2_code_free(compiled);
-        ctx->compiled[ctx->count] = NULL;
+    else {
+        e = malloc(sizeof(shared_regex) + len + 1);
+        if (!e) {
+            pthread_mutex_unlock(&shared_regex_lock);
+            fprintf(errors(), "Error: Out of memory compiling regex '%s'\n", pattern);
+            return -1;
+        }
+        if (compile_regex(&e->code, pattern, options, jit_options) != 0) {
+            pthread_mutex_unlock(&shared_regex_lock);
+            free(e);
+            return -1;
+        }
+        e->hash = hash;
+        e->options = options;
+        e->jit_options = jit_options;
+        e->refs = 0;
+        memcpy(e->pattern, pattern, len + 1);
+        e->next = *bucket;
+        *bucket = e;
+        shared_regex_count++;
+    }
+    lru_push_front(e);
+    if (!memlst_add(owner, (dtor_fn)release_shared_regex, e)) {
+        trim_shared_regexes();
+        pthread_mutex_unlock(&shared_regex_lock);
         return -1;
     }
+    e->refs++;
+    *re = e->code;
+    trim_shared_regexes();
+    pthread_mutex_unlock(&shared_regex_lock);
+    return 0;
+}
 
-    ctx->match_data[ctx->count] = match_data;
-
-    if (!memlst_add(&ctx->destructors, (dtor_fn)pcre2_match_data_free, match_data)) {
-        ctx->match_data[ctx->count] = NULL;
-        pcre2_code_free(compiled);
-        ctx->compiled[ctx->count] = NULL;
+static int add_regex_jit(regex_ctx* ctx, const char* pattern, uint32_t jit_options) {
+    if (ctx->count >= MAX_PATTERNS) {
+        fprintf(errors(), "Error: Too many regex patterns. Max allowed is %d\n", MAX_PATTERNS);
+        return -1;
+    }
+    if (add_regex_internal(&ctx->destructors, &ctx->compiled[ctx->count], pattern, 0, jit_options) != 0) {
         return -1;
     }
-    if (!memlst_add(&ctx->destructors, (dtor_fn)pcre2_code_free, compiled)) {
-        memlst_remove_last(&ctx->destructors);
-        pcre2_match_data_free(match_data);
-        ctx->match_data[ctx->count] = NULL;
+    pcre2_code* compiled = ctx->compiled[ctx->count];
+    if (!shared_regexes && !memlst_add(&ctx->destructors, (dtor_fn)pcre2_code_free, compiled)) {
         ctx->compiled[ctx->count] = NULL;
         return -1;
     }
+    // The source is kept for the literal index and regex set DFAs; without it the
+    // pattern is just matched on its own.
+    ctx->sources[ctx->count] = strdup(pattern);
+    if (ctx->sources[ctx->count] && !memlst_add(&ctx->destructors, free, ctx->sources[ctx->count])) {
+        free(ctx->sources[ctx->count]);
+        ctx->sources[ctx->count] = NULL;
+    }
     ctx->count++;
     return 0;
 }
 
+static int add_regex(regex_ctx* ctx, const char* pattern) {
+    return add_regex_jit(ctx, pattern, PCRE2_JIT_COMPLETE);
+}
+
+// Include patterns are also matched partially against directory prefixes to
+// prune subtrees, so they get a JIT variant for PCRE2_PARTIAL_HARD as well.
+static int add_include_regex(regex_ctx* ctx, const char* pattern) {
+    return add_regex_jit(ctx, pattern, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_HARD);
+}
+
 static int add_scoped_strip_rule(recap_context* ctx, const char* path_pattern, const char* strip_pattern) {
     if (ctx->scoped_strip_rule_count >= MAX_SCOPED_STRIP_RULES) {
-        fprintf(stderr, "Error: Too many scoped strip rules. Max allowed is %d\n", MAX_SCOPED_STRIP_RULES);
+        fprintf(errors(), "Error: Too many scoped strip rules. Max allowed is %d\n", MAX_SCOPED_STRIP_RULES);
         return -1;
     }
 
     scoped_strip_rule* rule = &ctx->scoped_strip_rules[ctx->scoped_strip_rule_count];
 
-    if (add_regex_internal(&rule->path_regex, path_pattern, 0) != 0) {
+    if (add_regex_internal(&ctx->cleanup, &rule->path_regex, path_pattern, 0, PCRE2_JIT_COMPLETE) != 0) {
         return -1;
     }
 
-    rule->path_match_data = pcre2_match_data_create_from_pattern(rule->path_regex, NULL);
-    if (!rule->path_match_data) {
-        pcre2_code_free(rule->path_regex);
-        return -1;
-    }
-
-    if (add_regex_internal(&rule->strip_regex, strip_pattern, PCRE2_MULTILINE) != 0) {
-        pcre2_match_data_free(rule->path_match_data);
-        pcre2_code_free(rule->path_regex);
+    if (add_regex_internal(&ctx->cleanup, &rule->strip_regex, strip_pattern, PCRE2_MULTILINE, PCRE2_JIT_COMPLETE) != 0) {
+        if (!shared_regexes) pcre2_code_free(rule->path_regex);
         rule->path_regex = NULL;
         return -1;
     }
 
-    rule->strip_match_data = pcre2_match_data_create_from_pattern(rule->strip_regex, NULL);
-    if (!rule->strip_match_data) {
-        pcre2_code_free(rule->strip_regex);
-        pcre2_match_data_free(rule->path_match_data);
-        pcre2_code_free(rule->path_regex);
-        return -1;
-    }
-
-    if (!memlst_add(&ctx->cleanup, (dtor_fn)pcre2_code_free, rule->path_regex)) {
-        goto error_cleanup;
-    }
-    if (!memlst_add(&ctx->cleanup, (dtor_fn)pcre2_match_data_free, rule->path_match_data)) {
-        memlst_remove_last(&ctx->cleanup);
-        goto error_cleanup;
-    }
-    if (!memlst_add(&ctx->cleanup, (dtor_fn)pcre2_code_free, rule->strip_regex)) {
-        memlst_remove_last(&ctx->cleanup);
-        memlst_remove_last(&ctx->cleanup);
-        goto error_cleanup;
-    }
-    if (!memlst_add(&ctx->cleanup, (dtor_fn)pcre2_match_data_free, rule->strip_match_data)) {
-        memlst_remove_last(&ctx->cleanup);
-        memlst_remove_last(&ctx->cleanup);
-        memlst_remove_last(&ctx->cleanup);
-        goto error_cleanup;
+    if (!shared_regexes) {
+        if (!memlst_add(&ctx->cleanup, (dtor_fn)pcre2_code_free, rule->path_regex)) {
+            pcre2_code_free(rule->strip_regex);
+            return -1;
+        }
+        if (!memlst_add(&ctx->cleanup, (dtor_fn)pcre2_code_free, rule->strip_regex)) {
+            return -1;
+        }
     }
 
+    rule->path_source = path_pattern;
+    rule->strip_source = strip_pattern;
     ctx->scoped_strip_rule_count++;
     return 0;
-
-error_cleanup:
-    pcre2_match_data_free(rule->strip_match_data);
-    pcre2_code_free(rule->strip_regex);
-    pcre2_match_data_free(rule->path_match_data);
-    pcre2_code_free(rule->path_regex);
-    return -1;
 }
 
 void free_regex_ctx(regex_ctx* ctx) {
@@ -128,9 +246,12 @@ void free_regex_ctx(regex_ctx* ctx) {
     memlst_destroy(&ctx->destructors);
     for (int i = 0; i < ctx->count; i++) {
         ctx->compiled[i] = NULL;
-        ctx->match_data[i] = NULL;
+        ctx->sources[i] = NULL;
     }
     ctx->count = 0;
+    ctx->literals = NULL;
+    ctx->dfa_count = 0;
+    ctx->fallback_count = 0;
 }
 
 void clear_recap_output_files(const char* target_dir) {
@@ -170,10 +291,16 @@ void clear_recap_output_files(const char* target_dir) {
     printf("Cleared %d file(s).\n", count);
 }
 
+// Searches upwards from the working directory for the ignore file; its rules
+// apply relative to the directory it was found in. Files of the same name in
+// the directories below are picked up by the walk.
 void load_gitignore(recap_context* ctx, const char* gitignore_filename_arg) {
     char path[MAX_PATH_SIZE];
-    strncpy(path, ctx->cwd, sizeof(path));
+    strncpy(path, ctx->cwd, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
     const char* filename = (gitignore_filename_arg && *gitignore_filename_arg) ? gitignore_filename_arg : ".gitignore";
+    const char* name = strrchr(filename, '/');
+    ctx->gitignore_name = name ? name + 1 : filename;
 
     while (1) {
         char gitignore_path[MAX_PATH_SIZE];
@@ -183,29 +310,18 @@ void load_gitignore(recap_context* ctx, const char* gitignore_filename_arg) {
             break;
         }
 
-        FILE* file = fopen(gitignore_path, "r");
-        if (file) {
-            char line[MAX_PATH_SIZE];
-            while (fgets(line, sizeof(line), file)) {
-                line[strcspn(line, "\r\n")] = 0;
-                char* trimmed = line;
-                while (isspace((unsigned char)*trimmed)) trimmed++;
-                if (*trimmed == '\0' || *trimmed == '#') continue;
-                if (ctx->fnmatch_exclude_filters.count < MAX_PATTERNS &&
-                    ctx->gitignore_entry_count < MAX_GITIGNORE_ENTRIES) {
-                    size_t trimmed_len = strnlen(trimmed, MAX_PATH_SIZE);
-                    if (trimmed_len >= MAX_PATH_SIZE) {
-                        fprintf(stderr,
-                                "Warning: .gitignore entry too long, skipping: %.32s...\n",
-                                trimmed);
-                        continue;
-                    }
-                    memcpy(ctx->gitignore_entries[ctx->gitignore_entry_count], trimmed, trimmed_len + 1);
-                    ctx->fnmatch_exclude_filters.patterns[ctx->fnmatch_exclude_filters.count++] =
-                        ctx->gitignore_entries[ctx->gitignore_entry_count++];
-                }
+        struct stat st;
+        if (stat(gitignore_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            char base[MAX_PATH_SIZE];
+            size_t root_len = strlen(path);
+            const char* below = ctx->cwd + root_len;
+            while (*below == '/') below++;
+            snprintf(base, sizeof(base), "%s%s", below, *below ? "/" : "");
+            ctx->gitignore_at_cwd = *below == '\0';
+            if (gitignore_set_root(ctx->ignore_rules, path, base) != 0 ||
+                gitignore_load(ctx->ignore_rules, gitignore_path) != 0) {
+                fprintf(stderr, "Warning: Could not load %s\n", gitignore_path);
             }
-            fclose(file);
             return;
         }
         char* sep = strrchr(path, '/');
@@ -214,6 +330,26 @@ void load_gitignore(recap_context* ctx, const char* gitignore_filename_arg) {
     }
 }
 
+// Options that write files, print and exit, or change how the server
+// itself runs are refused in requests.
+static int request_option_allowed(int opt) {
+    switch (opt) {
+    case 'h':
+    case 'v':
+    case 'C':
+    case 'o':
+    case 'O':
+    case 'c':
+    case 'p':
+    case 263:
+    case 264:
+    case 265:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
 void print_help(const char* version) {
     printf("Usage: recap [options] [path...]\n");
     printf("  `path...` are the starting points for traversal (default: .).\n\n");
@@ -227,9 +363,20 @@ void print_help(const char* version) {
     printf("  -I, --include-content <R>          Show content for files matching REGEX <R>.\n");
     printf("  -E, --exclude-content <R>          Exclude content for files matching REGEX <R>.\n");
     printf("  -g, --git [FILE]                   Use .gitignore patterns for exclusions (searches upwards from cwd).\n");
-    printf("  -s, --strip <REGEX>                In content blocks, skip all content that matches REGEX.\n");
-    printf("  -S, --strip-scope <P_RE> <S_RE>    Apply strip regex <S_RE> to files matching path regex <P_RE>.\n");
+    printf("      --git-index                    List the files tracked in .git/index instead of walking the tree.\n");
+    printf("      --changed                      Only list tracked files that differ from the index.\n");
+    printf("      --rev <COMMIT>                 List files and content as of COMMIT (ref, id, HEAD~N, ...).\n");
+    printf("  -s, --strip <REGEX>                In content blocks, remove every match of REGEX.\n");
+    printf("  -S, --strip-scope <P_RE> <S_RE>    Strip <S_RE> instead of --strip in files matching path regex <P_RE>.\n");
     printf("      --compact                      Remove comments and redundant whitespace from content.\n\n");
+    printf("Performance:\n");
+    printf("  -j, --jobs <N>                     Number of worker threads (default: online CPU count).\n");
+    printf("      --stream                       Write output while walking instead of after a full sort.\n");
+    printf("      --cache[=DIR]                  Reuse listings and processed content from earlier runs (default: %s).\n", DEFAULT_CACHE_DIR);
+    printf("      --serve <SOCKET>               Answer JSON requests on a Unix socket, keeping caches warm.\n");
+    printf("      --watch[=MS]                   Keep running and rewrite the output file when files change.\n");
+    printf("      --max-inflight <MB>            Memory bound for rendered content awaiting output (default: 64).\n");
+    printf("      --stats                        Print traversal statistics to stderr.\n\n");
     printf("Output and Upload:\n");
     printf("  -o, --output <FILE>                Specify the output file name (disables stdout).\n");
     printf("  -O, --output-dir <DIR>             Specify the output directory (disables stdout).\n");
@@ -249,8 +396,12 @@ void print_help(const char* version) {
     printf("    Use .gitignore rules for exclusion and upload the result to a private Gist.\n");
 }
 
-void parse_arguments(int argc, char* argv[], recap_context* ctx) {
-    ctx->fnmatch_exclude_filters.patterns[ctx->fnmatch_exclude_filters.count++] = ".git/";
+int parse_arguments(int argc, char* argv[], recap_context* ctx) {
+    ctx->ignore_rules = gitignore_create();
+    if (!ctx->ignore_rules || !memlst_add(&ctx->cleanup, (dtor_fn)gitignore_free, ctx->ignore_rules)) {
+        fprintf(errors(), "Error: Failed to set up ignore rules.\n");
+        return ARGS_FAILED;
+    }
     opterr = 0;
 
     static struct option long_options[] = {
@@ -269,55 +420,64 @@ void parse_arguments(int argc, char* argv[], recap_context* ctx) {
         {"output-dir", required_argument, 0, 'O'},
         {"clipboard", no_argument, 0, 'c'},
         {"compact", no_argument, 0, 256},
+        {"jobs", required_argument, 0, 'j'},
+        {"stats", no_argument, 0, 257},
+        {"stream", no_argument, 0, 258},
+        {"max-inflight", required_argument, 0, 259},
+        {"git-index", no_argument, 0, 260},
+        {"changed", no_argument, 0, 261},
+        {"rev", required_argument, 0, 262},
+        {"cache", optional_argument, 0, 263},
+        {"watch", optional_argument, 0, 264},
+        {"serve", required_argument, 0, 265},
         {0, 0, 0, 0}};
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "hvcC::i:e:I:E:s:S:g::p::o:O:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvcC::i:e:I:E:s:S:g::p::o:O:j:", long_options, NULL)) != -1) {
+        if (request_errors && !request_option_allowed(opt)) {
+            const char* name = NULL;
+            for (const struct option* o = long_options; o->name && !name; o++) {
+                if (o->val == opt) name = o->name;
+            }
+            fprintf(errors(), "Error: --%s is not available in server requests\n", name ? name : "?");
+            return ARGS_FAILED;
+        }
         switch (opt) {
         case 'h':
             print_help(ctx->version);
-            exit(0);
+            return ARGS_DONE;
         case 'v':
             printf("recap version %s\n", ctx->version);
-            exit(0);
+            return ARGS_DONE;
         case 'C':
             clear_recap_output_files(optarg);
-            exit(0);
+            return ARGS_DONE;
         case 'i':
-            add_regex(&ctx->include_filters, optarg);
+            add_include_regex(&ctx->include_filters, optarg);
             break;
         case 'e':
             add_regex(&ctx->exclude_filters, optarg);
             break;
         case 'I':
             add_regex(&ctx->content_include_filters, optarg);
-            add_regex(&ctx->include_filters, optarg);
+            add_include_regex(&ctx->include_filters, optarg);
             break;
         case 'E':
             add_regex(&ctx->content_exclude_filters, optarg);
             break;
         case 's':
             if (ctx->strip_regex) {
-                pcre2_code_free(ctx->strip_regex);
+                if (!shared_regexes) pcre2_code_free(ctx->strip_regex);
                 ctx->strip_regex = NULL;
             }
-            if (ctx->strip_match_data) {
-                pcre2_match_data_free(ctx->strip_match_data);
-                ctx->strip_match_data = NULL;
-            }
-            if (add_regex_internal(&ctx->strip_regex, optarg, PCRE2_MULTILINE) == 0) {
-                ctx->strip_match_data = pcre2_match_data_create_from_pattern(ctx->strip_regex, NULL);
-                if (!ctx->strip_match_data) {
-                    fprintf(stderr, "Error: Could not allocate match data for strip regex\n");
-                    pcre2_code_free(ctx->strip_regex);
-                    ctx->strip_regex = NULL;
-                }
+            if (add_regex_internal(&ctx->cleanup, &ctx->strip_regex, optarg, PCRE2_MULTILINE, PCRE2_JIT_COMPLETE) == 0) {
+                ctx->strip_source = optarg;
             }
             break;
         case 'S':
             if (optind >= argc) {
-                fprintf(stderr, "Error: --strip-scope requires two arguments\n");
-                exit(1);
+                fprintf(errors(), "Error: --strip-scope requires two arguments\n");
+                return ARGS_FAILED;
             }
             add_scoped_strip_rule(ctx, optarg, argv[optind]);
             optind++;
@@ -341,19 +501,74 @@ void parse_arguments(int argc, char* argv[], recap_context* ctx) {
         case 256:
             ctx->compact_output = 1;
             break;
+        case 257:
+            ctx->show_stats = 1;
+            break;
+        case 258:
+            ctx->stream_output = 1;
+            break;
+        case 259: {
+            char* end = NULL;
+            long megabytes = strtol(optarg, &end, 10);
+            if (!end || *end != '\0' || megabytes < 1 || megabytes > 4096) {
+                fprintf(errors(), "Error: --max-inflight expects a number of megabytes between 1 and 4096\n");
+                return ARGS_FAILED;
+            }
+            ctx->max_inflight_bytes = (size_t)megabytes * 1024 * 1024;
+            break;
+        }
+        case 260:
+            ctx->use_git_index = 1;
+            break;
+        case 261:
+            ctx->use_git_index = 1;
+            ctx->changed_only = 1;
+            break;
+        case 262:
+            ctx->rev = optarg;
+            break;
+        case 263:
+            ctx->cache_dir = optarg ? optarg : DEFAULT_CACHE_DIR;
+            break;
+        case 264: {
+            ctx->watch = 1;
+            ctx->watch_debounce_ms = DEFAULT_WATCH_DEBOUNCE_MS;
+            if (!optarg) break;
+            char* end = NULL;
+            long ms = strtol(optarg, &end, 10);
+            if (!end || *end != '\0' || ms < 1 || ms > 60000) {
+                fprintf(errors(), "Error: --watch expects a debounce time in milliseconds between 1 and 60000\n");
+                return ARGS_FAILED;
+            }
+            ctx->watch_debounce_ms = (int)ms;
+            break;
+        }
+        case 265:
+            ctx->serve_path = optarg;
+            break;
+        case 'j': {
+            char* end = NULL;
+            long jobs = strtol(optarg, &end, 10);
+            if (!end || *end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+                fprintf(errors(), "Error: --jobs expects a number between 1 and %d\n", MAX_JOBS);
+                return ARGS_FAILED;
+            }
+            ctx->jobs = (int)jobs;
+            break;
+        }
         case '?': {
             const char* problem = NULL;
             if (optind > 0 && optind <= argc) problem = argv[optind - 1];
             if (problem && strcmp(problem, "--strip-scope") == 0) {
-                fprintf(stderr, "Error: --strip-scope requires two arguments\n");
+                fprintf(errors(), "Error: --strip-scope requires two arguments\n");
             }
             else {
-                fprintf(stderr, "Error: Invalid option or missing argument\n");
+                fprintf(errors(), "Error: Invalid option or missing argument\n");
             }
-            exit(1);
+            return ARGS_FAILED;
         }
         default:
-            exit(1);
+            return ARGS_FAILED;
         }
     }
 
@@ -362,12 +577,54 @@ void parse_arguments(int argc, char* argv[], recap_context* ctx) {
             ctx->start_paths[ctx->start_path_count++] = argv[optind++];
         }
         else {
-            fprintf(stderr, "Error: Too many start paths specified.\n");
-            exit(1);
+            fprintf(errors(), "Error: Too many start paths specified.\n");
+            return ARGS_FAILED;
         }
     }
 
     if (ctx->start_path_count == 0) {
         ctx->start_paths[ctx->start_path_count++] = ".";
     }
+
+    if (ctx->rev && ctx->use_git_index) {
+        fprintf(errors(), "Error: --rev cannot be combined with --git-index or --changed\n");
+        return ARGS_FAILED;
+    }
+
+    if (ctx->watch) {
+        if (ctx->output.output_name[0] == '\0' && ctx->output.output_dir[0] == '\0') {
+            fprintf(errors(), "Error: --watch rewrites an output file; use --output or --output-dir\n");
+            return ARGS_FAILED;
+        }
+        if (ctx->rev || ctx->use_git_index || ctx->stream_output || ctx->copy_to_clipboard || ctx->gist_api_key) {
+            fprintf(errors(), "Error: --watch cannot be combined with --rev, --git-index, --changed, --stream, --clipboard or --paste\n");
+            return ARGS_FAILED;
+        }
+    }
+
+    if (ctx->serve_path && (ctx->watch || ctx->output.output_name[0] || ctx->output.output_dir[0] || ctx->copy_to_clipboard || ctx->gist_api_key)) {
+        fprintf(errors(), "Error: --serve cannot be combined with --watch, --output, --output-dir, --clipboard or --paste\n");
+        return ARGS_FAILED;
+    }
+
+    if (ctx->jobs == 0) {
+        ctx->jobs = default_job_count();
+    }
+
+    regex_ctx_build_set(&ctx->include_filters);
+    regex_ctx_build_set(&ctx->exclude_filters);
+    regex_ctx_build_set(&ctx->content_include_filters);
+    regex_ctx_build_set(&ctx->content_exclude_filters);
+    return ARGS_RUN;
+}
+
+// Parses the arguments of a --serve request. Errors are written to
+// errors_out instead of stderr. Calls must be serialized, since getopt keeps
+// global state.
+int parse_request_arguments(int argc, char* argv[], recap_context* ctx, FILE* errors_out) {
+    request_errors = errors_out;
+    optind = 0;
+    int rc = parse_arguments(argc, argv, ctx);
+    request_errors = NULL;
+    return rc;
 }
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Prefaulting the mapping is a Linux extension; elsewhere pages fault in lazily.
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+#define CACHE_MAGIC 0x50414352u
+#define CACHE_VERSION 3
+#define CACHE_ENTRIES_NAME "entries"
+#define CACHE_LOCK_NAME "lock"
+#define NSEC_PER_SEC 1000000000ull
+
+enum {
+    CACHE_DIR = 1,
+    CACHE_FILE
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} cache_header;
+
+// Records follow the header back to back: this struct, key_len bytes of
+// absolute path, data_len bytes of data, then padding to 8 bytes. Later
+// records for the same key replace earlier ones.
+typedef struct {
+    uint32_t kind;
+    int32_t status;
+    uint32_t key_len;
+    uint32_t reserved;
+    uint64_t variant;
+    cache_stamp stamp;
+    uint64_t data_len;
+} cache_record;
+
+// The entries file is mapped read-only for the whole run and indexed by an
+// open-addressing table of record offsets, so lookups from the walker and
+// content threads need no lock. Records made during the run are serialized
+// into pending and written out by cache_close().
+struct recap_cache {
+    path_buf dir;
+    char cwd[MAX_PATH_SIZE];
+    const unsigned char* map;
+    size_t map_size;
+    size_t map_len;
+    int header_ok;
+    uint64_t* slots;
+    size_t slot_mask;
+    size_t live_bytes;
+    uint64_t settled_before;
+    pthread_mutex_t lock;
+    path_buf pending;
+    size_t pending_count;
+    atomic_size_t dir_hits;
+    atomic_size_t file_hits;
+};
+
+static size_t record_size(const cache_record* rec) {
+    return (sizeof(cache_record) + rec->key_len + (size_t)rec->data_len + 7) & ~(size_t)7;
+}
+
+// FNV-1a; callers chain it over the parts of a key starting from
+// CACHE_HASH_SEED.
+uint64_t cache_hash(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t record_hash(uint32_t kind, uint64_t variant, const char* key, size_t key_len) {
+    uint64_t h = cache_hash(CACHE_HASH_SEED, &kind, sizeof(kind));
+    h = cache_hash(h, &variant, sizeof(variant));
+    return cache_hash(h, key, key_len);
+}
+
+// Slot holding the record for the key, or the empty slot it would go in.
+static uint64_t* find_slot(const recap_cache* cache, uint32_t kind, uint64_t variant, const char* key, size_t key_len) {
+    if (!cache->slots) return NULL;
+    size_t i = (size_t)record_hash(kind, variant, key, key_len) & cache->slot_mask;
+    while (cache->slots[i]) {
+        const cache_record* rec = (const cache_record*)(cache->map + cache->slots[i] - 1);
+        if (rec->kind == kind && rec->variant == variant && rec->key_len == key_len &&
+            memcmp(rec + 1, key, key_len) == 0) {
+            break;
+        }
+        i = (i + 1) & cache->slot_mask;
+    }
+    return &cache->slots[i];
+}
+
+// Indexes the mapped records; a record cut short by an interrupted write
+// ends the scan.
+static int index_records(recap_cache* cache) {
+    size_t count = 0;
+    size_t pos = sizeof(cache_header);
+    while (pos + sizeof(cache_record) <= cache->map_len) {
+        const cache_record* rec = (const cache_record*)(cache->map + pos);
+        if (rec->key_len > MAX_PATH_SIZE || rec->data_len > cache->map_len || record_size(rec) > cache->map_len - pos) break;
+        count++;
+        pos += record_size(rec);
+    }
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    cache->slots = calloc(capacity, sizeof(uint64_t));
+    if (!cache->slots) return -1;
+    cache->slot_mask = capacity - 1;
+
+    pos = sizeof(cache_header);
+    for (size_t i = 0; i < count; i++) {
+        const cache_record* rec = (const cache_record*)(cache->map + pos);
+        uint64_t* slot = find_slot(cache, rec->kind, rec->variant, (const char*)(rec + 1), rec->key_len);
+        if (*slot) cache->live_bytes -= record_size((const cache_record*)(cache->map + *slot - 1));
+        *slot = pos + 1;
+        cache->live_bytes += record_size(rec);
+        pos += record_size(rec);
+    }
+    cache->map_len = pos;
+    return 0;
+}
+
+static int cache_file_path(const recap_cache* cache, const char* name, path_buf* out) {
+    out->len = 0;
+    if (path_buf_push(out, cache->dir.data, cache->dir.len) != 0 || path_buf_push(out, "/", 1) != 0 ||
+        path_buf_push(out, name, strlen(name)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Keeps the cache directory out of version control and backups.
+static void create_cache_dir(const char* dir) {
+    if (mkdir(dir, 0755) != 0) return;
+    path_buf path = {0};
+    static const char* const files[][2] = {
+        {"/.gitignore", "# Created by recap --cache\n*\n"},
+        {"/CACHEDIR.TAG", "Signature: 8a477f597d28d172789f06886806bc55\n# This file is a cache directory tag created by recap.\n"}};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        path.len = 0;
+        if (path_buf_push(&path, dir, strlen(dir)) != 0 || path_buf_push(&path, files[i][0], strlen(files[i][0])) != 0) break;
+        FILE* f = fopen(path.data, "w");
+        if (!f) continue;
+        fputs(files[i][1], f);
+        fclose(f);
+    }
+    path_buf_free(&path);
+}
+
+recap_cache* cache_open(const char* dir, const char* cwd) {
+    recap_cache* cache = calloc(1, sizeof(recap_cache));
+    if (!cache) return NULL;
+    pthread_mutex_init(&cache->lock, NULL);
+    atomic_init(&cache->dir_hits, 0);
+    atomic_init(&cache->file_hits, 0);
+    snprintf(cache->cwd, sizeof(cache->cwd), "%s", cwd);
+
+    // Entries modified within the last second could still change without
+    // their mtime moving, so they are not recorded.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cache->settled_before = (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec - NSEC_PER_SEC;
+
+    path_buf path = {0};
+    create_cache_dir(dir);
+    struct stat st;
+    if (path_buf_push(&cache->dir, dir, strlen(dir)) != 0 || stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        cache_file_path(cache, CACHE_ENTRIES_NAME, &path) != 0) {
+        path_buf_free(&path);
+        cache_close(cache);
+        return NULL;
+    }
+
+    int fd = open(path.data, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cache_header)) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (map != MAP_FAILED) {
+            cache->map = map;
+            cache->map_size = (size_t)st.st_size;
+            cache->map_len = cache->map_size;
+            const cache_header* header = map;
+            cache->header_ok = header->magic == CACHE_MAGIC && header->version == CACHE_VERSION;
+        }
+    }
+    if (fd >= 0) close(fd);
+    path_buf_free(&path);
+    if (cache->header_ok && index_records(cache) != 0) {
+        cache_close(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void cache_stamp_from_stat(cache_stamp* stamp, const struct stat* st) {
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->size = (uint64_t)st->st_size;
+    stamp->mtime_ns = (uint64_t)st->st_mtim.tv_sec * NSEC_PER_SEC + (uint64_t)st->st_mtim.tv_nsec;
+    stamp->ctime_ns = (uint64_t)st->st_ctim.tv_sec * NSEC_PER_SEC + (uint64_t)st->st_ctim.tv_nsec;
+    stamp->ino = (uint64_t)st->st_ino;
+    stamp->dev = (uint64_t)st->st_dev;
+}
+
+int cache_stamp_settled(const recap_cache* cache, const cache_stamp* stamp) {
+    return stamp->mtime_ns < cache->settled_before;
+}
+
+// Keys are absolute so runs from different directories share entries.
+static size_t absolute_key(const recap_cache* cache, const char* path, char* key) {
+    int n = path[0] == '/' ? snprintf(key, MAX_PATH_SIZE, "%s", path) : snprintf(key, MAX_PATH_SIZE, "%s/%s", cache->cwd, path);
+    return n > 0 && n < MAX_PATH_SIZE ? (size_t)n : 0;
+}
+
+static const cache_record* find_record(const recap_cache* cache, uint32_t kind, const char* path, uint64_t variant, const cache_stamp* stamp) {
+    char key[MAX_PATH_SIZE];
+    size_t key_len = absolute_key(cache, path, key);
+    uint64_t* slot = key_len ? find_slot(cache, kind, variant, key, key_len) : NULL;
+    if (!slot || !*slot) return NULL;
+    const cache_record* rec = (const cache_record*)(cache->map + *slot - 1);
+    return memcmp(&rec->stamp, stamp, sizeof(cache_stamp)) == 0 ? rec : NULL;
+}
+
+static void add_record(recap_cache* cache, uint32_t kind, const char* path, uint64_t variant, const cache_stamp* stamp, int status, const char* data, size_t len) {
+    char key[MAX_PATH_SIZE];
+    cache_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = kind;
+    rec.status = status;
+    rec.key_len = (uint32_t)absolute_key(cache, path, key);
+    rec.variant = variant;
+    rec.stamp = *stamp;
+    rec.data_len = len;
+    if (rec.key_len == 0 || !cache_stamp_settled(cache, stamp)) return;
+
+    static const char padding[8];
+    size_t size = record_size(&rec);
+    pthread_mutex_lock(&cache->lock);
+    size_t start = cache->pending.len;
+    if (path_buf_reserve(&cache->pending, start + size + 1) == 0) {
+        path_buf_push(&cache->pending, (const char*)&rec, sizeof(rec));
+        path_buf_push(&cache->pending, key, rec.key_len);
+        path_buf_push(&cache->pending, data, len);
+        path_buf_push(&cache->pending, padding, size - (sizeof(rec) + rec.key_len + len));
+        cache->pending_count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+const char* cache_find_dir(recap_cache* cache, const char* path, const cache_stamp* stamp, size_t* len) {
+    const cache_record* rec = find_record(cache, CACHE_DIR, path, 0, stamp);
+    if (!rec) return NULL;
+    atomic_fetch_add(&cache->dir_hits, 1);
+    *len = (size_t)rec->data_len;
+    return (const char*)(rec + 1) + rec->key_len;
+}
+
+void cache_put_dir(recap_cache* cache, const char* path, const cache_stamp* stamp, const char* listing, size_t len) {
+    add_record(cache, CACHE_DIR, path, 0, stamp, 0, listing, len);
+}
+
+int cache_find_file(recap_cache* cache, const char* path, uint64_t variant, const cache_stamp* stamp, int* status, const char** data, size_t* len) {
+    const cache_record* rec = find_record(cache, CACHE_FILE, path, variant, stamp);
+    if (!rec) return 0;
+    atomic_fetch_add(&cache->file_hits, 1);
+    *status = rec->status;
+    *data = (const char*)(rec + 1) + rec->key_len;
+    *len = (size_t)rec->data_len;
+    return 1;
+}
+
+void cache_put_file(recap_cache* cache, const char* path, uint64_t variant, const cache_stamp* stamp, int status, const char* data, size_t len) {
+    add_record(cache, CACHE_FILE, path, variant, stamp, status, data, len);
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Writes the mapped records that are still current (not replaced during this
+// run, path still present) and the pending ones to a new file, then renames
+// it over the old one.
+static int rewrite_entries(recap_cache* cache, const path_buf* entries_path, const unsigned char* replaced) {
+    path_buf tmp = {0};
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld", (long)getpid());
+    if (path_buf_push(&tmp, entries_path->data, entries_path->len) != 0 || path_buf_push(&tmp, suffix, strlen(suffix)) != 0) {
+        path_buf_free(&tmp);
+        return -1;
+    }
+    int fd = open(tmp.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    cache_header header = {CACHE_MAGIC, CACHE_VERSION};
+    int rc = fd >= 0 ? write_all(fd, &header, sizeof(header)) : -1;
+    size_t pos = sizeof(cache_header);
+    while (rc == 0 && cache->header_ok && pos < cache->map_len) {
+        const cache_record* rec = (const cache_record*)(cache->map + pos);
+        size_t size = record_size(rec);
+        uint64_t* slot = find_slot(cache, rec->kind, rec->variant, (const char*)(rec + 1), rec->key_len);
+        size_t slot_index = (size_t)(slot - cache->slots);
+        char key[MAX_PATH_SIZE + 1];
+        memcpy(key, rec + 1, rec->key_len);
+        key[rec->key_len] = '\0';
+        struct stat st;
+        if (*slot == pos + 1 && !replaced[slot_index] && lstat(key, &st) == 0) {
+            rc = write_all(fd, rec, size);
+        }
+        pos += size;
+    }
+    if (rc == 0) rc = write_all(fd, cache->pending.data, cache->pending.len);
+    if (fd >= 0 && close(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp.data, entries_path->data);
+    if (rc != 0) unlink(tmp.data);
+    path_buf_free(&tmp);
+    return rc;
+}
+
+// Appends this run's records, or compacts the file once replaced records
+// would make up more than half of it. A lock file serializes concurrent runs.
+static void flush_pending(recap_cache* cache) {
+    path_buf entries_path = {0};
+    path_buf lock_path = {0};
+    unsigned char* replaced = cache->slots ? calloc(cache->slot_mask + 1, 1) : NULL;
+    int lock_fd = -1;
+    if (cache_file_path(cache, CACHE_ENTRIES_NAME, &entries_path) != 0 || cache_file_path(cache, CACHE_LOCK_NAME, &lock_path) != 0 ||
+        (cache->slots && !replaced) || (lock_fd = open(lock_path.data, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+        flock(lock_fd, LOCK_EX) != 0) {
+        fprintf(stderr, "Warning: Could not update the cache in %s\n", cache->dir.data);
+        goto done;
+    }
+
+    size_t replaced_bytes = 0;
+    for (size_t pos = 0; pos < cache->pending.len;) {
+        const cache_record* rec = (const cache_record*)(cache->pending.data + pos);
+        uint64_t* slot = find_slot(cache, rec->kind, rec->variant, (const char*)(rec + 1), rec->key_len);
+        if (slot && *slot && !replaced[slot - cache->slots]) {
+            replaced[slot - cache->slots] = 1;
+            replaced_bytes += record_size((const cache_record*)(cache->map + *slot - 1));
+        }
+        pos += record_size(rec);
+    }
+
+    size_t live = cache->live_bytes - replaced_bytes + cache->pending.len;
+    size_t total = (cache->header_ok ? cache->map_len : sizeof(cache_header)) + cache->pending.len;
+    int rc;
+    if (!cache->header_ok || total > 2 * live) {
+        rc = rewrite_entries(cache, &entries_path, replaced);
+    }
+    else {
+        int fd = open(entries_path.data, O_WRONLY | O_APPEND | O_CLOEXEC);
+        rc = fd >= 0 ? write_all(fd, cache->pending.data, cache->pending.len) : -1;
+        if (fd >= 0 && close(fd) != 0) rc = -1;
+    }
+    if (rc != 0) fprintf(stderr, "Warning: Could not update the cache in %s\n", cache->dir.data);
+
+done:
+    if (lock_fd >= 0) close(lock_fd);
+    free(replaced);
+    path_buf_free(&entries_path);
+    path_buf_free(&lock_path);
+}
+
+void cache_close(recap_cache* cache) {
+    if (!cache) return;
+    if (cache->pending_count > 0) flush_pending(cache);
+    if (cache->map) munmap((void*)cache->map, cache->map_size);
+    free(cache->slots);
+    path_buf_free(&cache->pending);
+    path_buf_free(&cache->dir);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+void cache_print_stats(const recap_cache* cache) {
+    fprintf(stderr, "Stats: cache reused %zu directory listings and %zu files, recorded %zu entries\n",
+            atomic_load(&cache->dir_hits), atomic_load(&cache->file_hits), cache->pending_count);
+}
+
+size_t cache_pending(const recap_cache* cache) {
+    return cache->pending_count;
+}
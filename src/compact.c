@@ -1,277 +1,1264 @@
 #define _POSIX_C_SOURCE 200809L
 #include "recap.h"
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+enum {
+    MODE_CODE = 0,
+    MODE_LINE_COMMENT,
+    MODE_BLOCK_COMMENT,
+    MODE_STRING,
+    MODE_BLOCK_SCALAR
+};
+
+// isalnum() in the C locale, or '_'.
 static int is_ident_char(int c) {
-    return isalnum((unsigned char)c) || c == '_';
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_';
+}
+
+// isspace() in the C locale, without the newline that ends a line.
+static int is_trailing_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static void stage_flush(compact_stream* cs) {
+    sink_write(cs->sink, cs->stage, cs->committed);
+    memmove(cs->stage, cs->stage + cs->committed, cs->len - cs->committed);
+    cs->len -= cs->committed;
+    cs->committed = 0;
 }
 
-static char* shrink_buffer(char* buf, size_t len) {
-    char* r = realloc(buf, len + 1);
-    return r ? r : buf;
+// Makes room for n more bytes. Only a run of possibly trailing whitespace
+// longer than the stage makes it grow.
+static void stage_reserve(compact_stream* cs, size_t n) {
+    if (cs->cap - cs->len >= n) return;
+    if (cs->committed > 0) stage_flush(cs);
+    if (cs->cap - cs->len >= n) return;
+
+    size_t cap = cs->cap * 2;
+    while (cap - cs->len < n) cap *= 2;
+    char* stage = cs->stage == cs->local_stage ? malloc(cap) : realloc(cs->stage, cap);
+    if (!stage) {
+        // Keep going without the trim instead of losing content.
+        cs->committed = cs->len;
+        stage_flush(cs);
+        if (cs->cap < n) cs->sink->failed = 1;
+        return;
+    }
+    if (cs->stage == cs->local_stage) memcpy(stage, cs->local_stage, cs->len);
+    cs->stage = stage;
+    cs->cap = cap;
 }
 
-static char* compact_c_like(const char* input, int allow_line, int allow_block) {
-    size_t n = strlen(input);
-    char* out = malloc(n + 1);
-    if (!out) return strdup("");
+static void end_line(compact_stream* cs) {
+    cs->len = cs->committed;
+    if (!cs->line_has_text) return;
+    stage_reserve(cs, 1);
+    if (cs->len < cs->cap) cs->stage[cs->len++] = '\n';
+    cs->committed = cs->len;
+    cs->line_has_text = 0;
+}
 
-    size_t o = 0;
-    int in_line = 0, in_block = 0, in_str = 0, in_chr = 0, esc = 0;
-    int pending_space = 0;
-    int last_ident = 0;
-    char quote = 0;
+static void put_byte_slow(compact_stream* cs, char c) {
+    if (c == '\n') {
+        end_line(cs);
+        return;
+    }
+    stage_reserve(cs, 1);
+    if (cs->len == cs->cap) return;
+    cs->stage[cs->len++] = c;
+    if (!is_trailing_space(c)) {
+        cs->committed = cs->len;
+        cs->line_has_text = 1;
+    }
+}
+
+static inline void put_byte(compact_stream* cs, char c) {
+    if (c == '\n' || cs->len == cs->cap) {
+        put_byte_slow(cs, c);
+        return;
+    }
+    cs->stage[cs->len++] = c;
+    if (!is_trailing_space(c)) {
+        cs->committed = cs->len;
+        cs->line_has_text = 1;
+    }
+}
 
-    for (size_t i = 0; i < n; i++) {
-        char c = input[i];
+static void put_span_slow(compact_stream* cs, const char* s, size_t n) {
+    const char* text_end = s + n;
+    while (text_end > s && is_trailing_space(text_end[-1])) text_end--;
 
-        if (in_line) {
-            if (c == '\n') {
-                out[o++] = '\n';
-                in_line = 0;
-                last_ident = 0;
+    size_t text = (size_t)(text_end - s);
+    if (text > 0) {
+        // Whatever whitespace was pending is followed by text now.
+        cs->committed = cs->len;
+        cs->line_has_text = 1;
+        if (text > cs->cap - cs->len) {
+            stage_flush(cs);
+            if (text >= cs->cap / 2) {
+                sink_write(cs->sink, s, text);
+                text = 0;
             }
-            continue;
         }
-        if (in_block) {
-            if (c == '*' && i + 1 < n && input[i + 1] == '/') {
-                i++;
-                in_block = 0;
-                continue;
-            }
-            if (c == '\n') {
-                out[o++] = '\n';
-                last_ident = 0;
-            }
-            continue;
+        memcpy(cs->stage + cs->len, s, text);
+        cs->len += text;
+        cs->committed = cs->len;
+    }
+
+    size_t spaces = n - (size_t)(text_end - s);
+    if (spaces > 0) {
+        stage_reserve(cs, spaces);
+        if (cs->cap - cs->len < spaces) return;
+        memcpy(cs->stage + cs->len, text_end, spaces);
+        cs->len += spaces;
+    }
+}
+
+// Writes a run of bytes without newlines.
+static inline void put_span(compact_stream* cs, const char* s, size_t n) {
+    if (n > cs->cap - cs->len || is_trailing_space(s[n - 1])) {
+        put_span_slow(cs, s, n);
+        return;
+    }
+    char* d = cs->stage + cs->len;
+    if (n <= 8) {
+        // Most runs in code are a token or two; skip the call.
+        for (size_t i = 0; i < n; i++) d[i] = s[i];
+    } else {
+        memcpy(d, s, n);
+    }
+    cs->len += n;
+    cs->committed = cs->len;
+    cs->line_has_text = 1;
+}
+
+static void feed_plain(compact_stream* cs, const char* p, const char* end) {
+    while (p < end) {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        const char* stop = eol ? eol : end;
+        if (stop > p) put_span(cs, p, (size_t)(stop - p));
+        if (!eol) break;
+        end_line(cs);
+        p = eol + 1;
+    }
+}
+
+
+// Bytes that end a run the lexer copies as is, per language: in code, in
+// block comments and in each kind of string.
+struct compact_sets {
+    scan_set code;
+    scan_set comment;
+    scan_set strings[LANGUAGE_MAX_STRINGS];
+    // 1 + the first kind of string that opens with the byte, or 0.
+    unsigned char first_string[256];
+    // The same for one-byte quotes that nothing else starts with, which
+    // need no lookahead.
+    unsigned char quote_string[256];
+    size_t quote_len[LANGUAGE_MAX_STRINGS];
+    size_t line_comment_len[2];
+    size_t block_open_len, block_close_len;
+};
+static struct compact_sets language_sets[LANGUAGE_MAX];
+// Raw strings and comments whose closing delimiter depends on how they open.
+static scan_set quote_body, paren_body, bracket_body;
+static pthread_once_t language_sets_once = PTHREAD_ONCE_INIT;
+
+static void add_set_byte(char* bytes, size_t* count, char c) {
+    for (size_t i = 0; i < *count; i++) {
+        if (bytes[i] == c) return;
+    }
+    if (*count < SCAN_SET_MAX) bytes[(*count)++] = c;
+}
+
+static void init_language_sets(void) {
+    for (size_t l = 0; l < language_count(); l++) {
+        const language_def* lang = language_at(l);
+        struct compact_sets* sets = &language_sets[l];
+        char bytes[SCAN_SET_MAX];
+        size_t n = 0;
+
+        add_set_byte(bytes, &n, '\n');
+        if (lang->whitespace != LANGUAGE_KEEP_SPACE) {
+            add_set_byte(bytes, &n, ' ');
+            add_set_byte(bytes, &n, '\t');
+            add_set_byte(bytes, &n, '\r');
         }
-        if (in_str) {
-            out[o++] = c;
-            if (!esc) {
-                if (c == '\\') {
-                    esc = 1;
-                } else if (c == quote) {
-                    in_str = 0;
-                }
-            } else {
-                esc = 0;
+        for (int i = 0; i < 2 && lang->line_comments[i]; i++) add_set_byte(bytes, &n, lang->line_comments[i][0]);
+        if (lang->block_open) add_set_byte(bytes, &n, lang->block_open[0]);
+        for (int i = 0; i < LANGUAGE_MAX_STRINGS && lang->strings[i].quote; i++) {
+            add_set_byte(bytes, &n, lang->strings[i].quote[0]);
+        }
+        if (lang->flags & (LANGUAGE_RUST_RAW | LANGUAGE_SWIFT_RAW)) add_set_byte(bytes, &n, '#');
+        if (lang->flags & LANGUAGE_VERBATIM_AT) add_set_byte(bytes, &n, '@');
+        if (lang->flags & LANGUAGE_LUA_LONG) add_set_byte(bytes, &n, '[');
+        if (lang->flags & LANGUAGE_CHAR_LITERALS) add_set_byte(bytes, &n, '\'');
+        scan_set_init(&sets->code, bytes, n);
+
+        n = 0;
+        add_set_byte(bytes, &n, '\n');
+        if (lang->block_close) add_set_byte(bytes, &n, lang->block_close[0]);
+        if ((lang->flags & LANGUAGE_NESTED_COMMENTS) && lang->block_open) add_set_byte(bytes, &n, lang->block_open[0]);
+        scan_set_init(&sets->comment, bytes, n);
+
+        for (int i = 0; i < 2 && lang->line_comments[i]; i++) sets->line_comment_len[i] = strlen(lang->line_comments[i]);
+        sets->block_open_len = lang->block_open ? strlen(lang->block_open) : 0;
+        sets->block_close_len = lang->block_close ? strlen(lang->block_close) : 0;
+        for (int i = LANGUAGE_MAX_STRINGS - 1; i >= 0; i--) {
+            if (!lang->strings[i].quote) continue;
+            sets->quote_len[i] = strlen(lang->strings[i].quote);
+            sets->first_string[(unsigned char)lang->strings[i].quote[0]] = (unsigned char)(i + 1);
+        }
+        if (!(lang->flags & LANGUAGE_QUOTE_AFTER_SPACE)) {
+            for (int i = 0; i < LANGUAGE_MAX_STRINGS && lang->strings[i].quote; i++) {
+                unsigned char c = (unsigned char)lang->strings[i].quote[0];
+                if (sets->quote_len[i] == 1 && sets->first_string[c] == i + 1) sets->quote_string[c] = (unsigned char)(i + 1);
             }
-            continue;
+            for (int i = 0; i < 2 && lang->line_comments[i]; i++) sets->quote_string[(unsigned char)lang->line_comments[i][0]] = 0;
+            if (lang->block_open) sets->quote_string[(unsigned char)lang->block_open[0]] = 0;
+            if (lang->flags & LANGUAGE_VERBATIM_AT) sets->quote_string['@'] = 0;
+            if (lang->flags & LANGUAGE_LUA_LONG) sets->quote_string['['] = 0;
+            if (lang->flags & LANGUAGE_CHAR_LITERALS) sets->quote_string['\''] = 0;
+        }
+        for (int i = 0; i < LANGUAGE_MAX_STRINGS && lang->strings[i].quote; i++) {
+            n = 0;
+            add_set_byte(bytes, &n, '\n');
+            add_set_byte(bytes, &n, lang->strings[i].quote[0]);
+            if (lang->strings[i].flags & STRING_ESCAPES) add_set_byte(bytes, &n, '\\');
+            scan_set_init(&sets->strings[i], bytes, n);
+        }
+    }
+    scan_set_init(&quote_body, "\"\n", 2);
+    scan_set_init(&paren_body, ")\n", 2);
+    scan_set_init(&bracket_body, "]\n", 2);
+}
+
+// Runs in code end within a few bytes at the next space, quote or comment
+// marker, where a vector scan costs more than it skips: they are looked up
+// byte by byte.
+static const char* skip_code_run(const scan_set* set, const char* p, const char* end) {
+    while (p < end && !set->member[(unsigned char)*p]) p++;
+    return p;
+}
+
+// Strings and comments run longer. The next bytes are still looked up
+// directly, as many end right away, before the vector scan takes over.
+#define SKIP_RUN_PROBE 16
+
+static const char* skip_run(const compact_stream* cs, const scan_set* set, const char* p, const char* end) {
+    const char* probe_end = end - p > SKIP_RUN_PROBE ? p + SKIP_RUN_PROBE : end;
+    for (; p < probe_end; p++) {
+        if (set->member[(unsigned char)*p]) return p;
+    }
+    return p < end ? cs->find(set, p, end) : p;
+}
+
+static int is_space_byte(unsigned char c) {
+    return c == '\n' || is_trailing_space((char)c);
+}
+
+// Tokens are a few bytes long; a loop beats a call to memcmp().
+static inline int starts_with(const char* p, const char* end, const char* token, size_t len) {
+    if ((size_t)(end - p) < len) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != token[i]) return 0;
+    }
+    return 1;
+}
+
+// Input starts out as if it followed newlines.
+#define BEFORE_START 0x0a0a0a0au
+
+// The byte age + 1 positions before p, which may have been lexed in an
+// earlier call to lex().
+static inline unsigned char byte_before(const compact_stream* cs, const char* p, int age) {
+    ptrdiff_t here = p - cs->lex_start;
+    if (here > age) return (unsigned char)p[-age - 1];
+    return (unsigned char)(cs->before >> (8 * (age - here)));
+}
+
+// Keeps words apart that a removed comment separated, as in "a/* b */c".
+static void settle_gap(compact_stream* cs, char next) {
+    cs->gap = 0;
+    if (is_ident_char((unsigned char)next)) put_byte(cs, ' ');
+}
+
+static int is_indicator_modifier(char c) {
+    return c == '-' || c == '+' || (c >= '0' && c <= '9');
+}
+
+// Follows the indentation of the line and whether it ends in a block scalar
+// indicator such as "|", ">-" or "|2" (YAML).
+static void note_yaml_run(compact_stream* cs, const char* run, size_t n) {
+    size_t i = 0;
+    if (cs->counting_indent) {
+        while (i < n && run[i] == ' ') i++;
+        cs->indent += (int)i;
+        if (i == n) return;
+        cs->counting_indent = 0;
+    }
+    size_t e = n;
+    while (e > i && is_trailing_space(run[e - 1])) e--;
+    if (e == i) return;
+
+    size_t s = e;
+    while (s > i && is_indicator_modifier(run[s - 1])) s--;
+    if (s == i) {
+        // Only modifiers, which may belong to an indicator in the last run.
+        if (i > 0 || is_space_byte(byte_before(cs, run, 0))) cs->scalar_indicator = 0;
+        return;
+    }
+    char c = run[s - 1];
+    unsigned char before = s >= 2 ? (unsigned char)run[s - 2] : byte_before(cs, run, 0);
+    cs->scalar_indicator = (c == '|' || c == '>') && (before == ' ' || before == '\t');
+}
+
+static void yaml_line_end(compact_stream* cs) {
+    if (cs->scalar_indicator) {
+        cs->mode = MODE_BLOCK_SCALAR;
+        cs->scalar_indent = cs->indent;
+    }
+    cs->scalar_indicator = 0;
+    cs->indent = 0;
+    cs->counting_indent = 1;
+}
+
+// Text in code without tokens: words, operators and, where whitespace is
+// kept, the spaces between them.
+static inline void code_run(compact_stream* cs, const char* run, size_t n) {
+    if (cs->whitespace == LANGUAGE_COLLAPSE_SPACE) {
+        if (cs->pending_space) {
+            char c = run[0];
+            if (cs->last_ident && (is_ident_char((unsigned char)c) || c == '<')) put_byte(cs, ' ');
+            cs->pending_space = 0;
+        }
+        put_span(cs, run, n);
+        cs->last_ident = is_ident_char((unsigned char)run[n - 1]);
+    } else {
+        if (cs->gap) settle_gap(cs, run[0]);
+        put_span(cs, run, n);
+    }
+    if (cs->flags & LANGUAGE_BLOCK_SCALARS) note_yaml_run(cs, run, n);
+}
+
+// Before a string or character literal that starts with c.
+static void code_token_start(compact_stream* cs, char c) {
+    if (cs->whitespace == LANGUAGE_COLLAPSE_SPACE) {
+        if (cs->pending_space) {
+            if (cs->last_ident && c == '"') put_byte(cs, ' ');
+            cs->pending_space = 0;
         }
-        if (in_chr) {
-            out[o++] = c;
-            if (!esc) {
-                if (c == '\\') {
-                    esc = 1;
-                } else if (c == '\'') {
-                    in_chr = 0;
-                }
-            } else {
-                esc = 0;
+        cs->last_ident = 0;
+    } else if (cs->gap) {
+        settle_gap(cs, c);
+    }
+}
+
+static void code_newline(compact_stream* cs) {
+    switch (cs->whitespace) {
+    case LANGUAGE_COLLAPSE_SPACE:
+        put_byte(cs, '\n');
+        cs->pending_space = 0;
+        cs->last_ident = 0;
+        break;
+    case LANGUAGE_KEEP_SPACE:
+        end_line(cs);
+        break;
+    default:
+        break;
+    }
+    cs->gap = 0;
+    cs->first_line = 0;
+    if (cs->flags & LANGUAGE_BLOCK_SCALARS) yaml_line_end(cs);
+}
+
+// A newline that ends a line comment or is part of a block comment.
+static void comment_newline(compact_stream* cs) {
+    if (cs->whitespace != LANGUAGE_MINIFY) put_byte(cs, '\n');
+    cs->last_ident = 0;
+    cs->gap = 0;
+    cs->first_line = 0;
+}
+
+static void open_string(compact_stream* cs, const char* open, size_t open_len, const char* close, size_t close_len,
+                        int flags, const scan_set* body) {
+    code_token_start(cs, open[0]);
+    put_span(cs, open, open_len);
+    if (close_len == 1) {
+        cs->close[0] = close[0];
+    } else {
+        memcpy(cs->close, close, close_len);
+    }
+    cs->close_len = close_len;
+    cs->escapes = (flags & STRING_ESCAPES) != 0;
+    cs->doubled = (flags & STRING_DOUBLED) != 0;
+    cs->esc = 0;
+    cs->body = body;
+    cs->mode = MODE_STRING;
+    cs->scalar_indicator = 0;
+}
+
+// A raw string closed by quote and as many '#' as it opened with.
+static size_t open_raw_string(compact_stream* cs, const char* open, size_t open_len, const char* quote,
+                              size_t quote_len, size_t hashes) {
+    char close[COMPACT_LOOKAHEAD];
+    memcpy(close, quote, quote_len);
+    memset(close + quote_len, '#', hashes);
+    open_string(cs, open, open_len, close, quote_len + hashes, 0, &quote_body);
+    return open_len;
+}
+
+// The comment starts at p.
+static void open_comment(compact_stream* cs, const char* p, const char* close, size_t close_len, const scan_set* body) {
+    if (cs->whitespace == LANGUAGE_KEEP_SPACE && is_ident_char(byte_before(cs, p, 0))) cs->gap = 1;
+    memcpy(cs->close, close, close_len);
+    cs->close_len = close_len;
+    cs->depth = 1;
+    cs->body = body;
+    cs->mode = MODE_BLOCK_COMMENT;
+}
+
+// "[", as many '=' as the level, then "[" (Lua). Returns the level or -1.
+static int long_bracket(const char* p, const char* end) {
+    if (p == end || *p != '[') return -1;
+    const char* q = p + 1;
+    while (q < end && *q == '=' && q - p < COMPACT_LOOKAHEAD / 2) q++;
+    if (q == end || *q != '[') return -1;
+    return (int)(q - p - 1);
+}
+
+static size_t long_bracket_close(char* close, int level) {
+    close[0] = ']';
+    memset(close + 1, '=', (size_t)level);
+    close[level + 1] = ']';
+    return (size_t)level + 2;
+}
+
+// p follows an r, br or cr string prefix (Rust).
+static int rust_raw_prefix(const compact_stream* cs, const char* p) {
+    if (byte_before(cs, p, 0) != 'r') return 0;
+    unsigned char before = byte_before(cs, p, 1);
+    if (before == 'b' || before == 'c') before = byte_before(cs, p, 2);
+    return !is_ident_char(before);
+}
+
+// p follows R, u8R, uR, UR or LR (C++).
+static int cpp_raw_prefix(const compact_stream* cs, const char* p) {
+    if (byte_before(cs, p, 0) != 'R') return 0;
+    int age = 1;
+    unsigned char c = byte_before(cs, p, 1);
+    if (c == '8' && byte_before(cs, p, 2) == 'u') {
+        age = 3;
+    } else if (c == 'u' || c == 'U' || c == 'L') {
+        age = 2;
+    }
+    return !is_ident_char(byte_before(cs, p, age));
+}
+
+// A quote at p may open a raw string.
+static inline int raw_prefix(const compact_stream* cs, const char* p) {
+    return ((cs->flags & LANGUAGE_RUST_RAW) && rust_raw_prefix(cs, p)) ||
+           ((cs->flags & LANGUAGE_CPP_RAW) && cpp_raw_prefix(cs, p));
+}
+
+static int is_raw_delimiter_char(unsigned char c) {
+    return c > ' ' && c < 0x7f && c != '(' && c != ')' && c != '\\' && c != '"';
+}
+
+// 'x', '\n', '\u{1F600}' or one multibyte character in quotes. Anything
+// else after a quote is a lifetime or a label (Rust). Returns the length.
+static size_t char_literal_len(const char* p, const char* end) {
+    const char* q = p + 1;
+    if (q >= end || *q == '\'' || *q == '\n') return 0;
+    if (*q == '\\') {
+        q += 2;
+        while (q < end && q - p < 12 && *q != '\'' && *q != '\n') q++;
+    } else {
+        unsigned char lead = (unsigned char)*q;
+        q += lead < 0x80 ? 1 : lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+    }
+    return q < end && *q == '\'' ? (size_t)(q - p + 1) : 0;
+}
+
+static int quote_boundary(unsigned char c) {
+    return is_space_byte(c) || c == '[' || c == '{' || c == ',' || c == ':';
+}
+
+// A special byte in code. Returns the length of the comment opener, string
+// opener or character literal that starts at p, 0 for an ordinary byte, or
+// -1 if more input is needed to tell.
+static ptrdiff_t code_token(compact_stream* cs, const char* p, const char* end, int final) {
+    if (!final && end - p < COMPACT_LOOKAHEAD) return -1;
+    const language_def* lang = cs->language;
+    const struct compact_sets* sets = cs->sets;
+    int flags = cs->flags;
+    char c = *p;
+    char close[COMPACT_LOOKAHEAD];
+
+    if (flags & LANGUAGE_LUA_LONG) {
+        if (c == '-' && starts_with(p, end, "--", 2)) {
+            int level = long_bracket(p + 2, end);
+            if (level >= 0) {
+                open_comment(cs, p, close, long_bracket_close(close, level), &bracket_body);
+                return level + 4;
             }
-            continue;
+        } else if (c == '[') {
+            int level = long_bracket(p, end);
+            if (level < 0) return 0;
+            open_string(cs, p, (size_t)level + 2, close, long_bracket_close(close, level), 0, &bracket_body);
+            return level + 2;
+        }
+    }
+
+    if (lang->block_open && c == lang->block_open[0] && starts_with(p, end, lang->block_open, sets->block_open_len)) {
+        open_comment(cs, p, lang->block_close, sets->block_close_len, &sets->comment);
+        return (ptrdiff_t)sets->block_open_len;
+    }
+    for (int i = 0; i < 2 && lang->line_comments[i]; i++) {
+        const char* token = lang->line_comments[i];
+        size_t len = sets->line_comment_len[i];
+        if (c != token[0] || !starts_with(p, end, token, len)) continue;
+        if ((flags & LANGUAGE_COMMENT_AFTER_SPACE) && !is_space_byte(byte_before(cs, p, 0))) break;
+        // The shebang tells what runs the file; keep it.
+        if (cs->first_line && p == cs->lex_start && cs->before == BEFORE_START && starts_with(p, end, "#!", 2)) break;
+        cs->mode = MODE_LINE_COMMENT;
+        return (ptrdiff_t)len;
+    }
+
+    if ((flags & LANGUAGE_RUST_RAW) && (c == '"' || c == '#') && rust_raw_prefix(cs, p)) {
+        size_t hashes = 0;
+        while (p + hashes < end && p[hashes] == '#' && hashes < 16) hashes++;
+        if (p + hashes < end && p[hashes] == '"') return (ptrdiff_t)open_raw_string(cs, p, hashes + 1, "\"", 1, hashes);
+    }
+    if ((flags & LANGUAGE_SWIFT_RAW) && c == '#') {
+        size_t hashes = 0;
+        while (p + hashes < end && p[hashes] == '#' && hashes < 16) hashes++;
+        if (starts_with(p + hashes, end, "\"\"\"", 3)) return (ptrdiff_t)open_raw_string(cs, p, hashes + 3, "\"\"\"", 3, hashes);
+        if (p + hashes < end && p[hashes] == '"') return (ptrdiff_t)open_raw_string(cs, p, hashes + 1, "\"", 1, hashes);
+    }
+    if ((flags & LANGUAGE_CPP_RAW) && c == '"' && cpp_raw_prefix(cs, p)) {
+        // At most 16 delimiter characters between the quote and '('.
+        size_t d = 1;
+        while (d <= 17 && p + d < end && is_raw_delimiter_char((unsigned char)p[d])) d++;
+        if (d <= 17 && p + d < end && p[d] == '(') {
+            close[0] = ')';
+            memcpy(close + 1, p + 1, d - 1);
+            close[d] = '"';
+            open_string(cs, p, d + 1, close, d + 1, 0, &paren_body);
+            return (ptrdiff_t)d + 1;
         }
+    }
+    if ((flags & LANGUAGE_VERBATIM_AT) && c == '@' && starts_with(p, end, "@\"", 2)) {
+        open_string(cs, p, 2, "\"", 1, STRING_DOUBLED, &quote_body);
+        return 2;
+    }
+    if ((flags & LANGUAGE_CHAR_LITERALS) && c == '\'') {
+        size_t len = char_literal_len(p, end);
+        if (len == 0) return 0;
+        code_token_start(cs, c);
+        put_span(cs, p, len);
+        return (ptrdiff_t)len;
+    }
 
-        if (allow_block && c == '/' && i + 1 < n && input[i + 1] == '*') {
-            i++;
-            in_block = 1;
+    for (int i = sets->first_string[(unsigned char)c] - 1; i >= 0 && i < LANGUAGE_MAX_STRINGS; i++) {
+        const string_rule* rule = &lang->strings[i];
+        if (!rule->quote) break;
+        size_t len = sets->quote_len[i];
+        if (rule->quote[0] != c || !starts_with(p, end, rule->quote, len)) continue;
+        if ((flags & LANGUAGE_QUOTE_AFTER_SPACE) && !quote_boundary(byte_before(cs, p, 0))) return 0;
+        open_string(cs, p, len, rule->quote, len, rule->flags, &sets->strings[i]);
+        return (ptrdiff_t)len;
+    }
+    return 0;
+}
+
+static const char* lex_line_comment(compact_stream* cs, const char* p, const char* end) {
+    const char* eol = memchr(p, '\n', (size_t)(end - p));
+    if (!eol) return end;
+    comment_newline(cs);
+    cs->mode = MODE_CODE;
+    if (cs->flags & LANGUAGE_BLOCK_SCALARS) yaml_line_end(cs);
+    return eol + 1;
+}
+
+static const char* lex_string(compact_stream* cs, const char* p, const char* end, int final) {
+    while (p < end) {
+        if (cs->esc) {
+            put_byte(cs, *p++);
+            cs->esc = 0;
             continue;
         }
-        if (allow_line && c == '/' && i + 1 < n && input[i + 1] == '/') {
-            i++;
-            in_line = 1;
+        const char* run = p;
+        p = skip_run(cs, cs->body, p, end);
+        if (p > run) put_span(cs, run, (size_t)(p - run));
+        if (p == end) break;
+        char c = *p;
+        if (c == '\n' || (c == '\\' && cs->escapes)) {
+            put_byte(cs, c);
+            p++;
+            cs->esc = c == '\\';
             continue;
         }
+        // A single closing byte is all that ends a run here but the above.
+        if ((cs->close_len > 1 || cs->doubled) && !final && end - p < COMPACT_LOOKAHEAD) break;
+        if (cs->close_len == 1 || starts_with(p, end, cs->close, cs->close_len)) {
+            if (cs->doubled && p + 1 < end && p[1] == c) {
+                put_span(cs, p, 2);
+                p += 2;
+                continue;
+            }
+            put_span(cs, p, cs->close_len);
+            p += cs->close_len;
+            cs->mode = MODE_CODE;
+            break;
+        }
+        put_byte(cs, c);
+        p++;
+    }
+    return p;
+}
 
-        if (c == ' ' || c == '\t' || c == '\r') {
-            pending_space = 1;
-            continue;
+static const char* lex_code(compact_stream* cs, const char* p, const char* end, int final) {
+    while (p < end) {
+        const char* run = p;
+        p = skip_code_run(&cs->sets->code, p, end);
+        if (p > run) {
+            code_run(cs, run, (size_t)(p - run));
+            if (p == end) break;
         }
+        char c = *p;
         if (c == '\n') {
-            out[o++] = '\n';
-            pending_space = 0;
-            last_ident = 0;
+            p++;
+            code_newline(cs);
+            if (cs->mode != MODE_CODE) break;
             continue;
         }
-
-        if (pending_space) {
-            int curr_ident = is_ident_char((unsigned char)c);
-            if (last_ident && (curr_ident || c == '"' || c == '<')) {
-                out[o++] = ' ';
-            }
-            pending_space = 0;
+        if (c == ' ' || c == '\t' || c == '\r') {
+            // Only special where whitespace is collapsed or dropped.
+            if (cs->whitespace == LANGUAGE_COLLAPSE_SPACE) cs->pending_space = 1;
+            p++;
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+            continue;
         }
-
-        if (c == '"') {
-            out[o++] = c;
-            in_str = 1;
-            quote = '"';
-            esc = 0;
-            last_ident = 0;
+        cs->counting_indent = 0;
+        int quote = cs->sets->quote_string[(unsigned char)c];
+        if (quote && !raw_prefix(cs, p)) {
+            p++;
+            open_string(cs, p - 1, 1, p - 1, 1, cs->language->strings[quote - 1].flags, &cs->sets->strings[quote - 1]);
+            p = lex_string(cs, p, end, final);
+            if (cs->mode != MODE_CODE) break;
             continue;
         }
-        if (c == '\'') {
-            out[o++] = c;
-            in_chr = 1;
-            esc = 0;
-            last_ident = 0;
+        ptrdiff_t n = code_token(cs, p, end, final);
+        if (n < 0) break;
+        if (n == 0) {
+            code_run(cs, p, 1);
+            p++;
             continue;
         }
+        p += n;
+        // Strings and line comments are short and frequent: lex them right away.
+        if (cs->mode == MODE_STRING) {
+            p = lex_string(cs, p, end, final);
+        } else if (cs->mode == MODE_LINE_COMMENT) {
+            p = lex_line_comment(cs, p, end);
+        }
+        if (cs->mode != MODE_CODE) break;
+    }
+    return p;
+}
 
-        out[o++] = c;
-        last_ident = is_ident_char((unsigned char)c);
-    }
-    out[o] = '\0';
-    return shrink_buffer(out, o);
-}
-
-static char* compact_hash_style(const char* input) {
-    size_t n = strlen(input);
-    char* out = malloc(n + 1);
-    if (!out) return strdup("");
-    size_t o = 0;
-    int in_str = 0, triple = 0, esc = 0;
-    char quote = 0;
-
-    for (size_t i = 0; i < n; i++) {
-        char c = input[i];
-        if (in_str) {
-            out[o++] = c;
-            if (triple) {
-                if (c == quote && i + 2 < n && input[i + 1] == quote && input[i + 2] == quote) {
-                    out[o++] = input[i + 1];
-                    out[o++] = input[i + 2];
-                    i += 2;
-                    in_str = 0;
-                    triple = 0;
-                }
-            } else {
-                if (!esc) {
-                    if (c == '\\') esc = 1;
-                    else if (c == quote) in_str = 0;
-                } else {
-                    esc = 0;
-                }
-            }
+static const char* lex_block_comment(compact_stream* cs, const char* p, const char* end, int final) {
+    const language_def* lang = cs->language;
+    while (p < end) {
+        p = skip_run(cs, cs->body, p, end);
+        if (p == end) break;
+        if (*p == '\n') {
+            comment_newline(cs);
+            p++;
             continue;
         }
-
-        if (c == '"' || c == '\'') {
-            if (i + 2 < n && input[i + 1] == c && input[i + 2] == c) {
-                out[o++] = c; out[o++] = c; out[o++] = c;
-                i += 2;
-                in_str = 1; triple = 1; quote = c; esc = 0;
-            } else {
-                out[o++] = c;
-                in_str = 1; triple = 0; quote = c; esc = 0;
+        if (!final && end - p < COMPACT_LOOKAHEAD) break;
+        if (starts_with(p, end, cs->close, cs->close_len)) {
+            p += cs->close_len;
+            if (--cs->depth == 0) {
+                cs->mode = MODE_CODE;
+                break;
             }
             continue;
         }
-
-        if (c == '#') {
-            while (i < n && input[i] != '\n') i++;
-            if (i < n && input[i] == '\n') out[o++] = '\n';
+        if ((cs->flags & LANGUAGE_NESTED_COMMENTS) && starts_with(p, end, lang->block_open, cs->sets->block_open_len)) {
+            cs->depth++;
+            p += cs->sets->block_open_len;
             continue;
         }
-
-        out[o++] = c;
+        p++;
     }
-    out[o] = '\0';
-    return shrink_buffer(out, o);
+    return p;
 }
 
-static char* compact_json_minify(const char* input) {
-    size_t n = strlen(input);
-    char* out = malloc(n + 1);
-    if (!out) return strdup("");
-    size_t o = 0;
-    int in_str = 0, esc = 0;
-    for (size_t i = 0; i < n; i++) {
-        char c = input[i];
-        if (in_str) {
-            out[o++] = c;
-            if (!esc) {
-                if (c == '\\') esc = 1;
-                else if (c == '"') in_str = 0;
-            } else {
-                esc = 0;
+// Inside a block scalar, lines indented deeper than the line that opened it
+// and blank lines are content, copied as they are.
+static const char* lex_block_scalar(compact_stream* cs, const char* p, const char* end) {
+    while (p < end) {
+        if (cs->counting_indent) {
+            const char* run = p;
+            while (p < end && (*p == ' ' || *p == '\r')) {
+                if (*p == ' ') cs->indent++;
+                p++;
+            }
+            if (p > run) put_span(cs, run, (size_t)(p - run));
+            if (p == end) break;
+            if (*p == '\n') {
+                end_line(cs);
+                cs->indent = 0;
+                p++;
+                continue;
+            }
+            cs->counting_indent = 0;
+            if (cs->indent <= cs->scalar_indent) {
+                cs->mode = MODE_CODE;
+                break;
             }
-            continue;
         }
-        if (c == '"') {
-            out[o++] = c;
-            in_str = 1; esc = 0;
-            continue;
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            put_span(cs, p, (size_t)(end - p));
+            return end;
         }
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
-        out[o++] = c;
+        if (eol > p) put_span(cs, p, (size_t)(eol - p));
+        end_line(cs);
+        cs->counting_indent = 1;
+        cs->indent = 0;
+        p = eol + 1;
     }
-    out[o] = '\0';
-    return shrink_buffer(out, o);
+    return p;
 }
 
-char* apply_compact_transformations(const char* content, const char* filename) {
-    char* intermediate = NULL;
-    const char* ext = strrchr(filename, '.');
+static const char* lex_modes(compact_stream* cs, const char* p, const char* end, int final) {
+    while (p < end) {
+        int mode = cs->mode;
+        const char* next;
+        switch (mode) {
+        case MODE_LINE_COMMENT:
+            next = lex_line_comment(cs, p, end);
+            break;
+        case MODE_BLOCK_COMMENT:
+            next = lex_block_comment(cs, p, end, final);
+            break;
+        case MODE_STRING:
+            next = lex_string(cs, p, end, final);
+            break;
+        case MODE_BLOCK_SCALAR:
+            next = lex_block_scalar(cs, p, end);
+            break;
+        default:
+            next = lex_code(cs, p, end, final);
+            break;
+        }
+        if (cs->mode == mode && next < end) return next;
+        p = next;
+    }
+    return p;
+}
+
+// Returns where lexing stopped: end, or fewer than COMPACT_LOOKAHEAD bytes
+// before it when those cannot be classified until more input arrives.
+static const char* lex(compact_stream* cs, const char* p, const char* end, int final) {
+    cs->lex_start = p;
+    const char* stop = lex_modes(cs, p, end, final);
+    size_t n = (size_t)(stop - p);
+    if (n >= 4) {
+        const unsigned char* b = (const unsigned char*)stop - 4;
+        cs->before = (unsigned)b[0] << 24 | (unsigned)b[1] << 16 | (unsigned)b[2] << 8 | b[3];
+    } else {
+        for (size_t i = 0; i < n; i++) cs->before = cs->before << 8 | (unsigned char)p[i];
+    }
+    return stop;
+}
 
-    if (ext) {
-        if (strcmp(ext, ".json") == 0) {
-            intermediate = compact_json_minify(content);
-        } else if (
-            strcmp(ext, ".c") == 0 || strcmp(ext, ".h") == 0 || strcmp(ext, ".cpp") == 0 ||
-            strcmp(ext, ".hpp") == 0 || strcmp(ext, ".java") == 0 || strcmp(ext, ".js") == 0 ||
-            strcmp(ext, ".ts") == 0 || strcmp(ext, ".go") == 0) {
-            intermediate = compact_c_like(content, 1, 1);
-        } else if (strcmp(ext, ".css") == 0) {
-            intermediate = compact_c_like(content, 0, 1);
-        } else if (
-            strcmp(ext, ".py") == 0 || strcmp(ext, ".sh") == 0 || strcmp(ext, ".rb") == 0 || strcmp(ext, ".pl") == 0) {
-            intermediate = compact_hash_style(content);
+// Lexes data after the bytes carried over from the previous chunk, and
+// carries over again what cannot be classified yet.
+static void lex_chunk(compact_stream* cs, const char* data, size_t len, int final) {
+    if (cs->carry_len > 0) {
+        char joined[2 * COMPACT_LOOKAHEAD];
+        size_t take = len < COMPACT_LOOKAHEAD ? len : COMPACT_LOOKAHEAD;
+        memcpy(joined, cs->carry, cs->carry_len);
+        memcpy(joined + cs->carry_len, data, take);
+        size_t total = cs->carry_len + take;
+        size_t used = (size_t)(lex(cs, joined, joined + total, final && take == len) - joined);
+        if (take == len) {
+            cs->carry_len = total - used;
+            memmove(cs->carry, joined + used, cs->carry_len);
+            return;
         }
+        // With a full COMPACT_LOOKAHEAD bytes after them, the carried bytes
+        // were all classified.
+        data += used - cs->carry_len;
+        len -= used - cs->carry_len;
+        cs->carry_len = 0;
+    }
+    const char* stop = lex(cs, data, data + len, final);
+    cs->carry_len = (size_t)(data + len - stop);
+    memcpy(cs->carry, stop, cs->carry_len);
+}
+
+static void set_language(compact_stream* cs, const language_def* lang) {
+    cs->language = lang;
+    if (!lang) return;
+    cs->sets = &language_sets[lang - language_at(0)];
+    cs->whitespace = lang->whitespace;
+    cs->flags = lang->flags;
+}
+
+static void feed_language(compact_stream* cs, const char* data, size_t len) {
+    if (cs->language) {
+        lex_chunk(cs, data, len, 0);
+    } else {
+        feed_plain(cs, data, data + len);
+    }
+}
+
+static void end_sniffing(compact_stream* cs) {
+    cs->sniffing = 0;
+    set_language(cs, language_for_shebang(cs->head, cs->head_len));
+    feed_language(cs, cs->head, cs->head_len);
+}
+
+static void stream_init(compact_stream* cs, out_sink* sink, const language_def* lang) {
+    memset(cs, 0, offsetof(compact_stream, local_stage));
+    cs->sink = sink;
+    cs->stage = cs->local_stage;
+    cs->cap = sizeof(cs->local_stage);
+    cs->before = BEFORE_START;
+    cs->first_line = 1;
+    cs->counting_indent = 1;
+    cs->find = scan_set_finder();
+    set_language(cs, lang);
+}
+
+void compact_stream_init(compact_stream* cs, const char* filename, out_sink* sink) {
+    pthread_once(&language_sets_once, init_language_sets);
+    stream_init(cs, sink, language_for_path(filename));
+    cs->sniffing = cs->language == NULL;
+}
+
+// Content ends at the first NUL; anything fed after it is ignored.
+void compact_stream_feed(compact_stream* cs, const char* data, size_t len) {
+    if (cs->ended) return;
+    const char* nul = memchr(data, '\0', len);
+    if (nul) {
+        len = (size_t)(nul - data);
+        cs->ended = 1;
+    }
+
+    if (cs->sniffing) {
+        size_t take = COMPACT_SNIFF_MAX - cs->head_len;
+        if (take > len) take = len;
+        memcpy(cs->head + cs->head_len, data, take);
+        cs->head_len += take;
+        data += take;
+        len -= take;
+        if (!cs->ended && cs->head_len < COMPACT_SNIFF_MAX && !memchr(cs->head, '\n', cs->head_len)) return;
+        end_sniffing(cs);
+    }
+    feed_language(cs, data, len);
+}
+
+// Settles what was waiting for more input, ends the last line and writes
+// everything out.
+void compact_stream_finish(compact_stream* cs) {
+    if (cs->sniffing) end_sniffing(cs);
+    if (cs->language) lex_chunk(cs, "", 0, 1);
+    end_line(cs);
+    cs->committed = cs->len;
+    stage_flush(cs);
+    if (cs->stage != cs->local_stage) free(cs->stage);
+    cs->stage = cs->local_stage;
+    cs->cap = sizeof(cs->local_stage);
+}
+
+// Large files are split into chunks that are lexed on several threads at
+// once. The state a chunk starts in depends on everything before it, so each
+// chunk is lexed from a guess: code at the start of a line, or, when the
+// chunk had to start in the middle of a long line, every state a line can be
+// in there. A run records its state at fixed offsets (marks), and keeps
+// going a little past the end of its chunk. Where it agrees with a run of
+// the next chunk at a mark, the output continues with that run; where none
+// agrees, the chunk is lexed again from the true state until it does.
+#define COMPACT_PARALLEL_MIN (2 * 1024 * 1024)
+#define COMPACT_CHUNK_MIN (512 * 1024)
+#define COMPACT_MARK_EVERY (16 * 1024)
+#define COMPACT_OVERLAP_MARKS 2
+#define COMPACT_MAX_RUNS 512
+
+enum {
+    ENTER_CODE,
+    ENTER_LINE_COMMENT,
+    ENTER_BLOCK_COMMENT,
+    ENTER_STRING // + the index of the kind of string
+};
+
+// Everything that decides how the input after pos compacts. Fields that
+// the mode does not use are cleared so that equal states compare equal.
+typedef struct {
+    size_t pos, out_len;
+    int clean; // nothing staged: out_len covers all output so far
+    int mode, depth, esc, escapes, doubled;
+    const scan_set* body;
+    char close[COMPACT_LOOKAHEAD];
+    size_t close_len;
+    int pending_space, last_ident, gap, first_line, line_has_text;
+} compact_mark;
+
+typedef struct {
+    const char* start;
+    const char* limit; // lexes up to here, past the end of its chunk
+    const char* stop; // where it stopped
+    size_t chunk;
+    compact_stream* cs;
+    out_sink out;
+    compact_mark* marks; // marks[0] is where it starts
+    size_t mark_count, mark_cap;
+    int failed;
+} compact_run;
+
+typedef struct {
+    const char* data;
+    const char* end;
+    const compact_stream* proto;
+    compact_run* runs;
+    size_t run_count;
+    atomic_size_t next;
+} compact_job;
+
+static void take_mark(const compact_stream* cs, const char* data, const char* pos, size_t out_len, compact_mark* m) {
+    memset(m, 0, sizeof(*m));
+    m->pos = (size_t)(pos - data);
+    m->out_len = out_len;
+    m->clean = cs->len == 0;
+    m->mode = cs->mode;
+    m->first_line = cs->first_line;
+    m->line_has_text = cs->line_has_text;
+    if (cs->mode == MODE_LINE_COMMENT) return;
+    // pending_space only matters after a word.
+    m->last_ident = cs->last_ident;
+    m->pending_space = cs->pending_space && cs->last_ident;
+    m->gap = cs->gap;
+    if (cs->mode == MODE_BLOCK_COMMENT) {
+        m->depth = cs->depth;
+    } else if (cs->mode == MODE_STRING) {
+        m->esc = cs->esc;
+        m->escapes = cs->escapes;
+        m->doubled = cs->doubled;
+    } else {
+        return;
+    }
+    m->body = cs->body;
+    m->close_len = cs->close_len;
+    memcpy(m->close, cs->close, cs->close_len);
+}
+
+static int same_mark(const compact_mark* a, const compact_mark* b) {
+    return a->clean && b->clean && a->pos == b->pos && a->mode == b->mode && a->depth == b->depth && a->esc == b->esc &&
+           a->escapes == b->escapes && a->doubled == b->doubled && a->body == b->body && a->close_len == b->close_len &&
+           memcmp(a->close, b->close, a->close_len) == 0 && a->pending_space == b->pending_space &&
+           a->last_ident == b->last_ident && a->gap == b->gap && a->first_line == b->first_line &&
+           a->line_has_text == b->line_has_text;
+}
+
+static int add_mark(compact_run* run, const char* data, const char* pos) {
+    if (run->mark_count == run->mark_cap) {
+        size_t cap = run->mark_cap ? run->mark_cap * 2 : 64;
+        compact_mark* marks = realloc(run->marks, cap * sizeof(*marks));
+        if (!marks) return -1;
+        run->marks = marks;
+        run->mark_cap = cap;
+    }
+    take_mark(run->cs, data, pos, run->out.len, &run->marks[run->mark_count++]);
+    return 0;
+}
+
+// Sets up cs as it would be at a chunk that starts at p, in the state enter.
+static void enter_state(compact_stream* cs, const char* data, const char* p, int enter, int midline) {
+    for (const char* b = p - data < 4 ? data : p - 4; b < p; b++) cs->before = cs->before << 8 | (unsigned char)*b;
+    cs->first_line = 0;
+    cs->line_has_text = midline || cs->whitespace == LANGUAGE_MINIFY;
+    const language_def* lang = cs->language;
+    const struct compact_sets* sets = cs->sets;
+    switch (enter) {
+    case ENTER_CODE:
+        break;
+    case ENTER_LINE_COMMENT:
+        cs->mode = MODE_LINE_COMMENT;
+        break;
+    case ENTER_BLOCK_COMMENT:
+        cs->mode = MODE_BLOCK_COMMENT;
+        cs->depth = 1;
+        cs->body = &sets->comment;
+        memcpy(cs->close, lang->block_close, sets->block_close_len);
+        cs->close_len = sets->block_close_len;
+        break;
+    default: {
+        size_t i = (size_t)(enter - ENTER_STRING);
+        cs->mode = MODE_STRING;
+        cs->escapes = (lang->strings[i].flags & STRING_ESCAPES) != 0;
+        cs->doubled = (lang->strings[i].flags & STRING_DOUBLED) != 0;
+        cs->body = &sets->strings[i];
+        memcpy(cs->close, lang->strings[i].quote, sets->quote_len[i]);
+        cs->close_len = sets->quote_len[i];
+        break;
+    }
+    }
+}
+
+// The next offset at which runs take a mark.
+static const char* next_mark(const char* data, const char* end, const char* p) {
+    size_t at = ((size_t)(p - data) / COMPACT_MARK_EVERY + 1) * COMPACT_MARK_EVERY;
+    return at < (size_t)(end - data) ? data + at : end;
+}
+
+static void lex_run(compact_job* job, compact_run* run) {
+    compact_stream* cs = run->cs;
+    const char* p = run->start;
+    if (add_mark(run, job->data, p) != 0) run->failed = 1;
+    // Lexing stops short of a mark where it needs to see past it, and then
+    // takes the mark there; runs in the same state stop at the same place.
+    for (const char* stop = next_mark(job->data, job->end, p); !run->failed && p < run->limit;
+         stop = next_mark(job->data, job->end, stop)) {
+        p = lex(cs, p, stop, stop == job->end);
+        stage_flush(cs);
+        if (add_mark(run, job->data, p) != 0) run->failed = 1;
+    }
+    if (run->out.failed) run->failed = 1;
+    run->stop = p;
+}
+
+static void* lex_runs(void* arg) {
+    compact_job* job = arg;
+    for (size_t i = atomic_fetch_add(&job->next, 1); i < job->run_count; i = atomic_fetch_add(&job->next, 1)) {
+        lex_run(job, &job->runs[i]);
+    }
+    return NULL;
+}
+
+// Where the chunk after p starts: at the next line, or, in a long line,
+// after a byte that leaves nothing pending such as ',' or ';'.
+static const char* chunk_start(const char* p, const char* end, int* midline) {
+    size_t reach = (size_t)(end - p) < COMPACT_MARK_EVERY ? (size_t)(end - p) : COMPACT_MARK_EVERY;
+    const char* eol = memchr(p, '\n', reach);
+    *midline = eol == NULL;
+    if (eol) return eol + 1;
+    for (const char* q = p; q < p + reach; q++) {
+        if (*q && strchr(",;{}()[]", *q)) return q + 1;
     }
+    return p;
+}
+
+// Makes main carry on exactly where run stopped.
+static void adopt_run(compact_stream* main, const compact_run* run) {
+    out_sink* sink = main->sink;
+    memcpy(main, run->cs, offsetof(compact_stream, carry));
+    main->sink = sink;
+    main->carry_len = 0;
+    main->line_has_text = run->cs->line_has_text;
+    size_t pending = run->cs->len - run->cs->committed;
+    main->len = main->committed = 0;
+    stage_reserve(main, pending);
+    if (main->cap < pending) return;
+    memcpy(main->stage, run->cs->stage + run->cs->committed, pending);
+    main->len = pending;
+}
 
-    if (!intermediate) {
-        intermediate = strdup(content);
+// The earliest mark from from_mark on at which a run of the chunk after
+// from's agrees with from. Returns that run, with the marks in both.
+static const compact_run* find_takeover(const compact_job* job, const compact_run* from, size_t* from_mark, size_t* to_mark) {
+    size_t first = *from_mark;
+    const compact_run* best = NULL;
+    for (size_t r = 0; r < job->run_count; r++) {
+        const compact_run* to = &job->runs[r];
+        if (to->chunk != from->chunk + 1 || to->failed) continue;
+        size_t i = first;
+        for (size_t j = 0; j < to->mark_count; j++) {
+            while (i < from->mark_count && from->marks[i].pos < to->marks[j].pos) i++;
+            if (i == from->mark_count) break;
+            if (best && to->marks[j].pos >= best->marks[*to_mark].pos) break;
+            if (same_mark(&from->marks[i], &to->marks[j])) {
+                best = to;
+                *from_mark = i;
+                *to_mark = j;
+                break;
+            }
+        }
     }
+    return best;
+}
 
-    const char* p = intermediate;
-    size_t original_len = strlen(p);
-    char* result_buffer = malloc(original_len + 1);
-    if (!result_buffer) {
-        free(intermediate);
-        return strdup("");
+// A run of a later chunk than after's that agrees with mark.
+static const compact_run* find_agreeing_run(const compact_job* job, size_t after, const compact_mark* mark, size_t* to_mark) {
+    for (size_t r = 0; r < job->run_count; r++) {
+        const compact_run* to = &job->runs[r];
+        if (to->chunk <= after || to->failed) continue;
+        for (size_t j = 0; j < to->mark_count && to->marks[j].pos <= mark->pos; j++) {
+            if (same_mark(&to->marks[j], mark)) {
+                *to_mark = j;
+                return to;
+            }
+        }
     }
-    char* q = result_buffer;
+    return NULL;
+}
 
-    while (*p) {
-        const char* start_of_line = p;
-        const char* end_of_line = strchr(p, '\n');
-        size_t line_len = end_of_line ? (size_t)(end_of_line - p) : strlen(p);
+// Writes the output of the runs in input order, switching from one run to
+// the next where they agree and lexing with main where none does.
+static void stitch_runs(compact_stream* main, const compact_job* job) {
+    const compact_run* run = &job->runs[0];
+    size_t written = 0, from_mark = 0, to_mark = 0;
+    for (;;) {
+        const compact_run* next = find_takeover(job, run, &from_mark, &to_mark);
+        if (next) {
+            sink_write(main->sink, run->out.data + written, run->marks[from_mark].out_len - written);
+            run = next;
+            from_mark = to_mark;
+            written = next->marks[to_mark].out_len;
+            continue;
+        }
+
+        if (run->out.len > written) sink_write(main->sink, run->out.data + written, run->out.len - written);
+        adopt_run(main, run);
+        const char* p = run->stop;
+        size_t chunk = run->chunk;
+        run = NULL;
+        for (const char* stop = next_mark(job->data, job->end, p); p < job->end && !run;
+             stop = next_mark(job->data, job->end, stop)) {
+            p = lex(main, p, stop, stop == job->end);
+            stage_flush(main);
+            compact_mark mark;
+            take_mark(main, job->data, p, 0, &mark);
+            run = find_agreeing_run(job, chunk, &mark, &to_mark);
+        }
+        if (!run) return;
+        from_mark = to_mark;
+        written = run->marks[to_mark].out_len;
+    }
+}
 
-        const char* line_content_end = p + line_len;
-        while (line_content_end > start_of_line && isspace((unsigned char)*(line_content_end - 1))) {
-            line_content_end--;
+static void free_runs(compact_run* runs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (runs[i].cs) {
+            if (runs[i].cs->stage != runs[i].cs->local_stage) free(runs[i].cs->stage);
+            free(runs[i].cs);
         }
+        sink_free(&runs[i].out);
+        free(runs[i].marks);
+    }
+    free(runs);
+}
 
-        size_t trimmed_len = line_content_end - start_of_line;
+// Splits data into chunks and sets up the runs that lex them. Returns the
+// number of runs, or 0 if that did not work out.
+static size_t plan_runs(compact_job* job, int jobs) {
+    size_t len = (size_t)(job->end - job->data);
+    size_t chunks = len / COMPACT_CHUNK_MIN;
+    if (chunks > (size_t)jobs * 2) chunks = (size_t)jobs * 2;
+    size_t per_chunk = 3 + LANGUAGE_MAX_STRINGS;
+    if (chunks * per_chunk > COMPACT_MAX_RUNS) chunks = COMPACT_MAX_RUNS / per_chunk;
+    if (chunks < 2) return 0;
 
-        if (trimmed_len > 0) {
-            memcpy(q, start_of_line, trimmed_len);
-            q += trimmed_len;
-            *q++ = '\n';
+    job->runs = calloc(chunks * per_chunk, sizeof(compact_run));
+    if (!job->runs) return 0;
+    const language_def* lang = job->proto->language;
+    const char* start = job->data;
+    int midline = 0;
+    size_t count = 0, chunk = 0;
+    while (start < job->end) {
+        const char* next = job->end;
+        int next_midline = 0;
+        if (chunk + 1 < chunks) {
+            const char* nominal = job->data + len / chunks * (chunk + 1);
+            if (nominal > start) next = chunk_start(nominal, job->end, &next_midline);
+            if (next <= start) next = job->end;
         }
+        // Lex on past the end of the chunk for a few marks to meet the next.
+        const char* limit = next;
+        for (int i = 0; i < COMPACT_OVERLAP_MARKS && limit < job->end; i++) limit = next_mark(job->data, job->end, limit);
 
-        if (end_of_line) {
-            p = end_of_line + 1;
-        } else {
-            break;
+        int enters[3 + LANGUAGE_MAX_STRINGS]; // per_chunk
+        int enter_count = 0;
+        enters[enter_count++] = ENTER_CODE;
+        if (chunk > 0 && midline) {
+            if (lang->line_comments[0]) enters[enter_count++] = ENTER_LINE_COMMENT;
+            if (lang->block_open) enters[enter_count++] = ENTER_BLOCK_COMMENT;
+            for (int i = 0; i < LANGUAGE_MAX_STRINGS && lang->strings[i].quote; i++) enters[enter_count++] = ENTER_STRING + i;
         }
+        for (int e = 0; e < enter_count; e++) {
+            compact_run* run = &job->runs[count++];
+            run->start = start;
+            run->limit = limit;
+            run->chunk = chunk;
+            sink_init_buffer(&run->out);
+            run->cs = malloc(sizeof(compact_stream));
+            if (!run->cs) {
+                free_runs(job->runs, count);
+                return 0;
+            }
+            stream_init(run->cs, &run->out, lang);
+            if (chunk > 0) enter_state(run->cs, job->data, start, enters[e], midline);
+        }
+        start = next;
+        midline = next_midline;
+        chunk++;
     }
-    *q = '\0';
-    free(intermediate);
+    return count;
+}
 
-    char* final_result = realloc(result_buffer, strlen(result_buffer) + 1);
-    return final_result ? final_result : result_buffer;
+// Compacts data as the whole input, as compact_stream_feed() and
+// compact_stream_finish() would, on up to jobs threads for large files.
+void compact_stream_complete(compact_stream* cs, const char* data, size_t len, int jobs) {
+    const char* nul = memchr(data, '\0', len);
+    if (nul) len = (size_t)(nul - data);
+    // YAML block scalars depend on indentation that runs do not track.
+    if (jobs < 2 || len < COMPACT_PARALLEL_MIN || !cs->language || (cs->flags & LANGUAGE_BLOCK_SCALARS)) {
+        compact_stream_feed(cs, data, len);
+        compact_stream_finish(cs);
+        return;
+    }
+
+    compact_job job;
+    job.data = data;
+    job.end = data + len;
+    job.proto = cs;
+    job.run_count = plan_runs(&job, jobs);
+    if (job.run_count == 0) {
+        compact_stream_feed(cs, data, len);
+        compact_stream_finish(cs);
+        return;
+    }
+    atomic_init(&job.next, 0);
+
+    size_t thread_count = (size_t)jobs < job.run_count ? (size_t)jobs : job.run_count;
+    pthread_t threads[MAX_JOBS];
+    size_t started = 0;
+    for (size_t i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, lex_runs, &job) != 0) break;
+        started++;
+    }
+    lex_runs(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < job.run_count; i++) failed |= job.runs[i].failed;
+    if (failed) {
+        compact_stream_feed(cs, data, len);
+    } else {
+        stitch_runs(cs, &job);
+    }
+    free_runs(job.runs, job.run_count);
+    compact_stream_finish(cs);
 }
@@ -0,0 +1,222 @@
+#include "recap.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Files are classified as binary when a NUL byte shows up this early.
+#define TEXT_SNIFF_SIZE 1024
+
+// Cache entry status for files listed without content.
+#define CACHED_BINARY 1
+
+// Sorted, lowercase; looked up with bsearch.
+static const char* const binary_extensions[] = {
+    "7z", "a", "avi", "bin", "bmp", "bz2", "class", "dll", "dylib", "eot",
+    "exe", "flac", "gif", "gz", "ico", "iso", "jar", "jpeg", "jpg", "lib",
+    "mkv", "mov", "mp3", "mp4", "o", "obj", "ogg", "otf", "pdf", "png",
+    "pyc", "rar", "so", "sqlite", "tar", "tgz", "tif", "tiff", "ttf", "wasm",
+    "wav", "webm", "webp", "woff", "woff2", "xz", "zip", "zst"};
+
+typedef struct {
+    const char* bytes;
+    size_t len;
+} magic_number;
+
+static const magic_number binary_magic[] = {
+    {"\x7f" "ELF", 4},
+    {"\x89PNG\r\n\x1a\n", 8},
+    {"GIF87a", 6},
+    {"GIF89a", 6},
+    {"\xff\xd8\xff", 3},
+    {"PK\x03\x04", 4},
+    {"\x1f\x8b", 2},
+    {"%PDF-", 5},
+    {"7z\xbc\xaf\x27\x1c", 6},
+    {"\xfd" "7zXZ", 5},
+    {"\x28\xb5\x2f\xfd", 4},
+    {"\xca\xfe\xba\xbe", 4},
+    {"\xcf\xfa\xed\xfe", 4},
+    {"\xce\xfa\xed\xfe", 4},
+    {"MZ\x90", 3},
+    {"Rar!\x1a\x07", 6},
+    {"OggS", 4},
+    {"wOFF", 4},
+    {"wOF2", 4}};
+
+static int compare_extension(const void* key, const void* elem) {
+    return strcasecmp((const char*)key, *(const char* const*)elem);
+}
+
+int has_binary_extension(const char* path) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char* dot = strrchr(base, '.');
+    if (!dot || dot == base || dot[1] == '\0') return 0;
+    return bsearch(dot + 1, binary_extensions,
+                   sizeof(binary_extensions) / sizeof(binary_extensions[0]),
+                   sizeof(binary_extensions[0]), compare_extension) != NULL;
+}
+
+static int looks_binary(const char* data, size_t len) {
+    size_t sniff = len < TEXT_SNIFF_SIZE ? len : TEXT_SNIFF_SIZE;
+    if (memchr(data, '\0', sniff)) return 1;
+    for (size_t i = 0; i < sizeof(binary_magic) / sizeof(binary_magic[0]); i++) {
+        if (len >= binary_magic[i].len && memcmp(data, binary_magic[i].bytes, binary_magic[i].len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void content_file_close(content_file* cf) {
+    if (cf->map) munmap(cf->map, cf->len);
+    free(cf->heap);
+    if (cf->fd >= 0) close(cf->fd);
+    cf->fd = -1;
+    cf->map = NULL;
+    cf->heap = NULL;
+    cf->data = NULL;
+}
+
+static int content_file_load(content_file* cf, size_t size) {
+    if (size >= ZERO_COPY_MIN_SIZE) {
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, cf->fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+            cf->map = map;
+            cf->data = map;
+            cf->len = size;
+            return 0;
+        }
+    }
+
+    cf->heap = malloc(size + 1);
+    if (!cf->heap) return -1;
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(cf->fd, cf->heap + total, size - total);
+        if (n <= 0) return -1;
+        total += (size_t)n;
+    }
+    cf->heap[size] = '\0';
+    cf->data = cf->heap;
+    cf->len = size;
+    return 0;
+}
+
+// Opens a content file once: a single open, fstat and read (or mmap for large
+// files, so verbatim spans can be handed to the kernel) serve both the binary
+// check and the content block. Files with a binary extension are rejected
+// without being opened. Returns CONTENT_FILE_TEXT with cf->status set to 0,
+// -1 (read error) or -2 (larger than max_bytes), or CONTENT_FILE_BINARY when
+// the file should only be listed by path; cf needs content_file_close() in
+// both cases.
+int content_file_open(content_file* cf, const char* path, size_t max_bytes) {
+    memset(cf, 0, sizeof(*cf));
+    cf->fd = -1;
+    if (has_binary_extension(path)) return CONTENT_FILE_BINARY;
+
+    cf->fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (cf->fd < 0) return CONTENT_FILE_BINARY;
+    struct stat st;
+    if (fstat(cf->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        cf->status = -1;
+        return CONTENT_FILE_TEXT;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size > max_bytes) {
+        char head[TEXT_SNIFF_SIZE];
+        ssize_t n = pread(cf->fd, head, sizeof(head), 0);
+        if (n > 0 && looks_binary(head, (size_t)n)) return CONTENT_FILE_BINARY;
+        cf->status = -2;
+        return CONTENT_FILE_TEXT;
+    }
+
+    if (content_file_load(cf, size) != 0) {
+        content_file_close(cf);
+        cf->status = -1;
+        return CONTENT_FILE_TEXT;
+    }
+    if (looks_binary(cf->data, cf->len)) return CONTENT_FILE_BINARY;
+    return CONTENT_FILE_TEXT;
+}
+
+// Same contract as content_file_open(), but a file whose stamp matches a
+// cache entry is not opened: binary files are recognized from the entry and
+// text comes back already processed (cf->processed). Otherwise the file is
+// read as usual and, when it is not being modified right now, cf is set up
+// for write_file_content_block() to record what it renders.
+int content_file_open_cached(content_file* cf, recap_cache* cache, const char* path, uint64_t variant, size_t max_bytes) {
+    if (has_binary_extension(path)) return content_file_open(cf, path, max_bytes);
+
+    struct stat st;
+    cache_stamp stamp;
+    int cacheable = 0;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        cache_stamp_from_stat(&stamp, &st);
+        int status;
+        const char* data;
+        size_t len;
+        if (cache_find_file(cache, path, variant, &stamp, &status, &data, &len)) {
+            memset(cf, 0, sizeof(*cf));
+            cf->fd = -1;
+            if (status == CACHED_BINARY) return CONTENT_FILE_BINARY;
+            cf->status = status;
+            cf->data = data;
+            cf->len = len;
+            cf->processed = 1;
+            return CONTENT_FILE_TEXT;
+        }
+        cacheable = cache_stamp_settled(cache, &stamp);
+    }
+
+    int kind = content_file_open(cf, path, max_bytes);
+    if (!cacheable) return kind;
+    if (kind == CONTENT_FILE_BINARY) {
+        cache_put_file(cache, path, variant, &stamp, CACHED_BINARY, "", 0);
+    }
+    else if (cf->status == -2) {
+        cache_put_file(cache, path, variant, &stamp, -2, "", 0);
+    }
+    else if (cf->status == 0) {
+        cf->cache_path = path;
+        cf->stamp = stamp;
+        cf->variant = variant;
+    }
+    return kind;
+}
+
+// Same contract as content_file_open() for a blob read from the object
+// store; name is the path the blob is listed under, for the extension check.
+int content_file_open_blob(content_file* cf, git_odb* odb, const char* hex_id, const char* name, size_t max_bytes) {
+    memset(cf, 0, sizeof(*cf));
+    cf->fd = -1;
+    if (has_binary_extension(name)) return CONTENT_FILE_BINARY;
+
+    unsigned char oid[GIT_OID_SIZE];
+    int type;
+    size_t len;
+    if (git_oid_from_hex(hex_id, oid) != 0 || git_odb_read(odb, oid, &type, &cf->heap, &len) != 0) {
+        cf->status = -1;
+        return CONTENT_FILE_TEXT;
+    }
+    if (type != GIT_OBJ_BLOB) {
+        content_file_close(cf);
+        cf->status = -1;
+        return CONTENT_FILE_TEXT;
+    }
+    if (looks_binary(cf->heap, len)) return CONTENT_FILE_BINARY;
+    if (len > max_bytes) {
+        content_file_close(cf);
+        cf->status = -2;
+        return CONTENT_FILE_TEXT;
+    }
+    cf->data = cf->heap;
+    cf->len = len;
+    return CONTENT_FILE_TEXT;
+}
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+int path_buf_reserve(path_buf* buf, size_t min_capacity) {
+    if (buf->cap >= min_capacity) return 0;
+    size_t new_cap = buf->cap ? buf->cap : 256;
+    while (new_cap < min_capacity) new_cap *= 2;
+    char* data = realloc(buf->data, new_cap);
+    if (!data) return -1;
+    buf->data = data;
+    buf->cap = new_cap;
+    return 0;
+}
+
+int path_buf_push(path_buf* buf, const char* s, size_t n) {
+    if (path_buf_reserve(buf, buf->len + n + 1) != 0) return -1;
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+void path_buf_truncate(path_buf* buf, size_t len) {
+    if (len > buf->len) return;
+    buf->len = len;
+    if (buf->data) buf->data[len] = '\0';
+}
+
+void path_buf_free(path_buf* buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+static int entry_type_from_mode(mode_t mode) {
+    if (S_ISDIR(mode)) return DIR_ENTRY_DIR;
+    if (S_ISREG(mode)) return DIR_ENTRY_REG;
+    return DIR_ENTRY_OTHER;
+}
+
+#if defined(__linux__)
+
+static int entry_type_from_dtype(unsigned char d_type) {
+    switch (d_type) {
+    case DT_DIR:
+        return DIR_ENTRY_DIR;
+    case DT_REG:
+        return DIR_ENTRY_REG;
+    case DT_UNKNOWN:
+        return DIR_ENTRY_UNKNOWN;
+    default:
+        return DIR_ENTRY_OTHER;
+    }
+}
+
+// The directory is opened relative to its parent's fd when the caller holds
+// one, so the kernel resolves a single name, and relative to the root fd
+// otherwise. path keeps the tail so a directory listed from the cache can
+// still be opened when a file in it is.
+static int scan_set_dir(dir_scan* scan, int root_fd, const char* root_path, const char* tail, int parent_fd) {
+    (void)root_path;
+    scan->nread = 0;
+    scan->pos = 0;
+    scan->path.len = 0;
+    if (path_buf_push(&scan->path, *tail ? tail : ".", *tail ? strlen(tail) : 1) != 0) return -1;
+    scan->at_fd = root_fd;
+    scan->at_name = 0;
+    if (parent_fd >= 0 && *tail) {
+        // The tail ends with '/'; the name starts after the one before it.
+        size_t start = scan->path.len - 1;
+        while (start > 0 && scan->path.data[start - 1] != '/') start--;
+        scan->at_fd = parent_fd;
+        scan->at_name = start;
+    }
+    return 0;
+}
+
+static int scan_stat_dir(dir_scan* scan, struct stat* st) {
+    return fstatat(scan->at_fd, scan->path.data + scan->at_name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+static int scan_dir_fd(dir_scan* scan) {
+    if (scan->fd < 0) scan->fd = openat(scan->at_fd, scan->path.data + scan->at_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return scan->fd;
+}
+
+static int scan_open_listing(dir_scan* scan) {
+    return scan_dir_fd(scan) < 0 ? -1 : 0;
+}
+
+// Returns 0 at the end of the directory and -1 on a read error.
+static int scan_read_entry(dir_scan* scan, const char** name, int* type) {
+    while (1) {
+        if (scan->pos >= scan->nread) {
+            long n = syscall(SYS_getdents64, scan->fd, scan->buf, DIR_SCAN_BUFFER_SIZE);
+            if (n <= 0) return n < 0 ? -1 : 0;
+            scan->nread = n;
+            scan->pos = 0;
+        }
+        struct linux_dirent64* d = (struct linux_dirent64*)(scan->buf + scan->pos);
+        scan->pos += d->d_reclen;
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+            continue;
+        }
+        *name = d->d_name;
+        *type = entry_type_from_dtype(d->d_type);
+        return 1;
+    }
+}
+
+static int scan_resolve_type(dir_scan* scan, const char* name) {
+    if (scan_dir_fd(scan) < 0) return -1;
+#if defined(STATX_TYPE)
+    struct statx stx;
+    if (statx(scan->fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE, &stx) == 0) {
+        return entry_type_from_mode(stx.stx_mode);
+    }
+    if (errno != ENOSYS) return -1;
+#endif
+    struct stat st;
+    if (fstatat(scan->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+    return entry_type_from_mode(st.st_mode);
+}
+
+static int scan_open_file(dir_scan* scan, const char* name) {
+    if (scan_dir_fd(scan) < 0) return -1;
+    return openat(scan->fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+}
+
+static int scan_share_fd(dir_scan* scan) {
+    if (scan_dir_fd(scan) < 0) return -1;
+    scan->fd_shared = 1;
+    return scan->fd;
+}
+
+static void scan_close_dir(dir_scan* scan) {
+    if (scan->fd >= 0 && !scan->fd_shared) close(scan->fd);
+    scan->fd = -1;
+    scan->fd_shared = 0;
+}
+
+#else
+
+static int scan_set_dir(dir_scan* scan, int root_fd, const char* root_path, const char* tail, int parent_fd) {
+    (void)root_fd;
+    (void)parent_fd;
+    scan->path.len = 0;
+    if (path_buf_push(&scan->path, root_path, strlen(root_path)) != 0) return -1;
+    if (*tail) {
+        size_t tail_len = strlen(tail);
+        if (path_buf_push(&scan->path, "/", 1) != 0 ||
+            path_buf_push(&scan->path, tail, tail_len - 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int scan_stat_dir(dir_scan* scan, struct stat* st) {
+    return lstat(scan->path.data, st);
+}
+
+static int scan_open_listing(dir_scan* scan) {
+    scan->dir = opendir(scan->path.data);
+    return scan->dir ? 0 : -1;
+}
+
+static int scan_read_entry(dir_scan* scan, const char** name, int* type) {
+    struct dirent* entry;
+    while ((entry = readdir(scan->dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        *name = entry->d_name;
+        *type = DIR_ENTRY_UNKNOWN;
+#if defined(_DIRENT_HAVE_D_TYPE) && defined(DT_UNKNOWN) && defined(DT_DIR) && defined(DT_REG)
+        if (entry->d_type == DT_DIR) *type = DIR_ENTRY_DIR;
+        else if (entry->d_type == DT_REG) *type = DIR_ENTRY_REG;
+        else if (entry->d_type != DT_UNKNOWN) *type = DIR_ENTRY_OTHER;
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+static int scan_resolve_type(dir_scan* scan, const char* name) {
+    size_t base_len = scan->path.len;
+    if (path_buf_push(&scan->path, "/", 1) != 0 || path_buf_push(&scan->path, name, strlen(name)) != 0) {
+        path_buf_truncate(&scan->path, base_len);
+        return -1;
+    }
+    struct stat st;
+    int rc = lstat(scan->path.data, &st);
+    path_buf_truncate(&scan->path, base_len);
+    if (rc != 0) return -1;
+    return entry_type_from_mode(st.st_mode);
+}
+
+static int scan_open_file(dir_scan* scan, const char* name) {
+    size_t base_len = scan->path.len;
+    if (path_buf_push(&scan->path, "/", 1) != 0 || path_buf_push(&scan->path, name, strlen(name)) != 0) {
+        path_buf_truncate(&scan->path, base_len);
+        return -1;
+    }
+    int fd = open(scan->path.data, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    path_buf_truncate(&scan->path, base_len);
+    return fd;
+}
+
+static int scan_share_fd(dir_scan* scan) {
+    (void)scan;
+    return -1;
+}
+
+static void scan_close_dir(dir_scan* scan) {
+    if (scan->dir) closedir(scan->dir);
+    scan->dir = NULL;
+}
+
+#endif
+
+// Listings are cached as a type byte followed by the NUL-terminated name for
+// each entry, keyed by the directory's path and stamp. parent_fd, when not
+// -1, is the fd of the directory containing the last component of tail.
+int dir_scan_open(dir_scan* scan, int root_fd, const char* root_path, const char* tail, int parent_fd) {
+    scan->listing = NULL;
+    scan->recording = 0;
+    scan->at_end = 0;
+    if (scan_set_dir(scan, root_fd, root_path, tail, parent_fd) != 0) return -1;
+    if (scan->cache) {
+        struct stat st;
+        scan->key.len = 0;
+        if (path_buf_push(&scan->key, root_path, strlen(root_path)) == 0 && path_buf_push(&scan->key, "/", 1) == 0 &&
+            path_buf_push(&scan->key, tail, strlen(tail)) == 0 && scan_stat_dir(scan, &st) == 0 && S_ISDIR(st.st_mode)) {
+            cache_stamp_from_stat(&scan->stamp, &st);
+            size_t len;
+            const char* listing = cache_find_dir(scan->cache, scan->key.data, &scan->stamp, &len);
+            if (listing) {
+                scan->listing = listing;
+                scan->listing_pos = listing;
+                scan->listing_end = listing + len;
+                return 0;
+            }
+            scan->recording = cache_stamp_settled(scan->cache, &scan->stamp);
+            scan->recorded.len = 0;
+        }
+    }
+    return scan_open_listing(scan);
+}
+
+int dir_scan_next(dir_scan* scan, const char** name, int* type) {
+    if (scan->listing) {
+        if (scan->listing_pos >= scan->listing_end) return 0;
+        *type = (unsigned char)scan->listing_pos[0];
+        *name = scan->listing_pos + 1;
+        scan->listing_pos = *name + strlen(*name) + 1;
+        return 1;
+    }
+    int rc = scan_read_entry(scan, name, type);
+    if (rc <= 0) {
+        scan->at_end = rc == 0;
+        return 0;
+    }
+    if (scan->recording) {
+        char type_byte = (char)*type;
+        if (path_buf_push(&scan->recorded, &type_byte, 1) != 0 || path_buf_push(&scan->recorded, *name, strlen(*name) + 1) != 0) {
+            scan->recording = 0;
+        }
+    }
+    return 1;
+}
+
+int dir_scan_resolve_type(dir_scan* scan, const char* name) {
+    return scan_resolve_type(scan, name);
+}
+
+// Opens a regular file in the directory being scanned; returns -1 if there is
+// none. A cached listing answers for names it does not contain.
+int dir_scan_open_file(dir_scan* scan, const char* name) {
+    if (scan->listing) {
+        const char* p = scan->listing;
+        while (p < scan->listing_end && strcmp(p + 1, name) != 0) p += strlen(p + 1) + 2;
+        if (p >= scan->listing_end) return -1;
+    }
+    return scan_open_file(scan, name);
+}
+
+// Hands the fd of the directory being scanned to the caller, who closes it
+// once its subdirectories are opened; -1 if there is none to share.
+int dir_scan_share_fd(dir_scan* scan) {
+    return scan_share_fd(scan);
+}
+
+// Only listings read to the end are recorded.
+void dir_scan_close(dir_scan* scan) {
+    if (scan->recording && scan->at_end) {
+        cache_put_dir(scan->cache, scan->key.data, &scan->stamp, scan->recorded.data ? scan->recorded.data : "", scan->recorded.len);
+    }
+    scan->recording = 0;
+    scan->listing = NULL;
+    scan_close_dir(scan);
+}
+
+int dir_scan_init(dir_scan* scan) {
+    memset(scan, 0, sizeof(*scan));
+    scan->fd = -1;
+#if defined(__linux__)
+    scan->buf = malloc(DIR_SCAN_BUFFER_SIZE);
+    if (!scan->buf) return -1;
+#endif
+    return 0;
+}
+
+void dir_scan_free(dir_scan* scan) {
+    dir_scan_close(scan);
+    free(scan->buf);
+    scan->buf = NULL;
+    path_buf_free(&scan->path);
+    path_buf_free(&scan->key);
+    path_buf_free(&scan->recorded);
+}
+
+int open_root_dir(const char* path) {
+#if defined(__linux__)
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#else
+    (void)path;
+    return -1;
+#endif
+}
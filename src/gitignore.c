@@ -0,0 +1,572 @@
+#include "recap.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Compiled gitignore rules. Each rule is classified once when it is added:
+ *
+ *   - literal rules without a slash ("build", "node_modules/") are keyed by
+ *     name and match any path component;
+ *   - anchored rules ("/dist", "docs/api/") are stored in a trie of literal
+ *     components; a rule whose later components contain wildcards hangs its
+ *     remaining glob off the trie node of its literal prefix ("src/gen-*");
+ *   - "*" followed by a literal ("*.log") is keyed by that suffix;
+ *   - other rules without a slash ("*.tmp[0-9]") are globs tried on the
+ *     basename.
+ *
+ * Trie edges and basename literals share one hash table keyed by parent node
+ * and component, so matching walks the components of a path once. The rule
+ * with the highest index among those that match wins, as in git, and decides
+ * between ignoring and re-including (!) the path.
+ */
+
+#define BASENAME_NODE (-1)
+#define SUFFIX_NODE (-2)
+#define ROOT_NODE 0
+
+enum {
+    GLOB_LITERAL,
+    GLOB_ANY,
+    GLOB_CLASS,
+    GLOB_STAR,
+    // "**/" at the start of a component: zero or more directories.
+    GLOB_ANY_DIRS,
+    // "**" as the last component: everything below.
+    GLOB_REST,
+    GLOB_END
+};
+
+typedef struct {
+    int type;
+    unsigned char ch;
+    const uint8_t* set;
+} glob_token;
+
+typedef struct {
+    int negate;
+    int dir_only;
+    const glob_token* glob;
+} gitignore_rule;
+
+typedef struct {
+    int rule_any;
+    int rule_dir;
+    int* globs;
+    int glob_count;
+    int glob_cap;
+} trie_node;
+
+typedef struct {
+    uint32_t hash;
+    int parent;
+    int node;
+    size_t len;
+    const char* name;
+} trie_edge;
+
+struct gitignore {
+    str_arena arena;
+    gitignore_rule* rules;
+    int rule_count;
+    int rule_cap;
+    trie_node* nodes;
+    int node_count;
+    int node_cap;
+    trie_edge* edges;
+    uint32_t edge_mask;
+    int edge_count;
+    int* basename_globs;
+    int basename_glob_count;
+    int basename_glob_cap;
+    // Distinct lengths of the "*literal" suffixes.
+    int* suffix_lens;
+    int suffix_len_count;
+    int suffix_len_cap;
+    // Paths are given relative to the working directory; base is the working
+    // directory relative to the directory the rules apply to ("" or "sub/"),
+    // root that directory itself for absolute paths.
+    char* root;
+    char* base;
+};
+
+static uint32_t edge_hash(int parent, const char* name, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)parent;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int grow_array(void** items, int* cap, int needed, size_t item_size) {
+    if (needed <= *cap) return 0;
+    int new_cap = *cap ? *cap * 2 : 16;
+    while (new_cap < needed) new_cap *= 2;
+    void* grown = realloc(*items, (size_t)new_cap * item_size);
+    if (!grown) return -1;
+    *items = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static int new_node(gitignore* gi) {
+    if (grow_array((void**)&gi->nodes, &gi->node_cap, gi->node_count + 1, sizeof(trie_node)) != 0) return -1;
+    trie_node* node = &gi->nodes[gi->node_count];
+    memset(node, 0, sizeof(*node));
+    node->rule_any = -1;
+    node->rule_dir = -1;
+    return gi->node_count++;
+}
+
+static int find_edge(const gitignore* gi, int parent, const char* name, size_t len) {
+    if (!gi->edges) return -1;
+    uint32_t h = edge_hash(parent, name, len);
+    for (uint32_t slot = h & gi->edge_mask;; slot = (slot + 1) & gi->edge_mask) {
+        const trie_edge* e = &gi->edges[slot];
+        if (!e->name) return -1;
+        if (e->hash == h && e->parent == parent && e->len == len && memcmp(e->name, name, len) == 0) return e->node;
+    }
+}
+
+static int grow_edges(gitignore* gi) {
+    uint32_t size = gi->edges ? (gi->edge_mask + 1) * 2 : 64;
+    trie_edge* edges = calloc(size, sizeof(trie_edge));
+    if (!edges) return -1;
+    for (uint32_t i = 0; gi->edges && i <= gi->edge_mask; i++) {
+        if (!gi->edges[i].name) continue;
+        uint32_t slot = gi->edges[i].hash & (size - 1);
+        while (edges[slot].name) slot = (slot + 1) & (size - 1);
+        edges[slot] = gi->edges[i];
+    }
+    free(gi->edges);
+    gi->edges = edges;
+    gi->edge_mask = size - 1;
+    return 0;
+}
+
+// Returns the child of parent for the component, creating it if needed.
+static int child_node(gitignore* gi, int parent, const char* name, size_t len) {
+    int node = find_edge(gi, parent, name, len);
+    if (node >= 0) return node;
+    if ((uint32_t)(gi->edge_count + 1) * 2 > (gi->edges ? gi->edge_mask + 1 : 0) && grow_edges(gi) != 0) return -1;
+    char* stored = arena_alloc(&gi->arena, len + 1);
+    if (!stored) return -1;
+    memcpy(stored, name, len);
+    stored[len] = '\0';
+    if ((node = new_node(gi)) < 0) return -1;
+
+    uint32_t h = edge_hash(parent, name, len);
+    uint32_t slot = h & gi->edge_mask;
+    while (gi->edges[slot].name) slot = (slot + 1) & gi->edge_mask;
+    trie_edge* e = &gi->edges[slot];
+    e->hash = h;
+    e->parent = parent;
+    e->node = node;
+    e->len = len;
+    e->name = stored;
+    gi->edge_count++;
+    return node;
+}
+
+static int has_wildcard(const char* p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\') return 1;
+    }
+    return 0;
+}
+
+// Parses a bracket expression starting after '['; returns the position after
+// the closing ']' or NULL if there is none, in which case '[' is literal.
+static const char* compile_class(const char* p, const char* end, uint8_t* set) {
+    memset(set, 0, 32);
+    int negate = 0;
+    if (p < end && (*p == '!' || *p == '^')) {
+        negate = 1;
+        p++;
+    }
+    int first = 1;
+    while (p < end && (*p != ']' || first)) {
+        first = 0;
+        unsigned char lo = (unsigned char)*p++;
+        if (lo == '\\' && p < end) lo = (unsigned char)*p++;
+        unsigned char hi = lo;
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            p++;
+            hi = (unsigned char)*p++;
+            if (hi == '\\' && p < end) hi = (unsigned char)*p++;
+        }
+        for (int c = lo; c <= hi; c++) set[c >> 3] |= (uint8_t)(1u << (c & 7));
+    }
+    if (p >= end) return NULL;
+    if (negate) {
+        for (int i = 0; i < 32; i++) set[i] = (uint8_t)~set[i];
+    }
+    return p + 1;
+}
+
+// git matches the literal part of a rooted pattern before its first wildcard
+// separately, so a "**" that starts right there counts as the start of a
+// component even inside one ("/a**/b"); first_wildcard gives that offset.
+static const glob_token* compile_glob(gitignore* gi, const char* p, size_t len, size_t first_wildcard) {
+    glob_token* tokens = arena_alloc(&gi->arena, (len + 1) * sizeof(glob_token));
+    if (!tokens) return NULL;
+    const char* start = p;
+    const char* end = p + len;
+    int n = 0;
+    while (p < end) {
+        glob_token* t = &tokens[n++];
+        t->set = NULL;
+        int at_component = p == start || p[-1] == '/' || (size_t)(p - start) == first_wildcard;
+        if (*p == '*') {
+            const char* q = p;
+            while (q < end && *q == '*') q++;
+            if (q - p >= 2 && at_component && (q == end || *q == '/')) {
+                t->type = q == end ? GLOB_REST : GLOB_ANY_DIRS;
+                p = q == end ? q : q + 1;
+            }
+            else {
+                t->type = GLOB_STAR;
+                p = q;
+            }
+        }
+        else if (*p == '?') {
+            t->type = GLOB_ANY;
+            p++;
+        }
+        else if (*p == '[') {
+            uint8_t* set = arena_alloc(&gi->arena, 32);
+            if (!set) return NULL;
+            const char* after = compile_class(p + 1, end, set);
+            if (after) {
+                t->type = GLOB_CLASS;
+                t->set = set;
+                p = after;
+            }
+            else {
+                t->type = GLOB_LITERAL;
+                t->ch = '[';
+                p++;
+            }
+        }
+        else {
+            if (*p == '\\' && p + 1 < end) p++;
+            t->type = GLOB_LITERAL;
+            t->ch = (unsigned char)*p++;
+        }
+    }
+    tokens[n].type = GLOB_END;
+    return tokens;
+}
+
+// Wildcards never match '/', except for the "**" forms.
+static int glob_match(const glob_token* t, const char* s) {
+    for (;; t++) {
+        switch (t->type) {
+        case GLOB_END:
+            return *s == '\0';
+        case GLOB_LITERAL:
+            if ((unsigned char)*s != t->ch) return 0;
+            s++;
+            break;
+        case GLOB_ANY:
+            if (*s == '\0' || *s == '/') return 0;
+            s++;
+            break;
+        case GLOB_CLASS: {
+            unsigned char c = (unsigned char)*s;
+            if (c == '\0' || c == '/' || !(t->set[c >> 3] & (1u << (c & 7)))) return 0;
+            s++;
+            break;
+        }
+        case GLOB_STAR:
+            if (t[1].type == GLOB_END) return strchr(s, '/') == NULL;
+            for (;; s++) {
+                if (glob_match(t + 1, s)) return 1;
+                if (*s == '\0' || *s == '/') return 0;
+            }
+        case GLOB_ANY_DIRS:
+            for (;;) {
+                if (glob_match(t + 1, s)) return 1;
+                s = strchr(s, '/');
+                if (!s) return 0;
+                s++;
+            }
+        case GLOB_REST:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+}
+
+static int add_suffix_len(gitignore* gi, int len) {
+    for (int i = 0; i < gi->suffix_len_count; i++) {
+        if (gi->suffix_lens[i] == len) return 0;
+    }
+    if (grow_array((void**)&gi->suffix_lens, &gi->suffix_len_cap, gi->suffix_len_count + 1, sizeof(int)) != 0) return -1;
+    gi->suffix_lens[gi->suffix_len_count++] = len;
+    return 0;
+}
+
+static int add_rule(gitignore* gi, int negate, int dir_only, const glob_token* glob) {
+    if (grow_array((void**)&gi->rules, &gi->rule_cap, gi->rule_count + 1, sizeof(gitignore_rule)) != 0) return -1;
+    gitignore_rule* rule = &gi->rules[gi->rule_count];
+    rule->negate = negate;
+    rule->dir_only = dir_only;
+    rule->glob = glob;
+    return gi->rule_count++;
+}
+
+// Attaches a literal rule to a trie, basename or suffix node.
+static int add_node_rule(gitignore* gi, int node, int negate, int dir_only) {
+    int rule = add_rule(gi, negate, dir_only, NULL);
+    if (rule < 0) return -1;
+    if (dir_only) gi->nodes[node].rule_dir = rule;
+    else gi->nodes[node].rule_any = rule;
+    return 0;
+}
+
+static int append_glob(int** list, int* count, int* cap, int rule) {
+    if (grow_array((void**)list, cap, *count + 1, sizeof(int)) != 0) return -1;
+    (*list)[(*count)++] = rule;
+    return 0;
+}
+
+gitignore* gitignore_create(void) {
+    gitignore* gi = calloc(1, sizeof(gitignore));
+    if (!gi) return NULL;
+    gi->base = strdup("");
+    if (!gi->base || new_node(gi) != ROOT_NODE) {
+        gitignore_free(gi);
+        return NULL;
+    }
+    return gi;
+}
+
+void gitignore_free(gitignore* gi) {
+    if (!gi) return;
+    for (int i = 0; i < gi->node_count; i++) free(gi->nodes[i].globs);
+    free(gi->nodes);
+    free(gi->rules);
+    free(gi->edges);
+    free(gi->basename_globs);
+    free(gi->suffix_lens);
+    free(gi->root);
+    free(gi->base);
+    arena_free(&gi->arena);
+    free(gi);
+}
+
+// Rules apply relative to root; base is the working directory relative to
+// root, with a trailing slash unless empty.
+int gitignore_set_root(gitignore* gi, const char* root, const char* base) {
+    char* new_root = strdup(root);
+    char* new_base = strdup(base);
+    if (!new_root || !new_base) {
+        free(new_root);
+        free(new_base);
+        return -1;
+    }
+    free(gi->root);
+    free(gi->base);
+    gi->root = new_root;
+    gi->base = new_base;
+    return 0;
+}
+
+// Adds one line of a gitignore file. Blank lines and comments are skipped;
+// returns -1 only when out of memory.
+int gitignore_add_line(gitignore* gi, const char* line, size_t len) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+    // Trailing spaces are dropped unless escaped.
+    while (len > 0 && line[len - 1] == ' ' && !(len > 1 && line[len - 2] == '\\')) len--;
+    if (len == 0 || line[0] == '#') return 0;
+
+    int negate = 0;
+    if (line[0] == '!') {
+        negate = 1;
+        line++;
+        len--;
+    }
+    int dir_only = 0;
+    if (len > 0 && line[len - 1] == '/') {
+        dir_only = 1;
+        len--;
+    }
+    if (len == 0) return 0;
+
+    // A slash at the start or in the middle anchors the rule.
+    int anchored = memchr(line, '/', len) != NULL;
+    if (line[0] == '/') {
+        line++;
+        len--;
+        if (len == 0) return 0;
+    }
+
+    if (!anchored) {
+        if (!has_wildcard(line, len)) {
+            int node = child_node(gi, BASENAME_NODE, line, len);
+            return node < 0 ? -1 : add_node_rule(gi, node, negate, dir_only);
+        }
+        if (len > 1 && line[0] == '*' && !has_wildcard(line + 1, len - 1)) {
+            int node = child_node(gi, SUFFIX_NODE, line + 1, len - 1);
+            if (node < 0 || add_suffix_len(gi, (int)len - 1) != 0) return -1;
+            return add_node_rule(gi, node, negate, dir_only);
+        }
+        const glob_token* glob = compile_glob(gi, line, len, (size_t)-1);
+        int rule = glob ? add_rule(gi, negate, dir_only, glob) : -1;
+        if (rule < 0) return -1;
+        return append_glob(&gi->basename_globs, &gi->basename_glob_count, &gi->basename_glob_cap, rule);
+    }
+
+    // Walk the literal components into the trie; the rest becomes a glob
+    // matched against the remainder of the path below that node.
+    int node = ROOT_NODE;
+    const char* p = line;
+    const char* end = line + len;
+    while (p < end) {
+        const char* slash = memchr(p, '/', (size_t)(end - p));
+        const char* stop = slash ? slash : end;
+        if (stop == p || has_wildcard(p, (size_t)(stop - p))) break;
+        if ((node = child_node(gi, node, p, (size_t)(stop - p))) < 0) return -1;
+        p = slash ? slash + 1 : end;
+    }
+    if (p >= end) return add_node_rule(gi, node, negate, dir_only);
+    size_t literal_len = strcspn(line, "*?[\\");
+    const glob_token* glob = compile_glob(gi, p, (size_t)(end - p), literal_len - (size_t)(p - line));
+    int rule = glob ? add_rule(gi, negate, dir_only, glob) : -1;
+    if (rule < 0) return -1;
+    trie_node* n = &gi->nodes[node];
+    return append_glob(&n->globs, &n->glob_count, &n->glob_cap, rule);
+}
+
+static int load_stream(gitignore* gi, FILE* file) {
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int status = 0;
+    while ((len = getline(&line, &cap, file)) >= 0) {
+        if (gitignore_add_line(gi, line, (size_t)len) != 0) {
+            status = -1;
+            break;
+        }
+    }
+    free(line);
+    return status;
+}
+
+int gitignore_load(gitignore* gi, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+    int status = load_stream(gi, file);
+    fclose(file);
+    return status;
+}
+
+// Compiles the ignore file open on fd (which is consumed) into a rule set of
+// its own; returns NULL when it has no rules or cannot be read.
+gitignore* gitignore_from_fd(int fd) {
+    FILE* file = fdopen(fd, "r");
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+    gitignore* gi = gitignore_create();
+    if (gi && (load_stream(gi, file) != 0 || gi->rule_count == 0)) {
+        gitignore_free(gi);
+        gi = NULL;
+    }
+    fclose(file);
+    return gi;
+}
+
+// Highest rule among globs[] (ascending) above best that matches s.
+static int best_glob(const gitignore* gi, const int* globs, int count, const char* s, int is_dir, int best) {
+    for (int i = count - 1; i >= 0 && globs[i] > best; i--) {
+        const gitignore_rule* rule = &gi->rules[globs[i]];
+        if (rule->dir_only && !is_dir) continue;
+        if (glob_match(rule->glob, s)) return globs[i];
+    }
+    return best;
+}
+
+static int best_node_rule(const trie_node* node, int is_dir, int best) {
+    if (node->rule_any > best) best = node->rule_any;
+    if (is_dir && node->rule_dir > best) best = node->rule_dir;
+    return best;
+}
+
+// Matches a path relative to the directory the rules apply to.
+int gitignore_match_local(const gitignore* gi, const char* path, int is_dir) {
+    int best = -1;
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    // Repository metadata is never listed, whatever the rules say.
+    if (is_dir && strcmp(name, ".git") == 0) return GITIGNORE_EXCLUDE;
+
+    size_t name_len = strlen(name);
+    int node = find_edge(gi, BASENAME_NODE, name, name_len);
+    if (node >= 0) best = best_node_rule(&gi->nodes[node], is_dir, best);
+    for (int i = 0; i < gi->suffix_len_count; i++) {
+        size_t len = (size_t)gi->suffix_lens[i];
+        if (len <= name_len && (node = find_edge(gi, SUFFIX_NODE, name + name_len - len, len)) >= 0) {
+            best = best_node_rule(&gi->nodes[node], is_dir, best);
+        }
+    }
+    best = best_glob(gi, gi->basename_globs, gi->basename_glob_count, name, is_dir, best);
+
+    node = ROOT_NODE;
+    const char* p = path;
+    while (1) {
+        const trie_node* n = &gi->nodes[node];
+        if (n->glob_count > 0) best = best_glob(gi, n->globs, n->glob_count, p, is_dir, best);
+        const char* next = strchr(p, '/');
+        size_t len = next ? (size_t)(next - p) : strlen(p);
+        if ((node = find_edge(gi, node, p, len)) < 0) break;
+        if (!next) {
+            best = best_node_rule(&gi->nodes[node], is_dir, best);
+            break;
+        }
+        p = next + 1;
+    }
+
+    if (best < 0) return GITIGNORE_NONE;
+    return gi->rules[best].negate ? GITIGNORE_INCLUDE : GITIGNORE_EXCLUDE;
+}
+
+// Decides a path relative to the working directory (or absolute). With
+// check_parents, every ancestor directory is tried first, since nothing can be
+// re-included below an ignored directory; the directory walk instead prunes
+// ignored directories as it goes and only asks about the entry itself.
+int gitignore_match(const gitignore* gi, const char* rel_path, int is_dir, int check_parents) {
+    const char* path = rel_path;
+    if (path[0] == '/') {
+        size_t root_len = gi->root ? strlen(gi->root) : 0;
+        if (root_len == 0 || strncmp(path, gi->root, root_len) != 0 || path[root_len] != '/') return GITIGNORE_NONE;
+        path += root_len + 1;
+    }
+    else if (strcmp(path, ".") == 0 || strncmp(path, "../", 3) == 0) {
+        return GITIGNORE_NONE;
+    }
+
+    // Relative paths start in the working directory, base below the root.
+    const char* prefix = path == rel_path ? gi->base : "";
+    if (prefix[0] == '\0' && !check_parents) return gitignore_match_local(gi, path, is_dir);
+    char buf[MAX_PATH_SIZE];
+    int n = snprintf(buf, sizeof(buf), "%s%s", prefix, path);
+    if (n < 0 || (size_t)n >= sizeof(buf)) return GITIGNORE_NONE;
+
+    if (check_parents) {
+        // Ancestors above the working directory are not considered, just
+        // like the directory walk never visits them.
+        for (char* slash = strchr(buf + strlen(prefix), '/'); slash; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            int verdict = gitignore_match_local(gi, buf, 1);
+            *slash = '/';
+            if (verdict == GITIGNORE_EXCLUDE) return GITIGNORE_EXCLUDE;
+        }
+    }
+    return gitignore_match_local(gi, buf, is_dir);
+}
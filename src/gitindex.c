@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// On-disk layout of an index entry (see git's Documentation/gitformat-index):
+// ten 32-bit stat fields, the object id, 16 bits of flags and, from version 3
+// on, 16 more when the extended flag is set; the path follows.
+#define INDEX_HEADER_SIZE 12
+#define INDEX_STAT_SIZE 40
+#define INDEX_FLAG_ASSUME_VALID 0x8000
+#define INDEX_FLAG_EXTENDED 0x4000
+#define INDEX_FLAG_STAGE 0x3000
+#define INDEX_EXT_INTENT_TO_ADD 0x2000
+#define INDEX_EXT_SKIP_WORKTREE 0x4000
+
+static uint32_t get_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t get_be16(const unsigned char* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} sha1_ctx;
+
+static uint32_t rol32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(sha1_ctx* c, const unsigned char* p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) w[i] = get_be32(p + 4 * i);
+    for (int i = 16; i < 80; i++) w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = c->h[0], b = c->h[1], d = c->h[3], e = c->h[4], cc = c->h[2];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & cc) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40) {
+            f = b ^ cc ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60) {
+            f = (b & cc) | (b & d) | (cc & d);
+            k = 0x8f1bbcdc;
+        }
+        else {
+            f = b ^ cc ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rol32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = cc;
+        cc = rol32(b, 30);
+        b = a;
+        a = t;
+    }
+    c->h[0] += a;
+    c->h[1] += b;
+    c->h[2] += cc;
+    c->h[3] += d;
+    c->h[4] += e;
+}
+
+static void sha1_init(sha1_ctx* c) {
+    c->h[0] = 0x67452301;
+    c->h[1] = 0xefcdab89;
+    c->h[2] = 0x98badcfe;
+    c->h[3] = 0x10325476;
+    c->h[4] = 0xc3d2e1f0;
+    c->length = 0;
+    c->used = 0;
+}
+
+static void sha1_update(sha1_ctx* c, const void* data, size_t len) {
+    const unsigned char* p = data;
+    c->length += len;
+    while (len > 0) {
+        size_t n = 64 - c->used < len ? 64 - c->used : len;
+        memcpy(c->block + c->used, p, n);
+        c->used += n;
+        p += n;
+        len -= n;
+        if (c->used == 64) {
+            sha1_block(c, c->block);
+            c->used = 0;
+        }
+    }
+}
+
+static void sha1_final(sha1_ctx* c, unsigned char out[20]) {
+    uint64_t bits = c->length * 8;
+    unsigned char pad = 0x80;
+    sha1_update(c, &pad, 1);
+    pad = 0;
+    while (c->used != 56) sha1_update(c, &pad, 1);
+    unsigned char len_be[8];
+    for (int i = 0; i < 8; i++) len_be[i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha1_update(c, len_be, 8);
+    for (int i = 0; i < 5; i++) {
+        out[4 * i] = (unsigned char)(c->h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(c->h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(c->h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)c->h[i];
+    }
+}
+
+// Resolves "<dir>/.git", which is either the git directory itself or, for
+// linked worktrees and submodules, a file holding "gitdir: <path>".
+static int resolve_git_dir(const char* dir, path_buf* git_dir) {
+    git_dir->len = 0;
+    if (path_buf_push(git_dir, dir, strlen(dir)) != 0 || path_buf_push(git_dir, "/.git", 5) != 0) return -1;
+
+    struct stat st;
+    if (stat(git_dir->data, &st) != 0) return -1;
+    if (S_ISDIR(st.st_mode)) return 0;
+    if (!S_ISREG(st.st_mode)) return -1;
+
+    char* content = NULL;
+    size_t len = 0;
+    if (read_file_into_buffer(git_dir->data, MAX_PATH_SIZE, &content, &len) != 0) return -1;
+    while (len > 0 && (content[len - 1] == '\n' || content[len - 1] == '\r')) content[--len] = '\0';
+    int rc = -1;
+    if (strncmp(content, "gitdir: ", 8) == 0 && content[8] != '\0') {
+        const char* target = content + 8;
+        git_dir->len = 0;
+        rc = 0;
+        if (target[0] != '/') {
+            rc = path_buf_push(git_dir, dir, strlen(dir)) == 0 && path_buf_push(git_dir, "/", 1) == 0 ? 0 : -1;
+        }
+        if (rc == 0) rc = path_buf_push(git_dir, target, strlen(target));
+    }
+    free(content);
+    return rc;
+}
+
+// Searches upwards from cwd for the repository the working directory belongs
+// to, like git itself does. The work tree is the directory holding ".git".
+int git_repo_find(const char* cwd, path_buf* work_tree, path_buf* git_dir) {
+    work_tree->len = 0;
+    if (path_buf_push(work_tree, cwd, strlen(cwd)) != 0) return -1;
+    while (1) {
+        if (resolve_git_dir(work_tree->data, git_dir) == 0) return 0;
+        char* sep = strrchr(work_tree->data, '/');
+        if (!sep) return -1;
+        if (sep == work_tree->data) {
+            if (work_tree->len == 1) return -1;
+            path_buf_truncate(work_tree, 1);
+        }
+        else {
+            path_buf_truncate(work_tree, (size_t)(sep - work_tree->data));
+        }
+    }
+}
+
+// Repositories created with --object-format=sha256 store 32-byte object ids.
+static size_t object_id_size(const char* git_dir) {
+    path_buf config = {0};
+    char* content = NULL;
+    size_t id_size = 20;
+    if (path_buf_push(&config, git_dir, strlen(git_dir)) == 0 && path_buf_push(&config, "/config", 7) == 0 &&
+        read_file_into_buffer(config.data, 1024 * 1024, &content, NULL) == 0) {
+        for (char* line = strtok(content, "\n"); line; line = strtok(NULL, "\n")) {
+            char* key = strcasestr(line, "objectformat");
+            if (key && strstr(key, "sha256")) id_size = 32;
+        }
+    }
+    free(content);
+    path_buf_free(&config);
+    return id_size;
+}
+
+// Steps over one entry without looking at it; returns its size or 0 when the
+// entry runs past the end of the file.
+static size_t entry_size(const git_index* idx, const unsigned char* p, size_t avail) {
+    size_t fixed = INDEX_STAT_SIZE + idx->id_size + 2;
+    if (avail < fixed) return 0;
+    uint16_t flags = get_be16(p + fixed - 2);
+    if (idx->version >= 3 && (flags & INDEX_FLAG_EXTENDED)) fixed += 2;
+    size_t pos = fixed;
+    if (idx->version >= 4) {
+        while (pos < avail && (p[pos] & 0x80)) pos++;
+        pos++;
+    }
+    const unsigned char* nul = pos < avail ? memchr(p + pos, '\0', avail - pos) : NULL;
+    if (!nul) return 0;
+    size_t size = (size_t)(nul - p) + 1;
+    if (idx->version < 4) size = (fixed + (size_t)(nul - (p + fixed)) + 8) & ~(size_t)7;
+    return size <= avail ? size : 0;
+}
+
+// Checks the header and walks the entries once to reach the extensions: a
+// split index keeps most entries in a second file and a sparse index stores
+// whole directories as single entries, and neither can be listed from here.
+static int index_validate(git_index* idx) {
+    const unsigned char* data = (const unsigned char*)idx->data;
+    if (idx->len < INDEX_HEADER_SIZE + idx->id_size || memcmp(data, "DIRC", 4) != 0) return -1;
+    idx->version = (int)get_be32(data + 4);
+    if (idx->version < 2 || idx->version > 4) return -1;
+    idx->remaining = get_be32(data + 8);
+
+    size_t end = idx->len - idx->id_size;
+    size_t pos = INDEX_HEADER_SIZE;
+    for (uint32_t i = 0; i < idx->remaining; i++) {
+        size_t size = entry_size(idx, data + pos, end - pos);
+        if (size == 0) return -1;
+        pos += size;
+    }
+    while (pos + 8 <= end) {
+        if (memcmp(data + pos, "link", 4) == 0 || memcmp(data + pos, "sdir", 4) == 0) return -1;
+        uint32_t ext_size = get_be32(data + pos + 4);
+        if (ext_size > end - pos - 8) return -1;
+        pos += 8 + ext_size;
+    }
+    idx->pos = INDEX_HEADER_SIZE;
+    return 0;
+}
+
+int git_index_open(git_index* idx, const char* git_dir) {
+    memset(idx, 0, sizeof(*idx));
+    path_buf path = {0};
+    if (path_buf_push(&path, git_dir, strlen(git_dir)) != 0 || path_buf_push(&path, "/index", 6) != 0) {
+        path_buf_free(&path);
+        return -1;
+    }
+    int fd = open(path.data, O_RDONLY | O_CLOEXEC);
+    path_buf_free(&path);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    idx->data = map;
+    idx->len = (size_t)st.st_size;
+    idx->mtime_sec = st.st_mtim.tv_sec;
+    idx->mtime_nsec = st.st_mtim.tv_nsec;
+    idx->id_size = object_id_size(git_dir);
+    if (index_validate(idx) != 0) {
+        git_index_close(idx);
+        return -1;
+    }
+    return 0;
+}
+
+void git_index_close(git_index* idx) {
+    if (idx->data) munmap(idx->data, idx->len);
+    idx->data = NULL;
+    path_buf_free(&idx->name);
+    path_buf_free(&idx->unmerged);
+}
+
+// Returns 1 with the next entry, 0 at the end. Unmerged paths come as up to
+// three stage entries and are reported once; entries outside the sparse
+// checkout are not in the work tree and are left out.
+int git_index_next(git_index* idx, git_index_entry* entry) {
+    const unsigned char* data = (const unsigned char*)idx->data;
+    while (idx->remaining > 0) {
+        const unsigned char* p = data + idx->pos;
+        idx->remaining--;
+        idx->pos += entry_size(idx, p, idx->len - idx->id_size - idx->pos);
+
+        size_t fixed = INDEX_STAT_SIZE + idx->id_size;
+        uint16_t flags = get_be16(p + fixed);
+        uint16_t ext_flags = 0;
+        fixed += 2;
+        if (idx->version >= 3 && (flags & INDEX_FLAG_EXTENDED)) {
+            ext_flags = get_be16(p + fixed);
+            fixed += 2;
+        }
+
+        const char* name;
+        size_t name_len;
+        if (idx->version >= 4) {
+            // The name replaces the last strip bytes of the previous one.
+            const unsigned char* q = p + fixed;
+            size_t strip = *q & 0x7f;
+            while (*q++ & 0x80) strip = ((strip + 1) << 7) | (*q & 0x7f);
+            size_t suffix_len = strlen((const char*)q);
+            if (strip > idx->name.len) return 0;
+            path_buf_truncate(&idx->name, idx->name.len - strip);
+            if (path_buf_push(&idx->name, (const char*)q, suffix_len) != 0) return 0;
+            name = idx->name.data;
+            name_len = idx->name.len;
+        }
+        else {
+            name = (const char*)p + fixed;
+            name_len = strlen(name);
+        }
+
+        if (ext_flags & INDEX_EXT_SKIP_WORKTREE) continue;
+        if (flags & INDEX_FLAG_STAGE) {
+            if (idx->unmerged.len == name_len && memcmp(idx->unmerged.data, name, name_len) == 0) continue;
+            idx->unmerged.len = 0;
+            if (path_buf_push(&idx->unmerged, name, name_len) != 0) return 0;
+        }
+
+        entry->oid = p + INDEX_STAT_SIZE;
+        entry->path = name;
+        entry->path_len = name_len;
+        entry->ctime_sec = get_be32(p);
+        entry->ctime_nsec = get_be32(p + 4);
+        entry->mtime_sec = get_be32(p + 8);
+        entry->mtime_nsec = get_be32(p + 12);
+        entry->ino = get_be32(p + 20);
+        entry->mode = get_be32(p + 24);
+        entry->uid = get_be32(p + 28);
+        entry->gid = get_be32(p + 32);
+        entry->size = get_be32(p + 36);
+        entry->assume_unchanged = (flags & INDEX_FLAG_ASSUME_VALID) != 0;
+        entry->intent_to_add = (ext_flags & INDEX_EXT_INTENT_TO_ADD) != 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Hashes the file as a blob and compares it with the entry's object id. Only
+// SHA-1 repositories can be checked; clean/smudge filters and line ending
+// conversion also make an unchanged file look modified.
+static int blob_differs(const git_index* idx, const git_index_entry* entry, const char* path) {
+    if (idx->id_size != 20) return 1;
+    char* content = NULL;
+    size_t len = 0;
+    if (read_file_into_buffer(path, (size_t)entry->size, &content, &len) != 0) return 1;
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "blob %zu", len);
+    sha1_ctx c;
+    unsigned char id[20];
+    sha1_init(&c);
+    sha1_update(&c, header, (size_t)header_len + 1);
+    sha1_update(&c, content, len);
+    sha1_final(&c, id);
+    free(content);
+    return memcmp(id, entry->oid, sizeof(id)) != 0;
+}
+
+// Mirrors git's change check: the stat data decides when it matches the
+// index, and so does a different size or mode. Otherwise (a touched file, or
+// one modified in the same instant the index was written, whose stat data
+// may not show it) the content is hashed and compared with the entry's blob.
+// Nanoseconds are only compared when the index recorded them.
+int git_index_entry_changed(const git_index* idx, const git_index_entry* entry, const char* path, const struct stat* st) {
+    if (entry->assume_unchanged) return 0;
+    if (entry->intent_to_add) return 1;
+    if ((entry->mode & S_IFMT) != (st->st_mode & S_IFMT)) return 1;
+    if (S_ISREG(st->st_mode) && ((entry->mode ^ st->st_mode) & S_IXUSR)) return 1;
+    if (entry->size != (uint32_t)st->st_size) return 1;
+
+    int racy = (int64_t)entry->mtime_sec > (int64_t)idx->mtime_sec ||
+               ((int64_t)entry->mtime_sec == (int64_t)idx->mtime_sec && (long)entry->mtime_nsec >= idx->mtime_nsec);
+    if (!racy && entry->mtime_sec == (uint32_t)st->st_mtim.tv_sec &&
+        (!entry->mtime_nsec || entry->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec) &&
+        entry->ctime_sec == (uint32_t)st->st_ctim.tv_sec &&
+        (!entry->ctime_nsec || entry->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec) &&
+        entry->ino == (uint32_t)st->st_ino && entry->uid == (uint32_t)st->st_uid && entry->gid == (uint32_t)st->st_gid) {
+        return 0;
+    }
+    return blob_differs(idx, entry, path);
+}
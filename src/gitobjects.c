@@ -0,0 +1,894 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define GIT_OID_HEX (GIT_OID_SIZE * 2)
+#define OBJECT_CACHE_BYTES (64 * 1024 * 1024)
+#define OBJECT_CACHE_BUCKETS 4096
+#define MAX_DELTA_CHAIN 4096
+#define MAX_REF_DEPTH 16
+#define MIN_ABBREV_LEN 4
+
+enum {
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7
+};
+
+// A mapped packfile and its .idx (version 1 or 2).
+typedef struct {
+    const unsigned char* idx;
+    size_t idx_len;
+    const unsigned char* pack;
+    size_t pack_len;
+    uint32_t count;
+    int idx_version;
+    const unsigned char* ids;
+    const unsigned char* offsets;
+    const unsigned char* large_offsets;
+    uint32_t large_count;
+} git_pack;
+
+// Objects decoded from packs, keyed by pack and offset. Delta bases are
+// looked up here before their chains are inflated again; the least recently
+// used entries go once the byte budget is exceeded.
+typedef struct cached_object {
+    size_t pack;
+    uint64_t offset;
+    int type;
+    char* data;
+    size_t len;
+    struct cached_object* prev;
+    struct cached_object* next;
+    struct cached_object* hash_next;
+} cached_object;
+
+struct git_odb {
+    path_buf git_dir;
+    path_buf common_dir;
+    path_buf* object_dirs;
+    int object_dir_count;
+    git_pack* packs;
+    size_t pack_count;
+    cached_object* buckets[OBJECT_CACHE_BUCKETS];
+    cached_object* lru_head;
+    cached_object* lru_tail;
+    size_t cache_bytes;
+    pthread_mutex_t lock;
+};
+
+static uint32_t get_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int git_oid_from_hex(const char* hex, unsigned char* oid) {
+    for (int i = 0; i < GIT_OID_SIZE; i++) {
+        int hi = hex_value((unsigned char)hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_value((unsigned char)hex[2 * i + 1]);
+        if (lo < 0) return -1;
+        oid[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+void git_oid_to_hex(const unsigned char* oid, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < GIT_OID_SIZE; i++) {
+        hex[2 * i] = digits[oid[i] >> 4];
+        hex[2 * i + 1] = digits[oid[i] & 15];
+    }
+    hex[GIT_OID_HEX] = '\0';
+}
+
+static int map_file(const char* path, const unsigned char** data, size_t* len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    *data = map;
+    *len = (size_t)st.st_size;
+    return 0;
+}
+
+// Maps pack-<id>.idx and its pack; idx_path ends in ".idx".
+static int open_pack(git_pack* pack, const char* idx_path) {
+    memset(pack, 0, sizeof(*pack));
+    if (map_file(idx_path, &pack->idx, &pack->idx_len) != 0) return -1;
+
+    path_buf pack_path = {0};
+    size_t stem_len = strlen(idx_path) - 4;
+    int rc = -1;
+    if (path_buf_push(&pack_path, idx_path, stem_len) == 0 && path_buf_push(&pack_path, ".pack", 5) == 0) {
+        rc = map_file(pack_path.data, &pack->pack, &pack->pack_len);
+    }
+    path_buf_free(&pack_path);
+
+    const unsigned char* fanout = pack->idx;
+    size_t header = 0;
+    if (rc == 0 && pack->idx_len >= 8 && memcmp(pack->idx, "\377tOc", 4) == 0) {
+        pack->idx_version = (int)get_be32(pack->idx + 4);
+        header = 8;
+        fanout = pack->idx + 8;
+    }
+    else {
+        pack->idx_version = 1;
+    }
+    if (rc == 0 && (pack->idx_version > 2 || pack->idx_len < header + 1024 || pack->pack_len < 32 ||
+                    memcmp(pack->pack, "PACK", 4) != 0)) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        pack->count = get_be32(fanout + 255 * 4);
+        const unsigned char* table = fanout + 1024;
+        size_t avail = pack->idx_len - header - 1024;
+        if (pack->idx_version == 1) {
+            if ((size_t)pack->count * 24 > avail) rc = -1;
+            pack->ids = table;
+        }
+        else {
+            if ((size_t)pack->count * 28 > avail) rc = -1;
+            pack->ids = table;
+            pack->offsets = table + (size_t)pack->count * 24;
+            pack->large_offsets = table + (size_t)pack->count * 28;
+            pack->large_count = (uint32_t)((avail - (size_t)pack->count * 28) / 8);
+        }
+    }
+    if (rc != 0) {
+        if (pack->idx) munmap((void*)pack->idx, pack->idx_len);
+        if (pack->pack) munmap((void*)pack->pack, pack->pack_len);
+        memset(pack, 0, sizeof(*pack));
+    }
+    return rc;
+}
+
+static const unsigned char* pack_id_at(const git_pack* pack, uint32_t i) {
+    return pack->idx_version == 1 ? pack->ids + (size_t)i * 24 + 4 : pack->ids + (size_t)i * GIT_OID_SIZE;
+}
+
+static uint64_t pack_offset_at(const git_pack* pack, uint32_t i) {
+    if (pack->idx_version == 1) return get_be32(pack->ids + (size_t)i * 24);
+    uint32_t offset = get_be32(pack->offsets + (size_t)i * 4);
+    if (!(offset & 0x80000000u)) return offset;
+    uint32_t large = offset & 0x7fffffffu;
+    if (large >= pack->large_count) return UINT64_MAX;
+    const unsigned char* p = pack->large_offsets + (size_t)large * 8;
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+// First index whose id is not below the prefix bytes (len of them).
+static uint32_t pack_lower_bound(const git_pack* pack, const unsigned char* id, size_t len) {
+    const unsigned char* fanout = pack->idx_version == 1 ? pack->idx : pack->idx + 8;
+    uint32_t lo = id[0] ? get_be32(fanout + (id[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(fanout + id[0] * 4);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(pack_id_at(pack, mid), id, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int pack_find(const git_pack* pack, const unsigned char* oid, uint64_t* offset) {
+    uint32_t i = pack_lower_bound(pack, oid, GIT_OID_SIZE);
+    if (i >= pack->count || memcmp(pack_id_at(pack, i), oid, GIT_OID_SIZE) != 0) return 0;
+    *offset = pack_offset_at(pack, i);
+    return *offset != UINT64_MAX;
+}
+
+static void load_packs(git_odb* odb, const char* object_dir) {
+    path_buf path = {0};
+    if (path_buf_push(&path, object_dir, strlen(object_dir)) != 0 || path_buf_push(&path, "/pack/", 6) != 0) {
+        path_buf_free(&path);
+        return;
+    }
+    size_t base_len = path.len;
+    DIR* dir = opendir(path.data);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len < 5 || strcmp(entry->d_name + name_len - 4, ".idx") != 0) continue;
+        path_buf_truncate(&path, base_len);
+        if (path_buf_push(&path, entry->d_name, name_len) != 0) continue;
+        git_pack* packs = realloc(odb->packs, (odb->pack_count + 1) * sizeof(git_pack));
+        if (!packs) break;
+        odb->packs = packs;
+        if (open_pack(&odb->packs[odb->pack_count], path.data) == 0) odb->pack_count++;
+    }
+    if (dir) closedir(dir);
+    path_buf_free(&path);
+}
+
+static int add_object_dir(git_odb* odb, const char* dir, size_t len) {
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        if (odb->object_dirs[i].len == len && memcmp(odb->object_dirs[i].data, dir, len) == 0) return 0;
+    }
+    path_buf* dirs = realloc(odb->object_dirs, (size_t)(odb->object_dir_count + 1) * sizeof(path_buf));
+    if (!dirs) return -1;
+    odb->object_dirs = dirs;
+    path_buf* added = &dirs[odb->object_dir_count];
+    memset(added, 0, sizeof(*added));
+    if (path_buf_push(added, dir, len) != 0) return -1;
+    odb->object_dir_count++;
+    load_packs(odb, added->data);
+    return 0;
+}
+
+// Object directories borrowed through objects/info/alternates, one per line,
+// relative paths resolved against the directory that lists them.
+static void load_alternates(git_odb* odb, int index) {
+    path_buf path = {0};
+    char* content = NULL;
+    if (path_buf_push(&path, odb->object_dirs[index].data, odb->object_dirs[index].len) == 0 &&
+        path_buf_push(&path, "/info/alternates", 16) == 0 &&
+        read_file_into_buffer(path.data, 1024 * 1024, &content, NULL) == 0) {
+        for (char* line = strtok(content, "\n"); line; line = strtok(NULL, "\n")) {
+            if (*line == '#' || *line == '\0') continue;
+            path.len = 0;
+            if (*line != '/') {
+                path_buf_push(&path, odb->object_dirs[index].data, odb->object_dirs[index].len);
+                path_buf_push(&path, "/", 1);
+            }
+            if (path_buf_push(&path, line, strlen(line)) == 0) add_object_dir(odb, path.data, path.len);
+        }
+    }
+    free(content);
+    path_buf_free(&path);
+}
+
+git_odb* git_odb_open(const char* git_dir) {
+    git_odb* odb = calloc(1, sizeof(git_odb));
+    if (!odb) return NULL;
+    pthread_mutex_init(&odb->lock, NULL);
+    if (path_buf_push(&odb->git_dir, git_dir, strlen(git_dir)) != 0) {
+        git_odb_free(odb);
+        return NULL;
+    }
+
+    // Linked worktrees keep refs and objects in the main repository.
+    path_buf path = {0};
+    char* common = NULL;
+    size_t common_len = 0;
+    path_buf_push(&path, git_dir, strlen(git_dir));
+    path_buf_push(&path, "/commondir", 10);
+    if (path.data && read_file_into_buffer(path.data, MAX_PATH_SIZE, &common, &common_len) == 0) {
+        while (common_len > 0 && (common[common_len - 1] == '\n' || common[common_len - 1] == '\r')) common[--common_len] = '\0';
+        if (common[0] != '/') {
+            path_buf_push(&odb->common_dir, git_dir, strlen(git_dir));
+            path_buf_push(&odb->common_dir, "/", 1);
+        }
+        path_buf_push(&odb->common_dir, common, common_len);
+    }
+    else {
+        path_buf_push(&odb->common_dir, git_dir, strlen(git_dir));
+    }
+    free(common);
+
+    path.len = 0;
+    int rc = path_buf_push(&path, odb->common_dir.data, odb->common_dir.len);
+    if (rc == 0) rc = path_buf_push(&path, "/objects", 8);
+    if (rc == 0) rc = add_object_dir(odb, path.data, path.len);
+    path_buf_free(&path);
+    if (rc != 0 || !odb->common_dir.data) {
+        git_odb_free(odb);
+        return NULL;
+    }
+    for (int i = 0; i < odb->object_dir_count; i++) load_alternates(odb, i);
+    return odb;
+}
+
+void git_odb_free(git_odb* odb) {
+    if (!odb) return;
+    cached_object* entry = odb->lru_head;
+    while (entry) {
+        cached_object* next = entry->next;
+        free(entry->data);
+        free(entry);
+        entry = next;
+    }
+    for (size_t i = 0; i < odb->pack_count; i++) {
+        munmap((void*)odb->packs[i].idx, odb->packs[i].idx_len);
+        munmap((void*)odb->packs[i].pack, odb->packs[i].pack_len);
+    }
+    free(odb->packs);
+    for (int i = 0; i < odb->object_dir_count; i++) path_buf_free(&odb->object_dirs[i]);
+    free(odb->object_dirs);
+    path_buf_free(&odb->git_dir);
+    path_buf_free(&odb->common_dir);
+    pthread_mutex_destroy(&odb->lock);
+    free(odb);
+}
+
+static size_t cache_bucket(size_t pack, uint64_t offset) {
+    uint64_t h = (offset ^ ((uint64_t)pack << 48)) * 0x9e3779b97f4a7c15ull;
+    return (size_t)(h >> 32) % OBJECT_CACHE_BUCKETS;
+}
+
+static void lru_unlink(git_odb* odb, cached_object* entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else odb->lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else odb->lru_tail = entry->prev;
+}
+
+static void lru_push_front(git_odb* odb, cached_object* entry) {
+    entry->prev = NULL;
+    entry->next = odb->lru_head;
+    if (odb->lru_head) odb->lru_head->prev = entry;
+    odb->lru_head = entry;
+    if (!odb->lru_tail) odb->lru_tail = entry;
+}
+
+static cached_object* cache_get(git_odb* odb, size_t pack, uint64_t offset) {
+    for (cached_object* entry = odb->buckets[cache_bucket(pack, offset)]; entry; entry = entry->hash_next) {
+        if (entry->pack == pack && entry->offset == offset) {
+            lru_unlink(odb, entry);
+            lru_push_front(odb, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cache_evict(git_odb* odb) {
+    cached_object* victim = odb->lru_tail;
+    cached_object** link = &odb->buckets[cache_bucket(victim->pack, victim->offset)];
+    while (*link != victim) link = &(*link)->hash_next;
+    *link = victim->hash_next;
+    lru_unlink(odb, victim);
+    odb->cache_bytes -= victim->len;
+    free(victim->data);
+    free(victim);
+}
+
+// Keeps a copy of data; objects that would take a large part of the budget
+// are not worth evicting everything else for.
+static void cache_put(git_odb* odb, size_t pack, uint64_t offset, int type, const char* data, size_t len) {
+    if (len > OBJECT_CACHE_BYTES / 8 || cache_get(odb, pack, offset)) return;
+    cached_object* entry = malloc(sizeof(cached_object));
+    char* copy = malloc(len + 1);
+    if (!entry || !copy) {
+        free(entry);
+        free(copy);
+        return;
+    }
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    entry->pack = pack;
+    entry->offset = offset;
+    entry->type = type;
+    entry->data = copy;
+    entry->len = len;
+    size_t bucket = cache_bucket(pack, offset);
+    entry->hash_next = odb->buckets[bucket];
+    odb->buckets[bucket] = entry;
+    lru_push_front(odb, entry);
+    odb->cache_bytes += len;
+    while (odb->cache_bytes > OBJECT_CACHE_BYTES && odb->lru_tail != entry) cache_evict(odb);
+}
+
+// Inflates exactly size bytes; the result is NUL-terminated.
+static char* inflate_exact(const unsigned char* in, size_t in_len, size_t size) {
+    char* out = malloc(size + 1);
+    if (!out) return NULL;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    int rc = Z_OK;
+    size_t done_in = 0;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = (uInt)size;
+    while (rc == Z_OK) {
+        // avail_in is 32 bits wide; feed large inputs in pieces.
+        if (zs.avail_in == 0) {
+            size_t chunk = in_len - done_in < (1u << 30) ? in_len - done_in : (1u << 30);
+            zs.next_in = (Bytef*)(in + done_in);
+            zs.avail_in = (uInt)chunk;
+            done_in += chunk;
+            if (chunk == 0) break;
+        }
+        rc = inflate(&zs, Z_FINISH);
+        if (rc == Z_BUF_ERROR && zs.avail_in == 0) rc = Z_OK;
+    }
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || zs.total_out != size) {
+        free(out);
+        return NULL;
+    }
+    out[size] = '\0';
+    return out;
+}
+
+static size_t delta_varint(const unsigned char** p, const unsigned char* end) {
+    size_t value = 0;
+    int shift = 0;
+    while (*p < end) {
+        unsigned char c = *(*p)++;
+        value |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+        if (!(c & 0x80) || shift > 56) break;
+    }
+    return value;
+}
+
+// Rebuilds an object from its base and a delta of copy and insert
+// instructions (see git's Documentation/gitformat-pack).
+static char* apply_delta(const char* base, size_t base_len, const unsigned char* delta, size_t delta_len, size_t* out_len) {
+    const unsigned char* p = delta;
+    const unsigned char* end = delta + delta_len;
+    if (delta_varint(&p, end) != base_len) return NULL;
+    size_t size = delta_varint(&p, end);
+    char* out = malloc(size + 1);
+    if (!out) return NULL;
+    size_t pos = 0;
+    while (p < end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            size_t offset = 0, len = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) offset |= (size_t)(p < end ? *p++ : 0) << (8 * i);
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (0x10 << i)) len |= (size_t)(p < end ? *p++ : 0) << (8 * i);
+            }
+            if (len == 0) len = 0x10000;
+            if (offset > base_len || len > base_len - offset || len > size - pos) break;
+            memcpy(out + pos, base + offset, len);
+            pos += len;
+        }
+        else if (op != 0) {
+            if ((size_t)op > (size_t)(end - p) || op > size - pos) break;
+            memcpy(out + pos, p, op);
+            p += op;
+            pos += op;
+        }
+        else {
+            break;
+        }
+    }
+    if (p != end || pos != size) {
+        free(out);
+        return NULL;
+    }
+    out[size] = '\0';
+    *out_len = size;
+    return out;
+}
+
+typedef struct {
+    int type;
+    size_t size;
+    size_t data_offset;
+    uint64_t base_offset;
+    const unsigned char* base_id;
+} pack_entry;
+
+static int parse_pack_entry(const git_pack* pack, uint64_t offset, pack_entry* entry) {
+    size_t end = pack->pack_len - GIT_OID_SIZE;
+    if (offset < 12 || offset >= end) return -1;
+    const unsigned char* p = pack->pack + offset;
+    const unsigned char* limit = pack->pack + end;
+    unsigned char c = *p++;
+    entry->type = (c >> 4) & 7;
+    entry->size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (p >= limit || shift > 56) return -1;
+        c = *p++;
+        entry->size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    if (entry->type == OBJ_OFS_DELTA) {
+        if (p >= limit) return -1;
+        c = *p++;
+        uint64_t distance = c & 0x7f;
+        while (c & 0x80) {
+            if (p >= limit || distance >> 56) return -1;
+            c = *p++;
+            distance = ((distance + 1) << 7) | (c & 0x7f);
+        }
+        if (distance == 0 || distance > offset) return -1;
+        entry->base_offset = offset - distance;
+    }
+    else if (entry->type == OBJ_REF_DELTA) {
+        if ((size_t)(limit - p) < GIT_OID_SIZE) return -1;
+        entry->base_id = p;
+        p += GIT_OID_SIZE;
+    }
+    else if (entry->type < GIT_OBJ_COMMIT || entry->type > GIT_OBJ_TAG) {
+        return -1;
+    }
+    entry->data_offset = (size_t)(p - pack->pack);
+    return 0;
+}
+
+static int read_object_locked(git_odb* odb, const unsigned char* oid, int* type, char** data, size_t* len, int depth);
+
+// Follows the delta chain down to a cached object or a full one, then applies
+// the deltas back up, caching every object rebuilt on the way.
+static int read_packed(git_odb* odb, size_t pack_index, uint64_t offset, int* type, char** data, size_t* len, int depth) {
+    const git_pack* pack = &odb->packs[pack_index];
+    uint64_t chain[MAX_DELTA_CHAIN];
+    int chain_len = 0;
+    char* base = NULL;
+    size_t base_len = 0;
+    int base_type = 0;
+
+    uint64_t at = offset;
+    while (1) {
+        cached_object* hit = cache_get(odb, pack_index, at);
+        if (hit) {
+            base = malloc(hit->len + 1);
+            if (!base) return -1;
+            memcpy(base, hit->data, hit->len + 1);
+            base_len = hit->len;
+            base_type = hit->type;
+            break;
+        }
+        pack_entry entry;
+        if (parse_pack_entry(pack, at, &entry) != 0) return -1;
+        if (entry.type == OBJ_OFS_DELTA || entry.type == OBJ_REF_DELTA) {
+            if (chain_len == MAX_DELTA_CHAIN) return -1;
+            chain[chain_len++] = at;
+            if (entry.type == OBJ_OFS_DELTA) {
+                at = entry.base_offset;
+                continue;
+            }
+            uint64_t base_at;
+            if (pack_find(pack, entry.base_id, &base_at)) {
+                at = base_at;
+                continue;
+            }
+            // The base of a REF_DELTA may also live elsewhere.
+            if (depth > 8 || read_object_locked(odb, entry.base_id, &base_type, &base, &base_len, depth + 1) != 0) return -1;
+            break;
+        }
+        base = inflate_exact(pack->pack + entry.data_offset, pack->pack_len - GIT_OID_SIZE - entry.data_offset, entry.size);
+        if (!base) return -1;
+        base_len = entry.size;
+        base_type = entry.type;
+        cache_put(odb, pack_index, at, base_type, base, base_len);
+        break;
+    }
+
+    while (chain_len > 0) {
+        uint64_t delta_at = chain[--chain_len];
+        pack_entry entry;
+        char* delta = NULL;
+        if (parse_pack_entry(pack, delta_at, &entry) == 0) {
+            delta = inflate_exact(pack->pack + entry.data_offset, pack->pack_len - GIT_OID_SIZE - entry.data_offset, entry.size);
+        }
+        size_t result_len = 0;
+        char* result = delta ? apply_delta(base, base_len, (const unsigned char*)delta, entry.size, &result_len) : NULL;
+        free(delta);
+        free(base);
+        if (!result) return -1;
+        base = result;
+        base_len = result_len;
+        cache_put(odb, pack_index, delta_at, base_type, base, base_len);
+    }
+
+    *type = base_type;
+    *data = base;
+    *len = base_len;
+    return 0;
+}
+
+static int object_type_from_name(const char* name, size_t len) {
+    if (len == 6 && memcmp(name, "commit", 6) == 0) return GIT_OBJ_COMMIT;
+    if (len == 4 && memcmp(name, "tree", 4) == 0) return GIT_OBJ_TREE;
+    if (len == 4 && memcmp(name, "blob", 4) == 0) return GIT_OBJ_BLOB;
+    if (len == 3 && memcmp(name, "tag", 3) == 0) return GIT_OBJ_TAG;
+    return 0;
+}
+
+// Loose objects are a zlib stream of "<type> <size>\0<data>".
+static int read_loose(git_odb* odb, const unsigned char* oid, int* type, char** data, size_t* len) {
+    char hex[GIT_OID_HEX + 1];
+    git_oid_to_hex(oid, hex);
+    path_buf path = {0};
+    int rc = -1;
+    for (int i = 0; i < odb->object_dir_count && rc != 0; i++) {
+        path.len = 0;
+        if (path_buf_push(&path, odb->object_dirs[i].data, odb->object_dirs[i].len) != 0 || path_buf_push(&path, "/", 1) != 0 ||
+            path_buf_push(&path, hex, 2) != 0 || path_buf_push(&path, "/", 1) != 0 || path_buf_push(&path, hex + 2, GIT_OID_HEX - 2) != 0) {
+            break;
+        }
+        const unsigned char* raw;
+        size_t raw_len;
+        if (map_file(path.data, &raw, &raw_len) != 0) continue;
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        char header[64];
+        zs.next_in = (Bytef*)raw;
+        zs.avail_in = (uInt)raw_len;
+        zs.next_out = (Bytef*)header;
+        zs.avail_out = sizeof(header);
+        if (inflateInit(&zs) == Z_OK) {
+            int zrc = inflate(&zs, Z_SYNC_FLUSH);
+            size_t got = sizeof(header) - zs.avail_out;
+            const char* nul = memchr(header, '\0', got);
+            const char* space = nul ? memchr(header, ' ', (size_t)(nul - header)) : NULL;
+            char* size_end = NULL;
+            unsigned long long size = space ? strtoull(space + 1, &size_end, 10) : 0;
+            char* out = (space && size_end == nul && size < SIZE_MAX) ? malloc((size_t)size + 1) : NULL;
+            if ((zrc == Z_OK || zrc == Z_STREAM_END) && out) {
+                size_t head_data = got - (size_t)(nul + 1 - header);
+                if (head_data > size) head_data = (size_t)size;
+                memcpy(out, nul + 1, head_data);
+                zs.next_out = (Bytef*)out + head_data;
+                zs.avail_out = (uInt)((size_t)size - head_data);
+                if (zrc != Z_STREAM_END) zrc = inflate(&zs, Z_FINISH);
+                if (zrc == Z_STREAM_END && zs.avail_out == 0) {
+                    out[size] = '\0';
+                    *type = object_type_from_name(header, (size_t)(space - header));
+                    *data = out;
+                    *len = (size_t)size;
+                    out = NULL;
+                    rc = *type ? 0 : -1;
+                    if (rc != 0) free(*data);
+                }
+            }
+            free(out);
+            inflateEnd(&zs);
+        }
+        munmap((void*)raw, raw_len);
+    }
+    path_buf_free(&path);
+    return rc;
+}
+
+static int read_object_locked(git_odb* odb, const unsigned char* oid, int* type, char** data, size_t* len, int depth) {
+    for (size_t i = 0; i < odb->pack_count; i++) {
+        uint64_t offset;
+        if (pack_find(&odb->packs[i], oid, &offset)) return read_packed(odb, i, offset, type, data, len, depth);
+    }
+    return read_loose(odb, oid, type, data, len);
+}
+
+// Returns the object in a malloc'ed, NUL-terminated buffer. Safe to call
+// from several threads; reads are serialized on the store's lock.
+int git_odb_read(git_odb* odb, const unsigned char* oid, int* type, char** data, size_t* len) {
+    pthread_mutex_lock(&odb->lock);
+    int rc = read_object_locked(odb, oid, type, data, len, 0);
+    pthread_mutex_unlock(&odb->lock);
+    return rc;
+}
+
+// Finds the single object whose hex id starts with prefix; 1 when found, 0
+// when there is none and -1 when it is ambiguous.
+static int find_abbreviated(git_odb* odb, const char* prefix, size_t prefix_len, unsigned char* oid) {
+    char full[GIT_OID_HEX + 1];
+    unsigned char low[GIT_OID_SIZE];
+    memset(full, '0', GIT_OID_HEX);
+    memcpy(full, prefix, prefix_len);
+    full[GIT_OID_HEX] = '\0';
+    if (git_oid_from_hex(full, low) != 0) return 0;
+
+    int found = 0;
+    size_t whole = prefix_len / 2;
+    for (size_t i = 0; i < odb->pack_count; i++) {
+        const git_pack* pack = &odb->packs[i];
+        for (uint32_t j = pack_lower_bound(pack, low, GIT_OID_SIZE); j < pack->count; j++) {
+            const unsigned char* id = pack_id_at(pack, j);
+            if (memcmp(id, low, whole) != 0 || ((prefix_len & 1) && (id[whole] >> 4) != (low[whole] >> 4))) break;
+            if (found && memcmp(oid, id, GIT_OID_SIZE) == 0) continue;
+            if (found) return -1;
+            memcpy(oid, id, GIT_OID_SIZE);
+            found = 1;
+        }
+    }
+
+    path_buf path = {0};
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        path.len = 0;
+        if (path_buf_push(&path, odb->object_dirs[i].data, odb->object_dirs[i].len) != 0 || path_buf_push(&path, "/", 1) != 0 ||
+            path_buf_push(&path, full, 2) != 0) {
+            break;
+        }
+        DIR* dir = opendir(path.data);
+        struct dirent* entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (strlen(entry->d_name) != GIT_OID_HEX - 2 || strncasecmp(entry->d_name, prefix + 2, prefix_len - 2) != 0) continue;
+            unsigned char id[GIT_OID_SIZE];
+            memcpy(full + 2, entry->d_name, GIT_OID_HEX - 2);
+            if (git_oid_from_hex(full, id) != 0) continue;
+            if (found && memcmp(oid, id, GIT_OID_SIZE) == 0) continue;
+            if (found) {
+                closedir(dir);
+                path_buf_free(&path);
+                return -1;
+            }
+            memcpy(oid, id, GIT_OID_SIZE);
+            found = 1;
+        }
+        if (dir) closedir(dir);
+    }
+    path_buf_free(&path);
+    return found;
+}
+
+static int resolve_ref(git_odb* odb, const char* name, unsigned char* oid, int depth);
+
+// "<hex>" or "ref: <name>" from a loose ref file; FETCH_HEAD-style trailing
+// text after the id is ignored.
+static int read_loose_ref(git_odb* odb, const path_buf* dir, const char* name, unsigned char* oid, int depth) {
+    path_buf path = {0};
+    char* content = NULL;
+    size_t len = 0;
+    int rc = -1;
+    if (path_buf_push(&path, dir->data, dir->len) == 0 && path_buf_push(&path, "/", 1) == 0 &&
+        path_buf_push(&path, name, strlen(name)) == 0 && read_file_into_buffer(path.data, 1024 * 1024, &content, &len) == 0) {
+        while (len > 0 && isspace((unsigned char)content[len - 1])) content[--len] = '\0';
+        if (strncmp(content, "ref: ", 5) == 0) {
+            rc = resolve_ref(odb, content + 5, oid, depth + 1);
+        }
+        else if (len >= GIT_OID_HEX && git_oid_from_hex(content, oid) == 0) {
+            rc = 0;
+        }
+    }
+    free(content);
+    path_buf_free(&path);
+    return rc;
+}
+
+static int read_packed_ref(git_odb* odb, const char* name, unsigned char* oid) {
+    path_buf path = {0};
+    char* content = NULL;
+    int rc = -1;
+    if (path_buf_push(&path, odb->common_dir.data, odb->common_dir.len) == 0 && path_buf_push(&path, "/packed-refs", 12) == 0 &&
+        read_file_into_buffer(path.data, SIZE_MAX / 2, &content, NULL) == 0) {
+        size_t name_len = strlen(name);
+        for (char* line = strtok(content, "\n"); line && rc != 0; line = strtok(NULL, "\n")) {
+            if (strlen(line) == GIT_OID_HEX + 1 + name_len && line[GIT_OID_HEX] == ' ' &&
+                memcmp(line + GIT_OID_HEX + 1, name, name_len) == 0 && git_oid_from_hex(line, oid) == 0) {
+                rc = 0;
+            }
+        }
+    }
+    free(content);
+    path_buf_free(&path);
+    return rc;
+}
+
+// Per-worktree refs (HEAD and the like) live in the git directory, the rest
+// in the common directory, loose or in packed-refs.
+static int resolve_ref(git_odb* odb, const char* name, unsigned char* oid, int depth) {
+    if (depth > MAX_REF_DEPTH || strstr(name, "..") || name[0] == '/') return -1;
+    if (read_loose_ref(odb, &odb->git_dir, name, oid, depth) == 0) return 0;
+    if (odb->common_dir.len != odb->git_dir.len || memcmp(odb->common_dir.data, odb->git_dir.data, odb->git_dir.len) != 0) {
+        if (read_loose_ref(odb, &odb->common_dir, name, oid, depth) == 0) return 0;
+    }
+    return read_packed_ref(odb, name, oid);
+}
+
+// Resolves a name the way git's rev-parse does for refs: full and
+// abbreviated object ids, then the usual ref namespaces in order.
+static int resolve_name(git_odb* odb, const char* name, size_t len, unsigned char* oid) {
+    static const char* const rules[] = {
+        "%.*s", "refs/%.*s", "refs/tags/%.*s", "refs/heads/%.*s", "refs/remotes/%.*s", "refs/remotes/%.*s/HEAD"};
+    if (len == 0 || (len == 1 && name[0] == '@')) {
+        name = "HEAD";
+        len = 4;
+    }
+    size_t hex_len = 0;
+    while (hex_len < len && hex_value((unsigned char)name[hex_len]) >= 0) hex_len++;
+    if (hex_len == len && len == GIT_OID_HEX) return git_oid_from_hex(name, oid);
+
+    char ref[MAX_PATH_SIZE];
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        int n = snprintf(ref, sizeof(ref), rules[i], (int)len, name);
+        if (n > 0 && (size_t)n < sizeof(ref) && resolve_ref(odb, ref, oid, 0) == 0) return 0;
+    }
+    if (hex_len == len && len >= MIN_ABBREV_LEN && len < GIT_OID_HEX) {
+        int found = find_abbreviated(odb, name, len, oid);
+        if (found < 0) fprintf(stderr, "Error: Short object id '%.*s' is ambiguous.\n", (int)len, name);
+        return found == 1 ? 0 : -1;
+    }
+    return -1;
+}
+
+// Finds "<key> <hex>" among the header lines of a commit or tag; nth counts
+// repeated keys such as parent (0 is the first).
+static int header_oid(const char* data, size_t len, const char* key, int nth, unsigned char* oid) {
+    size_t key_len = strlen(key);
+    const char* end = data + len;
+    for (const char* line = data; line < end && *line != '\n';) {
+        const char* eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol) eol = end;
+        if ((size_t)(eol - line) >= key_len + 1 + GIT_OID_HEX && memcmp(line, key, key_len) == 0 && line[key_len] == ' ') {
+            if (nth-- == 0) return git_oid_from_hex(line + key_len + 1, oid);
+        }
+        line = eol + 1;
+    }
+    return -1;
+}
+
+// Peels tags until the object is of the wanted type; a commit also peels to
+// its tree. want 0 stops at the first object that is not a tag.
+static int peel(git_odb* odb, unsigned char* oid, int want) {
+    for (int depth = 0; depth < MAX_REF_DEPTH; depth++) {
+        int type;
+        char* data;
+        size_t len;
+        if (git_odb_read(odb, oid, &type, &data, &len) != 0) return -1;
+        int rc = 1;
+        if (type == want || (want == 0 && type != GIT_OBJ_TAG)) rc = 0;
+        else if (type == GIT_OBJ_TAG) rc = header_oid(data, len, "object", 0, oid) == 0 ? 1 : -1;
+        else if (type == GIT_OBJ_COMMIT && want == GIT_OBJ_TREE) rc = header_oid(data, len, "tree", 0, oid) == 0 ? 1 : -1;
+        else rc = -1;
+        free(data);
+        if (rc <= 0) return rc;
+    }
+    return -1;
+}
+
+static int nth_parent(git_odb* odb, unsigned char* oid, int n) {
+    if (peel(odb, oid, GIT_OBJ_COMMIT) != 0) return -1;
+    if (n == 0) return 0;
+    int type;
+    char* data;
+    size_t len;
+    if (git_odb_read(odb, oid, &type, &data, &len) != 0) return -1;
+    int rc = header_oid(data, len, "parent", n - 1, oid);
+    free(data);
+    return rc;
+}
+
+// Resolves a commit-ish to the tree it names. Supports object ids (full or
+// abbreviated), ref names, and the suffixes ~N, ^N and ^{type}.
+int git_odb_resolve_tree(git_odb* odb, const char* rev, unsigned char* tree) {
+    size_t name_len = strcspn(rev, "~^");
+    if (resolve_name(odb, rev, name_len, tree) != 0) return -1;
+
+    const char* p = rev + name_len;
+    while (*p) {
+        char op = *p++;
+        if (op == '^' && *p == '{') {
+            const char* close = strchr(p, '}');
+            if (!close) return -1;
+            int want = close == p + 1 ? 0 : object_type_from_name(p + 1, (size_t)(close - p - 1));
+            if (close != p + 1 && want == 0) return -1;
+            if (peel(odb, tree, want) != 0) return -1;
+            p = close + 1;
+            continue;
+        }
+        int count = 1;
+        if (isdigit((unsigned char)*p)) {
+            count = (int)strtol(p, (char**)&p, 10);
+        }
+        if (op == '^') {
+            if (nth_parent(odb, tree, count) != 0) return -1;
+        }
+        else {
+            for (int i = 0; i < count; i++) {
+                if (nth_parent(odb, tree, 1) != 0) return -1;
+            }
+        }
+    }
+    return peel(odb, tree, GIT_OBJ_TREE);
+}
@@ -0,0 +1,267 @@
+#include "recap.h"
+#include <pthread.h>
+#include <string.h>
+
+#define ESC STRING_ESCAPES
+
+// What --compact knows about each language. keys lists, separated by
+// spaces, the extensions (with the dot, lower case), the exact file names
+// and the shebang interpreters ("#!name", without a version suffix) that
+// select it. Within strings, longer quotes go first.
+static const language_def languages[] = {
+    {"c", ".c .h .cc .cpp .cxx .c++ .hh .hpp .hxx .inl .m .mm .java .groovy .gradle .proto",
+     LANGUAGE_COLLAPSE_SPACE, LANGUAGE_CPP_RAW,
+     {"//"}, "/*", "*/", {{"\"", ESC}, {"'", ESC}}},
+    {"javascript", ".js .mjs .cjs .jsx .ts .mts .cts .tsx #!node #!nodejs #!deno #!bun",
+     LANGUAGE_COLLAPSE_SPACE, 0,
+     {"//"}, "/*", "*/", {{"\"", ESC}, {"'", ESC}, {"`", ESC}}},
+    {"go", ".go",
+     LANGUAGE_COLLAPSE_SPACE, 0,
+     {"//"}, "/*", "*/", {{"\"", ESC}, {"'", ESC}, {"`", 0}}},
+    {"csharp", ".cs",
+     LANGUAGE_COLLAPSE_SPACE, LANGUAGE_VERBATIM_AT,
+     {"//"}, "/*", "*/", {{"\"", ESC}, {"'", ESC}}},
+    {"kotlin", ".kt .kts",
+     LANGUAGE_COLLAPSE_SPACE, LANGUAGE_NESTED_COMMENTS,
+     {"//"}, "/*", "*/", {{"\"\"\"", 0}, {"\"", ESC}, {"'", ESC}}},
+    {"rust", ".rs",
+     LANGUAGE_COLLAPSE_SPACE, LANGUAGE_NESTED_COMMENTS | LANGUAGE_RUST_RAW | LANGUAGE_CHAR_LITERALS,
+     {"//"}, "/*", "*/", {{"\"", ESC}}},
+    {"dart", ".dart",
+     LANGUAGE_COLLAPSE_SPACE, LANGUAGE_NESTED_COMMENTS,
+     {"//"}, "/*", "*/", {{"\"\"\"", ESC}, {"'''", ESC}, {"\"", ESC}, {"'", ESC}}},
+    // Swift reads a run of operator characters as one operator, so "x = -1"
+    // must keep its spaces.
+    {"swift", ".swift",
+     LANGUAGE_KEEP_SPACE, LANGUAGE_NESTED_COMMENTS | LANGUAGE_SWIFT_RAW,
+     {"//"}, "/*", "*/", {{"\"\"\"", ESC}, {"\"", ESC}}},
+    // Often HTML with code in between, so whitespace stays.
+    {"php", ".php .phtml #!php",
+     LANGUAGE_KEEP_SPACE, 0,
+     {"//"}, "/*", "*/", {{"\"", ESC}, {"'", ESC}}},
+    {"css", ".css .scss .less",
+     LANGUAGE_COLLAPSE_SPACE, 0,
+     {NULL}, "/*", "*/", {{"\"", ESC}, {"'", ESC}}},
+    {"json", ".json",
+     LANGUAGE_MINIFY, 0,
+     {NULL}, NULL, NULL, {{"\"", ESC}}},
+    {"jsonc", ".jsonc .json5",
+     LANGUAGE_MINIFY, 0,
+     {"//"}, "/*", "*/", {{"\"", ESC}, {"'", ESC}}},
+    {"python", ".py .pyi .pyw .rb .pl .pm .ex .exs #!python #!ruby #!perl #!elixir",
+     LANGUAGE_KEEP_SPACE, 0,
+     {"#"}, NULL, NULL, {{"\"\"\"", 0}, {"'''", 0}, {"\"", ESC}, {"'", ESC}}},
+    // "${#list[@]}" and "a#b" are not comments.
+    {"shell", ".sh .bash .zsh .ksh .mk .dockerfile Makefile makefile GNUmakefile Dockerfile "
+              "#!sh #!bash #!zsh #!ksh #!dash #!ash #!make",
+     LANGUAGE_KEEP_SPACE, LANGUAGE_COMMENT_AFTER_SPACE,
+     {"#"}, NULL, NULL, {{"\"", ESC}, {"'", 0}}},
+    {"yaml", ".yaml .yml",
+     LANGUAGE_KEEP_SPACE, LANGUAGE_COMMENT_AFTER_SPACE | LANGUAGE_QUOTE_AFTER_SPACE | LANGUAGE_BLOCK_SCALARS,
+     {"#"}, NULL, NULL, {{"\"", ESC}, {"'", STRING_DOUBLED}}},
+    {"toml", ".toml",
+     LANGUAGE_KEEP_SPACE, 0,
+     {"#"}, NULL, NULL, {{"\"\"\"", ESC}, {"'''", 0}, {"\"", ESC}, {"'", 0}}},
+    {"sql", ".sql",
+     LANGUAGE_KEEP_SPACE, 0,
+     {"--"}, "/*", "*/", {{"'", STRING_DOUBLED}, {"\"", STRING_DOUBLED}}},
+    {"lua", ".lua #!lua #!luajit",
+     LANGUAGE_KEEP_SPACE, LANGUAGE_LUA_LONG,
+     {"--"}, NULL, NULL, {{"\"", ESC}, {"'", ESC}}},
+    {"markup", ".html .htm .xhtml .xml .svg .xsd .xsl .xslt .plist .vue .svelte",
+     LANGUAGE_KEEP_SPACE, 0,
+     {NULL}, "<!--", "-->", {{NULL}}},
+};
+
+_Static_assert(sizeof(languages) / sizeof(languages[0]) <= LANGUAGE_MAX, "raise LANGUAGE_MAX");
+
+// Keys are found with a perfect hash in two steps ("hash and displace"):
+// the hash picks a bucket, and the bucket's displacement, chosen when the
+// table is built so that no two keys share a slot, picks the slot. Should
+// no seed out of LANGUAGE_SEEDS place every key, lookups scan the keys.
+#define LANGUAGE_KEYS_MAX 256
+#define LANGUAGE_BUCKETS 64
+#define LANGUAGE_SLOTS 256
+#define LANGUAGE_KEY_MAX 24
+#define LANGUAGE_SEEDS 16
+
+static struct {
+    const char* key[LANGUAGE_KEYS_MAX];
+    unsigned char key_len[LANGUAGE_KEYS_MAX];
+    unsigned char key_language[LANGUAGE_KEYS_MAX];
+    size_t key_count;
+    uint64_t seed;
+    int linear;
+    unsigned short displacement[LANGUAGE_BUCKETS];
+    unsigned short slot[LANGUAGE_SLOTS]; // key index + 1, or 0
+} registry;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static uint64_t key_hash(const char* key, size_t len) {
+    return cache_hash(registry.seed, key, len);
+}
+
+static size_t key_slot(uint64_t h, unsigned displacement) {
+    uint64_t x = (h >> 6) ^ ((uint64_t)displacement * 0x9e3779b97f4a7c15ull);
+    x *= 0xff51afd7ed558ccdull;
+    return (size_t)(x >> 32) & (LANGUAGE_SLOTS - 1);
+}
+
+// Tries displacements for one bucket until its keys land in free slots
+// that are also distinct from each other.
+static int place_bucket(const size_t* keys, size_t count, const uint64_t* hashes) {
+    for (unsigned d = 0; d < 65536; d++) {
+        size_t slots[LANGUAGE_KEYS_MAX];
+        size_t i = 0;
+        for (; i < count; i++) {
+            slots[i] = key_slot(hashes[keys[i]], d);
+            if (registry.slot[slots[i]]) break;
+            size_t j = 0;
+            while (j < i && slots[j] != slots[i]) j++;
+            if (j < i) break;
+        }
+        if (i < count) continue;
+        for (i = 0; i < count; i++) registry.slot[slots[i]] = (unsigned short)(keys[i] + 1);
+        return (int)d;
+    }
+    return -1;
+}
+
+static const language_def* lookup_slot(const char* key, size_t len) {
+    uint64_t h = key_hash(key, len);
+    size_t slot = key_slot(h, registry.displacement[h & (LANGUAGE_BUCKETS - 1)]);
+    unsigned k = registry.slot[slot];
+    if (k == 0) return NULL;
+    k--;
+    if (registry.key_len[k] != len || memcmp(registry.key[k], key, len) != 0) return NULL;
+    return &languages[registry.key_language[k]];
+}
+
+// Builds the displacements for the current seed and checks that every key
+// is found through them.
+static int place_keys(void) {
+    static uint64_t hashes[LANGUAGE_KEYS_MAX];
+    static size_t members[LANGUAGE_BUCKETS][LANGUAGE_KEYS_MAX];
+    size_t sizes[LANGUAGE_BUCKETS] = {0};
+    memset(registry.slot, 0, sizeof(registry.slot));
+    for (size_t i = 0; i < registry.key_count; i++) {
+        hashes[i] = key_hash(registry.key[i], registry.key_len[i]);
+        size_t b = (size_t)hashes[i] & (LANGUAGE_BUCKETS - 1);
+        members[b][sizes[b]++] = i;
+    }
+
+    // Fullest buckets first, while most slots are still free.
+    for (size_t size = registry.key_count; size > 0; size--) {
+        for (size_t b = 0; b < LANGUAGE_BUCKETS; b++) {
+            if (sizes[b] != size) continue;
+            int d = place_bucket(members[b], size, hashes);
+            if (d < 0) return -1;
+            registry.displacement[b] = (unsigned short)d;
+        }
+    }
+    for (size_t i = 0; i < registry.key_count; i++) {
+        if (!lookup_slot(registry.key[i], registry.key_len[i])) return -1;
+    }
+    return 0;
+}
+
+static void init_registry(void) {
+    for (size_t l = 0; l < sizeof(languages) / sizeof(languages[0]); l++) {
+        const char* p = languages[l].keys;
+        while (*p) {
+            while (*p == ' ') p++;
+            size_t len = strcspn(p, " ");
+            if (len == 0) break;
+            if (registry.key_count < LANGUAGE_KEYS_MAX && len <= LANGUAGE_KEY_MAX) {
+                registry.key[registry.key_count] = p;
+                registry.key_len[registry.key_count] = (unsigned char)len;
+                registry.key_language[registry.key_count] = (unsigned char)l;
+                registry.key_count++;
+            }
+            p += len;
+        }
+    }
+
+    for (unsigned attempt = 0; attempt < LANGUAGE_SEEDS; attempt++) {
+        registry.seed = 0xcbf29ce484222325ull + attempt * 0x9e3779b97f4a7c15ull;
+        if (place_keys() == 0) return;
+    }
+    registry.linear = 1;
+}
+
+static const language_def* lookup(const char* key, size_t len) {
+    if (len == 0 || len > LANGUAGE_KEY_MAX) return NULL;
+    pthread_once(&registry_once, init_registry);
+    if (!registry.linear) return lookup_slot(key, len);
+    for (size_t k = 0; k < registry.key_count; k++) {
+        if (registry.key_len[k] == len && memcmp(registry.key[k], key, len) == 0) return &languages[registry.key_language[k]];
+    }
+    return NULL;
+}
+
+size_t language_count(void) {
+    return sizeof(languages) / sizeof(languages[0]);
+}
+
+const language_def* language_at(size_t index) {
+    return index < language_count() ? &languages[index] : NULL;
+}
+
+// By file name first, then by extension, which is matched without case.
+const language_def* language_for_path(const char* path) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const language_def* lang = lookup(base, strlen(base));
+    if (lang) return lang;
+
+    const char* ext = strrchr(base, '.');
+    if (!ext || ext == base) return NULL;
+    char key[LANGUAGE_KEY_MAX];
+    size_t len = strlen(ext);
+    if (len > sizeof(key)) return NULL;
+    for (size_t i = 0; i < len; i++) {
+        char c = ext[i];
+        key[i] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+    return lookup(key, len);
+}
+
+// line is the start of a file. Handles "#!/bin/sh", "#!/usr/bin/env -S
+// python3 -u" and versioned names such as "python3.12".
+const language_def* language_for_shebang(const char* line, size_t len) {
+    if (len < 2 || line[0] != '#' || line[1] != '!') return NULL;
+    const char* eol = memchr(line, '\n', len);
+    const char* end = eol ? eol : line + len;
+    const char* p = line + 2;
+
+    int after_env = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        const char* word = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        if (p == word) return NULL;
+        // env's own options and variable assignments come before the command.
+        if (after_env && (*word == '-' || memchr(word, '=', (size_t)(p - word)))) continue;
+
+        const char* name = word;
+        for (const char* s = word; s < p; s++) {
+            if (*s == '/') name = s + 1;
+        }
+        size_t name_len = (size_t)(p - name);
+        if (!after_env && name_len == 3 && memcmp(name, "env", 3) == 0) {
+            after_env = 1;
+            continue;
+        }
+
+        while (name_len > 0 && ((name[name_len - 1] >= '0' && name[name_len - 1] <= '9') || name[name_len - 1] == '.')) {
+            name_len--;
+        }
+        char key[LANGUAGE_KEY_MAX];
+        if (name_len == 0 || name_len + 2 > sizeof(key)) return NULL;
+        key[0] = '#';
+        key[1] = '!';
+        memcpy(key + 2, name, name_len);
+        return lookup(key, name_len + 2);
+    }
+    return NULL;
+}
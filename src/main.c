@@ -16,14 +16,6 @@ static void pcre2_code_ptr_cleanup(void* data) {
     }
 }
 
-static void pcre2_match_data_ptr_cleanup(void* data) {
-    pcre2_match_data** md = data;
-    if (md && *md) {
-        pcre2_match_data_free(*md);
-        *md = NULL;
-    }
-}
-
 static int setup_output_stream(recap_context* ctx) {
     int is_output_specified = (ctx->output.output_name[0] != '\0' || ctx->output.output_dir[0] != '\0');
 
@@ -50,7 +42,7 @@ static int setup_output_stream(recap_context* ctx) {
 }
 
 static void handle_post_processing(recap_context* ctx) {
-    if (ctx->matched_files.count == 0) {
+    if (ctx->stats.files_matched == 0) {
         if (!ctx->output.use_stdout) {
             fprintf(stderr, "Info: No files matched criteria. Removing empty output file: %s\n", ctx->output.calculated_output_path);
             remove(ctx->output.calculated_output_path);
@@ -109,6 +101,16 @@ static void handle_post_processing(recap_context* ctx) {
     }
 }
 
+static void open_cache(recap_context* ctx) {
+    ctx->cache = cache_open(ctx->cache_dir, ctx->cwd);
+    if (!ctx->cache) {
+        fprintf(stderr, "Warning: Could not open the cache in %s, continuing without it.\n", ctx->cache_dir);
+        return;
+    }
+    ctx->content_options = content_options_hash(ctx);
+    get_relative_path(ctx->cache_dir, ctx->cwd, ctx->cache_rel_path, sizeof(ctx->cache_rel_path));
+}
+
 int main(int argc, char* argv[]) {
     recap_context ctx = {0};
     int result = 0;
@@ -120,7 +122,6 @@ int main(int argc, char* argv[]) {
         !memlst_add(&ctx.cleanup, (dtor_fn)free_regex_ctx, &ctx.content_include_filters) ||
         !memlst_add(&ctx.cleanup, (dtor_fn)free_regex_ctx, &ctx.content_exclude_filters) ||
         !memlst_add(&ctx.cleanup, pcre2_code_ptr_cleanup, &ctx.strip_regex) ||
-        !memlst_add(&ctx.cleanup, pcre2_match_data_ptr_cleanup, &ctx.strip_match_data) ||
         !memlst_add(&ctx.cleanup, (dtor_fn)path_list_free, &ctx.matched_files)) {
         fprintf(stderr, "Error: Failed to register cleanup handlers.\n");
         result = 1;
@@ -135,7 +136,15 @@ int main(int argc, char* argv[]) {
     }
     normalize_path(ctx.cwd);
 
-    parse_arguments(argc, argv, &ctx);
+    int parsed = parse_arguments(argc, argv, &ctx);
+    if (parsed != ARGS_RUN) {
+        result = parsed == ARGS_FAILED;
+        goto cleanup;
+    }
+    if (ctx.serve_path) {
+        result = serve_run(&ctx) != 0;
+        goto cleanup;
+    }
 
     if (ctx.gist_api_key && ctx.gist_api_key[0] != '\0') {
         if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
@@ -150,14 +159,29 @@ int main(int argc, char* argv[]) {
         result = 1;
         goto cleanup;
     }
-    start_traversal(&ctx);
+    // Blob content from --rev is immutable and never cached.
+    if (ctx.cache_dir && !ctx.rev) {
+        open_cache(&ctx);
+    }
+    if (ctx.watch) {
+        result = watch_run(&ctx) != 0;
+    }
+    else if (start_traversal(&ctx) != 0) {
+        result = 1;
+    }
+    if (ctx.cache) {
+        if (ctx.show_stats) cache_print_stats(ctx.cache);
+        cache_close(ctx.cache);
+        ctx.cache = NULL;
+    }
 
     if (ctx.output_stream && ctx.output_stream != stdout) {
         fclose(ctx.output_stream);
         ctx.output_stream = NULL;
     }
 
-    handle_post_processing(&ctx);
+    // In watch mode the output file is kept up to date until interrupted.
+    if (!ctx.watch) handle_post_processing(&ctx);
 
 cleanup:
     if (ctx.output_stream && ctx.output_stream != stdout) {
@@ -0,0 +1,969 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+enum {
+    SINK_COPY = 0,
+    SINK_SPLICE,
+    SINK_COPY_FILE_RANGE
+};
+
+void sink_init_stream(out_sink* sink, FILE* stream) {
+    memset(sink, 0, sizeof(*sink));
+    sink->stream = stream;
+    sink->fd = -1;
+    sink->src_fd = -1;
+#if defined(__linux__)
+    struct stat st;
+    int fd = fileno(stream);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        int flags = fcntl(fd, F_GETFL);
+        if (S_ISFIFO(st.st_mode)) {
+            sink->fd = fd;
+            sink->zero_copy = SINK_SPLICE;
+        }
+        else if (S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND)) {
+            sink->fd = fd;
+            sink->zero_copy = SINK_COPY_FILE_RANGE;
+        }
+    }
+#endif
+}
+
+void sink_init_buffer(out_sink* sink) {
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+    sink->src_fd = -1;
+}
+
+static int sink_reserve(out_sink* sink, size_t extra) {
+    if (sink->len + extra <= sink->cap) return 0;
+    size_t new_cap = sink->cap ? sink->cap : 4096;
+    while (new_cap < sink->len + extra) new_cap *= 2;
+    char* data = realloc(sink->data, new_cap);
+    if (!data) {
+        sink->failed = 1;
+        return -1;
+    }
+    sink->data = data;
+    sink->cap = new_cap;
+    return 0;
+}
+
+void sink_write(out_sink* sink, const void* data, size_t len) {
+    if (len == 0) return;
+    if (sink->stream) {
+        if (fwrite(data, 1, len, sink->stream) != len) sink->failed = 1;
+        return;
+    }
+    if (sink_reserve(sink, len) != 0) return;
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+}
+
+void sink_puts(out_sink* sink, const char* s) {
+    sink_write(sink, s, strlen(s));
+}
+
+void sink_printf(out_sink* sink, const char* fmt, ...) {
+    va_list ap;
+    if (sink->stream) {
+        va_start(ap, fmt);
+        vfprintf(sink->stream, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    char small[256];
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(small)) {
+        sink_write(sink, small, (size_t)n);
+        return;
+    }
+    if (sink_reserve(sink, (size_t)n + 1) != 0) return;
+    va_start(ap, fmt);
+    vsnprintf(sink->data + sink->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    sink->len += (size_t)n;
+}
+
+// Has the kernel move large ranges of src_fd to a stream that is a pipe or
+// regular file. Returns how many leading bytes of the range are dealt with;
+// the caller writes the rest.
+static size_t sink_move_range(out_sink* sink, int src_fd, off_t off, size_t len) {
+    size_t done = 0;
+#if defined(__linux__)
+    if (sink->stream && sink->zero_copy != SINK_COPY && src_fd >= 0 && len >= ZERO_COPY_MIN_SIZE) {
+        if (fflush(sink->stream) != 0) {
+            sink->failed = 1;
+            return len;
+        }
+        loff_t src_off = off;
+        while (done < len) {
+            ssize_t n;
+            if (sink->zero_copy == SINK_SPLICE) {
+                n = splice(src_fd, &src_off, sink->fd, NULL, len - done, SPLICE_F_MORE);
+            }
+            else {
+                n = copy_file_range(src_fd, &src_off, sink->fd, NULL, len - done, 0);
+            }
+            if (n <= 0) {
+                // Unsupported file system pair or similar: stop trying for this sink.
+                if (n < 0) sink->zero_copy = SINK_COPY;
+                break;
+            }
+            done += (size_t)n;
+        }
+        sink->zero_copy_bytes += done;
+    }
+#else
+    (void)sink;
+    (void)src_fd;
+    (void)off;
+    (void)len;
+#endif
+    return done;
+}
+
+// Leaves a range out of a buffer sink, to be written by sink_write_block().
+// A sink holds ranges of one file only.
+static int sink_defer_range(out_sink* sink, int src_fd, off_t off, size_t len) {
+    if (sink->src_fd < 0) {
+        sink->src_fd = fcntl(src_fd, F_DUPFD_CLOEXEC, 0);
+        if (sink->src_fd < 0) return -1;
+        sink->deferred_from = src_fd;
+    }
+    else if (sink->deferred_from != src_fd) {
+        return -1;
+    }
+    if (sink->range_count == sink->range_cap) {
+        size_t cap = sink->range_cap ? sink->range_cap * 2 : 8;
+        sink_range* ranges = realloc(sink->ranges, cap * sizeof(sink_range));
+        if (!ranges) return -1;
+        sink->ranges = ranges;
+        sink->range_cap = cap;
+    }
+    sink_range* r = &sink->ranges[sink->range_count++];
+    r->at = sink->len;
+    r->off = off;
+    r->len = len;
+    return 0;
+}
+
+// Writes len bytes that also live at offset off of src_fd. Large ranges
+// going to a pipe or regular file are moved by the kernel, and buffer sinks
+// that defer ranges keep a reference instead of a copy; everything else,
+// and any range the kernel refuses, is copied from data.
+void sink_write_file_range(out_sink* sink, int src_fd, off_t off, const char* data, size_t len) {
+    if (!sink->stream && sink->defer_ranges && src_fd >= 0 && len >= ZERO_COPY_MIN_SIZE &&
+        sink_defer_range(sink, src_fd, off, len) == 0) {
+        return;
+    }
+    size_t done = sink_move_range(sink, src_fd, off, len);
+    sink_write(sink, data + done, len - done);
+}
+
+// Writes a block rendered into a buffer sink, with the file ranges it left
+// out in between. What the kernel does not move is read from the file.
+void sink_write_block(out_sink* sink, const out_sink* block) {
+    size_t at = 0;
+    for (size_t i = 0; i < block->range_count; i++) {
+        const sink_range* r = &block->ranges[i];
+        sink_write(sink, block->data + at, r->at - at);
+        at = r->at;
+        size_t done = sink_move_range(sink, block->src_fd, r->off, r->len);
+        char buf[16 * 1024];
+        while (done < r->len) {
+            size_t want = r->len - done < sizeof(buf) ? r->len - done : sizeof(buf);
+            ssize_t n = pread(block->src_fd, buf, want, r->off + (off_t)done);
+            if (n <= 0) {
+                // The file shrank since it was rendered.
+                sink->failed = 1;
+                break;
+            }
+            sink_write(sink, buf, (size_t)n);
+            done += (size_t)n;
+        }
+    }
+    sink_write(sink, block->data + at, block->len - at);
+}
+
+void sink_free(out_sink* sink) {
+    free(sink->data);
+    sink->data = NULL;
+    sink->len = 0;
+    sink->cap = 0;
+    if (sink->defer_ranges && sink->src_fd >= 0) close(sink->src_fd);
+    sink->src_fd = -1;
+    free(sink->ranges);
+    sink->ranges = NULL;
+    sink->range_count = 0;
+    sink->range_cap = 0;
+}
+
+_Static_assert(MAX_SCOPED_STRIP_RULES <= 32, "strip rule sets are kept in a uint32_t");
+
+// Every scoped rule whose path pattern matches rel_path applies; --strip
+// applies to the files no scoped rule covers. Returns one bit per applying
+// scoped rule, so 0 stands for --strip (or no rule at all).
+static uint32_t select_strip_rules(const recap_context* ctx, const char* rel_path, regex_scratch* regex) {
+    uint32_t rules = 0;
+    for (int i = 0; i < ctx->scoped_strip_rule_count; i++) {
+        if (pcre2_match(ctx->scoped_strip_rules[i].path_regex,
+                        (PCRE2_SPTR)rel_path,
+                        PCRE2_ZERO_TERMINATED,
+                        0, 0,
+                        regex->match_data,
+                        regex->match_context) >= 0) {
+            rules |= (uint32_t)1 << i;
+        }
+    }
+    return rules;
+}
+
+// One strip regex during a pass, with its next match at or after the pass
+// position.
+typedef struct {
+    const pcre2_code* code;
+    int jit;
+    int start_only;
+    int at_pos;
+    int done;
+    size_t from;
+    size_t start;
+    size_t end;
+} strip_rule_state;
+
+// Removes every match of the applying strip regexes in one left-to-right
+// pass and hands out the text in between as spans of data. Where matches
+// overlap, the one that starts first wins and the other regexes are tried
+// again after it. Matching always sees the whole file, so lookbehinds work
+// across stripped text; empty matches are not taken, and a regex anchored
+// to the start of the file is not tried anywhere else. \G matches at the
+// pass position, so a regex using it is searched again whenever that moves.
+typedef struct {
+    const char* data;
+    size_t len;
+    size_t pos;
+    regex_scratch* regex;
+    int count;
+    strip_rule_state rules[MAX_SCOPED_STRIP_RULES];
+} strip_pass;
+
+static void strip_find(strip_pass* sp, strip_rule_state* r) {
+    r->from = sp->pos;
+    if (r->start_only && sp->pos > 0) {
+        r->done = 1;
+        return;
+    }
+    // Regexes are JIT compiled when parsed; pcre2_jit_match() skips the
+    // checks pcre2_match() repeats on every call.
+    int rc = r->jit ? pcre2_jit_match(r->code, (PCRE2_SPTR)sp->data, sp->len, sp->pos, PCRE2_NOTEMPTY, sp->regex->match_data, sp->regex->match_context)
+                    : pcre2_match(r->code, (PCRE2_SPTR)sp->data, sp->len, sp->pos, PCRE2_NOTEMPTY, sp->regex->match_data, sp->regex->match_context);
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(sp->regex->match_data);
+    // \K can report a match that ends before it starts.
+    if (rc < 0 || ovector[0] < sp->pos || ovector[1] <= ovector[0]) {
+        r->done = 1;
+        return;
+    }
+    r->start = ovector[0];
+    r->end = ovector[1];
+}
+
+// Whether source uses \G. PCRE2 reports a regex starting with \G as
+// anchored just like one starting with \A, and says nothing of a \G in
+// another branch, so the source is looked at. A \G inside \Q...\E is taken
+// too, which only costs searches.
+static int uses_match_start(const char* source) {
+    for (const char* c = source; *c; c++) {
+        if (*c != '\\') continue;
+        if (c[1] == 'G') return 1;
+        if (c[1]) c++;
+    }
+    return 0;
+}
+
+static void strip_add(strip_pass* sp, const pcre2_code* code, const char* source) {
+    strip_rule_state* r = &sp->rules[sp->count++];
+    size_t jit_size = 0;
+    uint32_t options = 0;
+    pcre2_pattern_info(code, PCRE2_INFO_JITSIZE, &jit_size);
+    pcre2_pattern_info(code, PCRE2_INFO_ALLOPTIONS, &options);
+    r->code = code;
+    r->jit = jit_size > 0;
+    r->at_pos = source && uses_match_start(source);
+    // Anchored without \G means \A, or ^ outside multiline mode.
+    r->start_only = !r->at_pos && (options & PCRE2_ANCHORED) != 0;
+    r->done = 0;
+    strip_find(sp, r);
+}
+
+static void strip_begin(strip_pass* sp, const recap_context* ctx, uint32_t rules, regex_scratch* regex, const char* data, size_t len) {
+    sp->data = data;
+    sp->len = len;
+    sp->pos = 0;
+    sp->regex = regex;
+    sp->count = 0;
+    if (rules == 0 && ctx->strip_regex) strip_add(sp, ctx->strip_regex, ctx->strip_source);
+    for (int i = 0; i < ctx->scoped_strip_rule_count; i++) {
+        const scoped_strip_rule* rule = &ctx->scoped_strip_rules[i];
+        if (rules & ((uint32_t)1 << i)) strip_add(sp, rule->strip_regex, rule->strip_source);
+    }
+}
+
+// The next span that survives stripping; returns 0 once data is used up.
+static int strip_next(strip_pass* sp, size_t* start, size_t* len) {
+    while (sp->pos < sp->len) {
+        strip_rule_state* first = NULL;
+        for (int i = 0; i < sp->count; i++) {
+            strip_rule_state* r = &sp->rules[i];
+            if (r->at_pos && r->from != sp->pos) {
+                r->done = 0;
+                strip_find(sp, r);
+            } else if (!r->done && r->start < sp->pos) {
+                strip_find(sp, r);
+            }
+            if (!r->done && (!first || r->start < first->start)) first = r;
+        }
+        size_t from = sp->pos;
+        size_t stop = first ? first->start : sp->len;
+        sp->pos = first ? first->end : sp->len;
+        if (stop > from) {
+            *start = from;
+            *len = stop - from;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Everything besides the file itself that shapes its content block, so
+// cached blocks are only reused under the same options.
+uint64_t content_options_hash(const recap_context* ctx) {
+    uint64_t h = cache_hash(CACHE_HASH_SEED, ctx->version, strlen(ctx->version) + 1);
+    int limits[2] = {ctx->compact_output, MAX_FILE_CONTENT_SIZE};
+    h = cache_hash(h, limits, sizeof(limits));
+    const char* strip = ctx->strip_source ? ctx->strip_source : "";
+    h = cache_hash(h, strip, strlen(strip) + 1);
+    for (int i = 0; i < ctx->scoped_strip_rule_count; i++) {
+        const scoped_strip_rule* rule = &ctx->scoped_strip_rules[i];
+        h = cache_hash(h, rule->path_source, strlen(rule->path_source) + 1);
+        h = cache_hash(h, rule->strip_source, strlen(rule->strip_source) + 1);
+    }
+    return h;
+}
+
+// Decides whether rel_path gets a content block. When it does, cf holds the
+// opened file for write_file_content_block(); either way the caller closes it.
+static int should_show_content(const char* rel_path, const char* full_path, recap_context* ctx, regex_scratch* regex, content_file* cf) {
+    memset(cf, 0, sizeof(*cf));
+    cf->fd = -1;
+    if (ctx->content_exclude_filters.count > 0 && match_regex_list(&ctx->content_exclude_filters, rel_path, regex)) return 0;
+    if (ctx->content_include_filters.count > 0) {
+        if (match_regex_list(&ctx->content_include_filters, rel_path, regex)) {
+            if (ctx->objects) return content_file_open_blob(cf, ctx->objects, full_path, rel_path, MAX_FILE_CONTENT_SIZE) == CONTENT_FILE_TEXT;
+            if (ctx->cache) {
+                // Which strip rules apply depends on rel_path, which is not
+                // part of the cache key.
+                uint32_t rules = select_strip_rules(ctx, rel_path, regex);
+                uint64_t variant = cache_hash(ctx->content_options, &rules, sizeof(rules));
+                return content_file_open_cached(cf, ctx->cache, full_path, variant, MAX_FILE_CONTENT_SIZE) == CONTENT_FILE_TEXT;
+            }
+            return content_file_open(cf, full_path, MAX_FILE_CONTENT_SIZE) == CONTENT_FILE_TEXT;
+        }
+    }
+    return 0;
+}
+
+static const char* line_start_before(const char* lo, const char* p) {
+    while (p > lo && p[-1] != '\n') p--;
+    return p;
+}
+
+// Small writes produced while rewriting lines are gathered here so a file with
+// many CRLF lines costs a few sink writes instead of two per line.
+// It also carries the line state from one span of text to the next: whether
+// the last line was blank, and a line a span ended in the middle of.
+typedef struct {
+    out_sink* sink;
+    int src_fd;
+    off_t src_off;
+    const char* base;
+    int previous_line_was_blank;
+    int line_open;
+    int line_kept;
+    int held_cr;
+    int stopped;
+    size_t len;
+    char data[16 * 1024];
+} line_stage;
+
+// base is where the file is mapped, read from src_fd at src_off.
+static void stage_init(line_stage* st, out_sink* sink, const char* base, int src_fd, off_t src_off) {
+    st->sink = sink;
+    st->src_fd = src_fd;
+    st->src_off = src_off;
+    st->base = base;
+    st->previous_line_was_blank = 0;
+    st->line_open = 0;
+    st->line_kept = 0;
+    st->held_cr = 0;
+    st->stopped = 0;
+    st->len = 0;
+}
+
+static void stage_flush(line_stage* st) {
+    sink_write(st->sink, st->data, st->len);
+    st->len = 0;
+}
+
+static void stage_write(line_stage* st, const char* s, size_t n) {
+    if (st->len + n > sizeof(st->data)) {
+        stage_flush(st);
+        if (n > sizeof(st->data)) {
+            sink_write(st->sink, s, n);
+            return;
+        }
+    }
+    memcpy(st->data + st->len, s, n);
+    st->len += n;
+}
+
+// Unchanged input: large spans go through the zero-copy path.
+static void stage_span(line_stage* st, const char* s, size_t n) {
+    if (n < ZERO_COPY_MIN_SIZE) {
+        stage_write(st, s, n);
+        return;
+    }
+    stage_flush(st);
+    sink_write_file_range(st->sink, st->src_fd, st->src_off + (s - st->base), s, n);
+}
+
+// Emits text line by line: one trailing CR is dropped, runs of blank lines
+// collapse into one, output stops at the first NUL and the last line always
+// ends in a newline. find_line_event() skips over stretches that contain no
+// CR, NUL or empty line, so only the lines around those bytes are looked at
+// one by one; everything else is written as contiguous spans, and a file
+// without such lines goes out in a single write. src_fd is the file data was
+// read from, or -1 when data does not mirror the file.
+static void emit_lines(line_stage* st, const char* data, size_t len) {
+    const char* p = data;
+    const char* end = data + len;
+    const char* span = data;
+    int previous_line_was_blank = st->previous_line_was_blank;
+
+    while (p < end) {
+        if (!previous_line_was_blank && *p != '\n') {
+            const char* event = find_line_event(p, end);
+            if (event == end) {
+                if (end[-1] == '\n') {
+                    p = end;
+                    break;
+                }
+                // The unterminated last line still needs its newline.
+                p = line_start_before(p, end);
+            }
+            else if (*event == '\n') {
+                // The line after this newline is empty; it is the first blank
+                // line of its run and is handled below.
+                p = event + 1;
+                continue;
+            }
+            else if (*event == '\r' && event + 1 < end && event[1] == '\n' && event != p && event[-1] != '\n') {
+                // CRLF ending a non-blank line: everything since the span
+                // start is unchanged up to the CR.
+                stage_span(st, span, (size_t)(event - span));
+                stage_write(st, "\n", 1);
+                p = event + 2;
+                span = p;
+                continue;
+            }
+            else {
+                if (*event == '\0') end = event;
+                p = line_start_before(p, event);
+                if (p == end) break;
+            }
+        }
+
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        size_t line_len = eol ? (size_t)(eol - p) : (size_t)(end - p);
+        const char* nul = memchr(p, '\0', line_len);
+        if (nul) {
+            end = nul;
+            eol = NULL;
+            line_len = (size_t)(nul - p);
+            if (line_len == 0) break;
+        }
+        size_t kept_len = line_len;
+        if (kept_len > 0 && p[kept_len - 1] == '\r') kept_len--;
+        const char* next = eol ? eol + 1 : end;
+
+        int blank = (kept_len == 0);
+        int dropped = blank && previous_line_was_blank;
+        previous_line_was_blank = blank;
+
+        if (!dropped && kept_len == line_len && eol) {
+            p = next;
+            continue;
+        }
+
+        if (dropped) {
+            stage_span(st, span, (size_t)(p - span));
+        }
+        else {
+            stage_span(st, span, (size_t)(p - span) + kept_len);
+            stage_write(st, "\n", 1);
+        }
+        p = next;
+        span = next;
+    }
+    stage_span(st, span, (size_t)(p - span));
+    st->previous_line_was_blank = previous_line_was_blank;
+    st->stopped = end != data + len;
+}
+
+void emit_text_lines(out_sink* sink, const char* data, size_t len, int src_fd, off_t src_off) {
+    line_stage st;
+    stage_init(&st, sink, data, src_fd, src_off);
+    emit_lines(&st, data, len);
+    stage_flush(&st);
+}
+
+// Adds part of a line that a span ends in; a CR at its end is held back
+// until the next span shows whether the newline follows.
+static void stage_line_part(line_stage* st, const char* s, const char* stop) {
+    if (s == stop) return;
+    st->line_open = 1;
+    if (st->held_cr) {
+        stage_write(st, "\r", 1);
+        st->held_cr = 0;
+        st->line_kept = 1;
+    }
+    if (stop[-1] == '\r') {
+        stop--;
+        st->held_cr = 1;
+    }
+    if (stop > s) {
+        stage_span(st, s, (size_t)(stop - s));
+        st->line_kept = 1;
+    }
+}
+
+static void stage_line_end(line_stage* st) {
+    int blank = !st->line_kept;
+    if (!blank || !st->previous_line_was_blank) stage_write(st, "\n", 1);
+    st->previous_line_was_blank = blank;
+    st->line_open = 0;
+    st->line_kept = 0;
+    st->held_cr = 0;
+}
+
+// Emits what is left of a file between strip matches one span at a time,
+// with the same result as emit_text_lines() on the spans joined together:
+// whole lines go through emit_lines(), and only the lines that a cut runs
+// through are put together here. stage_finish() ends the last one.
+static void emit_text_span(line_stage* st, const char* s, size_t n) {
+    const char* end = s + n;
+    if (st->stopped) return;
+    if (st->line_open) {
+        const char* eol = memchr(s, '\n', n);
+        const char* stop = eol ? eol : end;
+        const char* nul = memchr(s, '\0', (size_t)(stop - s));
+        if (nul) {
+            stage_line_part(st, s, nul);
+            st->stopped = 1;
+            return;
+        }
+        stage_line_part(st, s, stop);
+        if (!eol) return;
+        stage_line_end(st);
+        s = eol + 1;
+    }
+    const char* tail = line_start_before(s, end);
+    if (tail > s) {
+        emit_lines(st, s, (size_t)(tail - s));
+        if (st->stopped) return;
+    }
+    const char* nul = memchr(tail, '\0', (size_t)(end - tail));
+    stage_line_part(st, tail, nul ? nul : end);
+    if (nul) st->stopped = 1;
+}
+
+static void stage_finish(line_stage* st) {
+    if (st->line_open) stage_line_end(st);
+    stage_flush(st);
+}
+
+
+static void write_file_content_block(const content_file* cf, const char* rel_path, recap_context* ctx, regex_scratch* regex, out_sink* sink) {
+    sink_printf(sink, "%s:\n", rel_path);
+    if (cf->status == -2) {
+        sink_printf(sink, "[File content too large to process (>%dMB)]\n", MAX_FILE_CONTENT_SIZE / (1024 * 1024));
+        return;
+    }
+    if (cf->status != 0) {
+        sink_puts(sink, "[Error reading file content]\n");
+        return;
+    }
+    if (cf->processed) {
+        emit_text_lines(sink, cf->data, cf->len, -1, 0);
+        return;
+    }
+
+    // Most files come out of stripping in one piece, which is compacted on
+    // several threads or written with the zero-copy path as a whole.
+    strip_pass sp;
+    strip_begin(&sp, ctx, select_strip_rules(ctx, rel_path, regex), regex, cf->data, cf->len);
+    size_t span_start = 0;
+    size_t span_len = 0;
+    size_t next_start = 0;
+    size_t next_len = 0;
+    int cut = strip_next(&sp, &span_start, &span_len) && strip_next(&sp, &next_start, &next_len);
+
+    if (ctx->compact_output) {
+        // Compacted lines are final, so they bypass emit_text_lines(). To be
+        // cached they are collected first unless sink is a buffer already.
+        out_sink staged;
+        out_sink* target = sink;
+        if (cf->cache_path && sink->stream) {
+            sink_init_buffer(&staged);
+            target = &staged;
+        }
+        size_t start = target->len;
+        compact_stream cs;
+        compact_stream_init(&cs, rel_path, target);
+        if (!cut) {
+            compact_stream_complete(&cs, cf->data + span_start, span_len, ctx->jobs);
+        }
+        else {
+            compact_stream_feed(&cs, cf->data + span_start, span_len);
+            do {
+                compact_stream_feed(&cs, cf->data + next_start, next_len);
+            } while (strip_next(&sp, &next_start, &next_len));
+            compact_stream_finish(&cs);
+        }
+        if (cf->cache_path && !target->failed) {
+            cache_put_file(ctx->cache, cf->cache_path, cf->variant, &cf->stamp, 0, target->data ? target->data + start : "", target->len - start);
+        }
+        if (target != sink) {
+            sink_write(sink, staged.data, staged.len);
+            sink_free(&staged);
+        }
+        return;
+    }
+
+    if (!cut) {
+        if (cf->cache_path) cache_put_file(ctx->cache, cf->cache_path, cf->variant, &cf->stamp, 0, cf->data + span_start, span_len);
+        emit_text_lines(sink, cf->data + span_start, span_len, cf->fd, (off_t)span_start);
+        return;
+    }
+
+    // The cache stores the stripped text before emit_text_lines(), so for
+    // it alone the spans are also gathered.
+    out_sink kept;
+    sink_init_buffer(&kept);
+    line_stage st;
+    stage_init(&st, sink, cf->data, cf->fd, 0);
+    if (cf->cache_path) sink_write(&kept, cf->data + span_start, span_len);
+    emit_text_span(&st, cf->data + span_start, span_len);
+    do {
+        if (cf->cache_path) sink_write(&kept, cf->data + next_start, next_len);
+        emit_text_span(&st, cf->data + next_start, next_len);
+    } while (strip_next(&sp, &next_start, &next_len));
+    stage_finish(&st);
+    if (cf->cache_path && !kept.failed) {
+        cache_put_file(ctx->cache, cf->cache_path, cf->variant, &cf->stamp, 0, kept.data ? kept.data : "", kept.len);
+    }
+    sink_free(&kept);
+}
+
+// Renders the content block of one matched file into block and returns
+// whether its content is shown; a file listed by path only leaves it empty.
+int output_render(recap_context* ctx, regex_scratch* regex, const char* full_path, const char* rel_path, out_sink* block) {
+    content_file cf;
+    int show_content = should_show_content(rel_path, full_path, ctx, regex, &cf);
+    if (show_content) {
+        write_file_content_block(&cf, rel_path, ctx, regex, block);
+    }
+    content_file_close(&cf);
+    return show_content;
+}
+
+typedef struct {
+    char* full_path;
+    char* rel_path;
+    int show_content;
+    int done;
+    int deferring;
+    out_sink block;
+} content_job;
+
+// Content blocks are rendered by worker threads into per-file buffers. Jobs
+// live in a ring that doubles as the reorder buffer: they are claimed in
+// submission order and written strictly from the head, so the output is the
+// same as the serial path. Workers stop claiming new jobs while the rendered
+// but unwritten bytes exceed the in-flight budget. When the output can take
+// file ranges from the kernel, blocks leave large unchanged ranges out (see
+// sink_write_file_range()) and the writer moves them as it drains the ring;
+// up to PIPELINE_MAX_DEFERRED_FILES blocks at a time hold their file open.
+struct content_pipeline {
+    recap_context* ctx;
+    content_job* jobs;
+    size_t capacity;
+    size_t head;
+    size_t next_claim;
+    size_t tail;
+    size_t inflight_bytes;
+    size_t max_inflight_bytes;
+    int defer_ranges;
+    int deferring;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_t* threads;
+    int thread_count;
+};
+
+static void* pipeline_worker(void* arg) {
+    content_pipeline* p = arg;
+    regex_scratch regex;
+    int have_regex = regex_scratch_init(&regex) == 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!(p->stopping && p->next_claim == p->tail) &&
+               (p->next_claim == p->tail || p->inflight_bytes >= p->max_inflight_bytes)) {
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        }
+        if (p->next_claim == p->tail) break;
+
+        content_job* job = &p->jobs[p->next_claim % p->capacity];
+        p->next_claim++;
+        job->deferring = p->defer_ranges && p->deferring < PIPELINE_MAX_DEFERRED_FILES;
+        if (job->deferring) p->deferring++;
+        pthread_mutex_unlock(&p->lock);
+
+        sink_init_buffer(&job->block);
+        job->block.defer_ranges = job->deferring;
+        if (have_regex) {
+            job->show_content = output_render(p->ctx, &regex, job->full_path, job->rel_path, &job->block);
+        }
+        else {
+            job->show_content = 1;
+            sink_printf(&job->block, "%s:\n[Error reading file content]\n", job->rel_path);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (job->deferring && job->block.range_count == 0) {
+            p->deferring--;
+            job->deferring = 0;
+        }
+        job->done = 1;
+        p->inflight_bytes += job->block.len;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    regex_scratch_free(&regex);
+    return NULL;
+}
+
+static void emit_entry(output_state* out, const char* rel_path, int show_content, const out_sink* block);
+
+// Writes every finished job at the head of the ring, waiting until at least
+// the jobs before min_head are out.
+static void pipeline_drain(content_pipeline* p, output_state* out, size_t min_head) {
+    pthread_mutex_lock(&p->lock);
+    while (p->head < p->tail) {
+        content_job* job = &p->jobs[p->head % p->capacity];
+        if (!job->done) {
+            if (p->head >= min_head) break;
+            pthread_cond_wait(&p->done_cond, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        emit_entry(out, job->rel_path, job->show_content, &job->block);
+        size_t written = job->block.len;
+        sink_free(&job->block);
+        free(job->full_path);
+        free(job->rel_path);
+
+        pthread_mutex_lock(&p->lock);
+        if (job->deferring) p->deferring--;
+        p->inflight_bytes -= written;
+        p->head++;
+        pthread_cond_broadcast(&p->work_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pipeline_submit(content_pipeline* p, output_state* out, const char* full_path, const char* rel_path) {
+    pipeline_drain(p, out, 0);
+    if (p->tail - p->head == p->capacity) {
+        pipeline_drain(p, out, p->head + 1);
+    }
+
+    content_job* job = &p->jobs[p->tail % p->capacity];
+    memset(job, 0, sizeof(*job));
+    job->full_path = strdup(full_path);
+    job->rel_path = strdup(rel_path);
+    if (!job->full_path || !job->rel_path) {
+        free(job->full_path);
+        free(job->rel_path);
+        emit_entry(out, rel_path, 0, NULL);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->tail++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pipeline_destroy(content_pipeline* p) {
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->thread_count; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    free(p->threads);
+    free(p->jobs);
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+static content_pipeline* pipeline_create(recap_context* ctx, int thread_count, int defer_ranges) {
+    content_pipeline* p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->ctx = ctx;
+    p->defer_ranges = defer_ranges;
+    p->capacity = PIPELINE_QUEUE_SIZE;
+    p->max_inflight_bytes = ctx->max_inflight_bytes ? ctx->max_inflight_bytes : DEFAULT_MAX_INFLIGHT_BYTES;
+    p->jobs = calloc(p->capacity, sizeof(content_job));
+    p->threads = calloc((size_t)thread_count, sizeof(pthread_t));
+    if (!p->jobs || !p->threads) {
+        free(p->jobs);
+        free(p->threads);
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&p->threads[i], NULL, pipeline_worker, p) != 0) break;
+        p->thread_count++;
+    }
+    if (p->thread_count == 0) {
+        pipeline_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+
+static void emit_entry(output_state* out, const char* rel_path, int show_content, const out_sink* block) {
+    recap_context* ctx = out->ctx;
+
+    if (out->include_content_mode) {
+        if (show_content) {
+            if (out->content_blocks > 0) {
+                fprintf(ctx->output_stream, "---\n");
+            }
+            if (block) {
+                sink_write_block(&out->sink, block);
+            }
+            else {
+                write_file_content_block(out->pending_file, rel_path, ctx, &out->regex, &out->sink);
+            }
+            out->content_blocks++;
+            out->last_output_was_content = 1;
+        }
+        else {
+            if (out->last_output_was_content) {
+                fprintf(ctx->output_stream, "---\n");
+            }
+            fprintf(ctx->output_stream, "%s\n", rel_path);
+            out->last_output_was_content = 0;
+        }
+        return;
+    }
+
+    fprintf(ctx->output_stream, "%s\n", rel_path);
+}
+
+int output_begin(output_state* out, recap_context* ctx) {
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    out->include_content_mode = (ctx->content_include_filters.count > 0);
+    sink_init_stream(&out->sink, ctx->output_stream);
+    if (regex_scratch_init(&out->regex) != 0) {
+        fprintf(stderr, "Error: Could not allocate regex match data.\n");
+        return -1;
+    }
+    // Watch mode renders and keeps the blocks itself.
+    if (out->include_content_mode && ctx->jobs > 1 && !ctx->watch) {
+        out->pipeline = pipeline_create(ctx, ctx->jobs, out->sink.zero_copy != SINK_COPY);
+    }
+    return 0;
+}
+
+void output_entry(output_state* out, const char* full_path, const char* rel_path) {
+    if (out->pipeline) {
+        pipeline_submit(out->pipeline, out, full_path, rel_path);
+        return;
+    }
+    content_file cf;
+    int show_content = out->include_content_mode && should_show_content(rel_path, full_path, out->ctx, &out->regex, &cf);
+    out->pending_file = &cf;
+    emit_entry(out, rel_path, show_content, NULL);
+    out->pending_file = NULL;
+    if (out->include_content_mode) content_file_close(&cf);
+}
+
+void output_rendered(output_state* out, const char* rel_path, int show_content, const out_sink* block) {
+    emit_entry(out, rel_path, show_content, block);
+}
+
+void output_end(output_state* out) {
+    if (out->pipeline) {
+        pipeline_drain(out->pipeline, out, out->pipeline->tail);
+        pipeline_destroy(out->pipeline);
+        out->pipeline = NULL;
+    }
+    if (out->ctx->show_stats && out->include_content_mode && !out->ctx->watch) {
+        fprintf(stderr, "Stats: %zu bytes of file content moved by the kernel\n", out->sink.zero_copy_bytes);
+    }
+    regex_scratch_free(&out->regex);
+}
+
+void print_output(recap_context* ctx) {
+    output_state out;
+    if (output_begin(&out, ctx) != 0) return;
+    path_buf full = {0};
+    path_buf rel = {0};
+    for (size_t i = 0; i < ctx->matched_files.count; i++) {
+        const path_entry* entry = &ctx->matched_files.items[i];
+        if (path_entry_full_path(entry, &full) != 0 || path_entry_rel_path(entry, &rel) != 0) {
+            fprintf(stderr, "Error: Could not allocate memory for path output.\n");
+            break;
+        }
+        output_entry(&out, full.data, rel.data);
+    }
+    output_end(&out);
+    path_buf_free(&full);
+    path_buf_free(&rel);
+}
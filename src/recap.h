@@ -6,45 +6,211 @@
 #include <pcre2.h>
 #include <sys/stat.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "lib/memlst.h"
 
 #define MAX_PATH_SIZE 4096
 #define MAX_PATTERNS 256
 #define MAX_SCOPED_STRIP_RULES 32
-#define MAX_GITIGNORE_ENTRIES 1024
 #define MAX_FILE_CONTENT_SIZE (10 * 1024 * 1024) // 10MB
+#define DEFAULT_CACHE_DIR ".recap-cache"
+#define MAX_JOBS 256
+#define DIR_SCAN_BUFFER_SIZE (64 * 1024)
+#define PIPELINE_QUEUE_SIZE 1024
+#define PIPELINE_MAX_DEFERRED_FILES 64
+#define DEFAULT_MAX_INFLIGHT_BYTES (64 * 1024 * 1024)
+#define ZERO_COPY_MIN_SIZE (64 * 1024)
+#define DEFAULT_WATCH_DEBOUNCE_MS 50
 
+// Bump allocator for path strings; everything is released at once.
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk;
+
+typedef struct {
+    arena_chunk* head;
+} str_arena;
+
+// full path = prefix + (rel path with the first rel_skip bytes removed)
+typedef struct {
+    size_t prefix_len;
+    size_t rel_skip;
+    char prefix[];
+} path_root;
+
+// A directory shared by the files below it; rel ends in '/' or is empty.
 typedef struct {
-    char* full_path;
-    char* rel_path;
+    const path_root* root;
+    size_t rel_len;
+    char rel[];
+} path_dir;
+
+typedef struct {
+    const path_dir* dir;
+    const char* name;
+    size_t name_len;
 } path_entry;
 
 typedef struct {
     path_entry* items;
     size_t count;
     size_t capacity;
+    str_arena arena;
 } path_list;
 
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} path_buf;
+
+enum {
+    DIR_ENTRY_UNKNOWN,
+    DIR_ENTRY_DIR,
+    DIR_ENTRY_REG,
+    DIR_ENTRY_OTHER
+};
+
+// File identity checked before a cache entry is reused.
+typedef struct {
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+    uint64_t ino;
+    uint64_t dev;
+} cache_stamp;
+
+#define CACHE_HASH_SEED 0xcbf29ce484222325ull
+
+typedef struct recap_cache recap_cache;
+
+// Directory reader: getdents64/statx relative to the directory fd on Linux,
+// opendir/readdir/lstat elsewhere. On Linux a directory is opened by name
+// from its parent's fd when the walker still holds it. With a cache,
+// listings of directories whose stamp is unchanged are replayed from it
+// (the directory is then only opened if a file in it is), and fresh
+// listings are recorded into it.
+typedef struct {
+    int fd;
+    void* dir;
+    char* buf;
+    long nread;
+    long pos;
+    path_buf path;
+    int at_fd;
+    size_t at_name;
+    int fd_shared;
+    recap_cache* cache;
+    path_buf key;
+    cache_stamp stamp;
+    const char* listing;
+    const char* listing_pos;
+    const char* listing_end;
+    int recording;
+    int at_end;
+    path_buf recorded;
+} dir_scan;
+
+typedef struct regex_dfa regex_dfa;
+typedef struct regex_literals regex_literals;
+
+// Patterns that reduce to literals go into a hash index and those in the
+// common regex subset are compiled together into regex set DFAs (see
+// regex_set.c); fallback lists the ones matched with PCRE2.
 typedef struct {
     pcre2_code* compiled[MAX_PATTERNS];
-    pcre2_match_data* match_data[MAX_PATTERNS];
+    char* sources[MAX_PATTERNS];
     int count;
+    regex_literals* literals;
+    regex_dfa* dfas[MAX_PATTERNS];
+    int dfa_count;
+    int fallback[MAX_PATTERNS];
+    int fallback_count;
     memlst_t destructors;
 } regex_ctx;
 
+// Per-thread matching state: match data plus a match context that carries a
+// private JIT stack.
 typedef struct {
-    const char* patterns[MAX_PATTERNS];
-    int count;
-} fnmatch_ctx;
+    pcre2_match_data* match_data;
+    pcre2_match_context* match_context;
+    pcre2_jit_stack* jit_stack;
+} regex_scratch;
+
+typedef struct gitignore gitignore;
+
+enum {
+    GITIGNORE_NONE = 0,
+    GITIGNORE_EXCLUDE,
+    GITIGNORE_INCLUDE
+};
+
+// Sequential reader over a mapped .git/index (versions 2 to 4).
+typedef struct {
+    char* data;
+    size_t len;
+    size_t pos;
+    uint32_t remaining;
+    int version;
+    size_t id_size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    path_buf name;
+    path_buf unmerged;
+} git_index;
+
+// Paths are relative to the work tree; stat fields are truncated to 32 bits
+// as git stores them.
+typedef struct {
+    const char* path;
+    size_t path_len;
+    const unsigned char* oid;
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    int assume_unchanged;
+    int intent_to_add;
+} git_index_entry;
+
+// Object ids read from the object store are SHA-1; SHA-256 repositories
+// are not supported there.
+#define GIT_OID_SIZE 20
+
+enum {
+    GIT_OBJ_COMMIT = 1,
+    GIT_OBJ_TREE,
+    GIT_OBJ_BLOB,
+    GIT_OBJ_TAG
+};
+
+typedef struct git_odb git_odb;
 
 typedef struct {
     pcre2_code* path_regex;
     pcre2_code* strip_regex;
-    pcre2_match_data* path_match_data;
-    pcre2_match_data* strip_match_data;
+    const char* path_source;
+    const char* strip_source;
 } scoped_strip_rule;
 
+typedef struct {
+    size_t directories_scanned;
+    size_t entries_seen;
+    size_t files_matched;
+    size_t subtrees_pruned;
+    size_t include_checks;
+    size_t include_checks_avoided;
+} traversal_stats;
+
 typedef struct {
     char output_dir[MAX_PATH_SIZE];
     char output_name[MAX_PATH_SIZE];
@@ -64,12 +230,40 @@ typedef struct {
     regex_ctx content_include_filters;
     regex_ctx content_exclude_filters;
 
-    fnmatch_ctx fnmatch_exclude_filters;
-    char gitignore_entries[MAX_GITIGNORE_ENTRIES][MAX_PATH_SIZE];
-    int gitignore_entry_count;
+    gitignore* ignore_rules;
+    // Name of the per-directory ignore files picked up during the walk; NULL
+    // without --git.
+    const char* gitignore_name;
+    int gitignore_at_cwd;
+
+    // List tracked files from .git/index instead of walking; changed_only
+    // keeps the ones whose content no longer matches the index.
+    int use_git_index;
+    int changed_only;
+
+    // With --rev, files come from this commit's tree; their full paths hold
+    // blob ids for the content readers to load from objects.
+    const char* rev;
+    git_odb* objects;
+
+    // --cache: directory listings and processed content kept between runs.
+    const char* cache_dir;
+    char cache_rel_path[MAX_PATH_SIZE];
+    recap_cache* cache;
+    uint64_t content_options;
+
+    // --watch: after the first walk, rewrite the output whenever inotify
+    // reports changes. The walk then also collects every directory it
+    // scanned into watch_dirs.
+    int watch;
+    int watch_debounce_ms;
+    path_list watch_dirs;
+
+    // --serve: answer requests on this Unix socket until interrupted.
+    const char* serve_path;
 
     pcre2_code* strip_regex;
-    pcre2_match_data* strip_match_data;
+    const char* strip_source;
 
     scoped_strip_rule scoped_strip_rules[MAX_SCOPED_STRIP_RULES];
     int scoped_strip_rule_count;
@@ -84,26 +278,302 @@ typedef struct {
     FILE* output_stream;
     int copy_to_clipboard;
     int compact_output;
+    int jobs;
+    size_t max_inflight_bytes;
+    int show_stats;
+    int stream_output;
+    traversal_stats stats;
 
 } recap_context;
 
-void parse_arguments(int argc, char* argv[], recap_context* ctx);
+// A file range a buffer sink left out: len bytes at offset off of the
+// sink's src_fd belong before data[at].
+typedef struct {
+    size_t at;
+    off_t off;
+    size_t len;
+} sink_range;
+
+typedef struct {
+    FILE* stream;
+    int fd;
+    int zero_copy;
+    char* data;
+    size_t len;
+    size_t cap;
+    int failed;
+    // With defer_ranges, a buffer sink keeps large unchanged ranges of one
+    // file as ranges of a duplicate of its descriptor, src_fd, so that
+    // sink_write_block() can have the kernel move them to the stream.
+    int defer_ranges;
+    int src_fd;
+    int deferred_from;
+    sink_range* ranges;
+    size_t range_count;
+    size_t range_cap;
+    // Bytes a stream sink had the kernel move.
+    size_t zero_copy_bytes;
+} out_sink;
+
+typedef struct {
+    int fd;
+    int status;
+    const char* data;
+    size_t len;
+    char* heap;
+    void* map;
+    // processed: data was read from the cache already stripped and
+    // compacted. Otherwise cache_path is set when the processed content
+    // should be recorded under stamp and variant.
+    int processed;
+    const char* cache_path;
+    cache_stamp stamp;
+    uint64_t variant;
+} content_file;
+
+enum {
+    CONTENT_FILE_BINARY = 0,
+    CONTENT_FILE_TEXT
+};
+
+#define SCAN_SET_MAX 8
+
+// Up to SCAN_SET_MAX distinct bytes for the scan_set_finder() function.
+// bytes is padded with repeats of the first one; member is the same set as
+// a lookup table.
+typedef struct {
+    int count;
+    char bytes[SCAN_SET_MAX];
+    unsigned char member[256];
+} scan_set;
+
+typedef const char* (*scan_set_find_fn)(const scan_set* set, const char* p, const char* end);
+
+// How --compact treats whitespace in code outside strings and comments.
+enum {
+    LANGUAGE_KEEP_SPACE = 0, // drop only trailing whitespace and empty lines
+    LANGUAGE_COLLAPSE_SPACE, // keep a space only where two words would merge
+    LANGUAGE_MINIFY          // drop all of it
+};
+
+#define LANGUAGE_MAX 32
+#define LANGUAGE_MAX_STRINGS 4
+
+// string_rule flags
+#define STRING_ESCAPES 0x1 // a backslash escapes the next byte
+#define STRING_DOUBLED 0x2 // the quote written twice stands for itself
+
+// language_def flags
+#define LANGUAGE_NESTED_COMMENTS 0x001
+#define LANGUAGE_COMMENT_AFTER_SPACE 0x002 // line comments start at a line start or after whitespace
+#define LANGUAGE_QUOTE_AFTER_SPACE 0x004   // so do strings, or after one of "[{,:" (YAML)
+#define LANGUAGE_RUST_RAW 0x008            // r"..." and r#"..."#
+#define LANGUAGE_SWIFT_RAW 0x010           // #"..."#
+#define LANGUAGE_CPP_RAW 0x020             // R"delimiter(...)delimiter"
+#define LANGUAGE_VERBATIM_AT 0x040         // @"..." without escapes (C#)
+#define LANGUAGE_LUA_LONG 0x080            // [==[...]==] strings and --[[...]] comments
+#define LANGUAGE_CHAR_LITERALS 0x100       // 'x' is a character, 'a alone a lifetime (Rust)
+#define LANGUAGE_BLOCK_SCALARS 0x200       // lines under "key: |" are content (YAML)
+
+typedef struct {
+    const char* quote; // opens and closes the string
+    int flags;
+} string_rule;
+
+// A language as --compact lexes it. The table is in languages.c.
+typedef struct {
+    const char* name;
+    const char* keys;
+    int whitespace;
+    int flags;
+    const char* line_comments[2];
+    const char* block_open;
+    const char* block_close;
+    string_rule strings[LANGUAGE_MAX_STRINGS];
+} language_def;
+
+// Enough to decide any token: comment markers, quotes and raw string
+// delimiters are shorter.
+#define COMPACT_LOOKAHEAD 32
+#define COMPACT_SNIFF_MAX 128
+
+struct compact_sets;
+
+// --compact state for one file. Input may arrive in any number of chunks;
+// comment and whitespace stripping and the trimming of trailing whitespace
+// happen in a single pass, and finished lines go to sink through stage.
+// Bytes past committed are whitespace that is dropped if the line ends
+// before anything else is written.
+typedef struct {
+    out_sink* sink;
+    const language_def* language; // NULL copies lines as they are
+    const struct compact_sets* sets;
+    int whitespace, flags; // of language
+    int ended;
+    int sniffing; // no language by name; the first line may have a shebang
+    int mode, depth, esc;
+    int escapes, doubled; // of the current string
+    const scan_set* body; // bytes that matter in the current string or comment
+    scan_set_find_fn find; // looked up once per stream
+    char close[COMPACT_LOOKAHEAD];
+    size_t close_len;
+    int pending_space, last_ident;
+    int gap; // a comment was removed right after a word
+    int first_line;
+    int scalar_indicator, counting_indent, indent, scalar_indent;
+    const char* lex_start;
+    unsigned before; // the last bytes lexed before lex_start, newest in the low byte
+    char carry[COMPACT_LOOKAHEAD]; // bytes waiting for the next chunk to be classified
+    size_t carry_len;
+    char head[COMPACT_SNIFF_MAX];
+    size_t head_len;
+    int line_has_text;
+    char* stage;
+    size_t len, cap, committed;
+    char local_stage[16 * 1024];
+} compact_stream;
+
+typedef struct content_pipeline content_pipeline;
+
+typedef struct {
+    recap_context* ctx;
+    int include_content_mode;
+    int content_blocks;
+    int last_output_was_content;
+    regex_scratch regex;
+    const content_file* pending_file;
+    out_sink sink;
+    content_pipeline* pipeline;
+} output_state;
+
+// parse_arguments results: go on and run, exit successfully (after --help,
+// --version or --clear), or fail.
+enum {
+    ARGS_RUN = 0,
+    ARGS_DONE,
+    ARGS_FAILED
+};
+
+int parse_arguments(int argc, char* argv[], recap_context* ctx);
+int parse_request_arguments(int argc, char* argv[], recap_context* ctx, FILE* errors_out);
+int regex_cache_init(void);
+void regex_cache_free(void);
 void load_gitignore(recap_context* ctx, const char* gitignore_filename);
 void clear_recap_output_files(const char* target_dir);
 void free_regex_ctx(regex_ctx* ctx);
 
 int start_traversal(recap_context* ctx);
+int watch_run(recap_context* ctx);
+int serve_run(recap_context* ctx);
+
+gitignore* gitignore_create(void);
+void gitignore_free(gitignore* gi);
+int gitignore_set_root(gitignore* gi, const char* root, const char* base);
+int gitignore_add_line(gitignore* gi, const char* line, size_t len);
+int gitignore_load(gitignore* gi, const char* path);
+gitignore* gitignore_from_fd(int fd);
+int gitignore_match_local(const gitignore* gi, const char* path, int is_dir);
+int gitignore_match(const gitignore* gi, const char* rel_path, int is_dir, int check_parents);
+
+int git_repo_find(const char* cwd, path_buf* work_tree, path_buf* git_dir);
+int git_index_open(git_index* idx, const char* git_dir);
+int git_index_next(git_index* idx, git_index_entry* entry);
+int git_index_entry_changed(const git_index* idx, const git_index_entry* entry, const char* path, const struct stat* st);
+void git_index_close(git_index* idx);
+git_odb* git_odb_open(const char* git_dir);
+void git_odb_free(git_odb* odb);
+int git_odb_read(git_odb* odb, const unsigned char* oid, int* type, char** data, size_t* len);
+int git_odb_resolve_tree(git_odb* odb, const char* rev, unsigned char* tree);
+int git_oid_from_hex(const char* hex, unsigned char* oid);
+void git_oid_to_hex(const unsigned char* oid, char* hex);
+
+recap_cache* cache_open(const char* dir, const char* cwd);
+void cache_close(recap_cache* cache);
+void cache_print_stats(const recap_cache* cache);
+size_t cache_pending(const recap_cache* cache);
+uint64_t cache_hash(uint64_t h, const void* data, size_t len);
+void cache_stamp_from_stat(cache_stamp* stamp, const struct stat* st);
+int cache_stamp_settled(const recap_cache* cache, const cache_stamp* stamp);
+const char* cache_find_dir(recap_cache* cache, const char* path, const cache_stamp* stamp, size_t* len);
+void cache_put_dir(recap_cache* cache, const char* path, const cache_stamp* stamp, const char* listing, size_t len);
+int cache_find_file(recap_cache* cache, const char* path, uint64_t variant, const cache_stamp* stamp, int* status, const char** data, size_t* len);
+void cache_put_file(recap_cache* cache, const char* path, uint64_t variant, const cache_stamp* stamp, int status, const char* data, size_t len);
 
-int is_text_file(const char* full_path);
+int regex_scratch_init(regex_scratch* scratch);
+void regex_scratch_free(regex_scratch* scratch);
+int regex_ctx_build_set(regex_ctx* ctx);
+int match_regex_index(const regex_ctx* ctx, const char* str, regex_scratch* scratch);
+int match_regex_list(const regex_ctx* ctx, const char* str, regex_scratch* scratch);
+
+void sink_init_stream(out_sink* sink, FILE* stream);
+void sink_init_buffer(out_sink* sink);
+void sink_write(out_sink* sink, const void* data, size_t len);
+void sink_puts(out_sink* sink, const char* s);
+void sink_printf(out_sink* sink, const char* fmt, ...);
+void sink_write_file_range(out_sink* sink, int src_fd, off_t off, const char* data, size_t len);
+void sink_write_block(out_sink* sink, const out_sink* block);
+void sink_free(out_sink* sink);
+void emit_text_lines(out_sink* sink, const char* data, size_t len, int src_fd, off_t src_off);
+
+enum {
+    TEXT_SCAN_SCALAR = 0,
+    TEXT_SCAN_SSE2,
+    TEXT_SCAN_AVX2
+};
+
+const char* find_line_event(const char* p, const char* end);
+void scan_set_init(scan_set* set, const char* bytes, size_t count);
+scan_set_find_fn scan_set_finder(void);
+int text_scan_select(int level);
+int text_scan_level(void);
+
+int output_begin(output_state* out, recap_context* ctx);
+void output_entry(output_state* out, const char* full_path, const char* rel_path);
+int output_render(recap_context* ctx, regex_scratch* regex, const char* full_path, const char* rel_path, out_sink* block);
+void output_rendered(output_state* out, const char* rel_path, int show_content, const out_sink* block);
+void output_end(output_state* out);
+void print_output(recap_context* ctx);
+uint64_t content_options_hash(const recap_context* ctx);
+int default_job_count(void);
+
+int has_binary_extension(const char* path);
+int content_file_open(content_file* cf, const char* path, size_t max_bytes);
+int content_file_open_cached(content_file* cf, recap_cache* cache, const char* path, uint64_t variant, size_t max_bytes);
+int content_file_open_blob(content_file* cf, git_odb* odb, const char* hex_id, const char* name, size_t max_bytes);
+void content_file_close(content_file* cf);
 void normalize_path(char* path);
 int generate_output_filename(output_ctx* output_context);
 void get_relative_path(const char* full_path, const char* cwd, char* rel_path_out, size_t size);
 
+void* arena_alloc(str_arena* arena, size_t size);
+void arena_free(str_arena* arena);
+
 int path_list_init(path_list* list);
+const path_root* path_list_add_root(path_list* list, const char* prefix, size_t prefix_len, size_t rel_skip);
+const path_dir* path_list_add_dir(path_list* list, const path_root* root, const char* rel, size_t rel_len);
+int path_list_add_file(path_list* list, const path_dir* dir, const char* name, size_t name_len);
 int path_list_add(path_list* list, const char* full_path, const char* rel_path);
+int path_entry_rel_path(const path_entry* entry, path_buf* out);
+int path_entry_full_path(const path_entry* entry, path_buf* out);
+int path_list_append(path_list* dst, path_list* src);
 void path_list_free(path_list* list);
 void path_list_sort(path_list* list);
 
+int path_buf_reserve(path_buf* buf, size_t min_capacity);
+int path_buf_push(path_buf* buf, const char* s, size_t n);
+void path_buf_truncate(path_buf* buf, size_t len);
+void path_buf_free(path_buf* buf);
+
+int dir_scan_init(dir_scan* scan);
+void dir_scan_free(dir_scan* scan);
+int dir_scan_open(dir_scan* scan, int root_fd, const char* root_path, const char* tail, int parent_fd);
+int dir_scan_next(dir_scan* scan, const char** name, int* type);
+int dir_scan_resolve_type(dir_scan* scan, const char* name);
+int dir_scan_open_file(dir_scan* scan, const char* name);
+int dir_scan_share_fd(dir_scan* scan);
+void dir_scan_close(dir_scan* scan);
+int open_root_dir(const char* path);
+
 int read_file_into_buffer(const char* path, size_t max_bytes, char** out_buf, size_t* out_len);
 
 char* upload_to_gist(const char* filepath, const char* github_token);
@@ -112,6 +582,14 @@ int program_exists(const char* name);
 
 int copy_file_content_to_clipboard(const char* filepath);
 
-char* apply_compact_transformations(const char* content, const char* filename);
+void compact_stream_init(compact_stream* cs, const char* filename, out_sink* sink);
+void compact_stream_feed(compact_stream* cs, const char* data, size_t len);
+void compact_stream_finish(compact_stream* cs);
+void compact_stream_complete(compact_stream* cs, const char* data, size_t len, int jobs);
+
+size_t language_count(void);
+const language_def* language_at(size_t index);
+const language_def* language_for_path(const char* path);
+const language_def* language_for_shebang(const char* line, size_t len);
 
 #endif
@@ -0,0 +1,1353 @@
+#include "recap.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGEX_JIT_STACK_START (32 * 1024)
+#define REGEX_JIT_STACK_MAX (1024 * 1024)
+
+// Limits for the combined automaton. A set whose DFA would grow past
+// DFA_MAX_STATES is split in two; a single pattern that still does not fit is
+// matched with PCRE2 instead.
+#define NFA_MAX_STATES 20000
+#define DFA_MAX_STATES 4096
+#define MAX_REPEAT_COUNT 64
+
+int regex_scratch_init(regex_scratch* scratch) {
+    memset(scratch, 0, sizeof(*scratch));
+    scratch->match_data = pcre2_match_data_create(1, NULL);
+    scratch->match_context = pcre2_match_context_create(NULL);
+    if (!scratch->match_data || !scratch->match_context) {
+        regex_scratch_free(scratch);
+        return -1;
+    }
+    // Without a stack of its own, JIT code is limited to a 32K block on the
+    // machine stack, which long paths or strip patterns over whole files can
+    // exhaust. Failing to get one just leaves the default in place.
+    scratch->jit_stack = pcre2_jit_stack_create(REGEX_JIT_STACK_START, REGEX_JIT_STACK_MAX, NULL);
+    if (scratch->jit_stack) {
+        pcre2_jit_stack_assign(scratch->match_context, NULL, scratch->jit_stack);
+    }
+    return 0;
+}
+
+void regex_scratch_free(regex_scratch* scratch) {
+    if (scratch->match_data) pcre2_match_data_free(scratch->match_data);
+    if (scratch->match_context) pcre2_match_context_free(scratch->match_context);
+    if (scratch->jit_stack) pcre2_jit_stack_free(scratch->jit_stack);
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+/*
+ * Regex set: the patterns of a regex_ctx that only use the common subset
+ * (literals, ., classes, \d \w \s, groups, alternation, greedy or lazy
+ * quantifiers, ^ $ \A \z \Z) are parsed into one Thompson NFA and turned into
+ * a DFA when the options are parsed. A path is then matched against all of
+ * them in a single pass over its bytes. Everything else (back references,
+ * lookaround, inline options, \b, ...) stays with PCRE2. The semantics are
+ * those of PCRE2 with default options on byte strings: . excludes \n, $ and
+ * \Z also match before a final \n, and \s includes \v.
+ */
+
+typedef struct {
+    uint8_t bits[32];
+} byte_set;
+
+enum {
+    AST_SET,
+    AST_CONCAT,
+    AST_ALT,
+    AST_REPEAT,
+    AST_ASSERT,
+    AST_EMPTY
+};
+
+enum {
+    ASSERT_BEGIN,
+    ASSERT_EOL,
+    ASSERT_END
+};
+
+typedef struct ast_node {
+    int type;
+    int arg;
+    int min;
+    int max;
+    struct ast_node* child;
+    struct ast_node* next;
+} ast_node;
+
+enum {
+    NFA_SET,
+    NFA_SPLIT,
+    NFA_ASSERT,
+    NFA_MATCH
+};
+
+typedef struct {
+    int type;
+    int arg;
+    int out1;
+    int out2;
+} nfa_state;
+
+typedef struct {
+    str_arena arena;
+    byte_set* sets;
+    int set_count;
+    int set_cap;
+    nfa_state* states;
+    int state_count;
+    int state_cap;
+    const char* p;
+    int unsupported;
+} set_builder;
+
+struct regex_dfa {
+    uint8_t byte_class[256];
+    int class_count;
+    int state_count;
+    int* trans;
+    int* accept;
+    int* eol_trans;
+    int* eol_accept;
+    int* end_accept;
+};
+
+#define DFA_DEAD (-2)
+
+static void set_add(byte_set* s, int c) {
+    s->bits[c >> 3] |= (uint8_t)(1u << (c & 7));
+}
+
+static int set_has(const byte_set* s, int c) {
+    return (s->bits[c >> 3] >> (c & 7)) & 1;
+}
+
+static void set_add_range(byte_set* s, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) set_add(s, c);
+}
+
+static void set_invert(byte_set* s) {
+    for (int i = 0; i < 32; i++) s->bits[i] = (uint8_t)~s->bits[i];
+}
+
+static void set_union(byte_set* dst, const byte_set* src) {
+    for (int i = 0; i < 32; i++) dst->bits[i] |= src->bits[i];
+}
+
+static int builder_add_set(set_builder* b, const byte_set* s) {
+    if (b->set_count == b->set_cap) {
+        int cap = b->set_cap ? b->set_cap * 2 : 32;
+        byte_set* sets = realloc(b->sets, (size_t)cap * sizeof(byte_set));
+        if (!sets) {
+            b->unsupported = 1;
+            return 0;
+        }
+        b->sets = sets;
+        b->set_cap = cap;
+    }
+    b->sets[b->set_count] = *s;
+    return b->set_count++;
+}
+
+static ast_node* new_node(set_builder* b, int type) {
+    ast_node* n = arena_alloc(&b->arena, sizeof(ast_node));
+    if (!n) {
+        b->unsupported = 1;
+        return NULL;
+    }
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+static ast_node* set_node(set_builder* b, const byte_set* s) {
+    ast_node* n = new_node(b, AST_SET);
+    if (n) n->arg = builder_add_set(b, s);
+    return n;
+}
+
+// \d \w \s and their negations; returns 0 if c is not a class escape.
+static int class_escape(int c, byte_set* out) {
+    memset(out, 0, sizeof(*out));
+    switch (c) {
+    case 'd':
+    case 'D':
+        set_add_range(out, '0', '9');
+        break;
+    case 'w':
+    case 'W':
+        set_add_range(out, '0', '9');
+        set_add_range(out, 'A', 'Z');
+        set_add_range(out, 'a', 'z');
+        set_add(out, '_');
+        break;
+    case 's':
+    case 'S':
+        set_add_range(out, '\t', '\r');
+        set_add(out, ' ');
+        break;
+    default:
+        return 0;
+    }
+    if (c == 'D' || c == 'W' || c == 'S') set_invert(out);
+    return 1;
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Single-character escapes shared by classes and the pattern body. p points
+// at the character after the backslash; returns the byte value or -1.
+static int char_escape(set_builder* b) {
+    int c = (unsigned char)*b->p;
+    switch (c) {
+    case 't':
+        b->p++;
+        return '\t';
+    case 'n':
+        b->p++;
+        return '\n';
+    case 'r':
+        b->p++;
+        return '\r';
+    case 'f':
+        b->p++;
+        return '\f';
+    case 'e':
+        b->p++;
+        return 0x1b;
+    case 'a':
+        b->p++;
+        return 0x07;
+    case 'x': {
+        const char* q = b->p + 1;
+        int value = 0;
+        if (*q == '{') {
+            q++;
+            int digits = 0;
+            while (hex_value((unsigned char)*q) >= 0 && digits < 2) {
+                value = value * 16 + hex_value((unsigned char)*q++);
+                digits++;
+            }
+            if (*q != '}' || digits == 0) return -1;
+            q++;
+        }
+        else {
+            for (int digits = 0; digits < 2 && hex_value((unsigned char)*q) >= 0; digits++) {
+                value = value * 16 + hex_value((unsigned char)*q++);
+            }
+        }
+        b->p = q;
+        return value;
+    }
+    default:
+        if (c != '\0' && !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+            b->p++;
+            return c;
+        }
+        return -1;
+    }
+}
+
+static ast_node* parse_class(set_builder* b) {
+    byte_set s;
+    memset(&s, 0, sizeof(s));
+    int negate = 0;
+    if (*b->p == '^') {
+        negate = 1;
+        b->p++;
+    }
+    int first = 1;
+    while (*b->p && (*b->p != ']' || first)) {
+        first = 0;
+        int lo;
+        if (*b->p == '[' && (b->p[1] == ':' || b->p[1] == '.' || b->p[1] == '=')) {
+            b->unsupported = 1;
+            return NULL;
+        }
+        if (*b->p == '\\') {
+            b->p++;
+            byte_set esc;
+            if (class_escape((unsigned char)*b->p, &esc)) {
+                b->p++;
+                set_union(&s, &esc);
+                continue;
+            }
+            if (*b->p == 'b') {
+                b->p++;
+                lo = 0x08;
+            }
+            else if ((lo = char_escape(b)) < 0) {
+                b->unsupported = 1;
+                return NULL;
+            }
+        }
+        else {
+            lo = (unsigned char)*b->p++;
+        }
+
+        int hi = lo;
+        if (b->p[0] == '-' && b->p[1] != ']' && b->p[1] != '\0') {
+            b->p++;
+            if (*b->p == '\\') {
+                b->p++;
+                if ((hi = char_escape(b)) < 0) {
+                    b->unsupported = 1;
+                    return NULL;
+                }
+            }
+            else if (*b->p == '[') {
+                b->unsupported = 1;
+                return NULL;
+            }
+            else {
+                hi = (unsigned char)*b->p++;
+            }
+            if (hi < lo) {
+                b->unsupported = 1;
+                return NULL;
+            }
+        }
+        set_add_range(&s, lo, hi);
+    }
+    if (*b->p != ']') {
+        b->unsupported = 1;
+        return NULL;
+    }
+    b->p++;
+    if (negate) set_invert(&s);
+    return set_node(b, &s);
+}
+
+static ast_node* parse_alt(set_builder* b);
+
+static ast_node* parse_atom(set_builder* b) {
+    int c = (unsigned char)*b->p;
+    byte_set s;
+    switch (c) {
+    case '(': {
+        if (b->p[1] == '*') break;
+        if (b->p[1] == '?') {
+            if (b->p[2] != ':') break;
+            b->p += 3;
+        }
+        else {
+            b->p++;
+        }
+        ast_node* inner = parse_alt(b);
+        if (!inner || *b->p != ')') break;
+        b->p++;
+        return inner;
+    }
+    case '[':
+        b->p++;
+        return parse_class(b);
+    case '.':
+        b->p++;
+        memset(&s, 0xff, sizeof(s));
+        s.bits['\n' >> 3] &= (uint8_t) ~(1u << ('\n' & 7));
+        return set_node(b, &s);
+    case '^':
+    case '$': {
+        b->p++;
+        ast_node* n = new_node(b, AST_ASSERT);
+        if (n) n->arg = c == '^' ? ASSERT_BEGIN : ASSERT_EOL;
+        return n;
+    }
+    case '\\': {
+        b->p++;
+        int e = (unsigned char)*b->p;
+        if (class_escape(e, &s)) {
+            b->p++;
+            return set_node(b, &s);
+        }
+        if (e == 'A' || e == 'z' || e == 'Z') {
+            b->p++;
+            ast_node* n = new_node(b, AST_ASSERT);
+            if (n) n->arg = e == 'A' ? ASSERT_BEGIN : (e == 'z' ? ASSERT_END : ASSERT_EOL);
+            return n;
+        }
+        int v = char_escape(b);
+        if (v < 0) break;
+        memset(&s, 0, sizeof(s));
+        set_add(&s, v);
+        return set_node(b, &s);
+    }
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '\0':
+        break;
+    default:
+        b->p++;
+        memset(&s, 0, sizeof(s));
+        set_add(&s, c);
+        return set_node(b, &s);
+    }
+    b->unsupported = 1;
+    return NULL;
+}
+
+static int parse_count(set_builder* b, int* out) {
+    if (*b->p < '0' || *b->p > '9') return 0;
+    int v = 0;
+    while (*b->p >= '0' && *b->p <= '9') {
+        v = v * 10 + (*b->p++ - '0');
+        if (v > MAX_REPEAT_COUNT) return 0;
+    }
+    *out = v;
+    return 1;
+}
+
+static ast_node* parse_repeat(set_builder* b) {
+    ast_node* atom = parse_atom(b);
+    if (!atom) return NULL;
+
+    int min;
+    int max;
+    switch (*b->p) {
+    case '*':
+        min = 0;
+        max = -1;
+        b->p++;
+        break;
+    case '+':
+        min = 1;
+        max = -1;
+        b->p++;
+        break;
+    case '?':
+        min = 0;
+        max = 1;
+        b->p++;
+        break;
+    case '{':
+        b->p++;
+        if (!parse_count(b, &min)) {
+            b->unsupported = 1;
+            return NULL;
+        }
+        max = min;
+        if (*b->p == ',') {
+            b->p++;
+            max = -1;
+            if (*b->p != '}' && (!parse_count(b, &max) || max < min)) {
+                b->unsupported = 1;
+                return NULL;
+            }
+        }
+        if (*b->p != '}') {
+            b->unsupported = 1;
+            return NULL;
+        }
+        b->p++;
+        break;
+    default:
+        return atom;
+    }
+
+    // Lazy quantifiers accept the same strings; possessive ones do not.
+    if (*b->p == '?') b->p++;
+    if (atom->type == AST_ASSERT || *b->p == '+' || *b->p == '*' || *b->p == '?' || *b->p == '{') {
+        b->unsupported = 1;
+        return NULL;
+    }
+    ast_node* n = new_node(b, AST_REPEAT);
+    if (!n) return NULL;
+    n->child = atom;
+    n->min = min;
+    n->max = max;
+    return n;
+}
+
+static ast_node* parse_concat(set_builder* b) {
+    ast_node* head = NULL;
+    ast_node** tail = &head;
+    while (*b->p && *b->p != '|' && *b->p != ')') {
+        ast_node* n = parse_repeat(b);
+        if (!n) return NULL;
+        *tail = n;
+        tail = &n->next;
+    }
+    if (!head) return new_node(b, AST_EMPTY);
+    if (!head->next) return head;
+    ast_node* n = new_node(b, AST_CONCAT);
+    if (n) n->child = head;
+    return n;
+}
+
+static ast_node* parse_alt(set_builder* b) {
+    ast_node* first = parse_concat(b);
+    if (!first || *b->p != '|') return first;
+    ast_node* n = new_node(b, AST_ALT);
+    if (!n) return NULL;
+    n->child = first;
+    ast_node** tail = &first->next;
+    while (*b->p == '|') {
+        b->p++;
+        ast_node* alt = parse_concat(b);
+        if (!alt) return NULL;
+        *tail = alt;
+        tail = &alt->next;
+    }
+    return n;
+}
+
+static ast_node* parse_pattern(set_builder* b, const char* source) {
+    b->p = source;
+    b->unsupported = 0;
+    ast_node* n = parse_alt(b);
+    if (!n || b->unsupported || *b->p != '\0') return NULL;
+    return n;
+}
+
+static int add_state(set_builder* b, int type, int arg, int out1, int out2) {
+    if (b->unsupported || b->state_count >= NFA_MAX_STATES) {
+        b->unsupported = 1;
+        return -1;
+    }
+    if (b->state_count == b->state_cap) {
+        int cap = b->state_cap ? b->state_cap * 2 : 256;
+        nfa_state* states = realloc(b->states, (size_t)cap * sizeof(nfa_state));
+        if (!states) {
+            b->unsupported = 1;
+            return -1;
+        }
+        b->states = states;
+        b->state_cap = cap;
+    }
+    nfa_state* s = &b->states[b->state_count];
+    s->type = type;
+    s->arg = arg;
+    s->out1 = out1;
+    s->out2 = out2;
+    return b->state_count++;
+}
+
+static int compile_node(set_builder* b, const ast_node* n, int next);
+
+static int compile_list(set_builder* b, const ast_node* n, int next) {
+    if (!n) return next;
+    int rest = compile_list(b, n->next, next);
+    return rest < 0 ? -1 : compile_node(b, n, rest);
+}
+
+// Builds the states for n so that they continue at next; returns the entry.
+static int compile_node(set_builder* b, const ast_node* n, int next) {
+    switch (n->type) {
+    case AST_SET:
+        return add_state(b, NFA_SET, n->arg, next, -1);
+    case AST_ASSERT:
+        return add_state(b, NFA_ASSERT, n->arg, next, -1);
+    case AST_EMPTY:
+        return next;
+    case AST_CONCAT:
+        return compile_list(b, n->child, next);
+    case AST_ALT: {
+        int count = 0;
+        for (const ast_node* c = n->child; c; c = c->next) count++;
+        const ast_node* alts[count];
+        int i = 0;
+        for (const ast_node* c = n->child; c; c = c->next) alts[i++] = c;
+        int cur = compile_node(b, alts[count - 1], next);
+        for (i = count - 2; i >= 0 && cur >= 0; i--) {
+            int start = compile_node(b, alts[i], next);
+            if (start < 0) return -1;
+            cur = add_state(b, NFA_SPLIT, 0, start, cur);
+        }
+        return cur;
+    }
+    case AST_REPEAT: {
+        int cur = next;
+        if (n->max < 0) {
+            int split = add_state(b, NFA_SPLIT, 0, -1, next);
+            if (split < 0) return -1;
+            int body = compile_node(b, n->child, split);
+            if (body < 0) return -1;
+            b->states[split].out1 = body;
+            cur = split;
+        }
+        else {
+            for (int i = n->min; i < n->max && cur >= 0; i++) {
+                int body = compile_node(b, n->child, cur);
+                if (body < 0) return -1;
+                cur = add_state(b, NFA_SPLIT, 0, body, cur);
+            }
+        }
+        for (int i = 0; i < n->min && cur >= 0; i++) {
+            cur = compile_node(b, n->child, cur);
+        }
+        return cur;
+    }
+    default:
+        return -1;
+    }
+}
+
+/* DFA construction */
+
+typedef struct {
+    int* items;
+    int count;
+} state_set;
+
+typedef struct {
+    set_builder* b;
+    const int* starts;
+    int start_count;
+    int* mark;
+    int generation;
+    int* stack;
+    int* buf;
+    // Interned NFA state sets, indexed by DFA state.
+    state_set* sets;
+    int* table;
+    int table_size;
+    regex_dfa* dfa;
+} dfa_builder;
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Epsilon closure of seeds into db->buf. begin: ^ may pass. end_mode: 0 keeps
+// $ and \z states for later; 1 lets $ pass (before a final \n); 2 lets $ and
+// \z pass (end of subject). Returns the number of states collected.
+static int closure(dfa_builder* db, const int* seeds, int seed_count, int begin, int end_mode) {
+    const nfa_state* states = db->b->states;
+    int top = 0;
+    int count = 0;
+    db->generation++;
+    for (int i = 0; i < seed_count; i++) {
+        if (seeds[i] >= 0 && db->mark[seeds[i]] != db->generation) {
+            db->mark[seeds[i]] = db->generation;
+            db->stack[top++] = seeds[i];
+        }
+    }
+    while (top > 0) {
+        int s = db->stack[--top];
+        const nfa_state* st = &states[s];
+        int follow[2] = {-1, -1};
+        switch (st->type) {
+        case NFA_SPLIT:
+            follow[0] = st->out1;
+            follow[1] = st->out2;
+            break;
+        case NFA_ASSERT:
+            if (st->arg == ASSERT_BEGIN) {
+                if (begin) follow[0] = st->out1;
+            }
+            else if (end_mode == 2 || (end_mode == 1 && st->arg == ASSERT_EOL)) {
+                follow[0] = st->out1;
+            }
+            else if (end_mode == 0) {
+                db->buf[count++] = s;
+            }
+            break;
+        default:
+            db->buf[count++] = s;
+            break;
+        }
+        for (int k = 0; k < 2; k++) {
+            int f = follow[k];
+            if (f >= 0 && db->mark[f] != db->generation) {
+                db->mark[f] = db->generation;
+                db->stack[top++] = f;
+            }
+        }
+    }
+    return count;
+}
+
+static int lowest_match(const dfa_builder* db, const int* items, int count) {
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+        const nfa_state* st = &db->b->states[items[i]];
+        if (st->type == NFA_MATCH && (best < 0 || st->arg < best)) best = st->arg;
+    }
+    return best;
+}
+
+static uint32_t hash_set(const int* items, int count) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < count; i++) {
+        h ^= (uint32_t)items[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int dfa_grow(regex_dfa* dfa, int needed) {
+    size_t n = (size_t)needed;
+    int* trans = realloc(dfa->trans, n * (size_t)dfa->class_count * sizeof(int));
+    if (!trans) return -1;
+    dfa->trans = trans;
+    int* accept = realloc(dfa->accept, n * sizeof(int));
+    if (!accept) return -1;
+    dfa->accept = accept;
+    int* eol_trans = realloc(dfa->eol_trans, n * sizeof(int));
+    if (!eol_trans) return -1;
+    dfa->eol_trans = eol_trans;
+    int* eol = realloc(dfa->eol_accept, n * sizeof(int));
+    if (!eol) return -1;
+    dfa->eol_accept = eol;
+    int* end = realloc(dfa->end_accept, n * sizeof(int));
+    if (!end) return -1;
+    dfa->end_accept = end;
+    return 0;
+}
+
+// Adds the state set in db->buf[0, count) unless it is already known; returns
+// its DFA index or -1 when the automaton grows too large.
+static int intern_state(dfa_builder* db, int count, int begin) {
+    qsort(db->buf, (size_t)count, sizeof(int), compare_ints);
+    uint32_t h = hash_set(db->buf, count);
+    int slot = (int)(h & (uint32_t)(db->table_size - 1));
+    if (!begin) {
+        while (db->table[slot] >= 0) {
+            const state_set* known = &db->sets[db->table[slot]];
+            if (known->count == count && memcmp(known->items, db->buf, (size_t)count * sizeof(int)) == 0) {
+                return db->table[slot];
+            }
+            slot = (slot + 1) & (db->table_size - 1);
+        }
+    }
+
+    regex_dfa* dfa = db->dfa;
+    if (dfa->state_count >= DFA_MAX_STATES) return -1;
+    int id = dfa->state_count;
+    if (dfa_grow(dfa, id + 1) != 0) return -1;
+    state_set* set = &db->sets[id];
+    set->items = arena_alloc(&db->b->arena, (size_t)(count ? count : 1) * sizeof(int));
+    if (!set->items) return -1;
+    memcpy(set->items, db->buf, (size_t)count * sizeof(int));
+    set->count = count;
+    if (!begin) db->table[slot] = id;
+    dfa->state_count++;
+
+    int accept = lowest_match(db, set->items, count);
+    dfa->accept[id] = accept >= 0 ? accept : (count == 0 ? DFA_DEAD : -1);
+    int n = closure(db, set->items, count, begin, 1);
+    dfa->eol_accept[id] = lowest_match(db, db->buf, n);
+    n = closure(db, set->items, count, begin, 2);
+    dfa->end_accept[id] = lowest_match(db, db->buf, n);
+    return id;
+}
+
+static void compute_byte_classes(regex_dfa* dfa, const set_builder* b) {
+    int cls[256];
+    memset(cls, 0, sizeof(cls));
+    int count = 1;
+    for (int i = 0; i < b->set_count; i++) {
+        // Split every class by membership in this set.
+        int remap[512];
+        for (int k = 0; k < 512; k++) remap[k] = -1;
+        int next = 0;
+        for (int c = 0; c < 256; c++) {
+            int key = cls[c] * 2 + set_has(&b->sets[i], c);
+            if (remap[key] < 0) remap[key] = next++;
+            cls[c] = remap[key];
+        }
+        count = next;
+    }
+    for (int c = 0; c < 256; c++) dfa->byte_class[c] = (uint8_t)cls[c];
+    dfa->class_count = count;
+}
+
+static void regex_dfa_free(regex_dfa* dfa) {
+    if (!dfa) return;
+    free(dfa->trans);
+    free(dfa->accept);
+    free(dfa->eol_trans);
+    free(dfa->eol_accept);
+    free(dfa->end_accept);
+    free(dfa);
+}
+
+// Consumes byte c from the NFA states in items and returns the DFA state that
+// follows, interning it if needed; -1 when the automaton grows too large.
+static int dfa_step(dfa_builder* db, const int* items, int count, int c, int* seeds) {
+    const set_builder* b = db->b;
+    int seed_count = 0;
+    for (int i = 0; i < count; i++) {
+        const nfa_state* st = &b->states[items[i]];
+        if (st->type == NFA_SET && set_has(&b->sets[st->arg], c)) seeds[seed_count++] = st->out1;
+    }
+    // A match may also start at the next position.
+    for (int i = 0; i < db->start_count; i++) seeds[seed_count++] = db->starts[i];
+    int n = closure(db, seeds, seed_count, 0, 0);
+    return intern_state(db, n, 0);
+}
+
+static regex_dfa* build_dfa(set_builder* b, const int* starts, int start_count) {
+    regex_dfa* dfa = calloc(1, sizeof(regex_dfa));
+    dfa_builder db;
+    memset(&db, 0, sizeof(db));
+    db.b = b;
+    db.starts = starts;
+    db.start_count = start_count;
+    db.dfa = dfa;
+    db.table_size = DFA_MAX_STATES * 2;
+    db.mark = calloc((size_t)b->state_count, sizeof(int));
+    db.stack = malloc((size_t)b->state_count * sizeof(int));
+    db.buf = malloc((size_t)(b->state_count + start_count) * sizeof(int));
+    db.sets = calloc(DFA_MAX_STATES, sizeof(state_set));
+    db.table = malloc((size_t)db.table_size * sizeof(int));
+    int* seeds = malloc((size_t)(b->state_count + start_count) * sizeof(int));
+    int* eol_items = malloc((size_t)b->state_count * sizeof(int));
+    int ok = dfa && db.mark && db.stack && db.buf && db.sets && db.table && seeds && eol_items;
+
+    if (ok) {
+        for (int i = 0; i < db.table_size; i++) db.table[i] = -1;
+        compute_byte_classes(dfa, b);
+        int representative[256];
+        for (int c = 255; c >= 0; c--) representative[dfa->byte_class[c]] = c;
+
+        int n = closure(&db, starts, start_count, 1, 0);
+        ok = intern_state(&db, n, 1) == 0;
+        for (int s = 0; ok && s < dfa->state_count; s++) {
+            int* row = &dfa->trans[(size_t)s * (size_t)dfa->class_count];
+            // Matching stops in accepting and dead states.
+            if (dfa->accept[s] != -1) {
+                for (int k = 0; k < dfa->class_count; k++) row[k] = s;
+                dfa->eol_trans[s] = s;
+                continue;
+            }
+            for (int k = 0; ok && k < dfa->class_count; k++) {
+                const state_set* set = &db.sets[s];
+                int target = dfa_step(&db, set->items, set->count, representative[k], seeds);
+                if (target < 0) {
+                    ok = 0;
+                    break;
+                }
+                // dfa_step may have moved dfa->trans.
+                dfa->trans[(size_t)s * (size_t)dfa->class_count + (size_t)k] = target;
+            }
+            if (ok) {
+                // A final \n: $ and \Z may pass before the pattern consumes it.
+                const state_set* set = &db.sets[s];
+                n = closure(&db, set->items, set->count, s == 0, 1);
+                memcpy(eol_items, db.buf, (size_t)n * sizeof(int));
+                int target = dfa_step(&db, eol_items, n, '\n', seeds);
+                if (target < 0) ok = 0;
+                else dfa->eol_trans[s] = target;
+            }
+        }
+    }
+
+    free(seeds);
+    free(eol_items);
+    free(db.mark);
+    free(db.stack);
+    free(db.buf);
+    free(db.sets);
+    free(db.table);
+    if (!ok) {
+        regex_dfa_free(dfa);
+        return NULL;
+    }
+    return dfa;
+}
+
+static int dfa_match(const regex_dfa* dfa, const char* str) {
+    const unsigned char* p = (const unsigned char*)str;
+    int s = 0;
+    while (1) {
+        int accept = dfa->accept[s];
+        if (accept >= 0) return accept;
+        if (accept == DFA_DEAD) return -1;
+        if (*p == '\0') return dfa->end_accept[s];
+        if (*p == '\n' && p[1] == '\0') {
+            if (dfa->eol_accept[s] >= 0) return dfa->eol_accept[s];
+            s = dfa->eol_trans[s];
+            p++;
+            continue;
+        }
+        s = dfa->trans[(size_t)s * (size_t)dfa->class_count + dfa->byte_class[*p++]];
+    }
+}
+
+/*
+ * Literal index: patterns that reduce to a finite set of literals anchored as
+ * a suffix (\.(c|h)$), a prefix (^(obj|test)/), the whole path (^a\.c$) or a
+ * path component (/node_modules/, (^|/)vendor(/|$)) are answered with hash
+ * lookups instead of being matched. $ and \z only agree with "ends with"
+ * when the subject does not end in \n, so such subjects bypass the index.
+ */
+
+#define LITERAL_MAX_STRINGS 64
+#define LITERAL_MAX_LEN 255
+
+enum {
+    LITERAL_EXACT,
+    LITERAL_PREFIX,
+    LITERAL_SUFFIX,
+    // Component kinds; +1 when a '/' must precede, +2 when one must follow.
+    LITERAL_COMPONENT
+};
+
+typedef struct {
+    const char* items[LITERAL_MAX_STRINGS];
+    int lens[LITERAL_MAX_STRINGS];
+    int count;
+} literal_set;
+
+typedef struct {
+    uint32_t hash;
+    int kind;
+    int len;
+    int pattern;
+    const char* str;
+} literal_entry;
+
+struct regex_literals {
+    str_arena arena;
+    literal_entry* slots;
+    uint32_t mask;
+    int entry_count;
+    int prefix_lens[LITERAL_MAX_LEN + 1];
+    int prefix_len_count;
+    int suffix_lens[LITERAL_MAX_LEN + 1];
+    int suffix_len_count;
+    unsigned component_kinds;
+    int has_exact;
+};
+
+static int literal_set_add(set_builder* b, literal_set* out, const char* str, int len) {
+    if (out->count >= LITERAL_MAX_STRINGS || len > LITERAL_MAX_LEN) return -1;
+    char* copy = arena_alloc(&b->arena, (size_t)len + 1);
+    if (!copy) return -1;
+    memcpy(copy, str, (size_t)len);
+    copy[len] = '\0';
+    out->items[out->count] = copy;
+    out->lens[out->count++] = len;
+    return 0;
+}
+
+// out = a x b, every string of a followed by every string of b.
+static int literal_set_product(set_builder* b, const literal_set* a, const literal_set* c, literal_set* out) {
+    char buf[2 * LITERAL_MAX_LEN];
+    out->count = 0;
+    for (int i = 0; i < a->count; i++) {
+        for (int j = 0; j < c->count; j++) {
+            int len = a->lens[i] + c->lens[j];
+            if (len > LITERAL_MAX_LEN) return -1;
+            memcpy(buf, a->items[i], (size_t)a->lens[i]);
+            memcpy(buf + a->lens[i], c->items[j], (size_t)c->lens[j]);
+            if (literal_set_add(b, out, buf, len) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static int expand_literals(set_builder* b, const ast_node* n, literal_set* out);
+
+static int expand_concat(set_builder* b, const ast_node* first, const ast_node* stop, literal_set* out) {
+    out->count = 0;
+    if (literal_set_add(b, out, "", 0) != 0) return -1;
+    for (const ast_node* c = first; c != stop; c = c->next) {
+        literal_set part;
+        literal_set acc = *out;
+        if (expand_literals(b, c, &part) != 0 || literal_set_product(b, &acc, &part, out) != 0) return -1;
+    }
+    return 0;
+}
+
+// Expands n into the finite set of strings it matches; fails on anything
+// unbounded, on assertions and on \n.
+static int expand_literals(set_builder* b, const ast_node* n, literal_set* out) {
+    out->count = 0;
+    switch (n->type) {
+    case AST_EMPTY:
+        return literal_set_add(b, out, "", 0);
+    case AST_SET:
+        for (int c = 0; c < 256; c++) {
+            if (!set_has(&b->sets[n->arg], c)) continue;
+            char ch = (char)c;
+            if (c == '\n' || literal_set_add(b, out, &ch, 1) != 0) return -1;
+        }
+        return 0;
+    case AST_CONCAT:
+        return expand_concat(b, n->child, NULL, out);
+    case AST_ALT:
+        for (const ast_node* c = n->child; c; c = c->next) {
+            literal_set part;
+            if (expand_literals(b, c, &part) != 0) return -1;
+            for (int i = 0; i < part.count; i++) {
+                if (literal_set_add(b, out, part.items[i], part.lens[i]) != 0) return -1;
+            }
+        }
+        return 0;
+    case AST_REPEAT: {
+        if (n->max < 0) return -1;
+        literal_set child;
+        literal_set power;
+        if (expand_literals(b, n->child, &child) != 0) return -1;
+        power.count = 0;
+        if (literal_set_add(b, &power, "", 0) != 0) return -1;
+        for (int k = 0; k <= n->max; k++) {
+            if (k >= n->min) {
+                for (int i = 0; i < power.count; i++) {
+                    if (literal_set_add(b, out, power.items[i], power.lens[i]) != 0) return -1;
+                }
+            }
+            if (k < n->max) {
+                literal_set acc = power;
+                if (literal_set_product(b, &acc, &child, &power) != 0) return -1;
+            }
+        }
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+static int is_assert(const ast_node* n, int begin) {
+    if (n->type != AST_ASSERT) return 0;
+    return begin ? n->arg == ASSERT_BEGIN : n->arg != ASSERT_BEGIN;
+}
+
+static int is_single_byte(const set_builder* b, const ast_node* n, int c) {
+    if (n->type != AST_SET || !set_has(&b->sets[n->arg], c)) return 0;
+    for (int i = 0; i < 32; i++) {
+        uint8_t expected = (i == (c >> 3)) ? (uint8_t)(1u << (c & 7)) : 0;
+        if (b->sets[n->arg].bits[i] != expected) return 0;
+    }
+    return 1;
+}
+
+// (^|/) when begin is set, (/|$) otherwise, in either order.
+static int is_component_boundary(const set_builder* b, const ast_node* n, int begin) {
+    if (n->type != AST_ALT) return 0;
+    const ast_node* x = n->child;
+    const ast_node* y = x ? x->next : NULL;
+    if (!x || !y || y->next) return 0;
+    return (is_assert(x, begin) && is_single_byte(b, y, '/')) || (is_assert(y, begin) && is_single_byte(b, x, '/'));
+}
+
+enum {
+    EDGE_NONE,
+    EDGE_ANCHOR,
+    EDGE_BOUNDARY
+};
+
+typedef struct {
+    int kind;
+    literal_set strings;
+} literal_form;
+
+// Reduces one top-level alternative to literals of a single kind.
+static int reduce_alternative(set_builder* b, const ast_node* n, literal_form* form) {
+    const ast_node* first = n;
+    const ast_node* single_next = n->next;
+    if (n->type == AST_CONCAT) {
+        first = n->child;
+        single_next = NULL;
+    }
+    const ast_node* stop = n->type == AST_CONCAT ? NULL : single_next;
+
+    int left = EDGE_NONE;
+    if (first != stop && is_assert(first, 1)) left = EDGE_ANCHOR;
+    else if (first != stop && is_component_boundary(b, first, 1)) left = EDGE_BOUNDARY;
+    if (left != EDGE_NONE) first = first->next;
+
+    // The right edge is the last node of the remaining list.
+    const ast_node* last = NULL;
+    for (const ast_node* c = first; c != stop; c = c->next) last = c;
+    int right = EDGE_NONE;
+    if (last && is_assert(last, 0)) right = EDGE_ANCHOR;
+    else if (last && is_component_boundary(b, last, 0)) right = EDGE_BOUNDARY;
+    if (right != EDGE_NONE) stop = last;
+
+    literal_set* s = &form->strings;
+    if (expand_concat(b, first, stop, s) != 0) return -1;
+
+    if (left == EDGE_ANCHOR && right == EDGE_ANCHOR) form->kind = LITERAL_EXACT;
+    else if (left == EDGE_ANCHOR && right == EDGE_NONE) form->kind = LITERAL_PREFIX;
+    else if (left == EDGE_NONE && right == EDGE_ANCHOR) form->kind = LITERAL_SUFFIX;
+    else if (left == EDGE_ANCHOR || right == EDGE_ANCHOR) return -1;
+    else {
+        // A component: strip the '/' a plain literal carries on either side.
+        int lead = left == EDGE_NONE;
+        int trail = right == EDGE_NONE;
+        for (int i = 0; i < s->count; i++) {
+            const char* str = s->items[i];
+            int len = s->lens[i];
+            if (len < lead + trail + 1) return -1;
+            if ((lead && str[0] != '/') || (trail && str[len - 1] != '/')) return -1;
+            if (memchr(str + lead, '/', (size_t)(len - lead - trail))) return -1;
+            s->items[i] = str + lead;
+            s->lens[i] = len - lead - trail;
+        }
+        form->kind = LITERAL_COMPONENT + lead + 2 * trail;
+    }
+    return 0;
+}
+
+static uint32_t literal_hash(int kind, const char* str, int len) {
+    uint32_t h = 2166136261u ^ (uint32_t)kind;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int literal_lookup(const regex_literals* lit, int kind, const char* str, int len) {
+    uint32_t h = literal_hash(kind, str, len);
+    for (uint32_t slot = h & lit->mask;; slot = (slot + 1) & lit->mask) {
+        const literal_entry* e = &lit->slots[slot];
+        if (!e->str) return -1;
+        if (e->hash == h && e->kind == kind && e->len == len && memcmp(e->str, str, (size_t)len) == 0) {
+            return e->pattern;
+        }
+    }
+}
+
+static void add_length(int* lens, int* count, int len) {
+    for (int i = 0; i < *count; i++) {
+        if (lens[i] == len) return;
+    }
+    lens[(*count)++] = len;
+}
+
+static void regex_literals_free(regex_literals* lit) {
+    if (!lit) return;
+    free(lit->slots);
+    arena_free(&lit->arena);
+    free(lit);
+}
+
+// Inserts the strings of form for pattern; the first pattern to claim a
+// literal keeps it. The table must have room for all of them.
+static int regex_literals_insert(regex_literals* lit, const literal_form* form, int pattern) {
+    for (int i = 0; i < form->strings.count; i++) {
+        int len = form->strings.lens[i];
+        char* str = arena_alloc(&lit->arena, (size_t)len + 1);
+        if (!str) return -1;
+        memcpy(str, form->strings.items[i], (size_t)len);
+        uint32_t h = literal_hash(form->kind, str, len);
+        uint32_t slot = h & lit->mask;
+        while (lit->slots[slot].str) {
+            const literal_entry* e = &lit->slots[slot];
+            if (e->hash == h && e->kind == form->kind && e->len == len && memcmp(e->str, str, (size_t)len) == 0) break;
+            slot = (slot + 1) & lit->mask;
+        }
+        if (!lit->slots[slot].str) {
+            literal_entry* e = &lit->slots[slot];
+            e->hash = h;
+            e->kind = form->kind;
+            e->len = len;
+            e->pattern = pattern;
+            e->str = str;
+            lit->entry_count++;
+        }
+        if (form->kind == LITERAL_PREFIX) add_length(lit->prefix_lens, &lit->prefix_len_count, len);
+        else if (form->kind == LITERAL_SUFFIX) add_length(lit->suffix_lens, &lit->suffix_len_count, len);
+        else if (form->kind == LITERAL_EXACT) lit->has_exact = 1;
+        else lit->component_kinds |= 1u << (form->kind - LITERAL_COMPONENT);
+    }
+    return 0;
+}
+
+// Returns the pattern of a literal matching str, -1 when none does and -2
+// when str ends in \n and the index cannot answer.
+static int literal_match(const regex_literals* lit, const char* str) {
+    int len = (int)strlen(str);
+    if (len > 0 && str[len - 1] == '\n') return -2;
+    int hit;
+    if (lit->has_exact && (hit = literal_lookup(lit, LITERAL_EXACT, str, len)) >= 0) return hit;
+    for (int i = 0; i < lit->prefix_len_count; i++) {
+        int l = lit->prefix_lens[i];
+        if (l <= len && (hit = literal_lookup(lit, LITERAL_PREFIX, str, l)) >= 0) return hit;
+    }
+    for (int i = 0; i < lit->suffix_len_count; i++) {
+        int l = lit->suffix_lens[i];
+        if (l <= len && (hit = literal_lookup(lit, LITERAL_SUFFIX, str + len - l, l)) >= 0) return hit;
+    }
+    if (lit->component_kinds) {
+        const char* start = str;
+        const char* end = str + len;
+        while (1) {
+            const char* slash = memchr(start, '/', (size_t)(end - start));
+            const char* stop = slash ? slash : end;
+            int has_left = start != str;
+            int has_right = slash != NULL;
+            for (int v = 0; v < 4; v++) {
+                if (!(lit->component_kinds & (1u << v))) continue;
+                if (((v & 1) && !has_left) || ((v & 2) && !has_right)) continue;
+                if ((hit = literal_lookup(lit, LITERAL_COMPONENT + v, start, (int)(stop - start))) >= 0) return hit;
+            }
+            if (!slash) break;
+            start = slash + 1;
+        }
+    }
+    return -1;
+}
+
+static int literal_grow(regex_literals* lit) {
+    uint32_t size = lit->mask ? (lit->mask + 1) * 2 : 64;
+    literal_entry* slots = calloc(size, sizeof(literal_entry));
+    if (!slots) return -1;
+    for (uint32_t i = 0; lit->slots && i <= lit->mask; i++) {
+        const literal_entry* e = &lit->slots[i];
+        if (!e->str) continue;
+        uint32_t slot = e->hash & (size - 1);
+        while (slots[slot].str) slot = (slot + 1) & (size - 1);
+        slots[slot] = *e;
+    }
+    free(lit->slots);
+    lit->slots = slots;
+    lit->mask = size - 1;
+    return 0;
+}
+
+#define LITERAL_MAX_FORMS 16
+
+// Adds pattern to the literal index if every top-level alternative of ast
+// reduces to literals; returns 1 when it did.
+static int add_literal_pattern(regex_ctx* ctx, set_builder* parser, const ast_node* ast, int pattern) {
+    literal_form forms[LITERAL_MAX_FORMS];
+    int form_count = 0;
+    const ast_node* alt = ast->type == AST_ALT ? ast->child : ast;
+    for (; alt; alt = ast->type == AST_ALT ? alt->next : NULL) {
+        if (form_count == LITERAL_MAX_FORMS || reduce_alternative(parser, alt, &forms[form_count]) != 0) return 0;
+        form_count++;
+    }
+
+    if (!ctx->literals) {
+        regex_literals* lit = calloc(1, sizeof(regex_literals));
+        if (!lit) return 0;
+        if (!memlst_add(&ctx->destructors, (dtor_fn)regex_literals_free, lit)) {
+            free(lit);
+            return 0;
+        }
+        ctx->literals = lit;
+    }
+    regex_literals* lit = ctx->literals;
+    for (int i = 0; i < form_count; i++) {
+        while ((uint32_t)(lit->entry_count + forms[i].strings.count) * 2 > lit->mask) {
+            if (literal_grow(lit) != 0) return 0;
+        }
+    }
+    for (int i = 0; i < form_count; i++) {
+        if (regex_literals_insert(lit, &forms[i], pattern) != 0) return 0;
+    }
+    return 1;
+}
+
+// Builds one DFA for patterns[lo, hi); halves the range when the automaton
+// gets too large. Patterns that cannot be covered end up in *uncovered.
+static void build_dfa_range(regex_ctx* ctx, const set_builder* parser, const ast_node** asts, const int* patterns, int lo, int hi, int* uncovered, int* uncovered_count) {
+    if (hi - lo < 2) {
+        for (int i = lo; i < hi; i++) uncovered[(*uncovered_count)++] = patterns[i];
+        return;
+    }
+
+    // The ASTs refer to the parser's byte sets by index.
+    set_builder b;
+    memset(&b, 0, sizeof(b));
+    for (int i = 0; i < parser->set_count && !b.unsupported; i++) builder_add_set(&b, &parser->sets[i]);
+    int starts[MAX_PATTERNS];
+    for (int i = lo; i < hi && !b.unsupported; i++) {
+        int match = add_state(&b, NFA_MATCH, patterns[i], -1, -1);
+        if (match >= 0) starts[i - lo] = compile_node(&b, asts[i], match);
+    }
+    regex_dfa* dfa = b.unsupported ? NULL : build_dfa(&b, starts, hi - lo);
+    free(b.states);
+    free(b.sets);
+    arena_free(&b.arena);
+
+    if (dfa && memlst_add(&ctx->destructors, (dtor_fn)regex_dfa_free, dfa)) {
+        ctx->dfas[ctx->dfa_count++] = dfa;
+        return;
+    }
+    regex_dfa_free(dfa);
+    int mid = lo + (hi - lo) / 2;
+    build_dfa_range(ctx, parser, asts, patterns, lo, mid, uncovered, uncovered_count);
+    build_dfa_range(ctx, parser, asts, patterns, mid, hi, uncovered, uncovered_count);
+}
+
+// Puts the patterns of ctx that reduce to literals into the literal index and
+// turns those that fall into the supported subset into regex set DFAs; the
+// rest keep being matched one by one with PCRE2, after the DFAs. Called once
+// the options are parsed; on any failure patterns simply stay with PCRE2.
+int regex_ctx_build_set(regex_ctx* ctx) {
+    ctx->dfa_count = 0;
+    ctx->fallback_count = 0;
+
+    set_builder parser;
+    memset(&parser, 0, sizeof(parser));
+    const ast_node* asts[MAX_PATTERNS];
+    int supported[MAX_PATTERNS];
+    int supported_count = 0;
+    int uncovered[MAX_PATTERNS];
+    int uncovered_count = 0;
+    for (int i = 0; i < ctx->count; i++) {
+        const ast_node* ast = ctx->sources[i] ? parse_pattern(&parser, ctx->sources[i]) : NULL;
+        if (ast && add_literal_pattern(ctx, &parser, ast, i)) continue;
+        if (ast) {
+            asts[supported_count] = ast;
+            supported[supported_count++] = i;
+        }
+        else {
+            uncovered[uncovered_count++] = i;
+        }
+    }
+
+    if (supported_count >= 2) {
+        build_dfa_range(ctx, &parser, asts, supported, 0, supported_count, uncovered, &uncovered_count);
+    }
+    else {
+        for (int i = 0; i < supported_count; i++) uncovered[uncovered_count++] = supported[i];
+    }
+    free(parser.sets);
+    arena_free(&parser.arena);
+
+    qsort(uncovered, (size_t)uncovered_count, sizeof(int), compare_ints);
+    memcpy(ctx->fallback, uncovered, (size_t)uncovered_count * sizeof(int));
+    ctx->fallback_count = uncovered_count;
+    return 0;
+}
+
+// Returns the index of a pattern that matches str, or -1. A regex set reports
+// the lowest-numbered of its patterns that has matched by the time the scan
+// stops, which need not be the lowest matching index overall; callers only
+// rely on it identifying a match.
+int match_regex_index(const regex_ctx* ctx, const char* str, regex_scratch* scratch) {
+    int hit = ctx->literals ? literal_match(ctx->literals, str) : -1;
+    if (hit >= 0) return hit;
+    if (hit == -1 && (ctx->literals || ctx->dfa_count > 0)) {
+        for (int k = 0; k < ctx->dfa_count; k++) {
+            hit = dfa_match(ctx->dfas[k], str);
+            if (hit >= 0) return hit;
+        }
+        for (int k = 0; k < ctx->fallback_count; k++) {
+            int i = ctx->fallback[k];
+            if (pcre2_match(ctx->compiled[i], (PCRE2_SPTR)str, PCRE2_ZERO_TERMINATED, 0, 0, scratch->match_data, scratch->match_context) >= 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    for (int i = 0; i < ctx->count; i++) {
+        if (pcre2_match(ctx->compiled[i], (PCRE2_SPTR)str, PCRE2_ZERO_TERMINATED, 0, 0, scratch->match_data, scratch->match_context) >= 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int match_regex_list(const regex_ctx* ctx, const char* str, regex_scratch* scratch) {
+    return match_regex_index(ctx, str, scratch) >= 0;
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <errno.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_MAX_REQUEST_SIZE (1024 * 1024)
+#define SERVE_MAX_ARGS 1024
+// An idle server reopens its cache after this long, so files modified
+// since it was opened can be recorded too.
+#define SERVE_CACHE_REFRESH_SEC 5
+
+// Requests hold the cache lock shared while they run; between requests the
+// cache is flushed and reopened under the exclusive lock, which makes the
+// entries recorded so far visible to the next requests.
+typedef struct {
+    recap_context* ctx;
+    pthread_mutex_t parse_lock;
+    pthread_rwlock_t cache_lock;
+    recap_cache* cache;
+    char cache_path[MAX_PATH_SIZE];
+    time_t cache_opened;
+    pthread_mutex_t active_lock;
+    pthread_cond_t idle_cond;
+    int active;
+} server;
+
+typedef struct {
+    server* srv;
+    int fd;
+} connection;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void send_error(int fd, const char* message) {
+    size_t len = strlen(message);
+    while (len > 0 && message[len - 1] == '\n') len--;
+    json_t* reply = json_object();
+    json_object_set_new(reply, "ok", json_false());
+    json_object_set_new(reply, "error", json_stringn(message, len));
+    char* text = json_dumps(reply, JSON_COMPACT);
+    json_decref(reply);
+    if (!text) return;
+    write_all(fd, text, strlen(text));
+    write_all(fd, "\n", 1);
+    free(text);
+}
+
+// Reads one request: a JSON object on a single line, or everything up to
+// the end of the client's writes.
+static char* read_request(int fd, size_t* out_len) {
+    size_t cap = 4096, len = 0;
+    char* buf = malloc(cap);
+    if (!buf) return NULL;
+    while (len < SERVE_MAX_REQUEST_SIZE) {
+        if (len == cap) {
+            char* grown = realloc(buf, cap * 2);
+            if (!grown) break;
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        char* newline = memchr(buf + len, '\n', (size_t)n);
+        len += (size_t)n;
+        if (newline) {
+            len = (size_t)(newline - buf);
+            break;
+        }
+    }
+    *out_len = len;
+    return buf;
+}
+
+static void refresh_cache(server* srv) {
+    if (!srv->cache || pthread_rwlock_trywrlock(&srv->cache_lock) != 0) return;
+    if (cache_pending(srv->cache) > 0 || time(NULL) - srv->cache_opened >= SERVE_CACHE_REFRESH_SEC) {
+        cache_close(srv->cache);
+        srv->cache = cache_open(srv->cache_path, srv->ctx->cwd);
+        srv->cache_opened = time(NULL);
+        if (!srv->cache) fprintf(stderr, "Warning: Could not reopen the cache in %s, continuing without it.\n", srv->cache_path);
+    }
+    pthread_rwlock_unlock(&srv->cache_lock);
+}
+
+// Sets up a fresh context from the request the way main() does from the
+// command line. Start paths are made absolute, since the server's working
+// directory is not the client's.
+static int prepare_request(server* srv, recap_context* ctx, json_t* request, FILE* errors) {
+    memlst_init(&ctx->cleanup);
+    if (!memlst_add(&ctx->cleanup, (dtor_fn)free_regex_ctx, &ctx->include_filters) ||
+        !memlst_add(&ctx->cleanup, (dtor_fn)free_regex_ctx, &ctx->exclude_filters) ||
+        !memlst_add(&ctx->cleanup, (dtor_fn)free_regex_ctx, &ctx->content_include_filters) ||
+        !memlst_add(&ctx->cleanup, (dtor_fn)free_regex_ctx, &ctx->content_exclude_filters) ||
+        !memlst_add(&ctx->cleanup, (dtor_fn)path_list_free, &ctx->matched_files)) {
+        fprintf(errors, "Error: Failed to register cleanup handlers.\n");
+        return -1;
+    }
+    ctx->version = srv->ctx->version;
+
+    json_t* cwd = json_object_get(request, "cwd");
+    if (cwd && (!json_is_string(cwd) || json_string_value(cwd)[0] != '/')) {
+        fprintf(errors, "Error: \"cwd\" must be an absolute path\n");
+        return -1;
+    }
+    const char* dir = cwd ? json_string_value(cwd) : srv->ctx->cwd;
+    if (strlen(dir) >= sizeof(ctx->cwd)) {
+        fprintf(errors, "Error: \"cwd\" is too long\n");
+        return -1;
+    }
+    strcpy(ctx->cwd, dir);
+    normalize_path(ctx->cwd);
+
+    json_t* args = json_object_get(request, "args");
+    if (args && (!json_is_array(args) || json_array_size(args) >= SERVE_MAX_ARGS)) {
+        fprintf(errors, "Error: \"args\" must be an array of at most %d strings\n", SERVE_MAX_ARGS - 1);
+        return -1;
+    }
+    char* argv[SERVE_MAX_ARGS + 1];
+    int argc = 0;
+    argv[argc++] = "recap";
+    for (size_t i = 0; args && i < json_array_size(args); i++) {
+        json_t* arg = json_array_get(args, i);
+        if (!json_is_string(arg)) {
+            fprintf(errors, "Error: \"args\" must be an array of at most %d strings\n", SERVE_MAX_ARGS - 1);
+            return -1;
+        }
+        argv[argc++] = (char*)json_string_value(arg);
+    }
+    argv[argc] = NULL;
+
+    pthread_mutex_lock(&srv->parse_lock);
+    int rc = parse_request_arguments(argc, argv, ctx, errors);
+    pthread_mutex_unlock(&srv->parse_lock);
+    if (rc != ARGS_RUN) return -1;
+
+    for (int i = 0; i < ctx->start_path_count; i++) {
+        const char* path = ctx->start_paths[i];
+        if (path[0] == '/') continue;
+        size_t len = strlen(ctx->cwd) + 1 + strlen(path) + 1;
+        char* absolute = malloc(len);
+        if (!absolute || !memlst_add(&ctx->cleanup, free, absolute)) {
+            free(absolute);
+            fprintf(errors, "Error: Out of memory.\n");
+            return -1;
+        }
+        snprintf(absolute, len, "%s/%s", ctx->cwd, path);
+        ctx->start_paths[i] = absolute;
+    }
+    ctx->output.use_stdout = 1;
+    return 0;
+}
+
+// Answers one request: a status line ({"ok":true} or {"ok":false,
+// "error":...}), then the output exactly as the command line would print
+// it. Problems found during the walk go to the server's stderr, like
+// warnings of a command-line run.
+static void* serve_connection(void* arg) {
+    connection* conn = arg;
+    server* srv = conn->srv;
+    int fd = conn->fd;
+    free(conn);
+
+    size_t len = 0;
+    char* text = read_request(fd, &len);
+    json_error_t error;
+    json_t* request = text ? json_loadb(text, len, 0, &error) : NULL;
+    free(text);
+    recap_context* ctx = calloc(1, sizeof(recap_context));
+
+    char* messages = NULL;
+    size_t messages_len = 0;
+    FILE* errors = open_memstream(&messages, &messages_len);
+    if (!request || !json_is_object(request)) {
+        send_error(fd, "Error: The request must be a JSON object on one line");
+    }
+    else if (!ctx || !errors) {
+        send_error(fd, "Error: Out of memory");
+    }
+    else {
+        int prepared = prepare_request(srv, ctx, request, errors);
+        fclose(errors);
+        errors = NULL;
+        if (prepared != 0 || messages_len > 0) {
+            send_error(fd, messages_len > 0 ? messages : "Error: Invalid request");
+        }
+        else {
+            int out_fd = dup(fd);
+            FILE* stream = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+            if (!stream) {
+                if (out_fd >= 0) close(out_fd);
+                send_error(fd, "Error: Could not open the output stream");
+            }
+            else {
+                fputs("{\"ok\":true}\n", stream);
+                ctx->output_stream = stream;
+                pthread_rwlock_rdlock(&srv->cache_lock);
+                if (srv->cache && !ctx->rev) {
+                    ctx->cache = srv->cache;
+                    ctx->content_options = content_options_hash(ctx);
+                    get_relative_path(srv->cache_path, ctx->cwd, ctx->cache_rel_path, sizeof(ctx->cache_rel_path));
+                }
+                start_traversal(ctx);
+                pthread_rwlock_unlock(&srv->cache_lock);
+                fclose(stream);
+            }
+        }
+    }
+    if (errors) fclose(errors);
+    free(messages);
+    if (request) json_decref(request);
+    if (ctx) {
+        memlst_destroy(&ctx->cleanup);
+        free(ctx);
+    }
+    close(fd);
+
+    refresh_cache(srv);
+    pthread_mutex_lock(&srv->active_lock);
+    srv->active--;
+    pthread_cond_broadcast(&srv->idle_cond);
+    pthread_mutex_unlock(&srv->active_lock);
+    return NULL;
+}
+
+// Binds the socket, replacing a stale one left behind by a server that is
+// no longer running.
+static int open_listener(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: Another server is already listening on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if (errno == ECONNREFUSED) unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Could not listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_run(recap_context* ctx) {
+    server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.ctx = ctx;
+    if (regex_cache_init() != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    int listen_fd = open_listener(ctx->serve_path);
+    if (listen_fd < 0) {
+        regex_cache_free();
+        return 1;
+    }
+    pthread_mutex_init(&srv.parse_lock, NULL);
+    pthread_rwlock_init(&srv.cache_lock, NULL);
+    pthread_mutex_init(&srv.active_lock, NULL);
+    pthread_cond_init(&srv.idle_cond, NULL);
+
+    // Like a command-line run, the server only keeps a cache with --cache.
+    const char* cache_dir = ctx->cache_dir;
+    if (cache_dir) {
+        int n = cache_dir[0] == '/' ? snprintf(srv.cache_path, sizeof(srv.cache_path), "%s", cache_dir)
+                                    : snprintf(srv.cache_path, sizeof(srv.cache_path), "%s/%s", ctx->cwd, cache_dir);
+        if (n > 0 && (size_t)n < sizeof(srv.cache_path)) {
+            normalize_path(srv.cache_path);
+            srv.cache = cache_open(srv.cache_path, ctx->cwd);
+            srv.cache_opened = time(NULL);
+        }
+        if (!srv.cache) fprintf(stderr, "Warning: Could not open the cache in %s, continuing without it.\n", cache_dir);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    // Request threads block the stop signals so they interrupt accept().
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    fprintf(stderr, "Info: Serving requests on %s. Press Ctrl-C to stop.\n", ctx->serve_path);
+    while (!serve_stop) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+        connection* conn = malloc(sizeof(connection));
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+        pthread_mutex_lock(&srv.active_lock);
+        srv.active++;
+        pthread_mutex_unlock(&srv.active_lock);
+        int started = conn != NULL;
+        if (conn) {
+            conn->srv = &srv;
+            conn->fd = fd;
+            started = pthread_create(&thread, &attr, serve_connection, conn) == 0;
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        pthread_attr_destroy(&attr);
+        if (!started) {
+            free(conn);
+            send_error(fd, "Error: Could not start a request thread");
+            close(fd);
+            pthread_mutex_lock(&srv.active_lock);
+            srv.active--;
+            pthread_mutex_unlock(&srv.active_lock);
+        }
+    }
+
+    close(listen_fd);
+    unlink(ctx->serve_path);
+    pthread_mutex_lock(&srv.active_lock);
+    while (srv.active > 0) {
+        pthread_cond_wait(&srv.idle_cond, &srv.active_lock);
+    }
+    pthread_mutex_unlock(&srv.active_lock);
+
+    cache_close(srv.cache);
+    regex_cache_free();
+    pthread_cond_destroy(&srv.idle_cond);
+    pthread_mutex_destroy(&srv.active_lock);
+    pthread_rwlock_destroy(&srv.cache_lock);
+    pthread_mutex_destroy(&srv.parse_lock);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include "recap.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TEXT_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char* (*line_event_fn)(const char* p, const char* end);
+
+static const char* find_line_event_scalar(const char* p, const char* end) {
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == '\r' || c == '\0') return p;
+        if (c == '\n' && p + 1 < end && p[1] == '\n') return p;
+    }
+    return end;
+}
+
+static const char* scan_set_find_scalar(const scan_set* set, const char* p, const char* end) {
+    while (p < end && !set->member[(unsigned char)*p]) p++;
+    return p;
+}
+
+#if defined(TEXT_SCAN_X86)
+
+// Each block compares the bytes at p and p + 1 so a "\n\n" pair is found
+// without carrying state across blocks; the block therefore needs one byte of
+// lookahead and the last few bytes go through the scalar loop.
+__attribute__((target("sse2")))
+static const char* find_line_event_sse2(const char* p, const char* end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p > 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i next = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, zero));
+        hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(next, nl)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_line_event_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_line_event_avx2(const char* p, const char* end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    while (end - p > 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i next = _mm256_loadu_si256((const __m256i*)(p + 1));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, zero));
+        hit = _mm256_or_si256(hit, _mm256_and_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(next, nl)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    // The SSE2 code is not VEX encoded; with the upper halves of the ymm
+    // registers still dirty, it and all SSE code after it run slowly.
+    _mm256_zeroupper();
+    return find_line_event_sse2(p, end);
+}
+
+// Sets of up to four bytes take half the compares; the padding repeats the
+// first byte, so comparing against all slots is always correct.
+__attribute__((target("sse2")))
+static const char* scan_set_find_sse2(const scan_set* set, const char* p, const char* end) {
+    if (end - p >= 16) {
+        const __m128i b0 = _mm_set1_epi8(set->bytes[0]);
+        const __m128i b1 = _mm_set1_epi8(set->bytes[1]);
+        const __m128i b2 = _mm_set1_epi8(set->bytes[2]);
+        const __m128i b3 = _mm_set1_epi8(set->bytes[3]);
+        const __m128i b4 = _mm_set1_epi8(set->bytes[4]);
+        const __m128i b5 = _mm_set1_epi8(set->bytes[5]);
+        const __m128i b6 = _mm_set1_epi8(set->bytes[6]);
+        const __m128i b7 = _mm_set1_epi8(set->bytes[7]);
+        int wide = set->count > 4;
+        for (;;) {
+            // The last block overlaps bytes already looked at; they are
+            // shifted out of the mask.
+            const char* block = end - p >= 16 ? p : end - 16;
+            __m128i v = _mm_loadu_si128((const __m128i*)block);
+            __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0), _mm_cmpeq_epi8(v, b1)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, b2), _mm_cmpeq_epi8(v, b3)));
+            if (wide) {
+                hit = _mm_or_si128(hit, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b4), _mm_cmpeq_epi8(v, b5)),
+                                                     _mm_or_si128(_mm_cmpeq_epi8(v, b6), _mm_cmpeq_epi8(v, b7))));
+            }
+            unsigned mask = (unsigned)_mm_movemask_epi8(hit) >> (p - block);
+            if (mask) return p + __builtin_ctz(mask);
+            p = block + 16;
+            if (p == end) return end;
+        }
+    }
+    return scan_set_find_scalar(set, p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_set_find_avx2(const scan_set* set, const char* p, const char* end) {
+    if (end - p >= 32) {
+        const __m256i b0 = _mm256_set1_epi8(set->bytes[0]);
+        const __m256i b1 = _mm256_set1_epi8(set->bytes[1]);
+        const __m256i b2 = _mm256_set1_epi8(set->bytes[2]);
+        const __m256i b3 = _mm256_set1_epi8(set->bytes[3]);
+        const __m256i b4 = _mm256_set1_epi8(set->bytes[4]);
+        const __m256i b5 = _mm256_set1_epi8(set->bytes[5]);
+        const __m256i b6 = _mm256_set1_epi8(set->bytes[6]);
+        const __m256i b7 = _mm256_set1_epi8(set->bytes[7]);
+        int wide = set->count > 4;
+        for (;;) {
+            const char* block = end - p >= 32 ? p : end - 32;
+            __m256i v = _mm256_loadu_si256((const __m256i*)block);
+            __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b0), _mm256_cmpeq_epi8(v, b1)),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(v, b2), _mm256_cmpeq_epi8(v, b3)));
+            if (wide) {
+                hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b4), _mm256_cmpeq_epi8(v, b5)),
+                                                           _mm256_or_si256(_mm256_cmpeq_epi8(v, b6), _mm256_cmpeq_epi8(v, b7))));
+            }
+            unsigned mask = (unsigned)_mm256_movemask_epi8(hit) >> (p - block);
+            if (mask) return p + __builtin_ctz(mask);
+            p = block + 32;
+            if (p == end) return end;
+        }
+    }
+    _mm256_zeroupper();
+    return scan_set_find_sse2(set, p, end);
+}
+
+#endif
+
+static line_event_fn line_event_impl = find_line_event_scalar;
+static scan_set_find_fn scan_set_impl = scan_set_find_scalar;
+static int line_event_level = TEXT_SCAN_SCALAR;
+static pthread_once_t text_scan_once = PTHREAD_ONCE_INIT;
+
+static int text_scan_supported(int level) {
+    switch (level) {
+    case TEXT_SCAN_SCALAR:
+        return 1;
+#if defined(TEXT_SCAN_X86)
+    case TEXT_SCAN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case TEXT_SCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static int apply_text_scan_level(int level) {
+    while (level > TEXT_SCAN_SCALAR && !text_scan_supported(level)) level--;
+    switch (level) {
+#if defined(TEXT_SCAN_X86)
+    case TEXT_SCAN_AVX2:
+        line_event_impl = find_line_event_avx2;
+        scan_set_impl = scan_set_find_avx2;
+        break;
+    case TEXT_SCAN_SSE2:
+        line_event_impl = find_line_event_sse2;
+        scan_set_impl = scan_set_find_sse2;
+        break;
+#endif
+    default:
+        level = TEXT_SCAN_SCALAR;
+        line_event_impl = find_line_event_scalar;
+        scan_set_impl = scan_set_find_scalar;
+        break;
+    }
+    line_event_level = level;
+    return level;
+}
+
+// RECAP_TEXT_SCAN=scalar|sse2|avx2 caps the level, so that the fallbacks
+// can be checked on any machine.
+static int text_scan_env_level(void) {
+    const char* name = getenv("RECAP_TEXT_SCAN");
+    if (name && strcmp(name, "scalar") == 0) return TEXT_SCAN_SCALAR;
+    if (name && strcmp(name, "sse2") == 0) return TEXT_SCAN_SSE2;
+    return TEXT_SCAN_AVX2;
+}
+
+static void text_scan_init(void) {
+#if defined(TEXT_SCAN_X86)
+    __builtin_cpu_init();
+#endif
+    apply_text_scan_level(text_scan_env_level());
+}
+
+// Lets benchmarks pin a specific implementation; falls back to the best
+// supported level below the requested one and returns the level in use.
+int text_scan_select(int level) {
+    pthread_once(&text_scan_once, text_scan_init);
+    return apply_text_scan_level(level);
+}
+
+int text_scan_level(void) {
+    pthread_once(&text_scan_once, text_scan_init);
+    return line_event_level;
+}
+
+const char* find_line_event(const char* p, const char* end) {
+    pthread_once(&text_scan_once, text_scan_init);
+    return line_event_impl(p, end);
+}
+
+void scan_set_init(scan_set* set, const char* bytes, size_t count) {
+    memset(set, 0, sizeof(*set));
+    if (count > SCAN_SET_MAX) count = SCAN_SET_MAX;
+    set->count = (int)count;
+    for (size_t i = 0; i < SCAN_SET_MAX; i++) {
+        set->bytes[i] = bytes[i < count ? i : 0];
+    }
+    for (size_t i = 0; i < count; i++) {
+        set->member[(unsigned char)bytes[i]] = 1;
+    }
+}
+
+// The function for the selected level that returns the first byte in
+// [p, end) that is in a set, or end. Callers that search many short runs
+// look it up once rather than on every search.
+scan_set_find_fn scan_set_finder(void) {
+    pthread_once(&text_scan_once, text_scan_init);
+    return scan_set_impl;
+}
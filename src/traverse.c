@@ -1,301 +1,1448 @@
 #define _POSIX_C_SOURCE 200809L
 #include "recap.h"
 #include <dirent.h>
-#include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
-static int match_regex_list(const regex_ctx* ctx, const char* str) {
-    for (int i = 0; i < ctx->count; i++) {
-        if (!ctx->match_data[i]) {
-            continue;
-        }
-        if (pcre2_match(ctx->compiled[i], (PCRE2_SPTR)str, PCRE2_ZERO_TERMINATED, 0, 0, ctx->match_data[i], NULL) >= 0) {
-            return 1;
-        }
+typedef struct {
+    char* full_path;
+    char* rel_prefix;
+    size_t rel_prefix_len;
+    int fd;
+    const path_root* list_root;
+} walk_root;
+
+// Rules of one per-directory ignore file; rel_len is the length of its
+// directory's relative path, so entries below match against rel + rel_len.
+// Scopes are owned by the walker that read them and live until it is done.
+typedef struct ignore_scope {
+    gitignore* rules;
+    const struct ignore_scope* parent;
+    size_t rel_len;
+    struct ignore_scope* next_owned;
+} ignore_scope;
+
+// State inherited down the walk: once a directory (or one of its ancestors)
+// matches an include pattern, everything below it is included without
+// matching again; ignore is the innermost ignore file scope.
+typedef struct {
+    int included_by;
+    const ignore_scope* ignore;
+} dir_state;
+
+typedef struct {
+    regex_scratch regex;
+    traversal_stats stats;
+} filter_scratch;
+
+// Directory fds held open for their subdirectories, per walk, at most a
+// quarter of the process's fd limit. Past that, directories open their path
+// from the root instead, so deep trees do not run out of fds.
+#define MAX_SHARED_DIR_FDS 256
+
+// A scanned directory's fd, held open while tasks for its subdirectories
+// are pending so that each of them is opened by its name alone.
+typedef struct {
+    int fd;
+    atomic_int refs;
+    atomic_int* shared;
+} dir_handle;
+
+typedef struct {
+    int root;
+    char* rel_path;
+    size_t rel_len;
+    dir_state state;
+    dir_handle* parent;
+} dir_task;
+
+// Per-worker deque: the owner pushes and pops at the bottom (depth-first),
+// idle workers steal the oldest (usually largest) subtrees from the top.
+typedef struct {
+    pthread_mutex_t lock;
+    dir_task* items;
+    size_t top;
+    size_t count;
+    size_t capacity;
+} task_deque;
+
+struct walk_pool;
+
+typedef struct {
+    struct walk_pool* pool;
+    int index;
+    filter_scratch scratch;
+    task_deque deque;
+    path_list files;
+    path_list dirs;
+    dir_scan scan;
+    path_buf rel;
+    ignore_scope* ignore_scopes;
+    pthread_t thread;
+} walker;
+
+typedef struct walk_pool {
+    recap_context* ctx;
+    walk_root* roots;
+    int root_count;
+    walker* workers;
+    int worker_count;
+    atomic_size_t pending;
+    atomic_size_t queued;
+    atomic_int sleepers;
+    atomic_int shared_fds;
+    int max_shared_fds;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+} walk_pool;
+
+// Picks up the ignore file of the directory being scanned. The walk roots'
+// own file was already loaded when it is the working directory's.
+static const ignore_scope* enter_ignore_scope(recap_context* ctx, dir_scan* scan, const dir_state* state, size_t rel_len, ignore_scope** owned) {
+    if (!ctx->gitignore_name || (rel_len == 0 && ctx->gitignore_at_cwd)) return state->ignore;
+    int fd = dir_scan_open_file(scan, ctx->gitignore_name);
+    if (fd < 0) return state->ignore;
+    gitignore* rules = gitignore_from_fd(fd);
+    if (!rules) return state->ignore;
+    ignore_scope* scope = malloc(sizeof(ignore_scope));
+    if (!scope) {
+        gitignore_free(rules);
+        return state->ignore;
     }
-    return 0;
+    scope->rules = rules;
+    scope->parent = state->ignore;
+    scope->rel_len = rel_len;
+    scope->next_owned = *owned;
+    *owned = scope;
+    return scope;
 }
 
-static int match_fnmatch_list(const fnmatch_ctx* ctx, const char* path_to_check) {
-    for (int i = 0; i < ctx->count; i++) {
-        const char* pattern = ctx->patterns[i];
+static void free_ignore_scopes(ignore_scope* scope) {
+    while (scope) {
+        ignore_scope* next = scope->next_owned;
+        gitignore_free(scope->rules);
+        free(scope);
+        scope = next;
+    }
+}
 
-        if (fnmatch(pattern, path_to_check, FNM_PATHNAME | FNM_PERIOD) == 0) return 1;
+// The innermost ignore file with a matching rule decides; the file found
+// above the working directory comes last.
+static int is_ignored(const char* rel_path, int is_dir, const recap_context* ctx, const dir_state* parent) {
+    // Tracked files are never ignored.
+    if (ctx->use_git_index || ctx->rev) return 0;
+    for (const ignore_scope* scope = parent ? parent->ignore : NULL; scope; scope = scope->parent) {
+        int verdict = gitignore_match_local(scope->rules, rel_path + scope->rel_len, is_dir);
+        if (verdict != GITIGNORE_NONE) return verdict == GITIGNORE_EXCLUDE;
+    }
+    return gitignore_match(ctx->ignore_rules, rel_path, is_dir, parent == NULL) == GITIGNORE_EXCLUDE;
+}
 
-        size_t len = strlen(pattern);
+// Returns 1 if some path below the directory could still satisfy an include
+// pattern. Unanchored patterns may match anywhere in a descendant's name, so
+// only start-anchored patterns can rule a subtree out: they must match "dir/"
+// completely or run out of subject while matching it (partial match).
+static int include_may_match_below(const regex_ctx* ctx, const char* dir_rel_path, regex_scratch* scratch) {
+    if (strcmp(dir_rel_path, ".") == 0) return 1;
 
-        if (len > 0 && pattern[len - 1] == '/') {
-            if (strstr(path_to_check, pattern) != NULL) return 1;
-        }
-        else {
-            if (strchr(pattern, '/') == NULL) {
-                char needle[MAX_PATH_SIZE];
-                int n = snprintf(needle, sizeof(needle), "/%s/", pattern);
-                if (n > 0 && (size_t)n < sizeof(needle)) {
-                    if (strstr(path_to_check, needle) != NULL) return 1;
-                }
-                n = snprintf(needle, sizeof(needle), "%s/", pattern);
-                if (n > 0 && strncmp(path_to_check, needle, strlen(needle)) == 0) return 1;
-            }
+    char prefix[MAX_PATH_SIZE];
+    int len = snprintf(prefix, sizeof(prefix), "%s/", dir_rel_path);
+    if (len < 0 || (size_t)len >= sizeof(prefix)) return 1;
+
+    for (int i = 0; i < ctx->count; i++) {
+        uint32_t options = 0;
+        pcre2_pattern_info(ctx->compiled[i], PCRE2_INFO_ALLOPTIONS, &options);
+        if (!(options & PCRE2_ANCHORED)) return 1;
+
+        int rc = pcre2_match(ctx->compiled[i], (PCRE2_SPTR)prefix, (PCRE2_SIZE)len, 0, PCRE2_PARTIAL_HARD, scratch->match_data, scratch->match_context);
+        if (rc >= 0 || rc == PCRE2_ERROR_PARTIAL) {
+            return 1;
         }
     }
     return 0;
 }
 
-static int should_be_skipped(const char* rel_path, const struct stat* st, recap_context* ctx) {
+static size_t count_separators(const char* path) {
+    size_t n = 0;
+    for (const char* p = strchr(path, '/'); p; p = strchr(p + 1, '/')) n++;
+    return n;
+}
+
+// Applies the exclusion and include filters to one entry. With a parent
+// state the entry's ancestors have already been evaluated, so only the entry
+// itself is matched; without one (start paths) every ancestor prefix is tried.
+// On success *state receives the state directories pass to their children.
+static int should_be_skipped(const char* rel_path, int is_dir, recap_context* ctx, const dir_state* parent, dir_state* state, filter_scratch* scratch) {
+    regex_scratch* regex = &scratch->regex;
+    state->included_by = -1;
+    state->ignore = parent ? parent->ignore : NULL;
     if (!ctx->output.use_stdout && strcmp(rel_path, ctx->output.relative_output_path) == 0) return 1;
-    if (match_fnmatch_list(&ctx->fnmatch_exclude_filters, rel_path)) return 1;
-    if (ctx->exclude_filters.count > 0 && match_regex_list(&ctx->exclude_filters, rel_path)) return 1;
+    if (ctx->cache && strcmp(rel_path, ctx->cache_rel_path) == 0) return 1;
+    if (is_ignored(rel_path, is_dir, ctx, parent)) return 1;
+    if (ctx->exclude_filters.count > 0 && match_regex_list(&ctx->exclude_filters, rel_path, regex)) return 1;
 
-    if (ctx->include_filters.count > 0) {
-        if (match_regex_list(&ctx->include_filters, rel_path)) return 0;
+    if (ctx->include_filters.count == 0) return 0;
+    // The working directory as a start path is not a path component: it is
+    // never matched, so it has no include match to pass down.
+    if (!parent && strcmp(rel_path, ".") == 0) return 0;
+
+    if (parent) {
+        size_t ancestors = count_separators(rel_path);
+        if (parent->included_by >= 0) {
+            // The per-prefix scheme matched at least the entry itself here.
+            scratch->stats.include_checks_avoided += 1;
+            state->included_by = parent->included_by;
+            return 0;
+        }
+        scratch->stats.include_checks++;
+        state->included_by = match_regex_index(&ctx->include_filters, rel_path, regex);
+        if (state->included_by >= 0) return 0;
+        // None of the ancestors matched when they were entered.
+        scratch->stats.include_checks_avoided += ancestors;
+    }
+    else {
+        scratch->stats.include_checks++;
+        state->included_by = match_regex_index(&ctx->include_filters, rel_path, regex);
+        if (state->included_by >= 0) return 0;
         char temp_path[MAX_PATH_SIZE];
         strncpy(temp_path, rel_path, sizeof(temp_path) - 1);
         temp_path[sizeof(temp_path) - 1] = '\0';
         for (char* p = strrchr(temp_path, '/'); p; p = strrchr(temp_path, '/')) {
             *p = '\0';
-            if (match_regex_list(&ctx->include_filters, temp_path)) return 0;
+            scratch->stats.include_checks++;
+            state->included_by = match_regex_index(&ctx->include_filters, temp_path, regex);
+            if (state->included_by >= 0) return 0;
         }
-        return S_ISDIR(st->st_mode) ? 0 : 1;
     }
-    return 0;
+
+    if (!is_dir) return 1;
+    if (include_may_match_below(&ctx->include_filters, rel_path, regex)) return 0;
+    scratch->stats.subtrees_pruned++;
+    return 1;
+}
+
+static void dir_handle_release(dir_handle* handle) {
+    if (handle && atomic_fetch_sub(&handle->refs, 1) == 1) {
+        close(handle->fd);
+        atomic_fetch_sub(handle->shared, 1);
+        free(handle);
+    }
 }
 
-static int should_show_content(const char* rel_path, const char* full_path, recap_context* ctx) {
-    if (ctx->content_exclude_filters.count > 0 && match_regex_list(&ctx->content_exclude_filters, rel_path)) return 0;
-    if (ctx->content_include_filters.count > 0) {
-        if (match_regex_list(&ctx->content_include_filters, rel_path)) {
-            return is_text_file(full_path);
+static int shared_dir_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur / 4 >= MAX_SHARED_DIR_FDS) {
+        return MAX_SHARED_DIR_FDS;
+    }
+    return (int)(limit.rlim_cur / 4);
+}
+
+static dir_handle* share_dir_fd(walk_pool* pool, dir_scan* scan) {
+    if (atomic_fetch_add(&pool->shared_fds, 1) >= pool->max_shared_fds) {
+        atomic_fetch_sub(&pool->shared_fds, 1);
+        return NULL;
+    }
+    dir_handle* handle = malloc(sizeof(dir_handle));
+    if (handle) handle->fd = dir_scan_share_fd(scan);
+    if (!handle || handle->fd < 0) {
+        atomic_fetch_sub(&pool->shared_fds, 1);
+        free(handle);
+        return NULL;
+    }
+    atomic_init(&handle->refs, 1);
+    handle->shared = &pool->shared_fds;
+    return handle;
+}
+
+static int deque_init(task_deque* dq) {
+    dq->items = NULL;
+    dq->top = 0;
+    dq->count = 0;
+    dq->capacity = 0;
+    return pthread_mutex_init(&dq->lock, NULL) == 0 ? 0 : -1;
+}
+
+static void deque_destroy(task_deque* dq) {
+    for (size_t i = 0; i < dq->count; i++) {
+        dir_task* task = &dq->items[(dq->top + i) % dq->capacity];
+        free(task->rel_path);
+        dir_handle_release(task->parent);
+    }
+    free(dq->items);
+    pthread_mutex_destroy(&dq->lock);
+}
+
+static int deque_push_bottom(task_deque* dq, const dir_task* task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        size_t new_capacity = dq->capacity ? dq->capacity * 2 : 64;
+        dir_task* new_items = malloc(new_capacity * sizeof(dir_task));
+        if (!new_items) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            new_items[i] = dq->items[(dq->top + i) % dq->capacity];
         }
+        free(dq->items);
+        dq->items = new_items;
+        dq->top = 0;
+        dq->capacity = new_capacity;
     }
+    dq->items[(dq->top + dq->count) % dq->capacity] = *task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
     return 0;
 }
 
-static void write_file_content_block(const char* full_path, const char* rel_path, recap_context* ctx) {
-    fprintf(ctx->output_stream, "%s:\n", rel_path);
-    char* content_buffer = NULL;
-    size_t file_size = 0;
-    int rf = read_file_into_buffer(full_path, MAX_FILE_CONTENT_SIZE, &content_buffer, &file_size);
-    if (rf == -2) {
-        fprintf(ctx->output_stream, "[File content too large to process (>%dMB)]\n", MAX_FILE_CONTENT_SIZE / (1024 * 1024));
-        return;
+static int deque_pop_bottom(task_deque* dq, dir_task* out) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *out = dq->items[(dq->top + dq->count) % dq->capacity];
+        found = 1;
     }
-    if (rf != 0) {
-        fprintf(ctx->output_stream, "[Error reading file content]\n");
-        return;
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int deque_steal_top(task_deque* dq, dir_task* out) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        *out = dq->items[dq->top];
+        dq->top = (dq->top + 1) % dq->capacity;
+        dq->count--;
+        found = 1;
     }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
 
-    const char* content_after_strip = content_buffer;
-    pcre2_code* strip_regex_to_use = NULL;
-    pcre2_match_data* strip_match_data_to_use = NULL;
+static int schedule_directory(walker* w, int root, const char* rel_path, size_t rel_len, const dir_state* state, dir_handle* parent) {
+    walk_pool* pool = w->pool;
+    dir_task task;
+    task.root = root;
+    task.state = *state;
+    task.parent = parent;
+    task.rel_len = rel_len;
+    task.rel_path = malloc(rel_len + 1);
+    if (!task.rel_path) return -1;
+    memcpy(task.rel_path, rel_path, rel_len + 1);
 
-    for (int i = 0; i < ctx->scoped_strip_rule_count; i++) {
-        if (pcre2_match(ctx->scoped_strip_rules[i].path_regex,
-                        (PCRE2_SPTR)rel_path,
-                        PCRE2_ZERO_TERMINATED,
-                        0, 0,
-                        ctx->scoped_strip_rules[i].path_match_data,
-                        NULL) >= 0) {
-            strip_regex_to_use = ctx->scoped_strip_rules[i].strip_regex;
-            strip_match_data_to_use = ctx->scoped_strip_rules[i].strip_match_data;
-            break;
-        }
+    if (parent) atomic_fetch_add(&parent->refs, 1);
+    atomic_fetch_add(&pool->pending, 1);
+    if (deque_push_bottom(&w->deque, &task) != 0) {
+        atomic_fetch_sub(&pool->pending, 1);
+        dir_handle_release(parent);
+        free(task.rel_path);
+        return -1;
     }
+    atomic_fetch_add(&pool->queued, 1);
 
-    if (!strip_regex_to_use && ctx->strip_regex) {
-        strip_regex_to_use = ctx->strip_regex;
-        strip_match_data_to_use = ctx->strip_match_data;
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
     }
+    return 0;
+}
 
-    if (strip_regex_to_use && strip_match_data_to_use) {
-        if (pcre2_match(strip_regex_to_use, (PCRE2_SPTR)content_buffer, file_size, 0, 0, strip_match_data_to_use, NULL) >= 0) {
-            PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(strip_match_data_to_use);
-            content_after_strip = content_buffer + ovector[1];
+static int take_task(walker* w, dir_task* out) {
+    walk_pool* pool = w->pool;
+    if (deque_pop_bottom(&w->deque, out)) {
+        atomic_fetch_sub(&pool->queued, 1);
+        return 1;
+    }
+    for (int i = 1; i < pool->worker_count; i++) {
+        walker* victim = &pool->workers[(w->index + i) % pool->worker_count];
+        if (deque_steal_top(&victim->deque, out)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            return 1;
         }
     }
+    return 0;
+}
 
-    char* compacted_content = NULL;
-    if (ctx->compact_output) {
-        compacted_content = apply_compact_transformations(content_after_strip, rel_path);
+static const char* build_full_path(path_buf* full, const walk_root* root, const path_buf* rel) {
+    full->len = 0;
+    if (path_buf_push(full, root->full_path, strlen(root->full_path)) != 0 ||
+        path_buf_push(full, "/", 1) != 0 ||
+        path_buf_push(full, rel->data + root->rel_prefix_len, rel->len - root->rel_prefix_len) != 0) {
+        return NULL;
     }
+    return full->data;
+}
 
-    const char* p = compacted_content ? compacted_content : content_after_strip;
-    int previous_line_was_blank = 0;
-    while (*p) {
-        const char* end_of_line = strchr(p, '\n');
-        size_t line_len = end_of_line ? (size_t)(end_of_line - p) : strlen(p);
-        if (line_len > 0 && p[line_len - 1] == '\r') line_len--;
-
-        if (line_len == 0) {
-            if (!previous_line_was_blank) {
-                fputc('\n', ctx->output_stream);
-                previous_line_was_blank = 1;
+// Reads one directory relative to its parent's fd. Entry names are appended to
+// the walker's rel buffer and popped again, so no path is formatted unless
+// the entry ends up in the file list or becomes a new directory task.
+static void traverse_directory(walker* w, const dir_task* task) {
+    walk_pool* pool = w->pool;
+    recap_context* ctx = pool->ctx;
+    const walk_root* root = &pool->roots[task->root];
+
+    int parent_fd = task->parent ? task->parent->fd : -1;
+    if (dir_scan_open(&w->scan, root->fd, root->full_path, task->rel_path + root->rel_prefix_len, parent_fd) != 0) {
+        return;
+    }
+    w->scratch.stats.directories_scanned++;
+    if (ctx->watch) {
+        const path_dir* scanned = path_list_add_dir(&w->dirs, root->list_root, task->rel_path, task->rel_len);
+        if (scanned) path_list_add_file(&w->dirs, scanned, "", 0);
+    }
+    dir_state here = task->state;
+    here.ignore = enter_ignore_scope(ctx, &w->scan, &task->state, task->rel_len, &w->ignore_scopes);
+
+    w->rel.len = 0;
+    if (path_buf_push(&w->rel, task->rel_path, task->rel_len) != 0) {
+        dir_scan_close(&w->scan);
+        return;
+    }
+    size_t base_len = w->rel.len;
+    size_t full_base_len = strlen(root->full_path) + 1 + (base_len - root->rel_prefix_len);
+    const path_dir* dir = NULL;
+    dir_handle* handle = NULL;
+    int shared = 0;
+
+    const char* name;
+    int type;
+    while (dir_scan_next(&w->scan, &name, &type)) {
+        w->scratch.stats.entries_seen++;
+        size_t name_len = strlen(name);
+        if (base_len + name_len >= MAX_PATH_SIZE || full_base_len + name_len >= MAX_PATH_SIZE) {
+            continue;
+        }
+        if (type == DIR_ENTRY_UNKNOWN) {
+            type = dir_scan_resolve_type(&w->scan, name);
+        }
+        if (type != DIR_ENTRY_DIR && type != DIR_ENTRY_REG) {
+            continue;
+        }
+
+        path_buf_truncate(&w->rel, base_len);
+        if (path_buf_push(&w->rel, name, name_len) != 0) {
+            continue;
+        }
+
+        dir_state state;
+        if (should_be_skipped(w->rel.data, type == DIR_ENTRY_DIR, ctx, &here, &state, &w->scratch)) {
+            continue;
+        }
+
+        if (type == DIR_ENTRY_DIR) {
+            if (w->rel.len + 1 >= MAX_PATH_SIZE || path_buf_push(&w->rel, "/", 1) != 0) {
+                fprintf(stderr, "Warning: path too long, skipping directory: %s\n", w->rel.data);
+                continue;
+            }
+            // Subdirectories fall back to opening their path from the root
+            // when this directory's fd cannot be shared.
+            if (!shared) {
+                shared = 1;
+                handle = share_dir_fd(pool, &w->scan);
+            }
+            if (schedule_directory(w, task->root, w->rel.data, w->rel.len, &state, handle) != 0) {
+                fprintf(stderr, "Warning: out of memory, skipping directory: %s\n", w->rel.data);
             }
         }
         else {
-            previous_line_was_blank = 0;
-            fprintf(ctx->output_stream, "%.*s\n", (int)line_len, p);
+            // Files share one record for their directory; full paths are
+            // rebuilt from the root when the list is printed.
+            if (!dir) dir = path_list_add_dir(&w->files, root->list_root, task->rel_path, task->rel_len);
+            if (dir && path_list_add_file(&w->files, dir, name, name_len) == 0) {
+                w->scratch.stats.files_matched++;
+            }
+        }
+    }
+
+    dir_scan_close(&w->scan);
+    dir_handle_release(handle);
+}
+
+static void* walker_main(void* arg) {
+    walker* w = arg;
+    walk_pool* pool = w->pool;
+    dir_task task;
+
+    while (1) {
+        if (take_task(w, &task)) {
+            traverse_directory(w, &task);
+            dir_handle_release(task.parent);
+            free(task.rel_path);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
         }
 
-        if (end_of_line) {
-            p = end_of_line + 1;
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->pending) > 0 && atomic_load(&pool->queued) == 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
         }
-        else {
+        atomic_fetch_sub(&pool->sleepers, 1);
+        int done = atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+static int walk_root_init(walk_root* root, const char* full_path, const char* rel_prefix) {
+    root->full_path = strdup(full_path);
+    root->rel_prefix = strdup(rel_prefix);
+    root->rel_prefix_len = strlen(rel_prefix);
+    root->fd = -1;
+    root->list_root = NULL;
+    if (!root->full_path || !root->rel_prefix) {
+        free(root->full_path);
+        free(root->rel_prefix);
+        return -1;
+    }
+    root->fd = open_root_dir(full_path);
+    return 0;
+}
+
+static void walk_root_free(walk_root* root) {
+    if (root->fd >= 0) close(root->fd);
+    free(root->full_path);
+    free(root->rel_prefix);
+}
+
+static void walk_pool_destroy(walk_pool* pool) {
+    for (int i = 0; i < pool->worker_count; i++) {
+        walker* w = &pool->workers[i];
+        deque_destroy(&w->deque);
+        path_list_free(&w->files);
+        path_list_free(&w->dirs);
+        dir_scan_free(&w->scan);
+        path_buf_free(&w->rel);
+        regex_scratch_free(&w->scratch.regex);
+        free_ignore_scopes(w->ignore_scopes);
+    }
+    free(pool->workers);
+    for (int i = 0; i < pool->root_count; i++) {
+        walk_root_free(&pool->roots[i]);
+    }
+    free(pool->roots);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+}
+
+static int walk_pool_init(walk_pool* pool, recap_context* ctx, int worker_count) {
+    memset(pool, 0, sizeof(*pool));
+    pool->ctx = ctx;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->shared_fds, 0);
+    pool->max_shared_fds = shared_dir_fd_limit();
+    if (pthread_mutex_init(&pool->idle_lock, NULL) != 0) return -1;
+    if (pthread_cond_init(&pool->idle_cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->idle_lock);
+        return -1;
+    }
+    pool->workers = calloc((size_t)worker_count, sizeof(walker));
+    if (!pool->workers) {
+        walk_pool_destroy(pool);
+        return -1;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        walker* w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        if (regex_scratch_init(&w->scratch.regex) != 0) {
+            walk_pool_destroy(pool);
+            return -1;
+        }
+        if (deque_init(&w->deque) != 0) {
+            regex_scratch_free(&w->scratch.regex);
+            walk_pool_destroy(pool);
+            return -1;
+        }
+        if (path_list_init(&w->files) != 0) {
+            deque_destroy(&w->deque);
+            regex_scratch_free(&w->scratch.regex);
+            walk_pool_destroy(pool);
+            return -1;
+        }
+        if (path_list_init(&w->dirs) != 0) {
+            path_list_free(&w->files);
+            deque_destroy(&w->deque);
+            regex_scratch_free(&w->scratch.regex);
+            walk_pool_destroy(pool);
+            return -1;
+        }
+        if (dir_scan_init(&w->scan) != 0) {
+            path_list_free(&w->dirs);
+            path_list_free(&w->files);
+            deque_destroy(&w->deque);
+            regex_scratch_free(&w->scratch.regex);
+            walk_pool_destroy(pool);
+            return -1;
+        }
+        w->scan.cache = ctx->cache;
+        pool->worker_count++;
+    }
+    return 0;
+}
+
+static void traversal_stats_merge(traversal_stats* dst, const traversal_stats* src) {
+    dst->directories_scanned += src->directories_scanned;
+    dst->entries_seen += src->entries_seen;
+    dst->files_matched += src->files_matched;
+    dst->subtrees_pruned += src->subtrees_pruned;
+    dst->include_checks += src->include_checks;
+    dst->include_checks_avoided += src->include_checks_avoided;
+}
+
+static void print_traversal_stats(const traversal_stats* stats) {
+    fprintf(stderr, "Stats: %zu directories scanned, %zu entries seen, %zu files matched, %zu subtrees pruned\n",
+            stats->directories_scanned, stats->entries_seen, stats->files_matched, stats->subtrees_pruned);
+    fprintf(stderr, "Stats: include filters evaluated on %zu paths, %zu ancestor prefix evaluations avoided\n",
+            stats->include_checks, stats->include_checks_avoided);
+}
+
+// The root's full path prefix is stored once in the result list, which
+// outlives the pool.
+static int walk_pool_add_root(walk_pool* pool, path_list* files, const char* full_path, const char* rel_prefix) {
+    walk_root* roots = realloc(pool->roots, (size_t)(pool->root_count + 1) * sizeof(walk_root));
+    if (!roots) return -1;
+    pool->roots = roots;
+    walk_root* root = &roots[pool->root_count];
+    if (walk_root_init(root, full_path, rel_prefix) != 0) return -1;
+    pool->root_count++;
+
+    path_buf prefix = {0};
+    if (path_buf_push(&prefix, full_path, strlen(full_path)) == 0 && path_buf_push(&prefix, "/", 1) == 0) {
+        root->list_root = path_list_add_root(files, prefix.data, prefix.len, root->rel_prefix_len);
+    }
+    path_buf_free(&prefix);
+    return root->list_root ? pool->root_count - 1 : -1;
+}
+
+static void walk_pool_run(walk_pool* pool) {
+    int started = 1;
+    for (int i = 1; i < pool->worker_count; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, walker_main, &pool->workers[i]) != 0) {
             break;
         }
+        started++;
+    }
+    walker_main(&pool->workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
     }
+}
+
+typedef struct {
+    char* path;
+    char* rel;
+    int is_dir;
+    dir_state state;
+} start_entry;
 
-    if (compacted_content) {
-        free(compacted_content);
+static void free_start_entries(start_entry* entries, int count) {
+    for (int i = 0; i < count; i++) {
+        free(entries[i].path);
+        free(entries[i].rel);
     }
-    free(content_buffer);
+    free(entries);
 }
 
-static void print_output(recap_context* ctx) {
-    int include_content_mode = (ctx->content_include_filters.count > 0);
-    int content_blocks = 0;
-    int last_output_was_content = 0;
+// Resolves the start paths and applies the filters to them. Directories get
+// their relative prefix ("" for the working directory, "dir/" otherwise).
+static int collect_start_entries(recap_context* ctx, filter_scratch* scratch, start_entry** out, int* out_count) {
+    start_entry* entries = calloc((size_t)(ctx->start_path_count > 0 ? ctx->start_path_count : 1), sizeof(start_entry));
+    if (!entries) return -1;
+    int count = 0;
 
-    for (size_t i = 0; i < ctx->matched_files.count; i++) {
-        const path_entry* entry = &ctx->matched_files.items[i];
-        const char* full_path = entry->full_path;
-        const char* rel_path = entry->rel_path;
-        int show_content = should_show_content(rel_path, full_path, ctx);
+    for (int i = 0; i < ctx->start_path_count; i++) {
+        char path[MAX_PATH_SIZE], rel_path[MAX_PATH_SIZE];
+        strncpy(path, ctx->start_paths[i], sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+        normalize_path(path);
 
-        if (include_content_mode) {
-            if (show_content) {
-                if (content_blocks > 0) {
-                    fprintf(ctx->output_stream, "---\n");
-                }
-                write_file_content_block(full_path, rel_path, ctx);
-                content_blocks++;
-                last_output_was_content = 1;
-            }
-            else {
-                if (last_output_was_content) {
-                    fprintf(ctx->output_stream, "---\n");
-                }
-                fprintf(ctx->output_stream, "%s\n", rel_path);
-                last_output_was_content = 0;
+        get_relative_path(path, ctx->cwd, rel_path, sizeof(rel_path));
+
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            fprintf(stderr, "Warning: Could not stat start path: %s\n", ctx->start_paths[i]);
+            continue;
+        }
+
+        dir_state state;
+        if (should_be_skipped(rel_path, S_ISDIR(st.st_mode), ctx, NULL, &state, scratch)) continue;
+
+        start_entry* entry = &entries[count];
+        if (S_ISDIR(st.st_mode)) {
+            char dir_rel_path[MAX_PATH_SIZE];
+            int dir_len = snprintf(dir_rel_path, sizeof(dir_rel_path), "%s/", rel_path);
+            if (dir_len < 0 || (size_t)dir_len >= sizeof(dir_rel_path)) {
+                fprintf(stderr, "Warning: path too long, skipping start directory: %s\n", rel_path);
+                continue;
             }
+            entry->rel = strdup(strcmp(rel_path, ".") == 0 ? "" : dir_rel_path);
+            entry->is_dir = 1;
+        }
+        else if (S_ISREG(st.st_mode)) {
+            entry->rel = strdup(rel_path);
+            entry->is_dir = 0;
+        }
+        else {
             continue;
         }
+        entry->path = strdup(path);
+        entry->state = state;
+        if (!entry->path || !entry->rel) {
+            free(entry->path);
+            free(entry->rel);
+            free_start_entries(entries, count);
+            return -1;
+        }
+        count++;
+    }
+
+    *out = entries;
+    *out_count = count;
+    return 0;
+}
 
-        fprintf(ctx->output_stream, "%s\n", rel_path);
+static int run_walk_pool(recap_context* ctx, start_entry* starts, int start_count) {
+    walk_pool pool;
+    int worker_count = ctx->jobs > 0 ? ctx->jobs : 1;
+    if (walk_pool_init(&pool, ctx, worker_count) != 0) {
+        fprintf(stderr, "Error: Failed to initialize traversal workers.\n");
+        return 1;
+    }
+
+    int next_worker = 0;
+    for (int i = 0; i < start_count; i++) {
+        start_entry* start = &starts[i];
+        if (start->is_dir) {
+            int root = walk_pool_add_root(&pool, &ctx->matched_files, start->path, start->rel);
+            // Spread the start directories over the workers so they are walked concurrently.
+            walker* w = &pool.workers[next_worker++ % pool.worker_count];
+            if (root < 0 || schedule_directory(w, root, start->rel, strlen(start->rel), &start->state, NULL) != 0) {
+                fprintf(stderr, "Warning: out of memory, skipping start directory: %s\n", start->path);
+            }
+        }
+        else if (path_list_add(&ctx->matched_files, start->path, start->rel) == 0) {
+            ctx->stats.files_matched++;
+        }
+    }
+
+    walk_pool_run(&pool);
+    for (int i = 0; i < pool.worker_count; i++) {
+        traversal_stats_merge(&ctx->stats, &pool.workers[i].scratch.stats);
+        if (path_list_append(&ctx->matched_files, &pool.workers[i].files) != 0 ||
+            (ctx->watch && path_list_append(&ctx->watch_dirs, &pool.workers[i].dirs) != 0)) {
+            fprintf(stderr, "Error: Failed to collect traversal results.\n");
+            walk_pool_destroy(&pool);
+            return 1;
+        }
+    }
+    walk_pool_destroy(&pool);
+
+    path_list_sort(&ctx->matched_files);
+    if (!ctx->watch) print_output(ctx);
+    return 0;
+}
+
+typedef struct {
+    size_t name_offset;
+    size_t name_len;
+    int is_dir;
+    const char* name;
+} stream_entry;
+
+typedef struct {
+    recap_context* ctx;
+    filter_scratch scratch;
+    dir_scan scan;
+    path_buf rel;
+    path_buf full;
+    int shared_fds;
+    int max_shared_fds;
+    output_state out;
+} stream_walker;
+
+// Orders directory entries the way their full relative paths sort with
+// strcmp: a directory sorts as "name/" since all of its descendants do.
+static int compare_stream_entries(const void* a, const void* b) {
+    const stream_entry* ea = a;
+    const stream_entry* eb = b;
+    for (size_t i = 0;; i++) {
+        int ca = i < ea->name_len ? (unsigned char)ea->name[i] : (i == ea->name_len && ea->is_dir ? '/' : 0);
+        int cb = i < eb->name_len ? (unsigned char)eb->name[i] : (i == eb->name_len && eb->is_dir ? '/' : 0);
+        if (ca != cb) return ca - cb;
+        if (ca == 0) return 0;
     }
 }
 
-static void traverse_directory(const char* base_path, const char* rel_path_prefix, recap_context* ctx) {
-    DIR* dir = opendir(base_path);
-    if (!dir) {
+static int compare_start_entries(const void* a, const void* b) {
+    return strcmp(((const start_entry*)a)->rel, ((const start_entry*)b)->rel);
+}
+
+// Reads and sorts one directory, then emits its files and recurses into its
+// subdirectories in that order. Only the listings of the directories on the
+// current path are held in memory, along with their fds so that each
+// subdirectory is opened by its name alone.
+static void stream_directory(stream_walker* sw, const walk_root* root, const dir_state* parent_state, int parent_fd) {
+    recap_context* ctx = sw->ctx;
+    if (dir_scan_open(&sw->scan, root->fd, root->full_path, sw->rel.data + root->rel_prefix_len, parent_fd) != 0) {
         return;
     }
+    sw->scratch.stats.directories_scanned++;
+    ignore_scope* owned = NULL;
+    dir_state here = *parent_state;
+    here.ignore = enter_ignore_scope(ctx, &sw->scan, parent_state, sw->rel.len, &owned);
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    stream_entry* entries = NULL;
+    size_t count = 0, capacity = 0;
+    int has_dirs = 0;
+    path_buf names = {0};
+    const char* name;
+    int type;
+    while (dir_scan_next(&sw->scan, &name, &type)) {
+        sw->scratch.stats.entries_seen++;
+        if (type == DIR_ENTRY_UNKNOWN) {
+            type = dir_scan_resolve_type(&sw->scan, name);
+        }
+        if (type != DIR_ENTRY_DIR && type != DIR_ENTRY_REG) {
             continue;
         }
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 32;
+            stream_entry* new_entries = realloc(entries, new_capacity * sizeof(stream_entry));
+            if (!new_entries) break;
+            entries = new_entries;
+            capacity = new_capacity;
+        }
+        size_t name_len = strlen(name);
+        size_t offset = names.len;
+        if (path_buf_push(&names, name, name_len + 1) != 0) break;
+        entries[count].name_offset = offset;
+        entries[count].name_len = name_len;
+        entries[count].is_dir = (type == DIR_ENTRY_DIR);
+        has_dirs |= entries[count].is_dir;
+        count++;
+    }
+    int dir_fd = has_dirs && sw->shared_fds < sw->max_shared_fds ? dir_scan_share_fd(&sw->scan) : -1;
+    if (dir_fd >= 0) sw->shared_fds++;
+    dir_scan_close(&sw->scan);
 
-        char full_path[MAX_PATH_SIZE];
-        char rel_path[MAX_PATH_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        entries[i].name = names.data + entries[i].name_offset;
+    }
+    if (count > 1) qsort(entries, count, sizeof(stream_entry), compare_stream_entries);
 
-        int len = snprintf(full_path, sizeof(full_path), "%s/%s", base_path, entry->d_name);
-        if (len < 0 || (size_t)len >= sizeof(full_path)) {
+    size_t base_len = sw->rel.len;
+    size_t full_base_len = strlen(root->full_path) + 1 + (base_len - root->rel_prefix_len);
+    for (size_t i = 0; i < count; i++) {
+        const stream_entry* entry = &entries[i];
+        if (base_len + entry->name_len >= MAX_PATH_SIZE || full_base_len + entry->name_len >= MAX_PATH_SIZE) {
             continue;
         }
-
-        len = snprintf(rel_path, sizeof(rel_path), "%s%s", rel_path_prefix, entry->d_name);
-        if (len < 0 || (size_t)len >= sizeof(rel_path)) {
+        path_buf_truncate(&sw->rel, base_len);
+        if (path_buf_push(&sw->rel, entry->name, entry->name_len) != 0) {
             continue;
         }
 
-        struct stat st;
-        int have_type = 0;
-#if defined(_DIRENT_HAVE_D_TYPE) && defined(DT_UNKNOWN) && defined(DT_DIR) && defined(DT_REG) && defined(S_IFDIR) && defined(S_IFREG)
-        if (entry->d_type != DT_UNKNOWN) {
-            memset(&st, 0, sizeof(st));
-            have_type = 1;
-            switch (entry->d_type) {
-            case DT_DIR:
-                st.st_mode = S_IFDIR;
-                break;
-            case DT_REG:
-                st.st_mode = S_IFREG;
-                break;
-            default:
-                have_type = 0;
-                break;
-            }
+        dir_state state;
+        if (should_be_skipped(sw->rel.data, entry->is_dir, ctx, &here, &state, &sw->scratch)) {
+            continue;
         }
-#endif
 
-        if (!have_type) {
-            if (lstat(full_path, &st) != 0) {
+        if (entry->is_dir) {
+            if (sw->rel.len + 1 >= MAX_PATH_SIZE || path_buf_push(&sw->rel, "/", 1) != 0) {
+                fprintf(stderr, "Warning: path too long, skipping directory: %s\n", sw->rel.data);
                 continue;
             }
+            stream_directory(sw, root, &state, dir_fd);
+        }
+        else {
+            const char* full_path = build_full_path(&sw->full, root, &sw->rel);
+            if (full_path) {
+                output_entry(&sw->out, full_path, sw->rel.data);
+                sw->scratch.stats.files_matched++;
+            }
+        }
+    }
+    path_buf_truncate(&sw->rel, base_len);
+    fflush(ctx->output_stream);
+
+    if (dir_fd >= 0) {
+        close(dir_fd);
+        sw->shared_fds--;
+    }
+    free(entries);
+    path_buf_free(&names);
+    free_ignore_scopes(owned);
+}
+
+// Streaming only reproduces the global sort when no start path lies inside
+// another one; the caller falls back to collecting otherwise.
+static int start_entries_disjoint(start_entry* starts, int start_count) {
+    qsort(starts, (size_t)start_count, sizeof(start_entry), compare_start_entries);
+    for (int i = 1; i < start_count; i++) {
+        const char* prev = starts[i - 1].rel;
+        if (strncmp(prev, starts[i].rel, strlen(prev)) == 0) return 0;
+    }
+    return 1;
+}
+
+static int run_stream(recap_context* ctx, start_entry* starts, int start_count) {
+    stream_walker sw;
+    memset(&sw, 0, sizeof(sw));
+    sw.ctx = ctx;
+    sw.scan.fd = -1;
+    sw.max_shared_fds = shared_dir_fd_limit();
+    if (regex_scratch_init(&sw.scratch.regex) != 0 || dir_scan_init(&sw.scan) != 0 || output_begin(&sw.out, ctx) != 0) {
+        fprintf(stderr, "Error: Failed to initialize streaming traversal.\n");
+        regex_scratch_free(&sw.scratch.regex);
+        dir_scan_free(&sw.scan);
+        return 1;
+    }
+    sw.scan.cache = ctx->cache;
+
+    for (int i = 0; i < start_count; i++) {
+        start_entry* start = &starts[i];
+        if (!start->is_dir) {
+            output_entry(&sw.out, start->path, start->rel);
+            sw.scratch.stats.files_matched++;
+            continue;
         }
-        if (should_be_skipped(rel_path, &st, ctx)) {
+        walk_root root;
+        if (walk_root_init(&root, start->path, start->rel) != 0) {
+            fprintf(stderr, "Warning: out of memory, skipping start directory: %s\n", start->path);
             continue;
         }
+        sw.rel.len = 0;
+        if (path_buf_push(&sw.rel, start->rel, strlen(start->rel)) == 0) {
+            stream_directory(&sw, &root, &start->state, -1);
+        }
+        walk_root_free(&root);
+    }
 
-        if (S_ISDIR(st.st_mode)) {
-            char dir_rel_path[MAX_PATH_SIZE];
-            int dir_len = snprintf(dir_rel_path, sizeof(dir_rel_path), "%s/", rel_path);
-            if (dir_len < 0 || (size_t)dir_len >= sizeof(dir_rel_path)) {
-                fprintf(stderr, "Warning: path too long, skipping directory: %s\n", rel_path);
+    traversal_stats_merge(&ctx->stats, &sw.scratch.stats);
+    output_end(&sw.out);
+    regex_scratch_free(&sw.scratch.regex);
+    dir_scan_free(&sw.scan);
+    path_buf_free(&sw.rel);
+    path_buf_free(&sw.full);
+    return 0;
+}
+
+// One directory on the path of the current index entry; files below a
+// skipped directory are dropped without being matched.
+typedef struct {
+    size_t rel_len;
+    int skipped;
+    dir_state state;
+    const path_dir* dir;
+} index_dir;
+
+// Replays the walk of one start directory over the sorted index entries:
+// directories are evaluated once, when the first entry below them shows up,
+// with the same inherited state the walker would pass down.
+typedef struct {
+    const path_root* root;
+    path_buf repo_prefix;
+    path_buf rel;
+    index_dir* stack;
+    size_t depth;
+    size_t capacity;
+    int seen;
+    int done;
+} index_walk;
+
+static index_dir* index_walk_push(index_walk* iw) {
+    if (iw->depth == iw->capacity) {
+        size_t new_capacity = iw->capacity ? iw->capacity * 2 : 32;
+        index_dir* stack = realloc(iw->stack, new_capacity * sizeof(index_dir));
+        if (!stack) return NULL;
+        iw->stack = stack;
+        iw->capacity = new_capacity;
+    }
+    index_dir* level = &iw->stack[iw->depth++];
+    memset(level, 0, sizeof(*level));
+    return level;
+}
+
+// With --changed, listed entries keep their index stat data in pending (one
+// per file added after first) until their files have been checked.
+typedef struct {
+    git_index_entry* pending;
+    size_t count;
+    size_t capacity;
+    size_t first;
+} index_changes;
+
+static void index_walk_entry(index_walk* iw, recap_context* ctx, const git_index_entry* entry, const char* rel, size_t rel_len, index_changes* changes, filter_scratch* scratch) {
+    while (iw->depth > 1) {
+        const index_dir* top = &iw->stack[iw->depth - 1];
+        if (top->rel_len < rel_len && memcmp(iw->rel.data, rel, top->rel_len) == 0) break;
+        iw->depth--;
+    }
+    path_buf_truncate(&iw->rel, iw->stack[iw->depth - 1].rel_len);
+
+    // Enter the directories between the deepest one kept and the file.
+    const char* slash;
+    while (!iw->stack[iw->depth - 1].skipped && (slash = memchr(rel + iw->rel.len, '/', rel_len - iw->rel.len)) != NULL) {
+        const index_dir* parent = &iw->stack[iw->depth - 1];
+        dir_state state;
+        if (path_buf_push(&iw->rel, rel + iw->rel.len, (size_t)(slash - rel) - iw->rel.len) != 0) return;
+        int skipped = should_be_skipped(iw->rel.data, 1, ctx, &parent->state, &state, scratch);
+        if (path_buf_push(&iw->rel, "/", 1) != 0) return;
+        index_dir* level = index_walk_push(iw);
+        if (!level) return;
+        level->rel_len = iw->rel.len;
+        level->skipped = skipped;
+        level->state = state;
+    }
+    index_dir* top = &iw->stack[iw->depth - 1];
+    if (top->skipped) return;
+
+    dir_state state;
+    if (should_be_skipped(rel, 0, ctx, &top->state, &state, scratch)) return;
+    if (changes && changes->count == changes->capacity) {
+        size_t new_capacity = changes->capacity ? changes->capacity * 2 : 1024;
+        git_index_entry* pending = realloc(changes->pending, new_capacity * sizeof(git_index_entry));
+        if (!pending) return;
+        changes->pending = pending;
+        changes->capacity = new_capacity;
+    }
+    if (!top->dir) top->dir = path_list_add_dir(&ctx->matched_files, iw->root, iw->rel.data, iw->rel.len);
+    if (!top->dir || path_list_add_file(&ctx->matched_files, top->dir, rel + top->rel_len, rel_len - top->rel_len) != 0) return;
+    if (changes) {
+        // The name may point into the reader's buffer, which moves on.
+        git_index_entry* kept = &changes->pending[changes->count++];
+        *kept = *entry;
+        kept->path = NULL;
+    }
+    else {
+        scratch->stats.files_matched++;
+    }
+}
+
+typedef struct {
+    recap_context* ctx;
+    const git_index* idx;
+    const index_changes* changes;
+    unsigned char* changed;
+    size_t begin;
+    size_t end;
+    pthread_t thread;
+} change_check;
+
+// Deleted files have nothing to show and are dropped as well. Files are
+// looked at by their full path: under --serve the process's working
+// directory is not the request's.
+static void* check_changes(void* arg) {
+    change_check* check = arg;
+    const path_list* files = &check->ctx->matched_files;
+    path_buf full = {0};
+    for (size_t i = check->begin; i < check->end; i++) {
+        struct stat st;
+        check->changed[i] = path_entry_full_path(&files->items[check->changes->first + i], &full) == 0 &&
+                            lstat(full.data, &st) == 0 &&
+                            git_index_entry_changed(check->idx, &check->changes->pending[i], full.data, &st);
+    }
+    path_buf_free(&full);
+    return NULL;
+}
+
+// Stats the listed files on the worker threads, like git's preloaded index,
+// and keeps the ones that changed.
+static void filter_changed(recap_context* ctx, const git_index* idx, const index_changes* changes) {
+    path_list* files = &ctx->matched_files;
+    unsigned char* changed = calloc(changes->count ? changes->count : 1, 1);
+    int worker_count = ctx->jobs > 0 ? ctx->jobs : 1;
+    if (changes->count < 1024) worker_count = 1;
+    change_check* checks = calloc((size_t)worker_count, sizeof(change_check));
+    if (!changed || !checks) {
+        fprintf(stderr, "Error: Could not allocate memory for the change check.\n");
+        files->count = changes->first;
+        free(changed);
+        free(checks);
+        return;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        checks[i].ctx = ctx;
+        checks[i].idx = idx;
+        checks[i].changes = changes;
+        checks[i].changed = changed;
+        checks[i].begin = changes->count * (size_t)i / (size_t)worker_count;
+        checks[i].end = changes->count * (size_t)(i + 1) / (size_t)worker_count;
+    }
+    int started = 1;
+    while (started < worker_count && pthread_create(&checks[started].thread, NULL, check_changes, &checks[started]) == 0) {
+        started++;
+    }
+    // Ranges whose thread could not be started are checked here.
+    for (int i = started; i < worker_count; i++) check_changes(&checks[i]);
+    check_changes(&checks[0]);
+    for (int i = 1; i < started; i++) pthread_join(checks[i].thread, NULL);
+
+    size_t kept = changes->first;
+    for (size_t i = 0; i < changes->count; i++) {
+        if (changed[i]) files->items[kept++] = files->items[changes->first + i];
+    }
+    files->count = kept;
+    ctx->stats.files_matched += kept - changes->first;
+    free(changed);
+    free(checks);
+}
+
+static void index_walk_free(index_walk* iw) {
+    path_buf_free(&iw->repo_prefix);
+    path_buf_free(&iw->rel);
+    free(iw->stack);
+}
+
+// Lists the start directories from .git/index: one sequential pass over the
+// entries and no directory reads. Start paths are cwd-relative and index
+// paths relative to the work tree; cwd_prefix maps between the two.
+static int run_index(recap_context* ctx, git_index* idx, const char* cwd_prefix, start_entry* starts, int start_count) {
+    size_t cwd_prefix_len = strlen(cwd_prefix);
+    index_walk* walks = calloc((size_t)(start_count > 0 ? start_count : 1), sizeof(index_walk));
+    if (!walks) {
+        fprintf(stderr, "Error: Failed to prepare start paths.\n");
+        return 1;
+    }
+    filter_scratch scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    if (regex_scratch_init(&scratch.regex) != 0) {
+        fprintf(stderr, "Error: Could not allocate regex match data.\n");
+        free(walks);
+        return 1;
+    }
+
+    int walk_count = 0;
+    for (int i = 0; i < start_count; i++) {
+        start_entry* start = &starts[i];
+        if (!start->is_dir) {
+            if (path_list_add(&ctx->matched_files, start->path, start->rel) == 0) ctx->stats.files_matched++;
+            continue;
+        }
+        index_walk* iw = &walks[walk_count++];
+        path_buf prefix = {0};
+        if (path_buf_push(&prefix, start->path, strlen(start->path)) == 0 && path_buf_push(&prefix, "/", 1) == 0) {
+            iw->root = path_list_add_root(&ctx->matched_files, prefix.data, prefix.len, strlen(start->rel));
+        }
+        path_buf_free(&prefix);
+        index_dir* level = index_walk_push(iw);
+        if (!iw->root || !level ||
+            path_buf_push(&iw->repo_prefix, cwd_prefix, cwd_prefix_len) != 0 ||
+            path_buf_push(&iw->repo_prefix, start->rel, strlen(start->rel)) != 0 ||
+            path_buf_push(&iw->rel, start->rel, strlen(start->rel)) != 0) {
+            fprintf(stderr, "Warning: out of memory, skipping start directory: %s\n", start->path);
+            iw->done = 1;
+            continue;
+        }
+        level->rel_len = iw->rel.len;
+        level->state = start->state;
+    }
+
+    index_changes changes = {0};
+    changes.first = ctx->matched_files.count;
+    git_index_entry entry;
+    while (git_index_next(idx, &entry)) {
+        scratch.stats.entries_seen++;
+        if (!S_ISREG(entry.mode) || entry.path_len <= cwd_prefix_len || entry.path_len - cwd_prefix_len >= MAX_PATH_SIZE) continue;
+        for (int i = 0; i < walk_count; i++) {
+            index_walk* iw = &walks[i];
+            if (iw->done) continue;
+            if (entry.path_len <= iw->repo_prefix.len || memcmp(entry.path, iw->repo_prefix.data, iw->repo_prefix.len) != 0) {
+                // Entries are sorted, so the ones below a directory are contiguous.
+                iw->done = iw->seen;
                 continue;
             }
-            traverse_directory(full_path, dir_rel_path, ctx);
+            iw->seen = 1;
+            index_walk_entry(iw, ctx, &entry, entry.path + cwd_prefix_len, entry.path_len - cwd_prefix_len, ctx->changed_only ? &changes : NULL, &scratch);
         }
-        else if (S_ISREG(st.st_mode)) {
-            path_list_add(&ctx->matched_files, full_path, rel_path);
+    }
+
+    for (int i = 0; i < walk_count; i++) {
+        index_walk_free(&walks[i]);
+    }
+    free(walks);
+    traversal_stats_merge(&ctx->stats, &scratch.stats);
+    regex_scratch_free(&scratch.regex);
+    if (ctx->changed_only) filter_changed(ctx, idx, &changes);
+    free(changes.pending);
+
+    path_list_sort(&ctx->matched_files);
+    if (!ctx->watch) print_output(ctx);
+    return 0;
+}
+
+// Finds the repository and maps the working directory into its work tree.
+// Start paths outside the work tree cannot be answered from git's data.
+static int find_work_tree(recap_context* ctx, path_buf* cwd_prefix, path_buf* git_dir) {
+    path_buf work_tree = {0};
+    int rc = -1;
+    if (git_repo_find(ctx->cwd, &work_tree, git_dir) == 0) {
+        const char* below = ctx->cwd + (work_tree.len > 1 ? work_tree.len : 0);
+        while (*below == '/') below++;
+        rc = 0;
+        if (path_buf_push(cwd_prefix, below, strlen(below)) != 0 || (*below && path_buf_push(cwd_prefix, "/", 1) != 0)) rc = -1;
+        for (int i = 0; rc == 0 && i < ctx->start_path_count; i++) {
+            char path[MAX_PATH_SIZE], rel_path[MAX_PATH_SIZE];
+            strncpy(path, ctx->start_paths[i], sizeof(path) - 1);
+            path[sizeof(path) - 1] = '\0';
+            normalize_path(path);
+            get_relative_path(path, ctx->cwd, rel_path, sizeof(rel_path));
+            if (rel_path[0] == '/' || strcmp(rel_path, "..") == 0 || strncmp(rel_path, "../", 3) == 0) rc = -1;
         }
     }
+    path_buf_free(&work_tree);
+    return rc;
+}
 
-    closedir(dir);
+static int open_git_index(recap_context* ctx, git_index* idx, path_buf* cwd_prefix) {
+    path_buf git_dir = {0};
+    int rc = find_work_tree(ctx, cwd_prefix, &git_dir);
+    if (rc == 0) rc = git_index_open(idx, git_dir.data);
+    path_buf_free(&git_dir);
+    return rc;
 }
 
-int start_traversal(recap_context* ctx) {
-    if (path_list_init(&ctx->matched_files) != 0) {
-        fprintf(stderr, "Error: Failed to initialize path list.\n");
+// Tree entries are "<octal mode> <name>\0<object id>".
+typedef struct {
+    const char* name;
+    size_t name_len;
+    unsigned mode;
+    const unsigned char* oid;
+} tree_entry;
+
+static const char* next_tree_entry(const char* p, const char* end, tree_entry* entry) {
+    entry->mode = 0;
+    while (p < end && *p >= '0' && *p <= '7') entry->mode = entry->mode * 8 + (unsigned)(*p++ - '0');
+    if (p >= end || *p++ != ' ') return NULL;
+    const char* nul = memchr(p, '\0', (size_t)(end - p));
+    if (!nul || (size_t)(end - nul - 1) < GIT_OID_SIZE) return NULL;
+    entry->name = p;
+    entry->name_len = (size_t)(nul - p);
+    entry->oid = (const unsigned char*)nul + 1;
+    return nul + 1 + GIT_OID_SIZE;
+}
+
+// Follows repo_path ("" for the root) down from the root tree. Returns the
+// entry's mode, 040000 for a tree, and 0 when the path does not exist.
+static unsigned lookup_tree_path(git_odb* odb, const unsigned char* root, const char* repo_path, unsigned char* oid) {
+    unsigned mode = 040000;
+    memcpy(oid, root, GIT_OID_SIZE);
+    const char* p = repo_path;
+    while (*p) {
+        size_t len = strcspn(p, "/");
+        int type;
+        char* data;
+        size_t size;
+        if (!S_ISDIR(mode) || git_odb_read(odb, oid, &type, &data, &size) != 0) return 0;
+        mode = 0;
+        tree_entry entry;
+        const char* end = data + size;
+        for (const char* e = type == GIT_OBJ_TREE ? data : NULL; e && (e = next_tree_entry(e, end, &entry)) != NULL;) {
+            if (entry.name_len == len && memcmp(entry.name, p, len) == 0) {
+                mode = entry.mode;
+                memcpy(oid, entry.oid, GIT_OID_SIZE);
+                break;
+            }
+        }
+        free(data);
+        if (mode == 0) return 0;
+        p += len;
+        while (*p == '/') p++;
+    }
+    return mode;
+}
+
+// Lists a tree from --rev below rel ("" or "dir/"). Files are added with
+// their blob id as the full path; symlinks and submodules are left out.
+static void walk_rev_tree(recap_context* ctx, const unsigned char* tree, path_buf* rel, const dir_state* parent, filter_scratch* scratch) {
+    int type = 0;
+    char* data = NULL;
+    size_t size;
+    if (git_odb_read(ctx->objects, tree, &type, &data, &size) != 0 || type != GIT_OBJ_TREE) {
+        free(data);
+        fprintf(stderr, "Warning: Could not read tree for directory: %s\n", rel->len ? rel->data : ".");
+        return;
+    }
+    scratch->stats.directories_scanned++;
+
+    size_t rel_len = rel->len;
+    const char* end = data + size;
+    tree_entry entry;
+    for (const char* e = data; (e = next_tree_entry(e, end, &entry)) != NULL;) {
+        scratch->stats.entries_seen++;
+        int is_dir = S_ISDIR(entry.mode);
+        if ((!is_dir && !S_ISREG(entry.mode)) || rel_len + entry.name_len + 2 >= MAX_PATH_SIZE) continue;
+        path_buf_truncate(rel, rel_len);
+        if (path_buf_push(rel, entry.name, entry.name_len) != 0) break;
+        dir_state state;
+        if (should_be_skipped(rel->data, is_dir, ctx, parent, &state, scratch)) continue;
+        if (is_dir) {
+            if (path_buf_push(rel, "/", 1) != 0) break;
+            walk_rev_tree(ctx, entry.oid, rel, &state, scratch);
+        }
+        else {
+            char hex[GIT_OID_SIZE * 2 + 1];
+            git_oid_to_hex(entry.oid, hex);
+            if (path_list_add(&ctx->matched_files, hex, rel->data) == 0) scratch->stats.files_matched++;
+        }
+    }
+    path_buf_truncate(rel, rel_len);
+    free(data);
+}
+
+// Lists the start paths as they are in the tree --rev names instead of the
+// working tree; no file is opened outside .git.
+static int run_rev(recap_context* ctx, const unsigned char* root, const char* cwd_prefix) {
+    filter_scratch scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    if (regex_scratch_init(&scratch.regex) != 0) {
+        fprintf(stderr, "Error: Could not allocate regex match data.\n");
         return 1;
     }
 
+    path_buf repo_path = {0};
+    path_buf rel = {0};
     for (int i = 0; i < ctx->start_path_count; i++) {
         char path[MAX_PATH_SIZE], rel_path[MAX_PATH_SIZE];
         strncpy(path, ctx->start_paths[i], sizeof(path) - 1);
         path[sizeof(path) - 1] = '\0';
         normalize_path(path);
-
         get_relative_path(path, ctx->cwd, rel_path, sizeof(rel_path));
+        int is_cwd = strcmp(rel_path, ".") == 0;
 
-        struct stat st;
-        if (lstat(path, &st) != 0) {
-            fprintf(stderr, "Warning: Could not stat start path: %s\n", ctx->start_paths[i]);
+        repo_path.len = 0;
+        rel.len = 0;
+        if (path_buf_push(&repo_path, cwd_prefix, strlen(cwd_prefix)) != 0 ||
+            path_buf_push(&repo_path, is_cwd ? "" : rel_path, is_cwd ? 0 : strlen(rel_path)) != 0) {
+            break;
+        }
+        unsigned char oid[GIT_OID_SIZE];
+        unsigned mode = lookup_tree_path(ctx->objects, root, repo_path.data, oid);
+        if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+            fprintf(stderr, "Warning: Start path not found in %s: %s\n", ctx->rev, ctx->start_paths[i]);
             continue;
         }
 
-        if (should_be_skipped(rel_path, &st, ctx)) continue;
-
-        if (S_ISDIR(st.st_mode)) {
-            char dir_rel_path[MAX_PATH_SIZE];
-            int dir_len = snprintf(dir_rel_path, sizeof(dir_rel_path), "%s/", rel_path);
-            if (dir_len < 0 || (size_t)dir_len >= sizeof(dir_rel_path)) {
-                fprintf(stderr, "Warning: path too long, skipping start directory: %s\n", rel_path);
-                continue;
+        dir_state state;
+        if (should_be_skipped(rel_path, S_ISDIR(mode), ctx, NULL, &state, &scratch)) continue;
+        if (S_ISDIR(mode)) {
+            if (path_buf_push(&rel, is_cwd ? "" : rel_path, is_cwd ? 0 : strlen(rel_path)) != 0 ||
+                (!is_cwd && path_buf_push(&rel, "/", 1) != 0)) {
+                break;
             }
-            traverse_directory(path, strcmp(rel_path, ".") == 0 ? "" : dir_rel_path, ctx);
+            walk_rev_tree(ctx, oid, &rel, &state, &scratch);
         }
-        else if (S_ISREG(st.st_mode)) {
-            path_list_add(&ctx->matched_files, path, rel_path);
+        else {
+            char hex[GIT_OID_SIZE * 2 + 1];
+            git_oid_to_hex(oid, hex);
+            if (path_list_add(&ctx->matched_files, hex, rel_path) == 0) scratch.stats.files_matched++;
         }
     }
+    path_buf_free(&repo_path);
+    path_buf_free(&rel);
+    traversal_stats_merge(&ctx->stats, &scratch.stats);
+    regex_scratch_free(&scratch.regex);
 
     path_list_sort(&ctx->matched_files);
-    print_output(ctx);
+    if (!ctx->watch) print_output(ctx);
     return 0;
 }
+
+static int start_rev(recap_context* ctx) {
+    path_buf cwd_prefix = {0};
+    path_buf git_dir = {0};
+    unsigned char tree[GIT_OID_SIZE];
+    int rc = 1;
+    if (find_work_tree(ctx, &cwd_prefix, &git_dir) != 0) {
+        fprintf(stderr, "Error: --rev needs start paths inside a git work tree.\n");
+    }
+    else if ((ctx->objects = git_odb_open(git_dir.data)) == NULL) {
+        fprintf(stderr, "Error: Could not open the git object store in %s\n", git_dir.data);
+    }
+    else if (git_odb_resolve_tree(ctx->objects, ctx->rev, tree) != 0) {
+        fprintf(stderr, "Error: Could not resolve revision '%s'.\n", ctx->rev);
+    }
+    else {
+        rc = run_rev(ctx, tree, cwd_prefix.data);
+    }
+    git_odb_free(ctx->objects);
+    ctx->objects = NULL;
+    path_buf_free(&cwd_prefix);
+    path_buf_free(&git_dir);
+    if (ctx->show_stats) {
+        print_traversal_stats(&ctx->stats);
+    }
+    return rc;
+}
+
+int start_traversal(recap_context* ctx) {
+    if (path_list_init(&ctx->matched_files) != 0 || (ctx->watch && path_list_init(&ctx->watch_dirs) != 0)) {
+        fprintf(stderr, "Error: Failed to initialize path list.\n");
+        return 1;
+    }
+    if (ctx->rev) return start_rev(ctx);
+
+    git_index idx;
+    path_buf cwd_prefix = {0};
+    if (ctx->use_git_index && open_git_index(ctx, &idx, &cwd_prefix) != 0) {
+        fprintf(stderr, "Warning: Could not read the git index, walking the directory tree instead.\n");
+        ctx->use_git_index = 0;
+        ctx->changed_only = 0;
+    }
+
+    filter_scratch scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    if (regex_scratch_init(&scratch.regex) != 0) {
+        fprintf(stderr, "Error: Could not allocate regex match data.\n");
+        if (ctx->use_git_index) git_index_close(&idx);
+        path_buf_free(&cwd_prefix);
+        return 1;
+    }
+
+    start_entry* starts = NULL;
+    int start_count = 0;
+    int rc = collect_start_entries(ctx, &scratch, &starts, &start_count);
+    traversal_stats_merge(&ctx->stats, &scratch.stats);
+    regex_scratch_free(&scratch.regex);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Failed to prepare start paths.\n");
+        if (ctx->use_git_index) git_index_close(&idx);
+        path_buf_free(&cwd_prefix);
+        return 1;
+    }
+
+    if (ctx->use_git_index) {
+        rc = run_index(ctx, &idx, cwd_prefix.data, starts, start_count);
+        git_index_close(&idx);
+    }
+    else if (ctx->stream_output && start_entries_disjoint(starts, start_count)) {
+        rc = run_stream(ctx, starts, start_count);
+    }
+    else {
+        rc = run_walk_pool(ctx, starts, start_count);
+    }
+    free_start_entries(starts, start_count);
+    path_buf_free(&cwd_prefix);
+
+    if (ctx->show_stats) {
+        print_traversal_stats(&ctx->stats);
+    }
+    return rc;
+}
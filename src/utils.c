@@ -9,17 +9,33 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 
-int is_text_file(const char* full_path) {
-    FILE* file = fopen(full_path, "rb");
-    if (!file) return 0;
-    unsigned char buffer[1024];
-    size_t bytes_read = fread(buffer, 1, sizeof(buffer), file);
-    fclose(file);
-    if (bytes_read == 0) return 1;
-    for (size_t i = 0; i < bytes_read; i++) {
-        if (buffer[i] == '\0') return 0;
-    }
-    return 1;
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+void* arena_alloc(str_arena* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena_chunk* chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arena_chunk) + chunk_size);
+        if (!chunk) return NULL;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    void* p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+void arena_free(str_arena* arena) {
+    arena_chunk* chunk = arena->head;
+    while (chunk) {
+        arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
 }
 
 int path_list_init(path_list* list) {
@@ -27,51 +43,233 @@ int path_list_init(path_list* list) {
     if (!list->items) return -1;
     list->count = 0;
     list->capacity = 16;
+    list->arena.head = NULL;
     return 0;
 }
 
-int path_list_add(path_list* list, const char* full_path, const char* rel_path) {
+const path_root* path_list_add_root(path_list* list, const char* prefix, size_t prefix_len, size_t rel_skip) {
+    path_root* root = arena_alloc(&list->arena, sizeof(path_root) + prefix_len + 1);
+    if (!root) return NULL;
+    root->prefix_len = prefix_len;
+    root->rel_skip = rel_skip;
+    memcpy(root->prefix, prefix, prefix_len);
+    root->prefix[prefix_len] = '\0';
+    return root;
+}
+
+const path_dir* path_list_add_dir(path_list* list, const path_root* root, const char* rel, size_t rel_len) {
+    path_dir* dir = arena_alloc(&list->arena, sizeof(path_dir) + rel_len + 1);
+    if (!dir) return NULL;
+    dir->root = root;
+    dir->rel_len = rel_len;
+    memcpy(dir->rel, rel, rel_len);
+    dir->rel[rel_len] = '\0';
+    return dir;
+}
+
+int path_list_add_file(path_list* list, const path_dir* dir, const char* name, size_t name_len) {
     if (list->count >= list->capacity) {
-        size_t new_capacity = list->capacity * 2;
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 16;
         path_entry* new_items = realloc(list->items, new_capacity * sizeof(path_entry));
         if (!new_items) return -1;
         list->items = new_items;
         list->capacity = new_capacity;
     }
+    char* stored = arena_alloc(&list->arena, name_len + 1);
+    if (!stored) return -1;
+    memcpy(stored, name, name_len);
+    stored[name_len] = '\0';
     path_entry* entry = &list->items[list->count];
-    entry->full_path = strdup(full_path);
-    entry->rel_path = strdup(rel_path);
-    if (!entry->full_path || !entry->rel_path) {
-        free(entry->full_path);
-        free(entry->rel_path);
-        return -1;
-    }
+    entry->dir = dir;
+    entry->name = stored;
+    entry->name_len = name_len;
     list->count++;
     return 0;
 }
 
+// Adds a single file that is not part of a directory walk, such as a file
+// given directly on the command line; its full path is kept verbatim.
+int path_list_add(path_list* list, const char* full_path, const char* rel_path) {
+    size_t rel_len = strlen(rel_path);
+    const char* slash = strrchr(rel_path, '/');
+    size_t dir_len = slash ? (size_t)(slash - rel_path) + 1 : 0;
+    const path_root* root = path_list_add_root(list, full_path, strlen(full_path), rel_len);
+    const path_dir* dir = root ? path_list_add_dir(list, root, rel_path, dir_len) : NULL;
+    if (!dir) return -1;
+    return path_list_add_file(list, dir, rel_path + dir_len, rel_len - dir_len);
+}
+
+int path_entry_rel_path(const path_entry* entry, path_buf* out) {
+    out->len = 0;
+    if (path_buf_reserve(out, entry->dir->rel_len + entry->name_len + 1) != 0) return -1;
+    path_buf_push(out, entry->dir->rel, entry->dir->rel_len);
+    path_buf_push(out, entry->name, entry->name_len);
+    return 0;
+}
+
+int path_entry_full_path(const path_entry* entry, path_buf* out) {
+    const path_dir* dir = entry->dir;
+    const path_root* root = dir->root;
+    out->len = 0;
+    if (path_buf_reserve(out, root->prefix_len + dir->rel_len + entry->name_len + 1) != 0) return -1;
+    path_buf_push(out, root->prefix, root->prefix_len);
+    if (root->rel_skip <= dir->rel_len) {
+        path_buf_push(out, dir->rel + root->rel_skip, dir->rel_len - root->rel_skip);
+        path_buf_push(out, entry->name, entry->name_len);
+    }
+    else if (root->rel_skip < dir->rel_len + entry->name_len) {
+        size_t skip = root->rel_skip - dir->rel_len;
+        path_buf_push(out, entry->name + skip, entry->name_len - skip);
+    }
+    return 0;
+}
+
+// Entries keep pointing into src's arena, so its chunks move over as well.
+int path_list_append(path_list* dst, path_list* src) {
+    if (src->count > 0) {
+        if (dst->count + src->count > dst->capacity) {
+            size_t new_capacity = dst->capacity ? dst->capacity : 16;
+            while (new_capacity < dst->count + src->count) new_capacity *= 2;
+            path_entry* new_items = realloc(dst->items, new_capacity * sizeof(path_entry));
+            if (!new_items) return -1;
+            dst->items = new_items;
+            dst->capacity = new_capacity;
+        }
+        memcpy(dst->items + dst->count, src->items, src->count * sizeof(path_entry));
+        dst->count += src->count;
+        src->count = 0;
+    }
+    if (src->arena.head) {
+        arena_chunk* tail = src->arena.head;
+        while (tail->next) tail = tail->next;
+        if (dst->arena.head) {
+            // Keep dst's partially used chunk in front for further allocations.
+            tail->next = dst->arena.head->next;
+            dst->arena.head->next = src->arena.head;
+        }
+        else {
+            dst->arena.head = src->arena.head;
+        }
+        src->arena.head = NULL;
+    }
+    return 0;
+}
+
 void path_list_free(path_list* list) {
     if (list) {
-        for (size_t i = 0; i < list->count; i++) {
-            free(list->items[i].full_path);
-            free(list->items[i].rel_path);
-        }
         free(list->items);
+        arena_free(&list->arena);
         list->items = NULL;
         list->count = 0;
         list->capacity = 0;
     }
 }
 
-static int compare_paths(const void* a, const void* b) {
-    const path_entry* pa = (const path_entry*)a;
-    const path_entry* pb = (const path_entry*)b;
-    return strcmp(pa->rel_path, pb->rel_path);
+// Byte depth of an entry's relative path (dir->rel + name), or 0 past its end.
+static inline unsigned char path_char_at(const path_entry* e, size_t depth) {
+    size_t dir_len = e->dir->rel_len;
+    if (depth < dir_len) return (unsigned char)e->dir->rel[depth];
+    depth -= dir_len;
+    return depth < e->name_len ? (unsigned char)e->name[depth] : 0;
+}
+
+// strcmp order of the joined relative paths, given that both agree on the
+// first depth bytes.
+static int compare_paths_from(const path_entry* a, const path_entry* b, size_t depth) {
+    if (a->dir == b->dir && depth >= a->dir->rel_len) {
+        return strcmp(a->name + (depth - a->dir->rel_len), b->name + (depth - a->dir->rel_len));
+    }
+    while (1) {
+        unsigned char ca = path_char_at(a, depth);
+        unsigned char cb = path_char_at(b, depth);
+        if (ca != cb || ca == 0) return (int)ca - (int)cb;
+        depth++;
+    }
+}
+
+static void swap_entries(path_entry* a, path_entry* b) {
+    path_entry tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Length of the prefix that every entry shares with the first one, starting
+// at depth. Entries of one directory share its whole relative path, so a
+// partition made of a single directory jumps straight to the names instead of
+// spending one partitioning pass per byte of the directory path.
+static size_t shared_prefix_from(const path_entry* items, size_t n, size_t depth) {
+    const path_entry* first = &items[0];
+    size_t first_len = first->dir->rel_len + first->name_len;
+    if (depth >= first_len) return 0;
+    size_t lcp = first_len - depth;
+    for (size_t i = 1; i < n && lcp > 0; i++) {
+        const path_entry* e = &items[i];
+        size_t k = 0;
+        if (e->dir == first->dir) {
+            size_t dir_rest = first->dir->rel_len > depth ? first->dir->rel_len - depth : 0;
+            k = dir_rest < lcp ? dir_rest : lcp;
+        }
+        while (k < lcp && path_char_at(e, depth + k) == path_char_at(first, depth + k)) k++;
+        lcp = k;
+    }
+    return lcp;
+}
+
+#define PATH_SORT_INSERTION_THRESHOLD 12
+
+// Multikey quicksort (Bentley & Sedgewick): three-way partitioning on the
+// byte at the current depth, so each byte of a shared prefix is looked at
+// once per partition rather than once per comparison.
+static void path_mkqs(path_entry* items, size_t n, size_t depth) {
+    while (n > 1) {
+        if (n <= PATH_SORT_INSERTION_THRESHOLD) {
+            for (size_t i = 1; i < n; i++) {
+                for (size_t j = i; j > 0 && compare_paths_from(&items[j - 1], &items[j], depth) > 0; j--) {
+                    swap_entries(&items[j - 1], &items[j]);
+                }
+            }
+            return;
+        }
+
+        depth += shared_prefix_from(items, n, depth);
+
+        unsigned char c0 = path_char_at(&items[0], depth);
+        unsigned char c1 = path_char_at(&items[n / 2], depth);
+        unsigned char c2 = path_char_at(&items[n - 1], depth);
+        size_t pivot_index = (c0 < c1) ? ((c1 < c2) ? n / 2 : (c0 < c2 ? n - 1 : 0))
+                                        : ((c0 < c2) ? 0 : (c1 < c2 ? n - 1 : n / 2));
+        swap_entries(&items[0], &items[pivot_index]);
+        unsigned char pivot = path_char_at(&items[0], depth);
+
+        // items[0, lt) < pivot, [lt, i) == pivot, (gt, n) > pivot
+        size_t lt = 0;
+        size_t i = 1;
+        size_t gt = n - 1;
+        while (i <= gt) {
+            unsigned char c = path_char_at(&items[i], depth);
+            if (c < pivot) {
+                swap_entries(&items[lt++], &items[i++]);
+            }
+            else if (c > pivot) {
+                swap_entries(&items[i], &items[gt--]);
+            }
+            else {
+                i++;
+            }
+        }
+
+        path_mkqs(items, lt, depth);
+        path_mkqs(items + gt + 1, n - gt - 1, depth);
+        if (pivot == 0) return;
+        items += lt;
+        n = gt + 1 - lt;
+        depth++;
+    }
 }
 
 void path_list_sort(path_list* list) {
     if (!list || list->count < 2) return;
-    qsort(list->items, list->count, sizeof(path_entry), compare_paths);
+    path_mkqs(list->items, list->count, 0);
 }
 
 void normalize_path(char* path) {
@@ -191,6 +389,12 @@ int generate_output_filename(output_ctx* ctx) {
     return 0;
 }
 
+int default_job_count(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1) return 1;
+    return online > MAX_JOBS ? MAX_JOBS : (int)online;
+}
+
 int program_exists(const char* name) {
     if (!name || name[0] == '\0') return 0;
     const char* path_env = getenv("PATH");
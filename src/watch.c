@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include "recap.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_EVENT_BUFFER_SIZE (64 * 1024)
+// A batch is written out at the latest after this many quiet periods, even
+// if events keep coming.
+#define WATCH_MAX_DELAY_FACTOR 20
+
+// A matched file and its rendered block. Files are kept sorted by rel like
+// the regular output; rendered is cleared when an event reports a change.
+typedef struct {
+    char* rel;
+    char* full;
+    int show_content;
+    int rendered;
+    int touched;
+    out_sink block;
+} watch_file;
+
+// A watched directory, indexed by its watch descriptor; rel is "" or ends
+// in '/'.
+typedef struct {
+    char* rel;
+    char* full;
+    unsigned generation;
+} watch_dir;
+
+typedef struct {
+    recap_context* ctx;
+    int fd;
+    watch_file* files;
+    size_t file_count;
+    watch_dir* dirs;
+    size_t dir_slots;
+    size_t dir_count;
+    unsigned generation;
+    path_buf temp_path;
+    path_buf temp_rel;
+    // Full paths of entries that were created in this batch but are not
+    // matched files, NUL separated; if they still exist the tree is walked
+    // again to apply the filters to them.
+    path_buf created;
+    int rescan;
+} watcher;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void watch_file_free(watch_file* f) {
+    free(f->rel);
+    free(f->full);
+    sink_free(&f->block);
+}
+
+static void watch_dir_free(watch_dir* d) {
+    free(d->rel);
+    free(d->full);
+    d->rel = NULL;
+    d->full = NULL;
+}
+
+static void watcher_free(watcher* w) {
+    for (size_t i = 0; i < w->file_count; i++) {
+        watch_file_free(&w->files[i]);
+    }
+    free(w->files);
+    for (size_t i = 0; i < w->dir_slots; i++) {
+        watch_dir_free(&w->dirs[i]);
+    }
+    free(w->dirs);
+    path_buf_free(&w->temp_path);
+    path_buf_free(&w->temp_rel);
+    path_buf_free(&w->created);
+    if (w->fd >= 0) close(w->fd);
+}
+
+static long find_file(const watcher* w, const char* rel) {
+    size_t lo = 0, hi = w->file_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(w->files[mid].rel, rel);
+        if (cmp == 0) return (long)mid;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+static void add_watch(watcher* w, const char* full, const char* rel) {
+    int wd = inotify_add_watch(w->fd, full, WATCH_MASK);
+    if (wd < 0) {
+        fprintf(stderr, "Warning: Could not watch %s: %s\n", full, strerror(errno));
+        return;
+    }
+    if ((size_t)wd >= w->dir_slots) {
+        size_t slots = w->dir_slots ? w->dir_slots : 64;
+        while (slots <= (size_t)wd) slots *= 2;
+        watch_dir* dirs = realloc(w->dirs, slots * sizeof(watch_dir));
+        if (!dirs) {
+            inotify_rm_watch(w->fd, wd);
+            return;
+        }
+        memset(dirs + w->dir_slots, 0, (slots - w->dir_slots) * sizeof(watch_dir));
+        w->dirs = dirs;
+        w->dir_slots = slots;
+    }
+    watch_dir* d = &w->dirs[wd];
+    if (!d->rel) {
+        d->rel = strdup(rel);
+        d->full = strdup(full);
+        if (!d->rel || !d->full) {
+            watch_dir_free(d);
+            inotify_rm_watch(w->fd, wd);
+            return;
+        }
+        w->dir_count++;
+    }
+    d->generation = w->generation;
+}
+
+// Walks the tree again and merges the result into the file list: files
+// that were there before keep their blocks, new ones are left to render.
+// Directories the walk no longer reaches stop being watched.
+static int collect(watcher* w) {
+    recap_context* ctx = w->ctx;
+    path_list_free(&ctx->matched_files);
+    path_list_free(&ctx->watch_dirs);
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    if (start_traversal(ctx) != 0) return -1;
+
+    path_buf full = {0};
+    path_buf rel = {0};
+    w->generation++;
+    for (size_t i = 0; i < ctx->watch_dirs.count; i++) {
+        const path_entry* entry = &ctx->watch_dirs.items[i];
+        if (path_entry_full_path(entry, &full) != 0 || path_entry_rel_path(entry, &rel) != 0) break;
+        add_watch(w, full.data, rel.data);
+    }
+    for (size_t wd = 0; wd < w->dir_slots; wd++) {
+        watch_dir* d = &w->dirs[wd];
+        if (d->rel && d->generation != w->generation) {
+            inotify_rm_watch(w->fd, (int)wd);
+            watch_dir_free(d);
+            w->dir_count--;
+        }
+    }
+
+    size_t count = ctx->matched_files.count;
+    watch_file* files = calloc(count ? count : 1, sizeof(watch_file));
+    if (!files) {
+        path_buf_free(&full);
+        path_buf_free(&rel);
+        return -1;
+    }
+    size_t old = 0, n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const path_entry* entry = &ctx->matched_files.items[i];
+        if (path_entry_full_path(entry, &full) != 0 || path_entry_rel_path(entry, &rel) != 0) break;
+        while (old < w->file_count && strcmp(w->files[old].rel, rel.data) < 0) {
+            watch_file_free(&w->files[old++]);
+        }
+        if (old < w->file_count && strcmp(w->files[old].rel, rel.data) == 0) {
+            files[n++] = w->files[old++];
+            continue;
+        }
+        watch_file* f = &files[n];
+        f->rel = strdup(rel.data);
+        f->full = strdup(full.data);
+        sink_init_buffer(&f->block);
+        if (!f->rel || !f->full) {
+            watch_file_free(f);
+            continue;
+        }
+        n++;
+    }
+    while (old < w->file_count) {
+        watch_file_free(&w->files[old++]);
+    }
+    free(w->files);
+    w->files = files;
+    w->file_count = n;
+    path_buf_free(&full);
+    path_buf_free(&rel);
+    return 0;
+}
+
+typedef struct {
+    watcher* w;
+    size_t* pending;
+    size_t count;
+    atomic_size_t next;
+} render_batch;
+
+static void* render_worker(void* arg) {
+    render_batch* batch = arg;
+    recap_context* ctx = batch->w->ctx;
+    int include_content_mode = ctx->content_include_filters.count > 0;
+    regex_scratch regex;
+    int have_regex = regex_scratch_init(&regex) == 0;
+
+    for (size_t i = atomic_fetch_add(&batch->next, 1); i < batch->count; i = atomic_fetch_add(&batch->next, 1)) {
+        watch_file* f = &batch->w->files[batch->pending[i]];
+        sink_free(&f->block);
+        sink_init_buffer(&f->block);
+        f->show_content = 0;
+        if (include_content_mode && have_regex) {
+            f->show_content = output_render(ctx, &regex, f->full, f->rel, &f->block);
+        }
+        else if (include_content_mode) {
+            f->show_content = 1;
+            sink_printf(&f->block, "%s:\n[Error reading file content]\n", f->rel);
+        }
+        f->rendered = 1;
+    }
+    if (have_regex) regex_scratch_free(&regex);
+    return NULL;
+}
+
+// Renders the files whose blocks are out of date on up to ctx->jobs threads.
+static size_t render_pending(watcher* w) {
+    render_batch batch = {w, NULL, 0, 0};
+    for (size_t i = 0; i < w->file_count; i++) {
+        if (!w->files[i].rendered) batch.count++;
+    }
+    if (batch.count == 0) return 0;
+    batch.pending = malloc(batch.count * sizeof(size_t));
+    if (!batch.pending) return 0;
+    batch.count = 0;
+    for (size_t i = 0; i < w->file_count; i++) {
+        if (!w->files[i].rendered) batch.pending[batch.count++] = i;
+    }
+    atomic_init(&batch.next, 0);
+
+    size_t thread_count = (size_t)(w->ctx->jobs > 1 ? w->ctx->jobs : 1);
+    if (thread_count > batch.count) thread_count = batch.count;
+    pthread_t threads[MAX_JOBS];
+    size_t started = 0;
+    for (size_t i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, render_worker, &batch) != 0) break;
+        started++;
+    }
+    render_worker(&batch);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(batch.pending);
+    return batch.count;
+}
+
+// Writes the whole output to a temporary file next to the output and
+// renames it over the output, so readers never see a partial file.
+static int write_output(watcher* w) {
+    recap_context* ctx = w->ctx;
+    FILE* stream = fopen(w->temp_path.data, "w");
+    if (!stream) {
+        fprintf(stderr, "Error: Could not open output file: %s\n", w->temp_path.data);
+        return -1;
+    }
+    ctx->output_stream = stream;
+    output_state out;
+    if (output_begin(&out, ctx) == 0) {
+        for (size_t i = 0; i < w->file_count; i++) {
+            const watch_file* f = &w->files[i];
+            output_rendered(&out, f->rel, f->show_content, &f->block);
+        }
+        output_end(&out);
+    }
+    ctx->output_stream = NULL;
+    int failed = ferror(stream);
+    if (fclose(stream) != 0 || failed || rename(w->temp_path.data, ctx->output.calculated_output_path) != 0) {
+        fprintf(stderr, "Error: Could not write output file: %s\n", ctx->output.calculated_output_path);
+        remove(w->temp_path.data);
+        return -1;
+    }
+    return 0;
+}
+
+// Records what an event means for the next update; returns 0 for events
+// that do not affect the output, such as the writes to the output itself.
+static int handle_event(watcher* w, const struct inotify_event* ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost: walk again and render everything.
+        for (size_t i = 0; i < w->file_count; i++) {
+            w->files[i].rendered = 0;
+        }
+        w->rescan = 1;
+        return 1;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= w->dir_slots || !w->dirs[ev->wd].rel) return 0;
+    watch_dir* d = &w->dirs[ev->wd];
+    if (ev->mask & IN_IGNORED) {
+        watch_dir_free(d);
+        w->dir_count--;
+        return 0;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        w->rescan = 1;
+        return 1;
+    }
+    if (ev->len == 0) return 0;
+
+    char rel[MAX_PATH_SIZE];
+    int n = snprintf(rel, sizeof(rel), "%s%s", d->rel, ev->name);
+    if (n < 0 || (size_t)n >= sizeof(rel)) return 0;
+    if (strcmp(rel, w->ctx->output.relative_output_path) == 0 || strcmp(rel, w->temp_rel.data) == 0) return 0;
+
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) w->rescan = 1;
+        return w->rescan;
+    }
+    long index = find_file(w, rel);
+    if (index >= 0) {
+        w->files[index].touched = 1;
+        return 1;
+    }
+    if (w->ctx->gitignore_name && strcmp(ev->name, w->ctx->gitignore_name) == 0) {
+        w->rescan = 1;
+        return 1;
+    }
+    // A file that was already there and not matched still is not: the
+    // filters only look at paths.
+    if (!(ev->mask & (IN_CREATE | IN_MOVED_TO))) return 0;
+    if (path_buf_push(&w->created, d->full, strlen(d->full)) != 0 ||
+        path_buf_push(&w->created, ev->name, strlen(ev->name)) != 0 ||
+        path_buf_push(&w->created, "", 1) != 0) {
+        w->rescan = 1;
+    }
+    return 1;
+}
+
+static void apply_batch(watcher* w, size_t events) {
+    recap_context* ctx = w->ctx;
+    uint64_t start = now_ns();
+
+    // Files that disappeared are dropped here; anything new takes a walk,
+    // since the filters and ignore rules are applied there.
+    size_t kept = 0;
+    for (size_t i = 0; i < w->file_count; i++) {
+        watch_file* f = &w->files[i];
+        if (f->touched) {
+            struct stat st;
+            f->touched = 0;
+            f->rendered = 0;
+            if (lstat(f->full, &st) != 0 || !S_ISREG(st.st_mode)) {
+                watch_file_free(f);
+                continue;
+            }
+        }
+        w->files[kept++] = *f;
+    }
+    w->file_count = kept;
+    for (size_t pos = 0; pos < w->created.len && !w->rescan; pos += strlen(w->created.data + pos) + 1) {
+        struct stat st;
+        if (lstat(w->created.data + pos, &st) == 0) w->rescan = 1;
+    }
+    path_buf_truncate(&w->created, 0);
+
+    int rescanned = w->rescan;
+    if (w->rescan) {
+        w->rescan = 0;
+        if (collect(w) != 0) fprintf(stderr, "Warning: Could not walk the tree again; the file list may be out of date.\n");
+    }
+    size_t rendered = render_pending(w);
+    if (write_output(w) != 0) return;
+    if (ctx->show_stats) {
+        fprintf(stderr, "Stats: output updated in %.1f ms after %zu events: %zu files rendered%s\n",
+                (double)(now_ns() - start) / 1e6, events, rendered, rescanned ? ", tree walked again" : "");
+    }
+}
+
+int watch_run(recap_context* ctx) {
+    watcher w;
+    memset(&w, 0, sizeof(w));
+    w.ctx = ctx;
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0) {
+        fprintf(stderr, "Error: Could not initialize inotify: %s\n", strerror(errno));
+        return 1;
+    }
+    if (path_buf_push(&w.temp_path, ctx->output.calculated_output_path, strlen(ctx->output.calculated_output_path)) != 0 ||
+        path_buf_push(&w.temp_path, ".tmp", 4) != 0 ||
+        path_buf_push(&w.temp_rel, ctx->output.relative_output_path, strlen(ctx->output.relative_output_path)) != 0 ||
+        path_buf_push(&w.temp_rel, ".tmp", 4) != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        watcher_free(&w);
+        return 1;
+    }
+
+    // The output is written by rename from now on.
+    if (ctx->output_stream) {
+        fclose(ctx->output_stream);
+        ctx->output_stream = NULL;
+    }
+    if (collect(&w) != 0) {
+        watcher_free(&w);
+        path_list_free(&ctx->watch_dirs);
+        return 1;
+    }
+    render_pending(&w);
+    if (write_output(&w) != 0) {
+        watcher_free(&w);
+        path_list_free(&ctx->watch_dirs);
+        return 1;
+    }
+    fprintf(stderr, "Info: Watching %zu directories, writing to %s. Press Ctrl-C to stop.\n", w.dir_count,
+            ctx->output.calculated_output_path);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Events are collected until none arrive for a debounce period, then
+    // the output is updated once for the whole batch.
+    char* buf = malloc(WATCH_EVENT_BUFFER_SIZE);
+    int debounce_ms = ctx->watch_debounce_ms;
+    size_t events = 0;
+    uint64_t batch_start = 0;
+    int result = buf ? 0 : 1;
+    while (buf && !watch_stop) {
+        int timeout = -1;
+        if (events > 0) {
+            uint64_t waited_ms = (now_ns() - batch_start) / 1000000;
+            uint64_t max_ms = (uint64_t)debounce_ms * WATCH_MAX_DELAY_FACTOR;
+            uint64_t left_ms = waited_ms < max_ms ? max_ms - waited_ms : 0;
+            timeout = left_ms < (uint64_t)debounce_ms ? (int)left_ms : debounce_ms;
+        }
+        struct pollfd pfd = {w.fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            result = 1;
+            break;
+        }
+        if (ready == 0) {
+            apply_batch(&w, events);
+            events = 0;
+            continue;
+        }
+
+        ssize_t len;
+        while ((len = read(w.fd, buf, WATCH_EVENT_BUFFER_SIZE)) > 0) {
+            for (char* p = buf; p < buf + len;) {
+                const struct inotify_event* ev = (const struct inotify_event*)p;
+                if (handle_event(&w, ev)) {
+                    if (events++ == 0) batch_start = now_ns();
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+
+    free(buf);
+    watcher_free(&w);
+    path_list_free(&ctx->watch_dirs);
+    return result;
+}
+
+#else
+
+int watch_run(recap_context* ctx) {
+    (void)ctx;
+    fprintf(stderr, "Error: --watch is only supported on Linux.\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,137 @@
+// Microbenchmark for the content line emitter. Compares the historical
+// strchr + fprintf loop with emit_text_lines() at every text scan level the
+// CPU supports, checks that all of them produce identical bytes, and reports
+// throughput in GB/s. Build and run with `make bench-emit`.
+#include "recap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_REPS 5
+
+static char* make_input(size_t size, int crlf, unsigned seed) {
+    char* buf = malloc(size + 1);
+    if (!buf) return NULL;
+    size_t pos = 0;
+    while (pos < size) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned r = (seed >> 16) & 0x7fff;
+        size_t line_len = (r % 100 < 8) ? 0 : 8 + r % 72;
+        for (size_t i = 0; i < line_len && pos < size; i++) {
+            buf[pos++] = (i < 4) ? ' ' : (char)('a' + (i * 7 + r) % 26);
+        }
+        if (crlf && pos < size) buf[pos++] = '\r';
+        if (pos < size) buf[pos++] = '\n';
+    }
+    buf[size] = '\0';
+    return buf;
+}
+
+static void legacy_emit(FILE* out, const char* content) {
+    const char* p = content;
+    int previous_line_was_blank = 0;
+    while (*p) {
+        const char* end_of_line = strchr(p, '\n');
+        size_t line_len = end_of_line ? (size_t)(end_of_line - p) : strlen(p);
+        if (line_len > 0 && p[line_len - 1] == '\r') line_len--;
+        if (line_len == 0) {
+            if (!previous_line_was_blank) {
+                fprintf(out, "\n");
+                previous_line_was_blank = 1;
+            }
+        }
+        else {
+            previous_line_was_blank = 0;
+            fprintf(out, "%.*s\n", (int)line_len, p);
+        }
+        if (!end_of_line) break;
+        p = end_of_line + 1;
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static const char* level_name(int level) {
+    switch (level) {
+    case TEXT_SCAN_AVX2:
+        return "avx2";
+    case TEXT_SCAN_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+static int run_dataset(const char* name, const char* input, size_t size, FILE* devnull) {
+    char* expected = NULL;
+    size_t expected_len = 0;
+    FILE* mem = open_memstream(&expected, &expected_len);
+    if (!mem) return -1;
+    legacy_emit(mem, input);
+    fclose(mem);
+
+    double best = 1e9;
+    for (int rep = 0; rep < BENCH_REPS; rep++) {
+        double t0 = now_seconds();
+        legacy_emit(devnull, input);
+        fflush(devnull);
+        double t = now_seconds() - t0;
+        if (t < best) best = t;
+    }
+    printf("%-6s %-16s %7.2f GB/s\n", name, "fprintf loop", (double)size / best / 1e9);
+
+    int status = 0;
+    for (int level = TEXT_SCAN_SCALAR; level <= TEXT_SCAN_AVX2; level++) {
+        if (text_scan_select(level) != level) continue;
+
+        out_sink check;
+        sink_init_buffer(&check);
+        emit_text_lines(&check, input, size, -1, 0);
+        if (check.len != expected_len || memcmp(check.data, expected, expected_len) != 0) {
+            fprintf(stderr, "Error: %s emitter output differs from the fprintf loop on %s input\n", level_name(level), name);
+            status = -1;
+        }
+        sink_free(&check);
+
+        out_sink sink;
+        sink_init_stream(&sink, devnull);
+        best = 1e9;
+        for (int rep = 0; rep < BENCH_REPS; rep++) {
+            double t0 = now_seconds();
+            emit_text_lines(&sink, input, size, -1, 0);
+            fflush(devnull);
+            double t = now_seconds() - t0;
+            if (t < best) best = t;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "emitter (%s)", level_name(level));
+        printf("%-6s %-16s %7.2f GB/s\n", name, label, (double)size / best / 1e9);
+    }
+    free(expected);
+    return status;
+}
+
+int main(void) {
+    FILE* devnull = fopen("/dev/null", "w");
+    if (!devnull) {
+        perror("fopen /dev/null");
+        return 1;
+    }
+    int status = 0;
+    for (int crlf = 0; crlf <= 1; crlf++) {
+        char* input = make_input(BENCH_SIZE, crlf, 42);
+        if (!input) {
+            fprintf(stderr, "Error: Could not allocate benchmark input\n");
+            return 1;
+        }
+        if (run_dataset(crlf ? "crlf" : "lf", input, BENCH_SIZE, devnull) != 0) status = 1;
+        free(input);
+    }
+    fclose(devnull);
+    return status;
+}
@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+"""Minimal client for `recap --serve`.
+
+Usage: recap-client.py SOCKET [recap options and paths...]
+
+Sends the options as one request, relative to the current directory, and
+writes the output to stdout. Errors reported by the server go to stderr and
+make the client exit with status 1.
+"""
+
+import json
+import os
+import socket
+import sys
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write(__doc__)
+        return 2
+
+    request = {"cwd": os.getcwd(), "args": sys.argv[2:]}
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(sys.argv[1])
+        sock.sendall(json.dumps(request).encode() + b"\n")
+        reply = sock.makefile("rb")
+        status = json.loads(reply.readline())
+        if not status.get("ok"):
+            sys.stderr.write(status.get("error", "Error: request failed") + "\n")
+            return 1
+        out = sys.stdout.buffer
+        for chunk in iter(lambda: reply.read(65536), b""):
+            out.write(chunk)
+        out.flush()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -15,7 +15,7 @@ LAST_RC=0
 
 build_if_needed() {
   if [ ! -x "$RECAP_BIN" ]; then
-    echo "Building recap (needs pcre2, libcurl, jansson dev headers)..."
+    echo "Building recap (needs pcre2, libcurl, jansson, zlib dev headers)..."
     (cd "$REPO_ROOT" && make) || { echo "Build failed"; exit 2; }
   fi
 }
@@ -59,10 +59,12 @@ assert_rc() {
     echo "OK  ($TEST_NAME): rc == $expected"
   fi
 }
+# grep reads a here-string: fed through a pipe, grep -q quitting at the first
+# match could kill printf with SIGPIPE and, under pipefail, flip the result.
 assert_out_contains() {
   TOTAL=$((TOTAL+1))
   local needle="$1"
-  if ! printf '%s' "$LAST_OUT" | grep -q -- "$needle"; then
+  if ! grep -q -- "$needle" <<< "$LAST_OUT"; then
     echo "FAIL ($TEST_NAME): output missing: $needle"
     echo "---- output ----"
     echo "$LAST_OUT"
@@ -74,7 +76,7 @@ assert_out_contains() {
 assert_out_not_contains() {
   TOTAL=$((TOTAL+1))
   local needle="$1"
-  if printf '%s' "$LAST_OUT" | grep -q -- "$needle"; then
+  if grep -q -- "$needle" <<< "$LAST_OUT"; then
     echo "FAIL ($TEST_NAME): output SHOULD NOT contain: $needle"
     echo "---- output ----"
     echo "$LAST_OUT"
@@ -83,10 +85,24 @@ assert_out_not_contains() {
     echo "OK  ($TEST_NAME): does not contain: $needle"
   fi
 }
+assert_out_equals() {
+  TOTAL=$((TOTAL+1))
+  local expected="$1"
+  if [ "$LAST_OUT" != "$expected" ]; then
+    echo "FAIL ($TEST_NAME): output differs from expected"
+    echo "---- expected ----"
+    echo "$expected"
+    echo "---- output ----"
+    echo "$LAST_OUT"
+    FAIL=$((FAIL+1))
+  else
+    echo "OK  ($TEST_NAME): output matches"
+  fi
+}
 assert_path_not_shown_with_colon() {
   TOTAL=$((TOTAL+1))
   local path="$1"
-  if printf '%s' "$LAST_OUT" | grep -q -- "$path:"; then
+  if grep -q -- "$path:" <<< "$LAST_OUT"; then
     echo "FAIL ($TEST_NAME): path shown with colon (indicates content shown) but expected not to: $path"
     echo "---- output ----"
     echo "$LAST_OUT"
@@ -123,6 +139,34 @@ assert_rc 0
 assert_out_contains "test/folder3/test.c"
 assert_out_not_contains "test/folder1/main.js"
 
+TEST_NAME="include-anchored-prune"
+run_cmd "$TMPROOT" -i '^test/folder3/.*\.c$' test
+assert_rc 0
+assert_out_contains "test/folder3/test.c"
+assert_out_not_contains "test/folder1/main.js"
+assert_out_not_contains "test/folder3/example.md"
+
+# The start path "." is not a path component that include patterns match.
+TEST_NAME="include-start-dot"
+run_cmd "$TMPROOT/test" -i '\.' .
+assert_rc 0
+assert_out_contains "folder3/test.c"
+assert_out_not_contains "folder1/Dockerfile"
+assert_out_not_contains "folder3/test$"
+run_cmd "$TMPROOT/test" -i '^\.$' .
+assert_rc 0
+assert_out_not_contains "folder"
+run_cmd "$TMPROOT/test" --stream -i '^\.$' .
+assert_rc 0
+assert_out_not_contains "folder"
+
+TEST_NAME="stats"
+run_cmd "$TMPROOT" --stats -i '^test/folder3/' test
+assert_rc 0
+assert_out_contains "test/folder3/test.c"
+assert_out_contains "2 subtrees pruned"
+assert_out_contains "ancestor prefix evaluations avoided"
+
 TEST_NAME="include-content"
 run_cmd "$TMPROOT" -I '\.c$' test
 assert_rc 0
@@ -149,17 +193,620 @@ run_cmd "$TMPROOT" -I '\.js$' -S '\.js$' '(?s)^\s*/\*\*.*?\*/\s*' test
 assert_rc 0
 assert_out_not_contains "Super cool JavaScript file"
 
+TEST_NAME="strip-every-match"
+mkdir -p "$TMPROOT/stripped"
+printf 'int a; // one\n#region gen\nx\n#endregion\nint b; // two\r\n#region more\ny\n#endregion\nint c;' > "$TMPROOT/stripped/a.c"
+printf 'X\nX\nkeep X\n' > "$TMPROOT/stripped/b.txt"
+run_cmd "$TMPROOT" -I 'stripped/' -s '\AX\n' -S '\.c$' ' *//[^\r\n]*' -S '\.c$' '(?s)^#region.*?^#endregion\n' stripped
+assert_rc 0
+assert_out_equals "$(printf 'stripped/a.c:\nint a;\nint b;\nint c;\n---\nstripped/b.txt:\nX\nkeep X')"
+
+TEST_NAME="strip-every-match-compact"
+run_cmd "$TMPROOT" --compact -I 'stripped/' -S '\.c$' '(?s)^#region.*?^#endregion\n' stripped
+assert_rc 0
+assert_out_contains "$(printf 'int a;\nint b;\nint c;')"
+assert_out_not_contains "#region"
+rm -rf "$TMPROOT/stripped"
+
+TEST_NAME="strip-match-start"
+mkdir -p "$TMPROOT/anchored"
+printf 'a\na\nb\na\n' > "$TMPROOT/anchored/c.txt"
+printf '// x\n  y\nz  w\n' > "$TMPROOT/anchored/d.md"
+run_cmd "$TMPROOT" -I 'anchored/' -S '\.txt$' '\Ga\n' -S '\.md$' '//[^\n]*\n' -S '\.md$' '\G +' -S '\.md$' '(?-m)^z' anchored
+assert_rc 0
+assert_out_equals "$(printf 'anchored/c.txt:\nb\na\n---\nanchored/d.md:\ny\nz  w')"
+rm -rf "$TMPROOT/anchored"
+
+TEST_NAME="stream"
+run_cmd "$TMPROOT" -I '\.(c|js|md)$' test
+SORTED_OUT="$LAST_OUT"
+run_cmd "$TMPROOT" --stream -I '\.(c|js|md)$' test
+assert_rc 0
+assert_out_equals "$SORTED_OUT"
+
+# Full paths are rebuilt from the start path each file was found under.
+TEST_NAME="start-path-forms"
+run_cmd "$TMPROOT" -I '\.(c|md)$' test/folder3
+assert_rc 0
+assert_out_contains "^test/folder3/test.c:$"
+assert_out_contains "This is a test"
+START_OUT="$LAST_OUT"
+for START in ./test/folder3 test/folder3/ "$TMPROOT/test/folder3"; do
+  run_cmd "$TMPROOT" -I '\.(c|md)$' "$START"
+  assert_out_equals "$START_OUT"
+done
+run_cmd "$TMPROOT/test" -I '\.(c|js)$' folder3 folder1
+assert_rc 0
+assert_out_contains "Super cool JavaScript file"
+assert_out_contains "return EXIT_SUCCESS"
+TOTAL=$((TOTAL+1))
+if [ "$(grep ':$' <<< "$LAST_OUT")" != "$(printf 'folder1/main.js:\nfolder3/test.c:')" ]; then
+  echo "FAIL ($TEST_NAME): files of both start paths not in sorted order"
+  FAIL=$((FAIL+1))
+else
+  echo "OK  ($TEST_NAME): files of both start paths in sorted order"
+fi
+MULTI_OUT="$LAST_OUT"
+run_cmd "$TMPROOT/test" -j 4 -I '\.(c|js)$' folder3 folder1
+assert_out_equals "$MULTI_OUT"
+
+# Listings follow strcmp order of the whole relative path, including names
+# that sort around '/' and bytes above 0x7f.
+TEST_NAME="sort-order"
+LONG_DIR="sorted/$(printf 'shared-prefix-%.0s' $(seq 1 12))"
+mkdir -p "$TMPROOT/sorted/abd" "$TMPROOT/sorted/a b" "$TMPROOT/sorted/a.d" "$TMPROOT/$LONG_DIR/n1-d"
+for f in a a.b a-b "a b" A B _x ab abc "$(printf '\303\251')" "~" 0 a0 abd-x abd.txt abd0 abd/x "a b/x" a.d/x; do
+  touch "$TMPROOT/sorted/$f"
+done
+for n in 1 2 10 11 20 3; do touch "$TMPROOT/$LONG_DIR/n$n" "$TMPROOT/$LONG_DIR/n1-d/m$n"; done
+for ARGS in "-j 1" "-j 4" "--stream"; do
+  run_cmd "$TMPROOT" $ARGS sorted
+  assert_out_equals "$(cd "$TMPROOT" && find sorted -type f | LC_ALL=C sort)"
+done
+rm -rf "$TMPROOT/sorted"
+
+TEST_NAME="parallel-listing"
+for d in 0 1 2 3 4 5 6 7; do
+  for sub in 0 1 2 3 4 5; do
+    mkdir -p "$TMPROOT/wide/d$d/s$sub/t"
+    for f in 0 1 2 3; do touch "$TMPROOT/wide/d$d/s$sub/f$f.txt" "$TMPROOT/wide/d$d/s$sub/t/g$f.c"; done
+  done
+  touch "$TMPROOT/wide/d$d/top.md"
+done
+run_cmd "$TMPROOT" -j 1 wide
+assert_rc 0
+TOTAL=$((TOTAL+1))
+if [ "$(grep -c . <<< "$LAST_OUT")" -ne 392 ]; then
+  echo "FAIL ($TEST_NAME): expected 392 paths, got $(grep -c . <<< "$LAST_OUT")"
+  FAIL=$((FAIL+1))
+else
+  echo "OK  ($TEST_NAME): all 392 paths listed"
+fi
+for ARGS in "wide" "-i /s(1|3)/ -e \.md$ wide" "wide/d5 test wide/d1/s2 wide/d0"; do
+  run_cmd "$TMPROOT" -j 1 $ARGS
+  SERIAL_OUT="$LAST_OUT"
+  for JOBS in 2 4 8; do
+    run_cmd "$TMPROOT" -j "$JOBS" $ARGS
+    assert_out_equals "$SERIAL_OUT"
+  done
+done
+rm -rf "$TMPROOT/wide"
+
+# A chain deeper than the directory fds the walk keeps open, walked under a
+# low fd limit, ending just below MAX_PATH_SIZE; what lies past it is skipped.
+TEST_NAME="deep-tree"
+DEEP_DIR="$(printf 'ab/%.0s' $(seq 1 1300))"
+mkdir -p "$TMPROOT/deep/$DEEP_DIR"
+touch "$TMPROOT/deep/$(printf 'ab/%.0s' $(seq 1 300))mid" "$TMPROOT/deep/${DEEP_DIR}end"
+(cd "$TMPROOT/deep/$DEEP_DIR" && mkdir -p "$(printf 'ab/%.0s' $(seq 1 100))" && touch "$(printf 'ab/%.0s' $(seq 1 100))lost")
+run_cmd "$TMPROOT/deep" -j 1 .
+assert_rc 0
+assert_out_contains "^${DEEP_DIR}end$"
+assert_out_contains "/mid$"
+assert_out_not_contains "lost"
+DEEP_OUT="$LAST_OUT"
+for DEEP_ARGS in "-j 4" "--stream" "--cache=$TMPROOT/deep-cache" "--cache=$TMPROOT/deep-cache --stream"; do
+  TOTAL=$((TOTAL+1))
+  if [ "$(cd "$TMPROOT/deep" && ulimit -n 64 && "$RECAP_BIN" $DEEP_ARGS . 2>&1)" != "$DEEP_OUT" ]; then
+    echo "FAIL ($TEST_NAME): $DEEP_ARGS under ulimit -n 64 differs from -j 1"
+    FAIL=$((FAIL+1))
+  else
+    echo "OK  ($TEST_NAME): $DEEP_ARGS under ulimit -n 64 matches -j 1"
+  fi
+done
+rm -rf "$TMPROOT/deep" "$TMPROOT/deep-cache"
+
+TEST_NAME="parallel-content"
+run_cmd "$TMPROOT" -j 1 -I '.*' test
+SERIAL_OUT="$LAST_OUT"
+run_cmd "$TMPROOT" -j 4 --max-inflight 1 -I '.*' test
+assert_rc 0
+assert_out_equals "$SERIAL_OUT"
+
+TEST_NAME="large-content"
+mkdir -p "$TMPROOT/large"
+seq -f 'row %g' 1 20000 > "$TMPROOT/large/plain.txt"
+seq -f 'row %g' 1 20000 | sed 's/$/\r/; 0~50s/$/\n\r\n\n/' > "$TMPROOT/large/crlf.txt"
+run_cmd "$TMPROOT" -I 'plain\.txt$' large
+assert_rc 0
+assert_out_equals "$(printf 'large/plain.txt:\n'; cat "$TMPROOT/large/plain.txt")"
+run_cmd "$TMPROOT" -I 'crlf\.txt$' large
+assert_out_equals "$(printf 'large/crlf.txt:\n'; sed 's/\r$//' "$TMPROOT/large/crlf.txt" | cat -s)"
+
+# RECAP_TEXT_SCAN caps the SIMD level; every level must print the same lines.
+TEST_NAME="text-scan-levels"
+mkdir -p "$TMPROOT/scan"
+awk 'BEGIN { for (i = 0; i < 3000; i++) {
+  printf "%*s%d %s\n", i % 9, "", i, substr("abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz", 1, i % 97)
+  if (i % 31 == 0) printf "\n\n\n"
+} }' > "$TMPROOT/scan/lf.txt"
+sed 's/$/\r/' "$TMPROOT/scan/lf.txt" > "$TMPROOT/scan/crlf.txt"
+printf '%s' "$(cat "$TMPROOT/scan/lf.txt")" > "$TMPROOT/scan/nonl.txt"
+printf 'x\r\n\r\n\r\ntail without newline\r' > "$TMPROOT/scan/short.txt"
+run_cmd "$TMPROOT" -I '\.txt$' scan
+assert_rc 0
+SCALAR_OUT=""
+for LEVEL in scalar sse2 avx2; do
+  RECAP_TEXT_SCAN=$LEVEL run_cmd "$TMPROOT" -I '\.txt$' scan
+  if [ "$LEVEL" = scalar ]; then
+    SCALAR_OUT="$LAST_OUT"
+    LF_OUT="$(sed -n '/^scan\/lf.txt:$/,/^---$/p' <<< "$LAST_OUT" | sed '1d;$d')"
+    TOTAL=$((TOTAL+1))
+    for NAME in crlf nonl; do
+      if [ "$(sed -n "/^scan\/$NAME.txt:$/,/^---$/p" <<< "$LAST_OUT" | sed '1d;$d')" != "$LF_OUT" ]; then
+        echo "FAIL ($TEST_NAME): $NAME.txt lines differ from lf.txt"
+        FAIL=$((FAIL+1))
+        continue 2
+      fi
+    done
+    echo "OK  ($TEST_NAME): LF, CRLF and unterminated files print the same lines"
+  else
+    assert_out_equals "$SCALAR_OUT"
+  fi
+done
+rm -rf "$TMPROOT/scan"
+
+# Output captured by run_cmd goes to a pipe, so unchanged ranges of large
+# files are spliced, also when blocks are rendered on worker threads.
+TEST_NAME="zero-copy"
+run_cmd "$TMPROOT" -j 1 -I '\.txt$' large
+SERIAL_OUT="$LAST_OUT"
+run_cmd "$TMPROOT" -I '\.txt$' large
+assert_rc 0
+assert_out_equals "$SERIAL_OUT"
+run_cmd "$TMPROOT" -j 4 -I '\.txt$' large
+assert_out_equals "$SERIAL_OUT"
+run_cmd "$TMPROOT" --stats -I '\.txt$' large
+assert_out_contains "Stats: [1-9][0-9]* bytes of file content moved by the kernel"
+run_cmd "$TMPROOT" --stats -j 4 -I '\.txt$' large
+assert_out_contains "Stats: [1-9][0-9]* bytes of file content moved by the kernel"
+# Regular files are filled with copy_file_range, from -o and from a
+# redirected stdout, serially and from worker threads.
+for JOBS in 1 4; do
+  rm -f "$TMPROOT/zero-copy.txt"
+  run_cmd "$TMPROOT" -j $JOBS -o zero-copy.txt -I '\.txt$' large
+  TOTAL=$((TOTAL+1))
+  if [ "$(cat "$TMPROOT/zero-copy.txt")" != "$SERIAL_OUT" ]; then
+    echo "FAIL ($TEST_NAME): -j $JOBS -o output differs from the serial output"
+    FAIL=$((FAIL+1))
+  else
+    echo "OK  ($TEST_NAME): -j $JOBS -o output matches the serial output"
+  fi
+  (cd "$TMPROOT" && "$RECAP_BIN" -j $JOBS -I '\.txt$' large > zero-copy.txt)
+  TOTAL=$((TOTAL+1))
+  if [ "$(cat "$TMPROOT/zero-copy.txt")" != "$SERIAL_OUT" ]; then
+    echo "FAIL ($TEST_NAME): -j $JOBS output redirected to a file differs from the serial output"
+    FAIL=$((FAIL+1))
+  else
+    echo "OK  ($TEST_NAME): -j $JOBS output redirected to a file matches the serial output"
+  fi
+done
+rm -f "$TMPROOT/zero-copy.txt"
+rm -rf "$TMPROOT/large"
+
+TEST_NAME="binary-detection"
+mkdir -p "$TMPROOT/bin"
+printf 'plain text\n' > "$TMPROOT/bin/logo.png"
+printf '%%PDF-1.4 no nul here\n' > "$TMPROOT/bin/doc.txt"
+printf 'readable\n' > "$TMPROOT/bin/notes.txt"
+run_cmd "$TMPROOT" -I '.' bin
+assert_rc 0
+assert_out_not_contains "logo.png:"
+assert_out_not_contains "doc.txt:"
+assert_out_contains "bin/notes.txt:"
+rm -rf "$TMPROOT/bin"
+
+TEST_NAME="regex-set"
+mkdir -p "$TMPROOT/rs/vendor" "$TMPROOT/rs/src"
+printf 'x\n' > "$TMPROOT/rs/vendor/lib.c"
+printf 'x\n' > "$TMPROOT/rs/src/aa.c"
+printf 'x\n' > "$TMPROOT/rs/src/main.c"
+printf 'x\n' > "$TMPROOT/rs/src/notes.md"
+# Mixes set-compatible patterns with a back reference that stays on PCRE2.
+run_cmd "$TMPROOT" -e '(^|/)vendor(/|$)' -e '\.md$' -e '/(a)\1\.c$' rs
+assert_rc 0
+assert_out_contains "rs/src/main.c"
+assert_out_not_contains "vendor/lib.c"
+assert_out_not_contains "notes.md"
+assert_out_not_contains "aa.c"
+rm -rf "$TMPROOT/rs"
+
+TEST_NAME="literal-index"
+mkdir -p "$TMPROOT/lit/skip" "$TMPROOT/lit/a/node_modules" "$TMPROOT/lit/keep"
+printf 'x\n' > "$TMPROOT/lit/skip/one.txt"
+printf 'x\n' > "$TMPROOT/lit/a/node_modules/two.txt"
+printf 'x\n' > "$TMPROOT/lit/keep/three.h"
+printf 'x\n' > "$TMPROOT/lit/keep/four.hpp"
+run_cmd "$TMPROOT" -e '^lit/skip/' -e '/node_modules/' -e '\.(c|h)$' lit
+assert_rc 0
+assert_out_contains "lit/keep/four.hpp"
+assert_out_not_contains "one.txt"
+assert_out_not_contains "two.txt"
+assert_out_not_contains "three.h"
+rm -rf "$TMPROOT/lit"
+
 TEST_NAME="gitignore"
 echo "folder2/" > "$TMPROOT/.gitignore"
 run_cmd "$TMPROOT" --git test
 assert_rc 0
 assert_out_not_contains "test/folder2/index.ts"
 
+TEST_NAME="gitignore-rules"
+printf '/test/folder1/*\n!/test/folder1/main.js\n**/folder3/*.md\n' > "$TMPROOT/.gitignore"
+run_cmd "$TMPROOT" --git test
+assert_rc 0
+assert_out_contains "test/folder1/main.js"
+assert_out_not_contains "test/folder1/index.html"
+assert_out_not_contains "test/folder3/example.md"
+assert_out_contains "test/folder3/test.c"
+rm -f "$TMPROOT/.gitignore"
+
+TEST_NAME="gitignore-nested"
+printf '*.md\n' > "$TMPROOT/.gitignore"
+printf '/index.ts\n' > "$TMPROOT/test/folder2/.gitignore"
+printf '!example.md\n' > "$TMPROOT/test/folder3/.gitignore"
+run_cmd "$TMPROOT" --git test
+assert_rc 0
+assert_out_not_contains "test/folder2/index.ts"
+assert_out_contains "test/folder3/example.md"
+assert_out_contains "test/folder1/main.js"
+rm -f "$TMPROOT/.gitignore" "$TMPROOT/test/folder2/.gitignore" "$TMPROOT/test/folder3/.gitignore"
+
+if command -v git >/dev/null 2>&1; then
+  TEST_NAME="git-index"
+  mkdir -p "$TMPROOT/repo/src"
+  printf 'one\n' > "$TMPROOT/repo/tracked.txt"
+  printf 'two\n' > "$TMPROOT/repo/src/main.c"
+  printf 'three\n' > "$TMPROOT/repo/untracked.txt"
+  git -C "$TMPROOT/repo" init -q
+  git -C "$TMPROOT/repo" add tracked.txt src/main.c
+  run_cmd "$TMPROOT/repo" --git-index
+  assert_rc 0
+  assert_out_contains "tracked.txt"
+  assert_out_contains "src/main.c"
+  assert_out_not_contains "untracked.txt"
+  run_cmd "$TMPROOT/repo/src" --git-index -I '\.c$'
+  assert_rc 0
+  assert_out_contains "main.c:"
+
+  TEST_NAME="git-index-changed"
+  printf 'two, edited\n' > "$TMPROOT/repo/src/main.c"
+  run_cmd "$TMPROOT/repo" --changed
+  assert_rc 0
+  assert_out_contains "src/main.c"
+  assert_out_not_contains "tracked.txt"
+
+  TEST_NAME="rev"
+  git -C "$TMPROOT/repo" -c user.name=t -c user.email=t@t commit -q -m first
+  run_cmd "$TMPROOT/repo" --rev HEAD -I '\.c$'
+  assert_rc 0
+  assert_out_contains "two"
+  assert_out_not_contains "edited"
+  assert_out_not_contains "untracked.txt"
+
+  TEST_NAME="rev-packed"
+  git -C "$TMPROOT/repo" -c user.name=t -c user.email=t@t commit -q -a -m second
+  git -C "$TMPROOT/repo" gc -q
+  run_cmd "$TMPROOT/repo/src" --rev HEAD~1 -I '\.c$'
+  assert_rc 0
+  assert_out_contains "main.c:"
+  assert_out_not_contains "edited"
+  run_cmd "$TMPROOT/repo" --rev no-such-branch
+  assert_rc 1
+  assert_out_contains "Could not resolve revision"
+  rm -rf "$TMPROOT/repo"
+fi
+
 TEST_NAME="compact"
 run_cmd "$TMPROOT" --compact -I '\.(js|c|ts|json)$' test
 assert_rc 0
 assert_out_not_contains "Super cool JavaScript file"
 
+TEST_NAME="compact-lines"
+mkdir -p "$TMPROOT/compacted"
+printf 'int  x = 1; /* a\n  b */  \r\n\n   \nchar* s = "  //  ";' > "$TMPROOT/compacted/a.c"
+printf 's = """ # kept  \n"""  # dropped\nx = 1   ' > "$TMPROOT/compacted/b.py"
+run_cmd "$TMPROOT" --compact -I '\.(c|py)$' compacted
+assert_rc 0
+assert_out_equals "$(printf 'compacted/a.c:\nint x=1;\nchar*s="  //  ";\n---\ncompacted/b.py:\ns = """ # kept\n"""\nx = 1')"
+rm -rf "$TMPROOT/compacted"
+
+TEST_NAME="compact-languages"
+mkdir -p "$TMPROOT/compacted"
+printf 'let s = r#"a // b"#; /* x /* y */ z */ let t = 1;\n' > "$TMPROOT/compacted/a.rs"
+printf 'run: |\n  echo # kept\nkey: v # dropped\n' > "$TMPROOT/compacted/b.yaml"
+printf '#!/usr/bin/env bash\n# dropped\necho ${#a[@]} # dropped\n' > "$TMPROOT/compacted/run"
+run_cmd "$TMPROOT" --compact -I 'compacted/' compacted
+assert_rc 0
+assert_out_equals "$(printf 'compacted/a.rs:\nlet s=r#"a // b"#;let t=1;\n---\ncompacted/b.yaml:\nrun: |\n  echo # kept\nkey: v\n---\ncompacted/run:\n#!/usr/bin/env bash\necho ${#a[@]}')"
+rm -rf "$TMPROOT/compacted"
+
+# Writes a file for every key of the language table, with a comment in the
+# language's syntax, and prints how many.
+make_language_files() {
+  local dir="$1" n=0 key lc bo bc
+  while IFS=$'\t' read -r key lc bo bc; do
+    n=$((n+1))
+    mkdir -p "$dir/$n"
+    local body="kept"
+    if [ -n "$lc" ]; then body="$lc gone"$'\n'"kept"
+    elif [ -n "$bo" ]; then body="$bo gone $bc"$'\n'"kept"
+    else body='[ "kept" ]'
+    fi
+    case "$key" in
+      '#!'*) printf '#!/usr/bin/env %s\n%s\n' "${key#\#!}" "$body" > "$dir/$n/script" ;;
+      .*) printf '%s\n' "$body" > "$dir/$n/f$key" ;;
+      *) printf '%s\n' "$body" > "$dir/$n/$key" ;;
+    esac
+  done < <(awk '
+    /^static const language_def languages\[\] = \{/ { on = 1; next }
+    on && /^\};/ { on = 0 }
+    !on { next }
+    /^    \{"/ { keys = $0; sub(/^    \{"[^"]*", /, "", keys); getkeys = 1 }
+    getkeys && /^ +"/ { keys = keys $0 }
+    /^ +\{(NULL|"[^"]*")\}, / {
+      getkeys = 0
+      gsub(/"[ ,]*"|"|,$/, "", keys); gsub(/^ +/, "", keys)
+      split($0, f, ", ")
+      lc = f[1]; bo = f[2]; bc = f[3]
+      gsub(/^ *\{|\}$|"/, "", lc); gsub(/"/, "", bo); gsub(/"/, "", bc)
+      if (lc == "NULL") lc = ""; if (bo == "NULL") bo = ""; if (bc == "NULL") bc = ""
+      n = split(keys, k, " ")
+      for (i = 1; i <= n; i++) printf "%s\t%s\t%s\t%s\n", k[i], lc, bo, bc
+    }' "$REPO_ROOT/src/languages.c")
+  echo "$n"
+}
+
+# Every extension, file name and shebang key of the language table must
+# select its language through the hashed lookup.
+TEST_NAME="compact-language-keys"
+KEY_COUNT="$(make_language_files "$TMPROOT/keys")"
+run_cmd "$TMPROOT" --compact -I . keys
+assert_rc 0
+assert_out_not_contains "gone"
+assert_out_not_contains '\[ "kept" \]'
+TOTAL=$((TOTAL+1))
+SHOWN="$(grep -c ':$' <<< "$LAST_OUT")"
+if [ "$KEY_COUNT" -lt 80 ] || [ "$SHOWN" -ne "$KEY_COUNT" ]; then
+  echo "FAIL ($TEST_NAME): $SHOWN of $KEY_COUNT key files shown"
+  FAIL=$((FAIL+1))
+else
+  echo "OK  ($TEST_NAME): all $KEY_COUNT key files compacted"
+fi
+rm -rf "$TMPROOT/keys"
+
+TEST_NAME="compact-parallel"
+mkdir -p "$TMPROOT/compacted"
+awk 'BEGIN { for (i = 0; i < 40000; i++) {
+  printf "int  v%d = f(\"a // %d\");   /* note %d\n   more */\n", i, i, i
+  if (i % 97 == 0) printf "/* a comment\nthat spans\n\nlines */ const char* s%d = \"x\n", i
+  if (i % 97 == 0) printf "y\";\n"
+} }' > "$TMPROOT/compacted/big.c"
+awk 'BEGIN { printf "["; for (i = 0; i < 60000; i++) printf "{\"k%d\": \"v, [%d]\", \"n\": %d}, ", i, i, i; printf "1]" }' > "$TMPROOT/compacted/big.json"
+run_cmd "$TMPROOT" -j 1 --compact -I 'compacted/' compacted
+SERIAL_OUT="$LAST_OUT"
+run_cmd "$TMPROOT" -j 4 --compact -I 'compacted/' compacted
+assert_rc 0
+assert_out_equals "$SERIAL_OUT"
+rm -rf "$TMPROOT/compacted"
+
+# The lexers scan long strings and comments with the selected SIMD level;
+# every level must compact to the same bytes.
+TEST_NAME="compact-text-scan-levels"
+mkdir -p "$TMPROOT/compacted"
+awk 'BEGIN { pad = "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"
+  for (i = 0; i < 2000; i++) {
+    printf "int  v%d = f(\"%s \\\" %d\");   // %s %d\n", i, substr(pad, 1, i % 70), i, substr(pad, 1, i % 53), i
+    if (i % 13 == 0) printf "/* %s\n%s * %d */  char  c%d = %c\"%c;\n", substr(pad, 1, i % 71), pad, i, i, 39, 39
+  } }' > "$TMPROOT/compacted/a.c"
+sed 's/$/\r/' "$TMPROOT/compacted/a.c" > "$TMPROOT/compacted/crlf.c"
+awk 'BEGIN { for (i = 0; i < 2000; i++) {
+    printf "x%d  =  \"%*s\"   # note %*s\n", i, i % 80, "s", i % 40, "c"
+    if (i % 17 == 0) printf "\"\"\"%*s\n  doc %d\n\"\"\"\n", i % 90, "", i
+  } }' > "$TMPROOT/compacted/b.py"
+awk 'BEGIN { printf "["; for (i = 0; i < 3000; i++) printf "{\"k%d\":  \"%*s\\\"\", \"n\": %d},\n ", i, i % 75, "v", i; printf "1]" }' > "$TMPROOT/compacted/c.json"
+awk 'BEGIN { for (i = 0; i < 2000; i++) printf "var  s%d = `%*s ${a} %d`;  /* %*s */ // %d\n", i, i % 66, "t", i, i % 48, "c", i }' > "$TMPROOT/compacted/d.js"
+RECAP_TEXT_SCAN=scalar run_cmd "$TMPROOT" --compact -I 'compacted/' compacted
+assert_rc 0
+assert_out_not_contains "note"
+SCALAR_OUT="$LAST_OUT"
+for LEVEL in sse2 avx2; do
+  RECAP_TEXT_SCAN=$LEVEL run_cmd "$TMPROOT" --compact -I 'compacted/' compacted
+  assert_out_equals "$SCALAR_OUT"
+done
+rm -rf "$TMPROOT/compacted"
+
+TEST_NAME="cache"
+mkdir -p "$TMPROOT/cached/src"
+printf 'int a; // note\n' > "$TMPROOT/cached/src/a.c"
+touch -t 202001010000 "$TMPROOT/cached/src/a.c" "$TMPROOT/cached/src"
+run_cmd "$TMPROOT/cached" --cache --compact --stats -I '\.c$'
+assert_rc 0
+assert_out_contains "recorded 2 entries"
+run_cmd "$TMPROOT/cached" --cache --compact --stats -I '\.c$'
+assert_rc 0
+assert_out_contains "int a;"
+assert_out_not_contains "note"
+assert_out_not_contains ".recap-cache"
+assert_out_contains "reused 1 directory listings and 1 files"
+
+TEST_NAME="cache-invalidate"
+printf 'int b;\n' > "$TMPROOT/cached/src/a.c"
+run_cmd "$TMPROOT/cached" --cache --compact -I '\.c$'
+assert_rc 0
+assert_out_contains "int b;"
+assert_out_not_contains "int a;"
+run_cmd "$TMPROOT/cached" --cache --stats -I '\.c$'
+assert_rc 0
+assert_out_contains "int b;"
+assert_out_contains "reused 1 directory listings and 0 files"
+rm -rf "$TMPROOT/cached"
+
+TEST_NAME="watch-needs-output"
+run_cmd "$TMPROOT" --watch test
+assert_rc 1
+assert_out_contains "--watch rewrites an output file"
+
+if [ "$(uname -s)" = "Linux" ]; then
+  # Waits up to 5s for the watched output to contain $1 (or, with "gone"
+  # as $2, to no longer contain it).
+  wait_for_watch_output() {
+    for _ in $(seq 50); do
+      if grep -q "$1" "$TMPROOT/watched/out.txt" 2>/dev/null; then
+        [ "${2:-}" = "gone" ] || break
+      elif [ "${2:-}" = "gone" ]; then
+        break
+      fi
+      sleep 0.1
+    done
+    LAST_OUT="$(cat "$TMPROOT/watched/out.txt" 2>/dev/null || true)"
+  }
+
+  TEST_NAME="watch"
+  mkdir -p "$TMPROOT/watched/src"
+  printf 'int first;\n' > "$TMPROOT/watched/src/a.c"
+  pushd "$TMPROOT/watched" >/dev/null
+  "$RECAP_BIN" --watch=10 -o out.txt -I '\.c$' 2>/dev/null &
+  WATCH_PID=$!
+  popd >/dev/null
+  wait_for_watch_output "first"
+  assert_out_contains "int first;"
+  printf 'int second;\n' > "$TMPROOT/watched/src/a.c"
+  mkdir "$TMPROOT/watched/src/new"
+  printf 'int third;\n' > "$TMPROOT/watched/src/new/b.c"
+  wait_for_watch_output "third"
+  assert_out_contains "int second;"
+  assert_out_contains "src/new/b.c:"
+  assert_out_not_contains "int first;"
+  rm "$TMPROOT/watched/src/a.c"
+  wait_for_watch_output "src/a.c" gone
+  assert_out_not_contains "src/a.c"
+  kill -TERM "$WATCH_PID"
+  set +e
+  wait "$WATCH_PID"
+  LAST_RC=$?
+  set -e
+  assert_rc 0
+  rm -rf "$TMPROOT/watched"
+fi
+
+TEST_NAME="serve-conflicts"
+run_cmd "$TMPROOT" --serve "$TMPROOT/recap.sock" -o out.txt
+assert_rc 1
+assert_out_contains "--serve cannot be combined with --watch, --output"
+
+if [ "$(uname -s)" = "Linux" ] && command -v python3 >/dev/null; then
+  # Runs one request against the server started below, like run_cmd.
+  run_client() {
+    local dir="$1"; shift
+    pushd "$dir" >/dev/null
+    set +e
+    LAST_OUT="$(python3 "$REPO_ROOT/test/recap-client.py" "$TMPROOT/recap.sock" "$@" 2>&1)"
+    LAST_RC=$?
+    set -e
+    popd >/dev/null
+  }
+
+  TEST_NAME="serve"
+  mkdir -p "$TMPROOT/served/src"
+  printf 'int served;\n' > "$TMPROOT/served/src/a.c"
+  printf 'not c\n' > "$TMPROOT/served/src/b.txt"
+  pushd "$TMPROOT/served" >/dev/null
+  "$RECAP_BIN" --serve "$TMPROOT/recap.sock" 2>/dev/null &
+  SERVE_PID=$!
+  popd >/dev/null
+  for _ in $(seq 50); do
+    [ -S "$TMPROOT/recap.sock" ] && break
+    sleep 0.1
+  done
+  run_client "$TMPROOT/served" -I '\.c$'
+  assert_rc 0
+  assert_out_contains "src/a.c:"
+  assert_out_contains "int served;"
+  assert_out_not_contains "b.txt"
+  # Paths are resolved against the client's directory, not the server's.
+  run_client "$TMPROOT/served/src" -I '\.txt$' .
+  assert_rc 0
+  assert_out_contains "not c"
+  assert_out_not_contains "int served;"
+
+  if command -v git >/dev/null 2>&1; then
+    TEST_NAME="serve-changed"
+    mkdir -p "$TMPROOT/served-repo"
+    printf 'one\n' > "$TMPROOT/served-repo/edited.txt"
+    printf 'two\n' > "$TMPROOT/served-repo/same.txt"
+    git -C "$TMPROOT/served-repo" init -q
+    git -C "$TMPROOT/served-repo" add edited.txt same.txt
+    printf 'one, edited\n' > "$TMPROOT/served-repo/edited.txt"
+    run_client "$TMPROOT/served-repo" --git-index --changed
+    assert_rc 0
+    assert_out_contains "edited.txt"
+    assert_out_not_contains "same.txt"
+    rm -rf "$TMPROOT/served-repo"
+  fi
+
+  TEST_NAME="serve-errors"
+  run_client "$TMPROOT/served" -I '('
+  assert_rc 1
+  assert_out_contains "Could not compile regex"
+  run_client "$TMPROOT/served" -o out.txt
+  assert_rc 1
+  assert_out_contains "--output is not available in server requests"
+
+  # More distinct patterns than the server keeps: old ones are freed and
+  # compiled again when a later request uses them.
+  TEST_NAME="serve-regex-cap"
+  for ROUND in 1 2 3 4 5 6 1; do
+    PATTERNS=()
+    for N in $(seq 200); do PATTERNS+=(-e "^never-$ROUND-$N/"); done
+    run_client "$TMPROOT/served" "${PATTERNS[@]}" -I '\.c$'
+    assert_rc 0
+    assert_out_contains "int served;"
+  done
+
+  TEST_NAME="serve-stop"
+  kill -TERM "$SERVE_PID"
+  set +e
+  wait "$SERVE_PID"
+  LAST_RC=$?
+  set -e
+  assert_rc 0
+  if [ -e "$TMPROOT/recap.sock" ]; then
+    echo "FAIL (serve-stop): socket still exists"
+    FAIL=$((FAIL+1))
+  else
+    echo "OK  (serve-stop): socket removed"
+  fi
+  TOTAL=$((TOTAL+1))
+  if [ -e "$TMPROOT/served/.recap-cache" ]; then
+    echo "FAIL (serve-stop): cache created without --cache"
+    FAIL=$((FAIL+1))
+  else
+    echo "OK  (serve-stop): no cache without --cache"
+  fi
+  rm -rf "$TMPROOT/served"
+fi
+
 TEST_NAME="output-file"
 run_cmd "$TMPROOT" -o "my-output.txt" test
 assert_rc 0